@@ -0,0 +1,623 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#include "edfs-alloc.h"
+#include "edfs-cache.h"
+#include "edfs-journal.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+
+/*
+ * Bitmap primitives, operating on 64 blocks at a time. The in-memory
+ * words share the byte layout of the on-disk bitmap (block n is bit
+ * n % 8 of byte n / 8) on little-endian hosts.
+ *
+ * Blocks held by a reservation (see edfs_allocate_blocks_reserved())
+ * are tracked in a second bitmap. Searches either treat those blocks
+ * as busy, or ignore the reservations when the file system is so full
+ * that reserved blocks have to be handed out to others.
+ */
+
+static inline uint64_t
+edfs_bitmap_busy_word(const edfs_image_t *img, uint32_t w,
+                      bool honor_reserved)
+{
+  uint64_t word = img->block_bitmap[w];
+
+  if (honor_reserved)
+    word |= img->block_reserved[w];
+
+  return word;
+}
+
+/* Returns the first free block in [from, to), or @to if there is none. */
+static uint32_t
+edfs_bitmap_find_clear(const edfs_image_t *img, uint32_t from, uint32_t to,
+                       bool honor_reserved)
+{
+  while (from < to)
+    {
+      uint64_t word = ~edfs_bitmap_busy_word(img, from / 64, honor_reserved)
+          & (~0ULL << (from % 64));
+
+      if (word)
+        {
+          uint32_t bit = (from & ~63u) + __builtin_ctzll(word);
+          return bit < to ? bit : to;
+        }
+
+      from = (from & ~63u) + 64;
+    }
+
+  return to;
+}
+
+/* Returns the first busy block in [from, to), or @to if there is none. */
+static uint32_t
+edfs_bitmap_find_set(const edfs_image_t *img, uint32_t from, uint32_t to,
+                     bool honor_reserved)
+{
+  while (from < to)
+    {
+      uint64_t word = edfs_bitmap_busy_word(img, from / 64, honor_reserved)
+          & (~0ULL << (from % 64));
+
+      if (word)
+        {
+          uint32_t bit = (from & ~63u) + __builtin_ctzll(word);
+          return bit < to ? bit : to;
+        }
+
+      from = (from & ~63u) + 64;
+    }
+
+  return to;
+}
+
+/* Finds the first run of free blocks in [from, to), returns its start
+ * and stores its length, capped at @max_len, in *@len.
+ */
+static uint32_t
+edfs_bitmap_find_run(const edfs_image_t *img, uint32_t from, uint32_t to,
+                     uint32_t max_len, bool honor_reserved, uint32_t *len)
+{
+  uint32_t start = edfs_bitmap_find_clear(img, from, to, honor_reserved);
+
+  if (start >= to)
+    {
+      *len = 0;
+      return to;
+    }
+
+  uint32_t limit = to - start > max_len ? start + max_len : to;
+  *len = edfs_bitmap_find_set(img, start, limit, honor_reserved) - start;
+
+  return start;
+}
+
+/* Finds the first run of at least @want free blocks in [from, to).
+ * Returns @to if there is no such run.
+ */
+static uint32_t
+edfs_bitmap_find_run_fitting(const edfs_image_t *img, uint32_t from,
+                             uint32_t to, uint32_t want)
+{
+  while (from < to)
+    {
+      uint32_t len;
+      uint32_t start = edfs_bitmap_find_run(img, from, to, want, true, &len);
+
+      if (len == 0)
+        break;
+      if (len == want)
+        return start;
+
+      from = start + len;
+    }
+
+  return to;
+}
+
+static void
+edfs_bitmap_update_range(uint64_t *map, uint32_t start, uint32_t len,
+                         bool set)
+{
+  while (len > 0)
+    {
+      uint32_t bit = start % 64;
+      uint32_t n = 64 - bit < len ? 64 - bit : len;
+      uint64_t mask = (n == 64 ? ~0ULL : ((1ULL << n) - 1)) << bit;
+
+      if (set)
+        map[start / 64] |= mask;
+      else
+        map[start / 64] &= ~mask;
+
+      start += n;
+      len -= n;
+    }
+}
+
+
+/*
+ * Loading and flushing the bitmap
+ */
+
+static inline uint32_t
+edfs_block_bitmap_n_bytes(const edfs_image_t *img)
+{
+  return ((uint64_t)img->sb.n_blocks + 7) / 8;
+}
+
+static void
+edfs_block_bitmap_mark_dirty(edfs_image_t *img, uint32_t start, uint32_t len)
+{
+  uint32_t first = (start / 8) / img->sb.block_size;
+  uint32_t last = ((start + len - 1) / 8) / img->sb.block_size;
+
+  for (uint32_t i = first; i <= last; i++)
+    if (!img->block_bitmap_dirty[i])
+      {
+        img->block_bitmap_dirty[i] = 1;
+        edfs_journal_dirtied(img, 1);
+      }
+}
+
+/* Reads the free-block bitmap into memory using a single read. */
+bool
+edfs_block_bitmap_load(edfs_image_t *img)
+{
+  uint32_t n_blocks = img->sb.n_blocks;
+  uint32_t n_bytes = edfs_block_bitmap_n_bytes(img);
+
+  if (n_bytes > img->sb.bitmap_size)
+    {
+      fprintf(stderr, "error: file '%s': bitmap too small for %u blocks.\n",
+              img->filename, n_blocks);
+      return false;
+    }
+
+  img->block_bitmap = calloc(((uint64_t)n_blocks + 63) / 64, sizeof(uint64_t));
+  img->block_reserved = calloc(((uint64_t)n_blocks + 63) / 64, sizeof(uint64_t));
+  img->block_bitmap_n_chunks =
+      (n_bytes + img->sb.block_size - 1) / img->sb.block_size;
+  img->block_bitmap_dirty = calloc(img->block_bitmap_n_chunks, 1);
+  if (!img->block_bitmap || !img->block_reserved || !img->block_bitmap_dirty)
+    return false;
+
+  if (edfs_image_pread(img, img->block_bitmap, n_bytes,
+                       img->sb.bitmap_start) != n_bytes)
+    {
+      fprintf(stderr, "error: file '%s': cannot read block bitmap.\n",
+              img->filename);
+      return false;
+    }
+
+  /* Ignore whatever follows the last block in the final word, and
+   * never hand out the boot block.
+   */
+  if (n_blocks % 64)
+    img->block_bitmap[n_blocks / 64] &= (1ULL << (n_blocks % 64)) - 1;
+  img->block_bitmap[0] |= 1;
+
+  uint32_t n_used = 0;
+  for (uint32_t w = 0; w < ((uint64_t)n_blocks + 63) / 64; w++)
+    n_used += __builtin_popcountll(img->block_bitmap[w]);
+
+  img->n_free_blocks = n_blocks - n_used;
+  img->block_cursor = 1;
+
+  return true;
+}
+
+void
+edfs_block_bitmap_free(edfs_image_t *img)
+{
+  free(img->block_bitmap);
+  free(img->block_reserved);
+  free(img->block_bitmap_dirty);
+  img->block_bitmap = NULL;
+  img->block_reserved = NULL;
+  img->block_bitmap_dirty = NULL;
+}
+
+/* Queues writes of the modified parts of the bitmap on @queue, one
+ * for every run of dirty chunks. The caller holds the allocator lock
+ * until the writes are done and then calls edfs_block_bitmap_clean().
+ * Returns 0 on success, error code otherwise.
+ */
+int
+edfs_block_bitmap_queue(edfs_image_t *img, edfs_io_queue_t *queue)
+{
+  if (!img->block_bitmap_dirty)
+    return 0;
+
+  uint32_t chunk_size = img->sb.block_size;
+  uint32_t n_bytes = edfs_block_bitmap_n_bytes(img);
+  uint32_t i = 0;
+
+  while (i < img->block_bitmap_n_chunks)
+    {
+      if (!img->block_bitmap_dirty[i])
+        {
+          i++;
+          continue;
+        }
+
+      uint32_t start = i;
+      while (i < img->block_bitmap_n_chunks && img->block_bitmap_dirty[i])
+        i++;
+
+      uint32_t begin = start * chunk_size;
+      uint32_t end = i * chunk_size < n_bytes ? i * chunk_size : n_bytes;
+
+      edfs_io_req_t *req = edfs_io_queue_add(queue, EDFS_IO_WRITE,
+                                             img->sb.bitmap_start + begin,
+                                             end - begin);
+      if (!req)
+        return -ENOMEM;
+      req->buf = (uint8_t *)img->block_bitmap + begin;
+    }
+
+  return 0;
+}
+
+/* Marks the whole bitmap as written. */
+void
+edfs_block_bitmap_clean(edfs_image_t *img)
+{
+  if (img->block_bitmap_dirty)
+    memset(img->block_bitmap_dirty, 0, img->block_bitmap_n_chunks);
+}
+
+
+/*
+ * Allocation
+ */
+
+/* Marks [start, start + len) as in use. Any reservation covering these
+ * blocks is dropped; its owner notices when it next takes blocks from
+ * its window.
+ */
+static void
+edfs_claim_blocks(edfs_image_t *img, uint32_t start, uint32_t len)
+{
+  edfs_bitmap_update_range(img->block_bitmap, start, len, true);
+  edfs_bitmap_update_range(img->block_reserved, start, len, false);
+  edfs_block_bitmap_mark_dirty(img, start, len);
+  img->n_free_blocks -= len;
+
+  img->block_cursor = start + len < img->sb.n_blocks ? start + len : 1;
+}
+
+/* Allocates up to @n_blocks blocks and stores their numbers in @blocks.
+ * The search starts at @goal, or at the allocation cursor if @goal is
+ * EDFS_BLOCK_INVALID, and wraps around once.
+ *
+ * Placement prefers, in order: a single free run that fits the entire
+ * request; the free runs following @goal, taken whole so that
+ * consecutive entries of @blocks are contiguous where possible; and,
+ * when the file system is nearly full, blocks reserved by others.
+ * Returns the number of blocks allocated, which is less than @n_blocks
+ * if the file system is (nearly) full.
+ */
+static int
+edfs_allocate_blocks_locked(edfs_image_t *img,
+                            edfs_block_t  goal,
+                            int           n_blocks,
+                            edfs_block_t *blocks)
+{
+  uint32_t n_total = img->sb.n_blocks;
+  uint32_t pos = goal != EDFS_BLOCK_INVALID && goal < n_total
+      ? goal : img->block_cursor;
+  int n = 0;
+
+  uint32_t start = edfs_bitmap_find_run_fitting(img, pos, n_total, n_blocks);
+  if (start >= n_total)
+    {
+      start = edfs_bitmap_find_run_fitting(img, 1, pos, n_blocks);
+      if (start >= pos)
+        start = n_total;
+    }
+
+  if (start < n_total)
+    {
+      edfs_claim_blocks(img, start, n_blocks);
+      for (n = 0; n < n_blocks; n++)
+        blocks[n] = start + n;
+      return n;
+    }
+
+  for (int pass = 0; pass < 4 && n < n_blocks; pass++)
+    {
+      bool honor_reserved = pass < 2;
+      uint32_t from = pass % 2 == 0 ? pos : 1;
+      uint32_t to = pass % 2 == 0 ? n_total : pos;
+
+      while (n < n_blocks && from < to)
+        {
+          uint32_t len;
+
+          start = edfs_bitmap_find_run(img, from, to, n_blocks - n,
+                                       honor_reserved, &len);
+          if (len == 0)
+            break;
+
+          edfs_claim_blocks(img, start, len);
+          for (uint32_t i = 0; i < len; i++)
+            blocks[n++] = start + i;
+
+          from = start + len;
+        }
+    }
+
+  return n;
+}
+
+int
+edfs_allocate_blocks(edfs_image_t *img,
+                     edfs_block_t  goal,
+                     int           n_blocks,
+                     edfs_block_t *blocks)
+{
+  if (!img->block_bitmap || n_blocks <= 0)
+    return 0;
+
+  pthread_mutex_lock(&img->alloc_lock);
+  int n = edfs_allocate_blocks_locked(img, goal, n_blocks, blocks);
+  pthread_mutex_unlock(&img->alloc_lock);
+
+  return n;
+}
+
+static void
+edfs_reservation_release_locked(edfs_image_t             *img,
+                                edfs_block_reservation_t *rsv)
+{
+  if (img->block_reserved && rsv->len > 0)
+    edfs_bitmap_update_range(img->block_reserved, rsv->start, rsv->len, false);
+
+  rsv->start = EDFS_BLOCK_INVALID;
+  rsv->len = 0;
+  rsv->window = EDFS_RESERVATION_MIN_WINDOW;
+}
+
+/* Drops whatever is left of reservation @rsv. */
+void
+edfs_reservation_release(edfs_image_t             *img,
+                         edfs_block_reservation_t *rsv)
+{
+  pthread_mutex_lock(&img->alloc_lock);
+  edfs_reservation_release_locked(img, rsv);
+  pthread_mutex_unlock(&img->alloc_lock);
+}
+
+/* Allocates @n_blocks blocks for a writer that appends sequentially,
+ * with @goal the block following its last block. Blocks are taken
+ * from the writer's reservation window @rsv as long as the writer
+ * stays sequential. An empty window is refilled with a run of free
+ * blocks at @goal, doubling in size with every refill, so that
+ * interleaved writers each obtain long contiguous runs. Returns the
+ * number of blocks allocated.
+ */
+int
+edfs_allocate_blocks_reserved(edfs_image_t             *img,
+                              edfs_block_reservation_t *rsv,
+                              edfs_block_t              goal,
+                              int                       n_blocks,
+                              edfs_block_t             *blocks)
+{
+  if (!img->block_bitmap || n_blocks <= 0)
+    return 0;
+
+  pthread_mutex_lock(&img->alloc_lock);
+
+  if (rsv->window < EDFS_RESERVATION_MIN_WINDOW)
+    rsv->window = EDFS_RESERVATION_MIN_WINDOW;
+
+  /* A writer that is no longer sequential gives up its window. */
+  if (rsv->len > 0 && goal != rsv->start)
+    edfs_reservation_release_locked(img, rsv);
+
+  int n = 0;
+
+  while (n < n_blocks)
+    {
+      if (rsv->len == 0)
+        {
+          uint32_t want = n_blocks - n > rsv->window ? n_blocks - n : rsv->window;
+          uint32_t n_total = img->sb.n_blocks;
+          uint32_t pos = goal != EDFS_BLOCK_INVALID && goal < n_total
+              ? goal : img->block_cursor;
+          uint32_t len;
+
+          uint32_t start = edfs_bitmap_find_run_fitting(img, pos, n_total, want);
+          if (start < n_total)
+            len = want;
+          else
+            start = edfs_bitmap_find_run(img, pos, n_total, want, true, &len);
+
+          if (len == 0)
+            break;
+
+          edfs_bitmap_update_range(img->block_reserved, start, len, true);
+          rsv->start = start;
+          rsv->len = len;
+          if (rsv->window < EDFS_RESERVATION_MAX_WINDOW)
+            rsv->window *= 2;
+        }
+
+      /* Other allocations may have claimed part of the window. */
+      uint32_t take = n_blocks - n < rsv->len ? n_blocks - n : rsv->len;
+      take = edfs_bitmap_find_set(img, rsv->start, rsv->start + take, false)
+          - rsv->start;
+      if (take == 0)
+        {
+          edfs_reservation_release_locked(img, rsv);
+          break;
+        }
+
+      edfs_claim_blocks(img, rsv->start, take);
+      for (uint32_t i = 0; i < take; i++)
+        blocks[n++] = rsv->start + i;
+
+      rsv->start += take;
+      rsv->len -= take;
+      goal = rsv->start;
+    }
+
+  /* Out of contiguous space: fall back to whatever is free. */
+  if (n < n_blocks)
+    n += edfs_allocate_blocks_locked(img, goal, n_blocks - n, blocks + n);
+
+  pthread_mutex_unlock(&img->alloc_lock);
+
+  return n;
+}
+
+/* Allocates a single block, near @goal if possible. Returns
+ * EDFS_BLOCK_INVALID if no free block is left.
+ */
+edfs_block_t
+edfs_allocate_block(edfs_image_t *img, edfs_block_t goal)
+{
+  edfs_block_t block;
+
+  if (edfs_allocate_blocks(img, goal, 1, &block) != 1)
+    return EDFS_BLOCK_INVALID;
+
+  return block;
+}
+
+static void
+edfs_free_block_locked(edfs_image_t *img, edfs_block_t block)
+{
+  uint64_t mask = 1ULL << (block % 64);
+
+  if (block == EDFS_BLOCK_INVALID || block >= img->sb.n_blocks ||
+      !(img->block_bitmap[block / 64] & mask))
+    return;
+
+  img->block_bitmap[block / 64] &= ~mask;
+  img->block_reserved[block / 64] &= ~mask;
+  edfs_block_bitmap_mark_dirty(img, block, 1);
+  img->n_free_blocks++;
+
+  /* A cached copy must not be written back over the next user, nor a
+   * journaled copy be replayed over it.
+   */
+  edfs_cache_forget(img, block);
+  edfs_journal_revoke(img, block);
+}
+
+void
+edfs_free_blocks(edfs_image_t       *img,
+                 const edfs_block_t *blocks,
+                 int                 n_blocks)
+{
+  if (!img->block_bitmap)
+    return;
+
+  pthread_mutex_lock(&img->alloc_lock);
+
+  for (int i = 0; i < n_blocks; i++)
+    edfs_free_block_locked(img, blocks[i]);
+
+  pthread_mutex_unlock(&img->alloc_lock);
+}
+
+/* Frees the @n_blocks blocks from @start on, as mapped by an extent. */
+void
+edfs_free_block_range(edfs_image_t *img,
+                      edfs_block_t  start,
+                      uint32_t      n_blocks)
+{
+  if (!img->block_bitmap)
+    return;
+
+  pthread_mutex_lock(&img->alloc_lock);
+
+  for (uint32_t i = 0; i < n_blocks && start + i < img->sb.n_blocks; i++)
+    edfs_free_block_locked(img, start + i);
+
+  pthread_mutex_unlock(&img->alloc_lock);
+}
+
+void
+edfs_free_block(edfs_image_t *img, edfs_block_t block)
+{
+  edfs_free_blocks(img, &block, 1);
+}
+
+/* Replaces the in-memory bitmap by @bitmap, in the same format, and
+ * marks it dirty in full. Used by edfs-fsck to repair the bitmap; the
+ * caller makes sure no blocks are reserved or being allocated.
+ */
+void
+edfs_block_bitmap_replace(edfs_image_t *img, const uint64_t *bitmap)
+{
+  uint32_t n_words = ((uint64_t)img->sb.n_blocks + 63) / 64;
+  uint32_t n_used = 0;
+
+  if (!img->block_bitmap)
+    return;
+
+  pthread_mutex_lock(&img->alloc_lock);
+
+  memcpy(img->block_bitmap, bitmap, n_words * sizeof(uint64_t));
+  for (uint32_t w = 0; w < n_words; w++)
+    n_used += __builtin_popcountll(img->block_bitmap[w]);
+
+  img->n_free_blocks = img->sb.n_blocks - n_used;
+  edfs_block_bitmap_mark_dirty(img, 0, img->sb.n_blocks);
+
+  pthread_mutex_unlock(&img->alloc_lock);
+}
+
+bool
+edfs_block_is_allocated(edfs_image_t *img, edfs_block_t block)
+{
+  if (!img->block_bitmap || block >= img->sb.n_blocks)
+    return false;
+
+  pthread_mutex_lock(&img->alloc_lock);
+  bool allocated = (img->block_bitmap[block / 64] >> (block % 64)) & 1;
+  pthread_mutex_unlock(&img->alloc_lock);
+
+  return allocated;
+}
+
+/* Accounts for @n_dirty blocks entering (or, if negative, leaving) the
+ * write-back buffers, @n_delalloc of which still need to be allocated.
+ * Adding blocks that need allocation fails with -ENOSPC when they could
+ * no longer be allocated at flush time; a few blocks are kept spare for
+ * indirect blocks.
+ */
+int
+edfs_writeback_account(edfs_image_t *img, int n_dirty, int n_delalloc)
+{
+  int res = 0;
+
+  pthread_mutex_lock(&img->alloc_lock);
+
+  if (n_delalloc > 0 &&
+      img->delalloc_blocks + n_delalloc + EDFS_INODE_N_BLOCKS >= img->n_free_blocks)
+    res = -ENOSPC;
+  else
+    {
+      /* Writers check the dirty count without taking the lock. */
+      __atomic_add_fetch(&img->dirty_blocks, n_dirty, __ATOMIC_RELAXED);
+      img->delalloc_blocks += n_delalloc;
+    }
+
+  pthread_mutex_unlock(&img->alloc_lock);
+
+  return res;
+}
@@ -0,0 +1,86 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#ifndef __EDFS_ALLOC_H__
+#define __EDFS_ALLOC_H__
+
+#include "edfs-common.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/*
+ * Block allocation
+ *
+ * The on-disk free-block bitmap is kept in memory as an array of 64-bit
+ * words, with a bit set for every block in use. Allocation is next-fit:
+ * searches start at a cursor just past the previous allocation, or at a
+ * caller-supplied goal block. Modified parts of the bitmap are written
+ * back by edfs_image_sync().
+ *
+ * Callers pass the block following the previous block of the same
+ * file as goal, so that files are extended in place, or a block of the
+ * parent directory for the first block of a file.
+ *
+ * All routines take the allocation lock of the image.
+ */
+
+/* A reservation window of free blocks, held in memory on behalf of a
+ * sequential writer. Reserved blocks are not marked in the bitmap;
+ * other allocations avoid them until the file system runs full.
+ */
+typedef struct
+{
+  edfs_block_t start;   /* next block to hand out */
+  uint32_t len;         /* blocks left in the window */
+  uint32_t window;      /* size of the next window */
+} edfs_block_reservation_t;
+
+#define EDFS_RESERVATION_MIN_WINDOW 8
+#define EDFS_RESERVATION_MAX_WINDOW 256
+
+#define EDFS_BLOCK_RESERVATION_INIT \
+  { EDFS_BLOCK_INVALID, 0, EDFS_RESERVATION_MIN_WINDOW }
+
+bool           edfs_block_bitmap_load     (edfs_image_t       *img);
+void           edfs_block_bitmap_free     (edfs_image_t       *img);
+int            edfs_block_bitmap_queue    (edfs_image_t       *img,
+                                           edfs_io_queue_t    *queue);
+void           edfs_block_bitmap_clean    (edfs_image_t       *img);
+void           edfs_block_bitmap_replace  (edfs_image_t       *img,
+                                           const uint64_t     *bitmap);
+
+edfs_block_t   edfs_allocate_block        (edfs_image_t       *img,
+                                           edfs_block_t        goal);
+int            edfs_allocate_blocks       (edfs_image_t       *img,
+                                           edfs_block_t        goal,
+                                           int                 n_blocks,
+                                           edfs_block_t       *blocks);
+int            edfs_allocate_blocks_reserved
+                                          (edfs_image_t             *img,
+                                           edfs_block_reservation_t *rsv,
+                                           edfs_block_t              goal,
+                                           int                       n_blocks,
+                                           edfs_block_t             *blocks);
+void           edfs_reservation_release   (edfs_image_t             *img,
+                                           edfs_block_reservation_t *rsv);
+void           edfs_free_block            (edfs_image_t       *img,
+                                           edfs_block_t        block);
+void           edfs_free_blocks           (edfs_image_t       *img,
+                                           const edfs_block_t *blocks,
+                                           int                 n_blocks);
+void           edfs_free_block_range      (edfs_image_t       *img,
+                                           edfs_block_t        start,
+                                           uint32_t            n_blocks);
+
+bool           edfs_block_is_allocated    (edfs_image_t       *img,
+                                           edfs_block_t        block);
+
+int            edfs_writeback_account     (edfs_image_t       *img,
+                                           int                 n_dirty,
+                                           int                 n_delalloc);
+
+#endif /* __EDFS_ALLOC_H__ */
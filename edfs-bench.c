@@ -0,0 +1,2102 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+/* Microbenchmarks of EdFS routines. These run directly against a
+ * scratch copy of an image, so no FUSE mount is involved.
+ */
+
+#define _GNU_SOURCE   /* splice() */
+
+#include "edfs-common.h"
+#include "edfs-alloc.h"
+#include "edfs-cache.h"
+#include "edfs-file.h"
+#include "edfs-extent.h"
+#include "edfs-dir.h"
+#include "edfs-dindex.h"
+#include "edfs-dcache.h"
+#include "edfs-readahead.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+
+static double
+bench_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Copies image @src to a new scratch file, of which the name is
+ * stored in @dst (at least PATH_MAX bytes).
+ */
+static bool
+bench_copy_image(const char *src, char *dst)
+{
+  const char *tmpdir = getenv("TMPDIR");
+  char buf[65536];
+  ssize_t n;
+
+  snprintf(dst, 4096, "%s/edfs-bench-XXXXXX", tmpdir ? tmpdir : "/tmp");
+
+  int in = open(src, O_RDONLY);
+  int out = mkstemp(dst);
+  if (in < 0 || out < 0)
+    {
+      fprintf(stderr, "error: cannot copy '%s': %s\n", src, strerror(errno));
+      if (in >= 0)
+        close(in);
+      if (out >= 0)
+        {
+          close(out);
+          unlink(dst);
+        }
+      return false;
+    }
+
+  while ((n = read(in, buf, sizeof(buf))) > 0)
+    if (write(out, buf, n) != n)
+      {
+        n = -1;
+        break;
+      }
+
+  close(in);
+  close(out);
+
+  if (n < 0)
+    {
+      fprintf(stderr, "error: cannot copy '%s': %s\n", src, strerror(errno));
+      unlink(dst);
+      return false;
+    }
+
+  return true;
+}
+
+/* Opens @filename with the flags and caches edfuse uses by default. */
+static edfs_image_t *
+bench_ops_open(const char *filename)
+{
+  edfs_image_t *img = edfs_image_open(filename, EDFS_IMAGE_READ_SUPER | EDFS_IMAGE_INODE_CACHE);
+
+  if (img)
+    {
+      img->dcache = edfs_dcache_new(EDFS_DCACHE_DEFAULT_SIZE);
+      img->dindex = edfs_dindex_new(EDFS_DINDEX_DEFAULT_SIZE);
+    }
+
+  return img;
+}
+
+/* Generates an empty image of format @version as scratch file, of
+ * which the name is stored in @dst (at least PATH_MAX bytes), and
+ * opens it.
+ */
+static edfs_image_t *
+bench_ops_generate(char *dst, uint16_t version, uint32_t block_size,
+                   uint32_t n_blocks, uint32_t n_inodes)
+{
+  const char *tmpdir = getenv("TMPDIR");
+
+  snprintf(dst, 4096, "%s/edfs-bench-XXXXXX", tmpdir ? tmpdir : "/tmp");
+
+  int fd = mkstemp(dst);
+  if (fd < 0)
+    {
+      fprintf(stderr, "error: cannot create image: %s\n", strerror(errno));
+      return NULL;
+    }
+  close(fd);
+
+  int res = edfs_image_create(dst, version, block_size, n_blocks, n_inodes, 0);
+  if (res < 0)
+    {
+      fprintf(stderr, "error: cannot create image: %s\n", strerror(-res));
+      unlink(dst);
+      return NULL;
+    }
+
+  edfs_image_t *img = bench_ops_open(dst);
+  if (!img)
+    unlink(dst);
+
+  return img;
+}
+
+
+/*
+ * inode-alloc: inode allocation rate as a function of inode table fill
+ * level, comparing a linear scan of the on-disk table (the behavior
+ * before the free-inode index) with edfs_new_inode().
+ */
+
+static edfs_inumber_t
+bench_find_free_inode_linear(edfs_image_t *img)
+{
+  edfs_disk_inode_t disk_inode;
+
+  for (edfs_inumber_t i = 1; i < img->sb.inode_table_n_inodes; i++)
+    if (pread(img->fd, &disk_inode, sizeof(disk_inode),
+              edfs_get_inode_offset(&img->sb, i)) > 0 &&
+        disk_inode.type == EDFS_INODE_TYPE_FREE)
+      return i;
+
+  return 0;
+}
+
+/* Fills the inode table with file inodes, lowest inumbers first, until
+ * @fill percent of the table is in use. Returns the number of free
+ * inodes left.
+ */
+static uint32_t
+bench_fill_inode_table(edfs_image_t *img, int fill)
+{
+  uint32_t n_inodes = img->sb.inode_table_n_inodes;
+  uint32_t target = (uint64_t)n_inodes * fill / 100;
+  edfs_inode_t inode;
+
+  while (n_inodes - img->n_free_inodes < target &&
+         edfs_new_inode(img, &inode, EDFS_INODE_TYPE_FILE) == 0)
+    edfs_write_inode(img, &inode);
+
+  return img->n_free_inodes;
+}
+
+/* Runs up to @n_ops allocations, returns the achieved rate or a
+ * negative value on error.
+ */
+static double
+bench_inode_alloc_run(const char *image, int fill, bool indexed,
+                      int n_ops, uint32_t *n_free)
+{
+  char scratch[4096];
+
+  if (!bench_copy_image(image, scratch))
+    return -1.0;
+
+  edfs_image_t *img = edfs_image_open(scratch, EDFS_IMAGE_READ_SUPER);
+  if (!img)
+    {
+      unlink(scratch);
+      return -1.0;
+    }
+
+  *n_free = bench_fill_inode_table(img, fill);
+  if (n_ops > *n_free)
+    n_ops = *n_free;
+
+  double start = bench_now();
+
+  for (int i = 0; i < n_ops; i++)
+    {
+      edfs_inode_t inode = { 0, };
+
+      if (indexed)
+        edfs_new_inode(img, &inode, EDFS_INODE_TYPE_FILE);
+      else
+        {
+          inode.inumber = bench_find_free_inode_linear(img);
+          inode.inode.type = EDFS_INODE_TYPE_FILE;
+        }
+
+      edfs_write_inode(img, &inode);
+    }
+
+  double elapsed = bench_now() - start;
+
+  edfs_image_close(img);
+  unlink(scratch);
+
+  return elapsed > 0 ? n_ops / elapsed : 0.0;
+}
+
+static int
+bench_inode_alloc(const char *image, int n_ops)
+{
+  static const int fill_levels[] = { 0, 25, 50, 75, 90, 95, 99 };
+
+  printf("inode-alloc: %s, %d creates per fill level\n", image, n_ops);
+  printf("%6s %8s %16s %16s\n", "fill%", "free", "linear ops/s", "indexed ops/s");
+
+  for (int i = 0; i < sizeof(fill_levels) / sizeof(fill_levels[0]); i++)
+    {
+      uint32_t n_free;
+      double linear, indexed;
+
+      linear = bench_inode_alloc_run(image, fill_levels[i], false,
+                                     n_ops, &n_free);
+      indexed = bench_inode_alloc_run(image, fill_levels[i], true,
+                                      n_ops, &n_free);
+      if (linear < 0 || indexed < 0)
+        return -1;
+
+      printf("%6d %8u %16.0f %16.0f\n",
+             fill_levels[i], n_free, linear, indexed);
+    }
+
+  return 0;
+}
+
+
+/*
+ * frag: fragmentation report, as the average length of runs of
+ * physically contiguous blocks per file. Covers the files in the image
+ * and synthetic workloads of interleaved appending writers, allocated
+ * under different placement policies.
+ */
+
+/* Stores the data blocks of @inode in logical order in @blocks, holes
+ * are skipped. Returns the number of blocks stored.
+ */
+static int
+bench_inode_blocks(edfs_image_t *img, edfs_inode_t *inode,
+                   edfs_block_t *blocks, int max_blocks)
+{
+  int n = 0;
+
+  if (edfs_disk_inode_has_extents(&inode->inode))
+    {
+      uint32_t n_logical = (inode->inode.size + img->sb.block_size - 1) /
+          img->sb.block_size;
+      edfs_extent_t extent;
+
+      for (uint32_t l = 0; l < n_logical && n < max_blocks;
+           l = extent.logical + extent.length)
+        {
+          if (edfs_extent_lookup(img, &inode->inode, l, &extent) < 0)
+            break;
+          if (extent.start == EDFS_BLOCK_INVALID)
+            continue;
+
+          for (uint32_t i = l - extent.logical;
+               i < extent.length && n < max_blocks; i++)
+            blocks[n++] = extent.start + i;
+        }
+
+      return n;
+    }
+
+  if (!edfs_disk_inode_has_indirect(&inode->inode))
+    {
+      for (int i = 0; i < EDFS_INODE_N_BLOCKS && n < max_blocks; i++)
+        if (edfs_disk_inode_get_block(&inode->inode, i) != EDFS_BLOCK_INVALID)
+          blocks[n++] = edfs_disk_inode_get_block(&inode->inode, i);
+
+      return n;
+    }
+
+  int n_per_block = edfs_get_n_blocks_per_indirect_block(&img->sb);
+  edfs_block16_t *indirect = malloc(img->sb.block_size);
+
+  for (int i = 0; i < EDFS_INODE_N_BLOCKS; i++)
+    {
+      edfs_block_t block = edfs_disk_inode_get_block(&inode->inode, i);
+
+      if (block == EDFS_BLOCK_INVALID ||
+          pread(img->fd, indirect, img->sb.block_size,
+                edfs_get_block_offset(&img->sb, block)) <= 0)
+        continue;
+
+      for (int j = 0; j < n_per_block && n < max_blocks; j++)
+        if (indirect[j] != EDFS_BLOCK_INVALID)
+          blocks[n++] = indirect[j];
+    }
+
+  free(indirect);
+
+  return n;
+}
+
+static int
+bench_count_runs(const edfs_block_t *blocks, int n_blocks)
+{
+  int n_runs = 0;
+
+  for (int i = 0; i < n_blocks; i++)
+    if (i == 0 || blocks[i] != blocks[i - 1] + 1)
+      n_runs++;
+
+  return n_runs;
+}
+
+typedef struct
+{
+  int n_files;
+  long n_blocks;
+  long n_runs;
+  double sum_file_run_length;  /* sum over files of blocks / runs */
+} bench_frag_t;
+
+static void
+bench_frag_add(bench_frag_t *frag, const edfs_block_t *blocks, int n_blocks)
+{
+  if (n_blocks == 0)
+    return;
+
+  int n_runs = bench_count_runs(blocks, n_blocks);
+
+  frag->n_files++;
+  frag->n_blocks += n_blocks;
+  frag->n_runs += n_runs;
+  frag->sum_file_run_length += (double)n_blocks / n_runs;
+}
+
+static void
+bench_frag_print(const char *label, const bench_frag_t *frag)
+{
+  printf("%-22s %6d %8ld %8ld %12.2f %12.2f\n", label,
+         frag->n_files, frag->n_blocks, frag->n_runs,
+         frag->n_runs ? (double)frag->n_blocks / frag->n_runs : 0.0,
+         frag->n_files ? frag->sum_file_run_length / frag->n_files : 0.0);
+}
+
+typedef enum
+{
+  PLACEMENT_NEXT_FIT,   /* no goal, plain next-fit */
+  PLACEMENT_GOAL,       /* extend the previous block, first near parent */
+  PLACEMENT_RESERVE     /* as GOAL, with per-writer reservation windows */
+} bench_placement_t;
+
+#define BENCH_FRAG_WRITERS 8
+
+/* Appends @n_blocks blocks to each of BENCH_FRAG_WRITERS files, one
+ * block at a time in round-robin order, which is the worst case for
+ * contiguity.
+ */
+static bool
+bench_frag_synthetic(const char *image, bench_placement_t placement,
+                     int n_blocks, bench_frag_t *frag)
+{
+  char scratch[4096];
+
+  if (!bench_copy_image(image, scratch))
+    return false;
+
+  edfs_image_t *img = edfs_image_open(scratch, EDFS_IMAGE_READ_SUPER);
+  if (!img)
+    {
+      unlink(scratch);
+      return false;
+    }
+
+  edfs_inode_t root;
+  edfs_read_root_inode(img, &root);
+
+  edfs_block_t root_block = edfs_disk_inode_get_block(&root.inode, 0);
+  edfs_block_t *blocks = calloc(BENCH_FRAG_WRITERS * n_blocks, sizeof(edfs_block_t));
+  edfs_block_reservation_t rsv[BENCH_FRAG_WRITERS];
+
+  for (int w = 0; w < BENCH_FRAG_WRITERS; w++)
+    rsv[w] = (edfs_block_reservation_t)EDFS_BLOCK_RESERVATION_INIT;
+
+  for (int i = 0; i < n_blocks; i++)
+    for (int w = 0; w < BENCH_FRAG_WRITERS; w++)
+      {
+        edfs_block_t *file = &blocks[w * n_blocks];
+        edfs_block_t goal = i > 0 ? file[i - 1] + 1 : root_block;
+
+        switch (placement)
+          {
+            case PLACEMENT_NEXT_FIT:
+              file[i] = edfs_allocate_block(img, EDFS_BLOCK_INVALID);
+              break;
+            case PLACEMENT_GOAL:
+              file[i] = edfs_allocate_block(img, goal);
+              break;
+            case PLACEMENT_RESERVE:
+              edfs_allocate_blocks_reserved(img, &rsv[w], goal, 1, &file[i]);
+              break;
+          }
+      }
+
+  for (int w = 0; w < BENCH_FRAG_WRITERS; w++)
+    bench_frag_add(frag, &blocks[w * n_blocks], n_blocks);
+
+  free(blocks);
+  edfs_image_close(img);
+  unlink(scratch);
+
+  return true;
+}
+
+static int
+bench_frag(const char *image, int n_ops)
+{
+  edfs_image_t *img = edfs_image_open(image, EDFS_IMAGE_READ_SUPER);
+  if (!img)
+    return -1;
+
+  int max_blocks = img->sb.n_blocks;
+  edfs_block_t *blocks = malloc(max_blocks * sizeof(edfs_block_t));
+  bench_frag_t frag = { 0, };
+
+  for (edfs_inumber_t i = 1; i < img->sb.inode_table_n_inodes; i++)
+    {
+      edfs_inode_t inode = { .inumber = i };
+
+      if (edfs_read_inode(img, &inode) <= 0 ||
+          inode.inode.type == EDFS_INODE_TYPE_FREE ||
+          edfs_disk_inode_is_directory(&inode.inode))
+        continue;
+
+      bench_frag_add(&frag, blocks, bench_inode_blocks(img, &inode, blocks, max_blocks));
+    }
+
+  /* Leave some space, so the synthetic runs are not limited by it. */
+  int n_blocks = n_ops;
+  if (n_blocks > img->n_free_blocks / (2 * BENCH_FRAG_WRITERS))
+    n_blocks = img->n_free_blocks / (2 * BENCH_FRAG_WRITERS);
+
+  free(blocks);
+  edfs_image_close(img);
+
+  printf("frag: %s\n", image);
+  printf("%-22s %6s %8s %8s %12s %12s\n", "", "files", "blocks", "runs",
+         "blocks/run", "avg per file");
+  bench_frag_print("image", &frag);
+
+  static const struct
+  {
+    bench_placement_t placement;
+    const char *label;
+  } policies[] =
+  {
+    { PLACEMENT_NEXT_FIT, "interleaved next-fit" },
+    { PLACEMENT_GOAL,     "interleaved goal" },
+    { PLACEMENT_RESERVE,  "interleaved reserve" },
+  };
+
+  for (int i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+    {
+      bench_frag_t synthetic = { 0, };
+
+      if (!bench_frag_synthetic(image, policies[i].placement, n_blocks, &synthetic))
+        return -1;
+
+      bench_frag_print(policies[i].label, &synthetic);
+    }
+
+  return 0;
+}
+
+
+/*
+ * Image backends
+ *
+ * Compares the pread() backend, with and without the in-memory inode
+ * table, and the io_uring engine against a memory-mapped image: inode
+ * reads, directory scans through the block cache, reading all file
+ * data, and rewriting the files followed by a sync (msync() for the
+ * mapped image).
+ */
+
+typedef struct
+{
+  double inodes_per_sec;
+  double dir_blocks_per_sec;
+  double read_mb_per_sec;
+  double write_sync_ms;
+} bench_backend_t;
+
+static bool
+bench_backend_run(const char *image, int flags, int n_rounds,
+                  bench_backend_t *result)
+{
+  char scratch[4096];
+
+  if (!bench_copy_image(image, scratch))
+    return false;
+
+  edfs_image_t *img = edfs_image_open(scratch, flags);
+  if (!img)
+    {
+      unlink(scratch);
+      return false;
+    }
+
+  uint32_t n_inodes = img->sb.inode_table_n_inodes;
+
+  /* No file holds more blocks than the image has. */
+  size_t max_size = (size_t)edfs_file_max_blocks(img) * img->sb.block_size;
+  if (max_size > (size_t)img->sb.n_blocks * img->sb.block_size)
+    max_size = (size_t)img->sb.n_blocks * img->sb.block_size;
+  char *buf = malloc(max_size);
+  uint64_t n_dir_blocks = 0, n_bytes = 0, checksum = 0;
+
+  double start = bench_now();
+  for (int r = 0; r < n_rounds; r++)
+    for (edfs_inumber_t i = 1; i < n_inodes; i++)
+      {
+        edfs_inode_t inode = { .inumber = i };
+        edfs_read_inode(img, &inode);
+        checksum += inode.inode.size;
+      }
+  result->inodes_per_sec = (double)n_rounds * (n_inodes - 1) / (bench_now() - start);
+
+  start = bench_now();
+  for (int r = 0; r < n_rounds; r++)
+    for (edfs_inumber_t i = 1; i < n_inodes; i++)
+      {
+        edfs_inode_t inode = { .inumber = i };
+
+        if (edfs_read_inode(img, &inode) <= 0 ||
+            !edfs_disk_inode_is_directory(&inode.inode))
+          continue;
+
+        for (int b = 0; b < EDFS_INODE_N_BLOCKS; b++)
+          {
+            edfs_block_t block = edfs_disk_inode_get_block(&inode.inode, b);
+            if (block == EDFS_BLOCK_INVALID)
+              continue;
+
+            edfs_buf_t *dir = edfs_cache_read(img, block);
+            if (!dir)
+              continue;
+
+            edfs_dir_entry_t *entries = (edfs_dir_entry_t *)dir->data;
+            for (int e = 0; e < edfs_get_n_dir_entries_per_block(&img->sb); e++)
+              checksum += entries[e].inumber;
+            edfs_cache_release(img, dir);
+            n_dir_blocks++;
+          }
+      }
+  result->dir_blocks_per_sec = n_dir_blocks / (bench_now() - start);
+
+  start = bench_now();
+  for (int r = 0; r < n_rounds; r++)
+    for (edfs_inumber_t i = 1; i < n_inodes; i++)
+      {
+        edfs_inode_t inode = { .inumber = i };
+
+        if (edfs_read_inode(img, &inode) <= 0 ||
+            inode.inode.type == EDFS_INODE_TYPE_FREE ||
+            edfs_disk_inode_is_directory(&inode.inode))
+          continue;
+
+        edfs_file_t *file = edfs_file_get(img, &inode);
+        ssize_t n = edfs_file_read(img, file, buf, inode.inode.size, 0);
+        edfs_file_put(img, file);
+
+        if (n > 0)
+          {
+            n_bytes += n;
+            checksum += buf[n - 1];
+          }
+      }
+  result->read_mb_per_sec = n_bytes / (1024.0 * 1024.0) / (bench_now() - start);
+
+  /* Rewrite every file in place, then make it durable. */
+  start = bench_now();
+  for (edfs_inumber_t i = 1; i < n_inodes; i++)
+    {
+      edfs_inode_t inode = { .inumber = i };
+
+      if (edfs_read_inode(img, &inode) <= 0 ||
+          inode.inode.type == EDFS_INODE_TYPE_FREE ||
+          edfs_disk_inode_is_directory(&inode.inode))
+        continue;
+
+      edfs_file_t *file = edfs_file_get(img, &inode);
+      ssize_t n = edfs_file_read(img, file, buf, inode.inode.size, 0);
+      if (n > 0)
+        edfs_file_write(img, file, buf, n, 0);
+      edfs_file_put(img, file);
+    }
+  edfs_image_sync(img);
+  fsync(img->fd);
+  result->write_sync_ms = (bench_now() - start) * 1000.0;
+
+  if (checksum == 0)
+    fprintf(stderr, "warning: image holds no data\n");
+
+  free(buf);
+  edfs_image_close(img);
+  unlink(scratch);
+
+  return true;
+}
+
+static int
+bench_backend(const char *image, int n_ops)
+{
+  static const struct
+  {
+    int flags;
+    const char *label;
+  } backends[] =
+  {
+    { EDFS_IMAGE_READ_SUPER,                          "pread" },
+    { EDFS_IMAGE_READ_SUPER | EDFS_IMAGE_INODE_CACHE, "pread+inode-cache" },
+    { EDFS_IMAGE_READ_SUPER | EDFS_IMAGE_INODE_CACHE |
+      EDFS_IMAGE_IO_URING,                            "io_uring+inode-cache" },
+    { EDFS_IMAGE_READ_SUPER | EDFS_IMAGE_MMAP,        "mmap" },
+  };
+
+  printf("backend: %s, %d rounds\n", image, n_ops);
+  printf("%-20s %14s %14s %10s %14s\n", "", "inodes/s", "dir blocks/s",
+         "read MB/s", "rewrite+sync");
+
+  for (int i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+    {
+      bench_backend_t result;
+
+      if (!bench_backend_run(image, backends[i].flags, n_ops, &result))
+        return -1;
+
+      printf("%-20s %14.0f %14.0f %10.1f %11.2f ms\n", backends[i].label,
+             result.inodes_per_sec, result.dir_blocks_per_sec,
+             result.read_mb_per_sec, result.write_sync_ms);
+    }
+
+  return 0;
+}
+
+
+/*
+ * Splice
+ *
+ * Large sequential reads of a file, delivered to /dev/null the way
+ * edfuse hands them to /dev/fuse: copied through a user-space buffer
+ * (read callback), or spliced from the image through a pipe using the
+ * extents that read_buf returns.
+ */
+
+#define BENCH_SPLICE_REQUEST (128 * 1024)
+
+typedef struct
+{
+  int pipe[2];
+  int out;
+} bench_splice_t;
+
+static int
+bench_splice_extent(edfs_image_t             *img,
+                    const edfs_file_extent_t *extent,
+                    void                     *user_data)
+{
+  bench_splice_t *state = user_data;
+
+  if (extent->type != EDFS_EXTENT_DISK)
+    {
+      /* Buffered data and holes are passed in memory. */
+      static const char zero[4096];
+      size_t done = 0;
+
+      while (done < extent->len)
+        {
+          size_t n = extent->len - done < sizeof(zero) ? extent->len - done : sizeof(zero);
+          if (write(state->out, extent->data ? extent->data + done : zero, n) < 0)
+            return -errno;
+          done += n;
+        }
+      return 0;
+    }
+
+#ifdef __linux__
+  loff_t pos = extent->pos;
+  size_t left = extent->len;
+
+  while (left > 0)
+    {
+      ssize_t n = splice(img->fd, &pos, state->pipe[1], NULL, left, SPLICE_F_MOVE);
+      if (n <= 0)
+        return n < 0 ? -errno : -EIO;
+
+      for (ssize_t out = 0; out < n; )
+        {
+          ssize_t m = splice(state->pipe[0], NULL, state->out, NULL, n - out,
+                             SPLICE_F_MOVE);
+          if (m <= 0)
+            return m < 0 ? -errno : -EIO;
+          out += m;
+        }
+
+      left -= n;
+    }
+
+  return 0;
+#else
+  return -ENOSYS;
+#endif
+}
+
+static int
+bench_splice(const char *image, int n_ops)
+{
+  char scratch[4096];
+
+  if (!bench_copy_image(image, scratch))
+    return -1;
+
+  edfs_image_t *img = edfs_image_open(scratch, EDFS_IMAGE_READ_SUPER | EDFS_IMAGE_INODE_CACHE);
+  if (!img)
+    {
+      unlink(scratch);
+      return -1;
+    }
+
+  /* A file of the maximum size that fits, not linked into any
+   * directory.
+   */
+  edfs_inode_t inode;
+  size_t size = (size_t)edfs_file_max_blocks(img) * img->sb.block_size;
+  if (size > (size_t)img->n_free_blocks / 2 * img->sb.block_size)
+    size = (size_t)img->n_free_blocks / 2 * img->sb.block_size;
+  char *buf = malloc(size);
+  int res = -1;
+
+  for (size_t i = 0; i < size; i++)
+    buf[i] = i * 7;
+
+  if (edfs_new_inode(img, &inode, EDFS_INODE_TYPE_FILE) < 0 ||
+      edfs_write_inode(img, &inode) < 0)
+    goto out;
+
+  edfs_file_t *file = edfs_file_get(img, &inode);
+  if (!file ||
+      edfs_file_write(img, file, buf, size, 0) != size ||
+      edfs_file_flush(img, file) < 0)
+    goto out;
+
+  bench_splice_t state;
+  state.out = open("/dev/null", O_WRONLY);
+  if (state.out < 0 || pipe(state.pipe) < 0)
+    goto out;
+
+  printf("splice: %zu KiB file, %d KiB requests, %d rounds\n", size / 1024,
+         BENCH_SPLICE_REQUEST / 1024, n_ops);
+
+  double start = bench_now();
+  for (int r = 0; r < n_ops; r++)
+    for (off_t off = 0; off < size; off += BENCH_SPLICE_REQUEST)
+      {
+        ssize_t n = edfs_file_read(img, file, buf, BENCH_SPLICE_REQUEST, off);
+        if (n < 0 || write(state.out, buf, n) != n)
+          goto out;
+      }
+  double copy = bench_now() - start;
+
+  start = bench_now();
+  for (int r = 0; r < n_ops; r++)
+    for (off_t off = 0; off < size; off += BENCH_SPLICE_REQUEST)
+      if (edfs_file_read_extents(img, file, BENCH_SPLICE_REQUEST, off,
+                                 bench_splice_extent, &state) < 0)
+        {
+          fprintf(stderr, "error: splice failed\n");
+          goto out;
+        }
+  double spliced = bench_now() - start;
+
+  double mb = (double)n_ops * size / (1024.0 * 1024.0);
+  printf("%-10s %10.1f MB/s\n", "copy", mb / copy);
+  printf("%-10s %10.1f MB/s\n", "splice", mb / spliced);
+
+  edfs_file_put(img, file);
+  res = 0;
+
+out:
+  free(buf);
+  edfs_image_close(img);
+  unlink(scratch);
+
+  return res;
+}
+
+
+/*
+ * Readahead
+ *
+ * Sequential and random reads of two files whose data is not in the
+ * page cache of the host, without and with readahead. The files are
+ * written in alternating chunks, so that their data is not contiguous
+ * in the image, and the image is evicted from the page cache before
+ * every pass. They are created on a generated image rather than the
+ * given one, so that they are large enough for the reads to go to the
+ * disk instead of being served from the page cache of a small image.
+ */
+
+#define BENCH_READAHEAD_SIZE    (256 * 1024 * 1024)
+#define BENCH_READAHEAD_REQUEST (128 * 1024)
+#define BENCH_READAHEAD_CHUNK   (64 * 1024)
+#define BENCH_READAHEAD_RANDOM  4096
+#define BENCH_READAHEAD_N_RANDOM 1024
+
+static void
+bench_readahead_evict(edfs_image_t *img)
+{
+  fsync(img->fd);
+  posix_fadvise(img->fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+/* Reads both files sequentially and at random, n_rounds times; stores
+ * the sequential rate in MB/s and the random reads per second.
+ */
+static bool
+bench_readahead_run(edfs_image_t *img, edfs_file_t **files, size_t size,
+                    char *buf, int n_rounds, double *seq, double *random_ops)
+{
+  double seq_time = 0.0, random_time = 0.0;
+
+  srandom(n_rounds);
+
+  for (int r = 0; r < n_rounds; r++)
+    {
+      bench_readahead_evict(img);
+
+      double start = bench_now();
+      for (int f = 0; f < 2; f++)
+        for (off_t off = 0; off < size; off += BENCH_READAHEAD_REQUEST)
+          if (edfs_file_read(img, files[f], buf, BENCH_READAHEAD_REQUEST,
+                             off) <= 0)
+            return false;
+      seq_time += bench_now() - start;
+
+      bench_readahead_evict(img);
+
+      start = bench_now();
+      for (int i = 0; i < BENCH_READAHEAD_N_RANDOM; i++)
+        {
+          off_t off = (random() % (size / BENCH_READAHEAD_RANDOM)) *
+              BENCH_READAHEAD_RANDOM;
+          if (edfs_file_read(img, files[i % 2], buf, BENCH_READAHEAD_RANDOM,
+                             off) <= 0)
+            return false;
+        }
+      random_time += bench_now() - start;
+    }
+
+  *seq = 2.0 * n_rounds * size / (1024.0 * 1024.0) / seq_time;
+  *random_ops = (double)n_rounds * BENCH_READAHEAD_N_RANDOM / random_time;
+
+  return true;
+}
+
+static int
+bench_readahead(const char *image, int n_ops)
+{
+  char scratch[4096];
+  size_t size = BENCH_READAHEAD_SIZE;
+
+  /* Each round reads both files twice, so use fewer rounds than -n. */
+  n_ops = n_ops / 64 > 0 ? n_ops / 64 : 1;
+
+  /* Room for both files and their extent trees. */
+  edfs_image_t *img = bench_ops_generate(scratch, EDFS_VERSION_LATEST, 4096,
+                                         2 * size / 4096 + 4096, 64);
+  if (!img)
+    return -1;
+
+  edfs_file_t *files[2] = { NULL, NULL };
+  char *buf = malloc(BENCH_READAHEAD_REQUEST);
+  int res = -1;
+
+  for (size_t i = 0; i < BENCH_READAHEAD_REQUEST; i++)
+    buf[i] = i * 7;
+
+  for (int f = 0; f < 2; f++)
+    {
+      edfs_inode_t inode;
+
+      if (edfs_new_inode(img, &inode, EDFS_INODE_TYPE_FILE) < 0 ||
+          edfs_write_inode(img, &inode) < 0 ||
+          !(files[f] = edfs_file_get(img, &inode)))
+        goto out;
+    }
+
+  for (off_t off = 0; off < size; off += BENCH_READAHEAD_CHUNK)
+    for (int f = 0; f < 2; f++)
+      if (edfs_file_write(img, files[f], buf, BENCH_READAHEAD_CHUNK,
+                          off) != BENCH_READAHEAD_CHUNK ||
+          edfs_file_flush(img, files[f]) < 0)
+        {
+          fprintf(stderr, "error: could not write the files\n");
+          goto out;
+        }
+  edfs_image_sync(img);
+
+  printf("readahead: 2 files of %zu MiB on a generated version %d image "
+         "of %zu MiB, %d KiB sequential and %d KiB random reads, "
+         "%d rounds\n", size / (1024 * 1024), img->sb.version,
+         (size_t)(edfs_get_size(&img->sb) / (1024 * 1024)),
+         BENCH_READAHEAD_REQUEST / 1024, BENCH_READAHEAD_RANDOM / 1024,
+         n_ops);
+  printf("%-24s %10s %12s\n", "", "seq MB/s", "random/s");
+
+  double seq, random_ops;
+  if (!bench_readahead_run(img, files, size, buf, n_ops, &seq, &random_ops))
+    goto out;
+  printf("%-24s %10.1f %12.0f\n", "off", seq, random_ops);
+
+  img->readahead = edfs_readahead_new(img, EDFS_READAHEAD_DEFAULT_SIZE,
+                                      EDFS_READAHEAD_DEFAULT_THREADS);
+  if (!img->readahead ||
+      !bench_readahead_run(img, files, size, buf, n_ops, &seq, &random_ops))
+    goto out;
+
+  edfs_readahead_stats_t stats;
+  char label[64];
+
+  edfs_readahead_get_stats(img->readahead, &stats);
+  snprintf(label, sizeof(label), "on (%zu KiB, %d threads)",
+           stats.max_size / 1024, stats.n_threads);
+  printf("%-24s %10.1f %12.0f\n", label, seq, random_ops);
+  printf("%llu windows, %llu dropped, %llu blocks read ahead\n",
+         (unsigned long long)stats.windows,
+         (unsigned long long)stats.dropped,
+         (unsigned long long)stats.blocks);
+
+  res = 0;
+
+out:
+  /* Stop the threads before the files go away. */
+  edfs_readahead_free(img->readahead);
+  img->readahead = NULL;
+  for (int f = 0; f < 2; f++)
+    if (files[f])
+      edfs_file_put(img, files[f]);
+
+  free(buf);
+  edfs_image_close(img);
+  unlink(scratch);
+
+  return res;
+}
+
+
+/*
+ * Directory lookups
+ *
+ * Lookups of every name in the largest directory of the image, plus one
+ * of a name that does not exist, and creation and removal of an entry,
+ * with directories scanned block by block or answered by the directory
+ * index. The dentry cache is disabled, so that every lookup reaches the
+ * directory.
+ */
+
+typedef struct
+{
+  char (*names)[EDFS_FILENAME_SIZE];
+  uint32_t n_names;
+} bench_dir_names_t;
+
+static bool
+bench_dir_collect(const edfs_dir_entry_t *entry, uint32_t next,
+                  void *user_data)
+{
+  bench_dir_names_t *names = user_data;
+
+  strncpy(names->names[names->n_names++], entry->filename, EDFS_FILENAME_SIZE);
+  return true;
+}
+
+static bool
+bench_dir_run(const char *image, bool indexed, int n_ops,
+              double *lookups_per_sec, double *creates_per_sec)
+{
+  char scratch[4096];
+
+  if (!bench_copy_image(image, scratch))
+    return false;
+
+  edfs_image_t *img = edfs_image_open(scratch, EDFS_IMAGE_READ_SUPER | EDFS_IMAGE_INODE_CACHE);
+  if (!img)
+    {
+      unlink(scratch);
+      return false;
+    }
+
+  if (indexed)
+    img->dindex = edfs_dindex_new(EDFS_DINDEX_DEFAULT_SIZE);
+
+  uint32_t max_entries = EDFS_INODE_N_BLOCKS * edfs_get_n_dir_entries_per_block(&img->sb);
+  bench_dir_names_t names = { calloc(max_entries + 1, EDFS_FILENAME_SIZE), 0 };
+  edfs_inode_t dir = { .inumber = 0 };
+  uint32_t n_names = 0;
+  bool ok = false;
+
+  for (edfs_inumber_t i = 1; i < img->sb.inode_table_n_inodes; i++)
+    {
+      edfs_inode_t inode = { .inumber = i };
+
+      if (edfs_read_inode(img, &inode) <= 0 ||
+          !edfs_disk_inode_is_directory(&inode.inode))
+        continue;
+
+      /* The largest directory that has room for one more entry. */
+      names.n_names = 0;
+      edfs_dir_iterate(img, &inode, 0, bench_dir_collect, &names);
+      if (names.n_names < max_entries &&
+          (names.n_names > n_names || dir.inumber == 0))
+        {
+          dir = inode;
+          n_names = names.n_names;
+        }
+    }
+
+  if (dir.inumber == 0)
+    {
+      fprintf(stderr, "error: no directory with a free entry\n");
+      goto out;
+    }
+
+  names.n_names = 0;
+  edfs_dir_iterate(img, &dir, 0, bench_dir_collect, &names);
+  strcpy(names.names[names.n_names++], "nonexistent");
+
+  uint64_t n_found = 0;
+  double start = bench_now();
+  for (int r = 0; r < n_ops; r++)
+    for (uint32_t i = 0; i < names.n_names; i++)
+      {
+        edfs_dir_entry_t direntry = { 0, };
+
+        strncpy(direntry.filename, names.names[i], EDFS_FILENAME_SIZE - 1);
+        n_found += edfs_dir_lookup(img, &dir, &direntry);
+      }
+  *lookups_per_sec = (double)n_ops * names.n_names / (bench_now() - start);
+
+  ok = n_found == (uint64_t)n_ops * (names.n_names - 1);
+  if (!ok)
+    fprintf(stderr, "error: lookups failed\n");
+
+  start = bench_now();
+  for (int r = 0; ok && r < n_ops; r++)
+    {
+      edfs_inode_t inode;
+
+      if (edfs_dir_create(img, &dir, "benchentry", EDFS_INODE_TYPE_FILE, &inode) < 0 ||
+          edfs_dir_remove(img, &dir, "benchentry", &inode) < 0)
+        {
+          fprintf(stderr, "error: create failed\n");
+          ok = false;
+        }
+    }
+  *creates_per_sec = n_ops / (bench_now() - start);
+
+out:
+  free(names.names);
+  edfs_image_close(img);
+  unlink(scratch);
+
+  return ok;
+}
+
+static int
+bench_dir(const char *image, int n_ops)
+{
+  printf("dir: %s, %d rounds\n", image, n_ops * 16);
+  printf("%-10s %14s %14s\n", "", "lookups/s", "create+rm/s");
+
+  for (int indexed = 0; indexed <= 1; indexed++)
+    {
+      double lookups_per_sec, creates_per_sec;
+
+      if (!bench_dir_run(image, indexed, n_ops * 16,
+                         &lookups_per_sec, &creates_per_sec))
+        return -1;
+
+      printf("%-10s %14.0f %14.0f\n", indexed ? "indexed" : "scan",
+             lookups_per_sec, creates_per_sec);
+    }
+
+  return 0;
+}
+
+
+/*
+ * Stress
+ *
+ * Threads that concurrently create, write, read back, truncate and
+ * remove files in one shared directory, after which the directory, the
+ * free block count and the free inode count must be as they were.
+ * Followed by the aggregate read bandwidth of 1 up to
+ * BENCH_STRESS_MAX_THREADS threads, each reading a different file.
+ */
+
+#define BENCH_STRESS_MAX_THREADS 8
+
+typedef struct
+{
+  edfs_image_t *img;
+  edfs_inode_t dir;
+  edfs_inode_t file;
+  int id;
+  size_t max_size;
+  int n_ops;
+  int n_errors;
+  uint64_t n_bytes;
+} bench_stress_worker_t;
+
+static bool
+bench_stress_count(const edfs_dir_entry_t *entry, uint32_t next,
+                   void *user_data)
+{
+  (*(uint32_t *)user_data)++;
+  return true;
+}
+
+static uint32_t
+bench_stress_n_entries(edfs_image_t *img, edfs_inode_t *dir)
+{
+  uint32_t n_entries = 0;
+
+  edfs_dir_iterate(img, dir, 0, bench_stress_count, &n_entries);
+  return n_entries;
+}
+
+static uint32_t
+bench_stress_n_dir_blocks(const edfs_inode_t *dir)
+{
+  uint32_t n_blocks = 0;
+
+  for (int i = 0; i < EDFS_INODE_N_BLOCKS; i++)
+    if (edfs_disk_inode_get_block(&dir->inode, i) != EDFS_BLOCK_INVALID)
+      n_blocks++;
+
+  return n_blocks;
+}
+
+static bool
+bench_stress_error(bench_stress_worker_t *worker, const char *what, int op)
+{
+  fprintf(stderr, "error: thread %d, op %d: %s\n", worker->id, op, what);
+  worker->n_errors++;
+  return false;
+}
+
+/* One create, write, verify, truncate, verify, remove cycle. */
+static bool
+bench_stress_cycle(bench_stress_worker_t *worker, int op,
+                   char *wbuf, char *rbuf, size_t size)
+{
+  edfs_image_t *img = worker->img;
+  edfs_inode_t dir = worker->dir;
+  edfs_inode_t inode;
+  char name[EDFS_FILENAME_SIZE];
+
+  snprintf(name, sizeof(name), "stress%d", worker->id);
+  for (size_t i = 0; i < size; i++)
+    wbuf[i] = worker->id * 31 + op + i;
+
+  if (edfs_dir_create(img, &dir, name, EDFS_INODE_TYPE_FILE, &inode) < 0)
+    return bench_stress_error(worker, "create failed", op);
+
+  edfs_file_t *file = edfs_file_get(img, &inode);
+  if (!file)
+    return bench_stress_error(worker, "open failed", op);
+
+  bool ok = edfs_file_write(img, file, wbuf, size, 0) == size;
+  if (ok && op % 2 == 0)
+    ok = edfs_file_flush(img, file) == 0;
+  if (!ok)
+    bench_stress_error(worker, "write failed", op);
+  else if (edfs_file_read(img, file, rbuf, size, 0) != size ||
+           memcmp(wbuf, rbuf, size) != 0)
+    ok = bench_stress_error(worker, "read back differs", op);
+  else if (edfs_file_truncate(img, file, size / 2) < 0 ||
+           edfs_file_read(img, file, rbuf, size, 0) != size / 2 ||
+           memcmp(wbuf, rbuf, size / 2) != 0)
+    ok = bench_stress_error(worker, "truncate failed", op);
+
+  edfs_file_put(img, file);
+
+  edfs_dir_entry_t direntry = { 0, };
+  strncpy(direntry.filename, name, EDFS_FILENAME_SIZE - 1);
+  dir = worker->dir;
+  if (!edfs_dir_lookup(img, &dir, &direntry) ||
+      direntry.inumber != inode.inumber)
+    return bench_stress_error(worker, "lookup failed", op);
+
+  if (edfs_dir_remove(img, &dir, name, &inode) < 0)
+    return bench_stress_error(worker, "remove failed", op);
+
+  return ok;
+}
+
+static void *
+bench_stress_worker(void *user_data)
+{
+  bench_stress_worker_t *worker = user_data;
+  size_t max_size = worker->max_size;
+  char *wbuf = malloc(max_size);
+  char *rbuf = malloc(max_size);
+
+  for (int op = 0; op < worker->n_ops && worker->n_errors == 0; op++)
+    {
+      /* Sizes vary from a partial block to the maximum file size. */
+      size_t size = 1 + (op * 7919 + worker->id * 104729) % max_size;
+
+      bench_stress_cycle(worker, op, wbuf, rbuf, size);
+    }
+
+  free(wbuf);
+  free(rbuf);
+  return NULL;
+}
+
+static void *
+bench_stress_reader(void *user_data)
+{
+  bench_stress_worker_t *worker = user_data;
+  size_t size = worker->file.inode.size;
+  char *buf = malloc(size);
+
+  edfs_file_t *file = edfs_file_get(worker->img, &worker->file);
+  for (int op = 0; file && op < worker->n_ops; op++)
+    {
+      ssize_t n = edfs_file_read(worker->img, file, buf, size, 0);
+      if (n != size)
+        {
+          bench_stress_error(worker, "short read", op);
+          break;
+        }
+      worker->n_bytes += n;
+    }
+
+  if (file)
+    edfs_file_put(worker->img, file);
+  free(buf);
+  return NULL;
+}
+
+/* Runs @func in @n_threads threads, returns the wall clock time or a
+ * negative value if a thread reported errors.
+ */
+static double
+bench_stress_run(bench_stress_worker_t *workers, int n_threads,
+                 void *(*func) (void *))
+{
+  pthread_t threads[BENCH_STRESS_MAX_THREADS];
+  int n_errors = 0;
+
+  double start = bench_now();
+  for (int t = 0; t < n_threads; t++)
+    pthread_create(&threads[t], NULL, func, &workers[t]);
+  for (int t = 0; t < n_threads; t++)
+    {
+      pthread_join(threads[t], NULL);
+      n_errors += workers[t].n_errors;
+    }
+
+  return n_errors > 0 ? -1.0 : bench_now() - start;
+}
+
+static int
+bench_stress(const char *image, int n_ops)
+{
+  char scratch[4096];
+
+  if (!bench_copy_image(image, scratch))
+    return -1;
+
+  edfs_image_t *img = edfs_image_open(scratch, EDFS_IMAGE_READ_SUPER | EDFS_IMAGE_INODE_CACHE);
+  if (!img)
+    {
+      unlink(scratch);
+      return -1;
+    }
+
+  uint32_t max_entries = EDFS_INODE_N_BLOCKS * edfs_get_n_dir_entries_per_block(&img->sb);
+  bench_stress_worker_t workers[BENCH_STRESS_MAX_THREADS];
+  edfs_inode_t files[BENCH_STRESS_MAX_THREADS];
+  edfs_inode_t dir = { .inumber = 0 };
+  int n_files = 0;
+  int res = -1;
+
+  /* A directory with room for an entry per thread, and the largest
+   * files to read.
+   */
+  for (edfs_inumber_t i = 1; i < img->sb.inode_table_n_inodes; i++)
+    {
+      edfs_inode_t inode = { .inumber = i };
+
+      if (edfs_read_inode(img, &inode) <= 0 ||
+          inode.inode.type == EDFS_INODE_TYPE_FREE)
+        continue;
+
+      if (edfs_disk_inode_is_directory(&inode.inode))
+        {
+          if (dir.inumber == 0 &&
+              bench_stress_n_entries(img, &inode) + BENCH_STRESS_MAX_THREADS <= max_entries)
+            dir = inode;
+          continue;
+        }
+
+      /* Keep the largest files, sorted by size. */
+      int j = n_files < BENCH_STRESS_MAX_THREADS ? n_files++ : BENCH_STRESS_MAX_THREADS;
+      for ( ; j > 0 && files[j - 1].inode.size < inode.inode.size; j--)
+        if (j < BENCH_STRESS_MAX_THREADS)
+          files[j] = files[j - 1];
+      if (j < BENCH_STRESS_MAX_THREADS)
+        files[j] = inode;
+    }
+
+  if (dir.inumber == 0 || n_files == 0 || files[0].inode.size == 0)
+    {
+      fprintf(stderr, "error: image needs a directory with %d free entries and a non-empty file\n",
+              BENCH_STRESS_MAX_THREADS);
+      goto out;
+    }
+
+  uint32_t n_entries = bench_stress_n_entries(img, &dir);
+  uint32_t n_dir_blocks = bench_stress_n_dir_blocks(&dir);
+  uint32_t n_free_blocks = img->n_free_blocks;
+  uint32_t n_free_inodes = img->n_free_inodes;
+
+  /* Files are limited to a share of the free space, leaving room for
+   * indirect blocks, so that writes do not run out of space.
+   */
+  size_t max_size = (size_t)edfs_file_max_blocks(img) * img->sb.block_size;
+  size_t share = (size_t)n_free_blocks / (2 * BENCH_STRESS_MAX_THREADS) * img->sb.block_size;
+  if (max_size > share)
+    max_size = share;
+
+  printf("stress: %s, directory %u, %d threads, %d cycles per thread, files up to %zu KiB\n",
+         image, dir.inumber, BENCH_STRESS_MAX_THREADS, n_ops, max_size / 1024);
+
+  for (int t = 0; t < BENCH_STRESS_MAX_THREADS; t++)
+    workers[t] = (bench_stress_worker_t){ .img = img, .dir = dir, .id = t,
+                                          .max_size = max_size, .n_ops = n_ops };
+
+  double elapsed = bench_stress_run(workers, BENCH_STRESS_MAX_THREADS,
+                                    bench_stress_worker);
+  if (elapsed < 0)
+    goto out;
+
+  edfs_file_flush_all(img);
+  edfs_read_inode(img, &dir);
+
+  /* A directory block added during the run is not given back. */
+  uint32_t n_new_dir_blocks = bench_stress_n_dir_blocks(&dir) - n_dir_blocks;
+
+  if (bench_stress_n_entries(img, &dir) != n_entries ||
+      img->n_free_blocks + n_new_dir_blocks != n_free_blocks ||
+      img->n_free_inodes != n_free_inodes)
+    {
+      fprintf(stderr, "error: image not restored: %u/%u entries, %u/%u free blocks, %u/%u free inodes\n",
+              bench_stress_n_entries(img, &dir), n_entries,
+              img->n_free_blocks + n_new_dir_blocks, n_free_blocks,
+              img->n_free_inodes, n_free_inodes);
+      goto out;
+    }
+
+  printf("%-10s %10.0f cycles/s, image restored\n", "cycles",
+         BENCH_STRESS_MAX_THREADS * n_ops / elapsed);
+
+  printf("%-10s %10s %10s\n", "readers", "MB/s", "speedup");
+
+  double base = 0.0;
+  for (int n_threads = 1; n_threads <= BENCH_STRESS_MAX_THREADS; n_threads *= 2)
+    {
+      uint64_t n_bytes = 0;
+
+      for (int t = 0; t < n_threads; t++)
+        workers[t] = (bench_stress_worker_t){ .img = img, .file = files[t % n_files],
+                                              .id = t, .n_ops = n_ops * 4 };
+
+      elapsed = bench_stress_run(workers, n_threads, bench_stress_reader);
+      if (elapsed < 0)
+        goto out;
+
+      for (int t = 0; t < n_threads; t++)
+        n_bytes += workers[t].n_bytes;
+
+      double mb_per_sec = n_bytes / (1024.0 * 1024.0) / elapsed;
+      if (n_threads == 1)
+        base = mb_per_sec;
+      printf("%-10d %10.1f %9.2fx\n", n_threads, mb_per_sec, mb_per_sec / base);
+    }
+
+  res = 0;
+
+out:
+  edfs_image_close(img);
+  unlink(scratch);
+
+  return res;
+}
+
+
+/*
+ * Operations
+ *
+ * Latency of the operations behind the FUSE callbacks, called directly
+ * instead of through a mount: path lookups in a deep hierarchy and in
+ * a wide directory, sequential and random reads, and a storm of file
+ * creations. Images are copies of the given image or generated ones,
+ * with the caches set up as edfuse does by default. Reports ops/s, p50
+ * and p99 per operation; with -o, the results are also written as CSV,
+ * to compare across commits.
+ */
+
+#define BENCH_OPS_DEEP_LEVELS   32
+#define BENCH_OPS_READ_SEQ      (128 * 1024)   /* FUSE's largest request */
+#define BENCH_OPS_READ_RANDOM   4096
+
+static FILE *bench_csv;
+
+typedef struct
+{
+  double *samples;
+  int n_samples;
+  int max_samples;
+  double start;
+  double elapsed;
+} bench_latency_t;
+
+static bool
+bench_latency_init(bench_latency_t *lat, int max_samples)
+{
+  lat->samples = malloc(max_samples * sizeof(double));
+  lat->n_samples = 0;
+  lat->max_samples = max_samples;
+  lat->elapsed = 0.0;
+
+  return lat->samples != NULL;
+}
+
+static inline void
+bench_latency_begin(bench_latency_t *lat)
+{
+  lat->start = bench_now();
+}
+
+static inline void
+bench_latency_end(bench_latency_t *lat)
+{
+  double t = bench_now() - lat->start;
+
+  if (lat->n_samples < lat->max_samples)
+    lat->samples[lat->n_samples++] = t;
+  lat->elapsed += t;
+}
+
+static int
+bench_double_compare(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* Prints and frees the results of @op. */
+static void
+bench_latency_report(const char *op, bench_latency_t *lat)
+{
+  int n = lat->n_samples;
+
+  qsort(lat->samples, n, sizeof(double), bench_double_compare);
+
+  double ops_per_sec = n > 0 ? n / lat->elapsed : 0.0;
+  double p50 = n > 0 ? lat->samples[n / 2] * 1e6 : 0.0;
+  double p99 = n > 0 ? lat->samples[n * 99 / 100] * 1e6 : 0.0;
+
+  printf("%-22s %8d %12.0f %10.2f %10.2f\n", op, n, ops_per_sec, p50, p99);
+  if (bench_csv)
+    fprintf(bench_csv, "%s,%d,%.0f,%.3f,%.3f\n", op, n, ops_per_sec, p50, p99);
+
+  free(lat->samples);
+}
+
+static bool
+bench_ops_lookup(edfs_image_t *img, const char *path, bool expected,
+                 bench_latency_t *lat)
+{
+  edfs_inode_t inode;
+
+  bench_latency_begin(lat);
+  bool found = edfs_find_inode(img, path, &inode);
+  bench_latency_end(lat);
+
+  if (found != expected)
+    fprintf(stderr, "error: lookup of '%s' failed\n", path);
+  return found == expected;
+}
+
+/* Lookups of the innermost directory of a chain of nested directories,
+ * with and without the dentry cache.
+ */
+static bool
+bench_ops_deep(int n_ops)
+{
+  char scratch[4096];
+  char path[BENCH_OPS_DEEP_LEVELS * 4 + 1] = "";
+  bool ok = true;
+
+  edfs_image_t *img = bench_ops_generate(scratch, EDFS_VERSION_LATEST,
+                                         512, 4096, 256);
+  if (!img)
+    return false;
+
+  edfs_inode_t dir;
+  edfs_read_root_inode(img, &dir);
+  for (int i = 0; i < BENCH_OPS_DEEP_LEVELS && ok; i++)
+    {
+      char name[4];
+      edfs_inode_t child;
+
+      snprintf(name, sizeof(name), "d%02d", i);
+      ok = edfs_dir_create(img, &dir, name, EDFS_INODE_TYPE_DIRECTORY, &child) == 0;
+      sprintf(path + strlen(path), "/%s", name);
+      dir = child;
+    }
+
+  edfs_dcache_t *dcache = img->dcache;
+  for (int cached = 1; cached >= 0 && ok; cached--)
+    {
+      bench_latency_t lat;
+
+      img->dcache = cached ? dcache : NULL;
+      if (!bench_latency_init(&lat, n_ops))
+        break;
+      for (int i = 0; i < n_ops && ok; i++)
+        ok = bench_ops_lookup(img, path, true, &lat);
+      bench_latency_report(cached ? "lookup-deep" : "lookup-deep-nodcache", &lat);
+    }
+  img->dcache = dcache;
+
+  edfs_image_close(img);
+  unlink(scratch);
+  return ok;
+}
+
+/* Lookups of random names, existing or not, in a directory holding as
+ * many entries as fit, without the dentry cache.
+ */
+static bool
+bench_ops_wide(int n_ops)
+{
+  char scratch[4096];
+  bool ok = true;
+
+  edfs_image_t *img = bench_ops_generate(scratch, EDFS_VERSION_LATEST,
+                                         EDFS_MAX_BLOCK_SIZE, 4096, 4096);
+  if (!img)
+    return false;
+
+  int n_entries = EDFS_INODE_N_BLOCKS * edfs_get_n_dir_entries_per_block(&img->sb);
+  edfs_inode_t root, inode;
+
+  edfs_read_root_inode(img, &root);
+  for (int i = 0; i < n_entries && ok; i++)
+    {
+      char name[16];
+
+      snprintf(name, sizeof(name), "f%04d", i);
+      ok = edfs_dir_create(img, &root, name, EDFS_INODE_TYPE_FILE, &inode) == 0;
+    }
+
+  edfs_dcache_free(img->dcache);
+  img->dcache = NULL;
+
+  bench_latency_t hit, miss;
+  if (ok && bench_latency_init(&hit, n_ops) && bench_latency_init(&miss, n_ops))
+    {
+      srandom(1);
+      for (int i = 0; i < n_ops && ok; i++)
+        {
+          char path[16];
+
+          snprintf(path, sizeof(path), "/f%04d", (int)(random() % n_entries));
+          ok = bench_ops_lookup(img, path, true, &hit);
+          snprintf(path, sizeof(path), "/g%04d", (int)(random() % n_entries));
+          ok = ok && bench_ops_lookup(img, path, false, &miss);
+        }
+      bench_latency_report("lookup-wide", &hit);
+      bench_latency_report("lookup-wide-missing", &miss);
+    }
+
+  edfs_image_close(img);
+  unlink(scratch);
+  return ok;
+}
+
+/* Sequential reads of every file in FUSE-sized requests, and random
+ * page-sized reads across the files, as read through an open handle.
+ */
+static bool
+bench_ops_read(const char *image, int n_ops)
+{
+  char scratch[4096];
+  bool ok = true;
+
+  if (!bench_copy_image(image, scratch))
+    return false;
+
+  edfs_image_t *img = bench_ops_open(scratch);
+  if (!img)
+    {
+      unlink(scratch);
+      return false;
+    }
+
+  edfs_file_t **files = malloc(img->sb.inode_table_n_inodes * sizeof(edfs_file_t *));
+  char *buf = malloc(BENCH_OPS_READ_SEQ);
+  int n_files = 0;
+
+  for (edfs_inumber_t i = 1; i < img->sb.inode_table_n_inodes; i++)
+    {
+      edfs_inode_t inode = { .inumber = i };
+
+      if (edfs_read_inode(img, &inode) > 0 &&
+          inode.inode.type != EDFS_INODE_TYPE_FREE &&
+          !edfs_disk_inode_is_directory(&inode.inode) &&
+          inode.inode.size >= BENCH_OPS_READ_RANDOM)
+        files[n_files++] = edfs_file_get(img, &inode);
+    }
+
+  bench_latency_t seq, rnd;
+  if (n_files > 0 && bench_latency_init(&seq, n_ops) &&
+      bench_latency_init(&rnd, n_ops))
+    {
+      for (int i = 0, f = 0; i < n_ops && ok; f = (f + 1) % n_files)
+        for (off_t off = 0; off < files[f]->inode.inode.size && i < n_ops && ok;
+             off += BENCH_OPS_READ_SEQ, i++)
+          {
+            bench_latency_begin(&seq);
+            ok = edfs_file_read(img, files[f], buf, BENCH_OPS_READ_SEQ, off) > 0;
+            bench_latency_end(&seq);
+          }
+
+      srandom(1);
+      for (int i = 0; i < n_ops && ok; i++)
+        {
+          edfs_file_t *file = files[random() % n_files];
+          off_t off = random() % (file->inode.inode.size / BENCH_OPS_READ_RANDOM) *
+              BENCH_OPS_READ_RANDOM;
+
+          bench_latency_begin(&rnd);
+          ok = edfs_file_read(img, file, buf, BENCH_OPS_READ_RANDOM, off) > 0;
+          bench_latency_end(&rnd);
+        }
+
+      bench_latency_report("read-seq", &seq);
+      bench_latency_report("read-random", &rnd);
+    }
+  else if (n_files == 0)
+    fprintf(stderr, "warning: image holds no files to read\n");
+
+  for (int f = 0; f < n_files; f++)
+    edfs_file_put(img, files[f]);
+  free(files);
+  free(buf);
+  edfs_image_close(img);
+  unlink(scratch);
+  return ok;
+}
+
+/* Creation, first write and release of new files, spread over as many
+ * directories as needed.
+ */
+static bool
+bench_ops_create(int n_ops)
+{
+  char scratch[4096];
+  char data[1024];
+  bool ok = true;
+
+  edfs_image_t *img = bench_ops_generate(scratch, EDFS_VERSION_LATEST,
+                                         4096, 16384, n_ops + 1024);
+  if (!img)
+    return false;
+
+  int n_per_dir = EDFS_INODE_N_BLOCKS * edfs_get_n_dir_entries_per_block(&img->sb);
+  edfs_inode_t root, dir, inode;
+  bench_latency_t lat;
+
+  memset(data, 'x', sizeof(data));
+  edfs_read_root_inode(img, &root);
+
+  if (!bench_latency_init(&lat, n_ops))
+    ok = false;
+  for (int i = 0; i < n_ops && ok; i++)
+    {
+      char name[16];
+
+      if (i % n_per_dir == 0)
+        {
+          snprintf(name, sizeof(name), "d%04d", i / n_per_dir);
+          if (edfs_dir_create(img, &root, name, EDFS_INODE_TYPE_DIRECTORY, &dir) < 0)
+            {
+              fprintf(stderr, "warning: create storm stopped after %d files\n", i);
+              break;
+            }
+        }
+
+      snprintf(name, sizeof(name), "f%04d", i % n_per_dir);
+      bench_latency_begin(&lat);
+      ok = edfs_dir_create(img, &dir, name, EDFS_INODE_TYPE_FILE, &inode) == 0;
+      edfs_file_t *file = ok ? edfs_file_get(img, &inode) : NULL;
+      ok = file && edfs_file_write(img, file, data, sizeof(data), 0) == sizeof(data);
+      if (file)
+        edfs_file_put(img, file);
+      bench_latency_end(&lat);
+    }
+  if (lat.samples)
+    bench_latency_report("create", &lat);
+
+  edfs_image_close(img);
+  unlink(scratch);
+  return ok;
+}
+
+static int
+bench_ops(const char *image, int n_ops)
+{
+  n_ops *= 16;
+
+  printf("ops: %s, %d operations each\n", image, n_ops);
+  printf("%-22s %8s %12s %10s %10s\n", "operation", "n", "ops/s",
+         "p50 us", "p99 us");
+  if (bench_csv)
+    fprintf(bench_csv, "operation,n,ops_per_sec,p50_us,p99_us\n");
+
+  if (!bench_ops_deep(n_ops) ||
+      !bench_ops_wide(n_ops) ||
+      !bench_ops_read(image, n_ops) ||
+      !bench_ops_create(n_ops))
+    return -1;
+
+  return 0;
+}
+
+
+/*
+ * Block mapping
+ *
+ * Files mapped by indirect blocks (version 1) against extent trees
+ * (version 2), on generated images: the blocks spent on the mapping,
+ * the rate of random block lookups, cold sequential reads, and whether
+ * a file can grow past the largest file of version 1. The files are
+ * written in interleaved chunks, as by concurrent writers.
+ */
+
+#define BENCH_MAPPING_N_FILES 4
+#define BENCH_MAPPING_CHUNK   (64 * 1024)
+#define BENCH_MAPPING_REQUEST (128 * 1024)
+
+static bool
+bench_mapping_run(uint16_t version, size_t size, int n_ops)
+{
+  char scratch[4096];
+  bool ok = false;
+
+  edfs_image_t *img = bench_ops_generate(scratch, version, 4096, 65535,
+                                         2 * BENCH_MAPPING_N_FILES);
+  if (!img)
+    return false;
+
+  edfs_file_t *files[BENCH_MAPPING_N_FILES] = { NULL, };
+  char *buf = malloc(BENCH_MAPPING_REQUEST);
+  uint32_t n_free_blocks = img->n_free_blocks;
+
+  memset(buf, 'x', BENCH_MAPPING_REQUEST);
+
+  for (int f = 0; f < BENCH_MAPPING_N_FILES; f++)
+    {
+      edfs_inode_t inode;
+
+      if (edfs_new_inode(img, &inode, EDFS_INODE_TYPE_FILE) < 0 ||
+          edfs_write_inode(img, &inode) < 0 ||
+          !(files[f] = edfs_file_get(img, &inode)))
+        goto out;
+    }
+
+  for (off_t off = 0; off < size; off += BENCH_MAPPING_CHUNK)
+    for (int f = 0; f < BENCH_MAPPING_N_FILES; f++)
+      if (edfs_file_write(img, files[f], buf, BENCH_MAPPING_CHUNK,
+                          off) != BENCH_MAPPING_CHUNK ||
+          edfs_file_flush(img, files[f]) < 0)
+        {
+          fprintf(stderr, "error: could not write the files\n");
+          goto out;
+        }
+  edfs_image_sync(img);
+
+  uint32_t n_data = BENCH_MAPPING_N_FILES * (size / img->sb.block_size);
+  uint32_t n_map = n_free_blocks - img->n_free_blocks - n_data;
+
+  uint32_t n_logical = size / img->sb.block_size;
+  long n_lookups = (long)n_ops * 4096;
+
+  srandom(n_ops);
+  double start = bench_now();
+  for (long i = 0; i < n_lookups; i++)
+    {
+      edfs_block_t block;
+
+      if (edfs_file_bmap(img, files[i % BENCH_MAPPING_N_FILES],
+                         random() % n_logical, &block) < 0 ||
+          block == EDFS_BLOCK_INVALID)
+        goto out;
+    }
+  double lookups = n_lookups / (bench_now() - start);
+
+  bench_readahead_evict(img);
+  start = bench_now();
+  for (int f = 0; f < BENCH_MAPPING_N_FILES; f++)
+    for (off_t off = 0; off < size; off += BENCH_MAPPING_REQUEST)
+      if (edfs_file_read(img, files[f], buf, BENCH_MAPPING_REQUEST,
+                         off) <= 0)
+        goto out;
+  double seq = (double)BENCH_MAPPING_N_FILES * size / (1024.0 * 1024.0) /
+      (bench_now() - start);
+
+  /* The files are as large as a file of version 1 can be. */
+  ssize_t n = edfs_file_write(img, files[0], buf, img->sb.block_size, size);
+
+  printf("v%-6u %10u %14.0f %10.1f %14llu %10s\n", version, n_map, lookups,
+         seq, (unsigned long long)edfs_file_max_blocks(img) *
+         img->sb.block_size / (1024 * 1024),
+         n == img->sb.block_size ? "yes" : strerror(-n));
+  if (bench_csv)
+    fprintf(bench_csv, "%u,%u,%.0f,%.1f\n", version, n_map, lookups, seq);
+
+  ok = true;
+
+out:
+  for (int f = 0; f < BENCH_MAPPING_N_FILES; f++)
+    if (files[f])
+      edfs_file_put(img, files[f]);
+
+  free(buf);
+  edfs_image_close(img);
+  unlink(scratch);
+
+  return ok;
+}
+
+static int
+bench_mapping(const char *image, int n_ops)
+{
+  /* The largest file of version 1 at this block size. */
+  size_t size = EDFS_INODE_N_BLOCKS * (4096 / sizeof(edfs_block16_t)) * 4096;
+
+  printf("mapping: %d files of %zu KiB in %d KiB chunks, 4096-byte blocks\n",
+         BENCH_MAPPING_N_FILES, size / 1024, BENCH_MAPPING_CHUNK / 1024);
+  printf("%-7s %10s %14s %10s %14s %10s\n", "format", "map blocks",
+         "lookups/s", "seq MB/s", "max file MiB", "past v1");
+  if (bench_csv)
+    fprintf(bench_csv, "version,map_blocks,lookups_per_sec,seq_mb_per_sec\n");
+
+  if (!bench_mapping_run(EDFS_VERSION_1, size, n_ops) ||
+      !bench_mapping_run(EDFS_VERSION_2, size, n_ops))
+    return -1;
+
+  return 0;
+}
+
+
+/*
+ * Block sizes
+ *
+ * One large file written and read back sequentially in large requests,
+ * on generated version 3 images of every block size from 4 KiB to the
+ * largest. The images are sized at BENCH_BLOCKSIZE_IMAGE, past the
+ * 512 MiB that 16-bit block numbers allowed; they are sparse, so only
+ * the file takes space. Reads are cold and n_ops sets the file size in
+ * MiB.
+ */
+
+#define BENCH_BLOCKSIZE_IMAGE   (4ULL << 30)
+#define BENCH_BLOCKSIZE_REQUEST (1024 * 1024)
+
+static bool
+bench_blocksize_run(uint32_t block_size, size_t size)
+{
+  char scratch[4096];
+  bool ok = false;
+
+  edfs_image_t *img = bench_ops_generate(scratch, EDFS_VERSION_3, block_size,
+                                         BENCH_BLOCKSIZE_IMAGE / block_size,
+                                         64);
+  if (!img)
+    return false;
+
+  edfs_file_t *file = NULL;
+  char *buf = malloc(BENCH_BLOCKSIZE_REQUEST);
+  uint32_t n_free_blocks = img->n_free_blocks;
+  edfs_inode_t inode;
+
+  if (!buf || edfs_new_inode(img, &inode, EDFS_INODE_TYPE_FILE) < 0 ||
+      edfs_write_inode(img, &inode) < 0 ||
+      !(file = edfs_file_get(img, &inode)))
+    goto out;
+
+  memset(buf, 'x', BENCH_BLOCKSIZE_REQUEST);
+
+  double start = bench_now();
+  for (off_t off = 0; off < size; off += BENCH_BLOCKSIZE_REQUEST)
+    if (edfs_file_write(img, file, buf, BENCH_BLOCKSIZE_REQUEST,
+                        off) != BENCH_BLOCKSIZE_REQUEST)
+      {
+        fprintf(stderr, "error: could not write the file\n");
+        goto out;
+      }
+  if (edfs_file_flush(img, file) < 0 || edfs_image_sync(img) < 0)
+    goto out;
+  fsync(img->fd);
+  double write = size / (1024.0 * 1024.0) / (bench_now() - start);
+
+  uint32_t n_map = n_free_blocks - img->n_free_blocks -
+      size / img->sb.block_size;
+
+  bench_readahead_evict(img);
+  start = bench_now();
+  for (off_t off = 0; off < size; off += BENCH_BLOCKSIZE_REQUEST)
+    if (edfs_file_read(img, file, buf, BENCH_BLOCKSIZE_REQUEST, off) <= 0)
+      goto out;
+  double read = size / (1024.0 * 1024.0) / (bench_now() - start);
+
+  printf("%10u %10llu %10u %10.1f %10.1f\n", block_size,
+         (unsigned long long)edfs_get_size(&img->sb) / (1024 * 1024),
+         n_map, write, read);
+  if (bench_csv)
+    fprintf(bench_csv, "%u,%u,%.1f,%.1f\n", block_size, n_map, write, read);
+
+  ok = true;
+
+out:
+  if (file)
+    edfs_file_put(img, file);
+
+  free(buf);
+  edfs_image_close(img);
+  unlink(scratch);
+
+  return ok;
+}
+
+static int
+bench_blocksize(const char *image, int n_ops)
+{
+  size_t size = (size_t)n_ops * 1024 * 1024;
+
+  printf("blocksize: file of %zu MiB in %d KiB requests, version %d images\n",
+         size / (1024 * 1024), BENCH_BLOCKSIZE_REQUEST / 1024,
+         EDFS_VERSION_3);
+  printf("%10s %10s %10s %10s %10s\n", "block size", "image MiB",
+         "map blocks", "write MB/s", "read MB/s");
+  if (bench_csv)
+    fprintf(bench_csv, "block_size,map_blocks,write_mb_per_sec,read_mb_per_sec\n");
+
+  for (uint32_t block_size = 4096; block_size <= EDFS_MAX_BLOCK_SIZE;
+       block_size *= 2)
+    if (!bench_blocksize_run(block_size, size))
+      return -1;
+
+  return 0;
+}
+
+
+/*
+ * Main
+ */
+
+typedef struct
+{
+  const char *name;
+  int (*run) (const char *image, int n_ops);
+  const char *description;
+} bench_workload_t;
+
+static const bench_workload_t workloads[] =
+{
+  { "inode-alloc", bench_inode_alloc,
+    "inode allocation rate against inode table fill level" },
+  { "frag",        bench_frag,
+    "average run length per file, in the image and under placement policies" },
+  { "backend",     bench_backend,
+    "pread, io_uring and mmap image access: inodes, directories, file data" },
+  { "splice",      bench_splice,
+    "large sequential reads copied through user space against spliced" },
+  { "readahead",   bench_readahead,
+    "cold reads of 256 MiB files on a generated image, without and with readahead" },
+  { "dir",         bench_dir,
+    "directory lookups and entry creation, scanned against indexed" },
+  { "stress",      bench_stress,
+    "concurrent create/write/remove correctness, read scaling with threads" },
+  { "ops",         bench_ops,
+    "latency per operation (ops/s, p50, p99) on generated images; -o for CSV" },
+  { "mapping",     bench_mapping,
+    "indirect blocks against extent trees: size, lookups, reads, file limit" },
+  { "blocksize",   bench_blocksize,
+    "large sequential writes and cold reads against the block size" },
+};
+
+#define N_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static void
+usage(const char *execname)
+{
+  fprintf(stderr, "usage: %s [-n ops] [-o results.csv] workload image\n\nworkloads:\n",
+          execname);
+  for (int i = 0; i < N_WORKLOADS; i++)
+    fprintf(stderr, "  %-14s %s\n", workloads[i].name,
+            workloads[i].description);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n_ops = 256;
+  int opt;
+  int res = -1;
+
+  while ((opt = getopt(argc, argv, "n:o:")) != -1)
+    {
+      switch (opt)
+        {
+          case 'n':
+            n_ops = atoi(optarg);
+            break;
+          case 'o':
+            if (bench_csv)
+              fclose(bench_csv);
+            bench_csv = fopen(optarg, "w");
+            if (!bench_csv)
+              {
+                fprintf(stderr, "error: cannot open '%s': %s\n", optarg,
+                        strerror(errno));
+                return -1;
+              }
+            break;
+          default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+  if (argc - optind != 2 || n_ops <= 0)
+    {
+      usage(argv[0]);
+      return -1;
+    }
+
+  for (int i = 0; i < N_WORKLOADS; i++)
+    if (strcmp(workloads[i].name, argv[optind]) == 0)
+      {
+        res = workloads[i].run(argv[optind + 1], n_ops) < 0 ? -1 : 0;
+        goto out;
+      }
+
+  fprintf(stderr, "error: unknown workload '%s'\n", argv[optind]);
+  usage(argv[0]);
+
+out:
+  if (bench_csv)
+    fclose(bench_csv);
+  return res;
+}
@@ -0,0 +1,523 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#include "edfs-cache.h"
+#include "edfs-journal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+
+/* Buffers live in a single array and are linked by index into the hash
+ * chains. Buffers not holding a block have block EDFS_BLOCK_INVALID;
+ * block 0 holds the super block and is never cached.
+ *
+ * For a mapped image, buffers point into the mapping instead of holding
+ * a copy, so nothing is read or written back; the cache only tracks
+ * pins and dirty state.
+ *
+ * The cache lock protects the buffer headers. The contents of a buffer
+ * are protected by whoever owns the block, such as the lock of the
+ * directory it belongs to, and are only modified while pinned. Misses
+ * are read with the cache lock held.
+ */
+#define NIL (-1)
+
+/* Upper bound on the number of buffers written by a single request. */
+#define EDFS_CACHE_MAX_IOV 64
+
+struct _edfs_cache
+{
+  uint32_t block_size;
+
+  int32_t *buckets;
+  uint32_t bucket_mask;
+
+  edfs_buf_t *bufs;
+  uint32_t n_bufs;
+  uint32_t clock_hand;
+
+  char *memory;
+
+  pthread_mutex_t lock;
+
+  edfs_cache_stats_t stats;
+};
+
+
+static inline uint32_t
+edfs_cache_hash(edfs_cache_t *cache, edfs_block_t block)
+{
+  return (block * 2654435761u) & cache->bucket_mask;
+}
+
+/* Creates a cache for @img of at most @max_bytes of buffers. */
+edfs_cache_t *
+edfs_cache_new(edfs_image_t *img, size_t max_bytes)
+{
+  uint32_t block_size = img->sb.block_size;
+  uint32_t n_bufs = max_bytes / block_size;
+  if (n_bufs < EDFS_CACHE_MIN_BUFFERS)
+    n_bufs = EDFS_CACHE_MIN_BUFFERS;
+
+  edfs_cache_t *cache = calloc(1, sizeof(edfs_cache_t));
+  if (!cache)
+    return NULL;
+
+  uint32_t n_buckets = 1;
+  while (n_buckets < n_bufs)
+    n_buckets <<= 1;
+
+  cache->block_size = block_size;
+  cache->bucket_mask = n_buckets - 1;
+  cache->n_bufs = n_bufs;
+  cache->buckets = malloc(n_buckets * sizeof(int32_t));
+  cache->bufs = calloc(n_bufs, sizeof(edfs_buf_t));
+  if (!img->map)
+    cache->memory = malloc((size_t)n_bufs * block_size);
+
+  if (!cache->buckets || !cache->bufs || (!img->map && !cache->memory))
+    {
+      edfs_cache_free(cache);
+      return NULL;
+    }
+
+  for (uint32_t i = 0; i < n_buckets; i++)
+    cache->buckets[i] = NIL;
+
+  for (uint32_t i = 0; i < n_bufs; i++)
+    {
+      cache->bufs[i].block = EDFS_BLOCK_INVALID;
+      if (cache->memory)
+        cache->bufs[i].data = cache->memory + (size_t)i * block_size;
+      cache->bufs[i].chain_next = NIL;
+    }
+
+  cache->stats.max_buffers = n_bufs;
+  pthread_mutex_init(&cache->lock, NULL);
+
+  return cache;
+}
+
+/* Frees the cache. Dirty buffers are lost; the image flushes the cache
+ * before it is closed.
+ */
+void
+edfs_cache_free(edfs_cache_t *cache)
+{
+  if (!cache)
+    return;
+
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->buckets);
+  free(cache->bufs);
+  free(cache->memory);
+  free(cache);
+}
+
+static edfs_buf_t *
+edfs_cache_find(edfs_cache_t *cache, edfs_block_t block)
+{
+  for (int32_t i = cache->buckets[edfs_cache_hash(cache, block)]; i != NIL;
+       i = cache->bufs[i].chain_next)
+    if (cache->bufs[i].block == block)
+      return &cache->bufs[i];
+
+  return NULL;
+}
+
+static void
+edfs_cache_unhash(edfs_cache_t *cache, edfs_buf_t *buf)
+{
+  int32_t *link = &cache->buckets[edfs_cache_hash(cache, buf->block)];
+  int32_t index = buf - cache->bufs;
+
+  while (*link != index)
+    link = &cache->bufs[*link].chain_next;
+  *link = buf->chain_next;
+
+  buf->block = EDFS_BLOCK_INVALID;
+  buf->chain_next = NIL;
+  buf->dirty = false;
+  cache->stats.n_buffers--;
+}
+
+static int
+edfs_cache_write_buf(edfs_image_t *img, edfs_buf_t *buf)
+{
+  if (img->map)
+    {
+      buf->dirty = false;
+      return 0;
+    }
+
+  ssize_t res = edfs_image_pwrite(img, buf->data, img->sb.block_size,
+                                  edfs_get_block_offset(&img->sb, buf->block));
+  if (res < 0)
+    return -errno;
+  if (res != img->sb.block_size)
+    return -EIO;
+
+  buf->dirty = false;
+  img->bcache->stats.writebacks++;
+  return 0;
+}
+
+/* Picks a buffer to hold @block, using the CLOCK algorithm: buffers
+ * that have been used since the hand last passed get a second chance.
+ * A dirty victim is written back first, unless the image has a journal:
+ * then dirty buffers stay until they are committed. Returns NULL if all
+ * buffers are pinned or the write-back fails.
+ */
+static edfs_buf_t *
+edfs_cache_evict(edfs_image_t *img)
+{
+  edfs_cache_t *cache = img->bcache;
+
+  for (uint32_t n = 0; n < 2 * cache->n_bufs; n++)
+    {
+      edfs_buf_t *buf = &cache->bufs[cache->clock_hand];
+      cache->clock_hand = (cache->clock_hand + 1) % cache->n_bufs;
+
+      if (buf->pins > 0)
+        continue;
+
+      if (buf->referenced)
+        {
+          buf->referenced = false;
+          continue;
+        }
+
+      if (buf->block == EDFS_BLOCK_INVALID)
+        return buf;
+
+      if (buf->dirty && (img->journal || edfs_cache_write_buf(img, buf) < 0))
+        continue;
+
+      edfs_cache_unhash(cache, buf);
+      cache->stats.evictions++;
+      return buf;
+    }
+
+  return NULL;
+}
+
+/* Returns the buffer for @block, pinned. *@hit tells whether the
+ * buffer already held the block; if not, its contents are undefined.
+ */
+static edfs_buf_t *
+edfs_cache_get(edfs_image_t *img, edfs_block_t block, bool *hit)
+{
+  edfs_cache_t *cache = img->bcache;
+  edfs_buf_t *buf = edfs_cache_find(cache, block);
+
+  *hit = buf != NULL;
+  if (buf)
+    {
+      cache->stats.hits++;
+      buf->pins++;
+      buf->referenced = true;
+      return buf;
+    }
+
+  cache->stats.misses++;
+
+  buf = edfs_cache_evict(img);
+  if (!buf)
+    return NULL;
+
+  uint32_t bucket = edfs_cache_hash(cache, block);
+  buf->block = block;
+  buf->chain_next = cache->buckets[bucket];
+  cache->buckets[bucket] = buf - cache->bufs;
+  buf->pins = 1;
+  buf->referenced = true;
+  buf->dirty = false;
+  cache->stats.n_buffers++;
+
+  if (img->map)
+    buf->data = edfs_image_block_ptr(img, block);
+
+  return buf;
+}
+
+/* Returns a pinned buffer holding the contents of @block, read from
+ * disk if it is not cached. Returns NULL on failure.
+ */
+edfs_buf_t *
+edfs_cache_read(edfs_image_t *img, edfs_block_t block)
+{
+  bool hit;
+
+  pthread_mutex_lock(&img->bcache->lock);
+
+  edfs_buf_t *buf = edfs_cache_get(img, block, &hit);
+  if (buf && !hit && !img->map &&
+      edfs_image_pread(img, buf->data, img->sb.block_size,
+                       edfs_get_block_offset(&img->sb, block))
+      != img->sb.block_size)
+    {
+      buf->pins = 0;
+      edfs_cache_unhash(img->bcache, buf);
+      buf = NULL;
+    }
+
+  pthread_mutex_unlock(&img->bcache->lock);
+
+  return buf;
+}
+
+/* Makes sure that the @n_blocks blocks in @blocks are cached, reading
+ * those that are not in a single batch. Used to fetch the indirect
+ * blocks of a file together. Returns 0 on success, error code
+ * otherwise.
+ */
+int
+edfs_cache_load(edfs_image_t *img, const edfs_block_t *blocks, int n_blocks)
+{
+  edfs_buf_t *bufs[EDFS_CACHE_MAX_IOV];
+  edfs_io_req_t reqs[EDFS_CACHE_MAX_IOV];
+  int n_bufs = 0, n_reqs = 0;
+  int res = 0;
+
+  if (n_blocks > EDFS_CACHE_MAX_IOV)
+    n_blocks = EDFS_CACHE_MAX_IOV;
+
+  pthread_mutex_lock(&img->bcache->lock);
+
+  for (int i = 0; i < n_blocks; i++)
+    {
+      bool hit;
+      edfs_buf_t *buf = edfs_cache_get(img, blocks[i], &hit);
+
+      if (!buf)
+        {
+          res = -EIO;
+          break;
+        }
+
+      if (hit || img->map)
+        {
+          buf->pins--;
+          continue;
+        }
+
+      /* The buffers being read stay pinned until the batch is done. */
+      bufs[n_bufs++] = buf;
+      edfs_io_req_t *req = &reqs[n_reqs++];
+      memset(req, 0, sizeof(edfs_io_req_t));
+      req->op = EDFS_IO_READ;
+      req->buf = buf->data;
+      req->len = img->sb.block_size;
+      req->offset = edfs_get_block_offset(&img->sb, blocks[i]);
+    }
+
+  if (n_reqs > 0 && edfs_image_io(img, reqs, n_reqs) < 0)
+    res = -EIO;
+
+  for (int i = 0; i < n_bufs; i++)
+    {
+      bufs[i]->pins--;
+      if (reqs[i].res != (ssize_t)img->sb.block_size)
+        edfs_cache_unhash(img->bcache, bufs[i]);
+    }
+
+  pthread_mutex_unlock(&img->bcache->lock);
+
+  return res;
+}
+
+/* Returns a pinned, zero-filled and dirty buffer for @block, without
+ * reading it. Used for newly allocated blocks.
+ */
+edfs_buf_t *
+edfs_cache_new_block(edfs_image_t *img, edfs_block_t block)
+{
+  bool hit;
+
+  pthread_mutex_lock(&img->bcache->lock);
+
+  edfs_buf_t *buf = edfs_cache_get(img, block, &hit);
+  if (buf)
+    {
+      memset(buf->data, 0, img->sb.block_size);
+      if (!buf->dirty)
+        edfs_journal_dirtied(img, 1);
+      buf->dirty = true;
+    }
+
+  pthread_mutex_unlock(&img->bcache->lock);
+
+  return buf;
+}
+
+void
+edfs_cache_release(edfs_image_t *img, edfs_buf_t *buf)
+{
+  pthread_mutex_lock(&img->bcache->lock);
+  buf->pins--;
+  pthread_mutex_unlock(&img->bcache->lock);
+}
+
+void
+edfs_cache_mark_dirty(edfs_image_t *img, edfs_buf_t *buf)
+{
+  pthread_mutex_lock(&img->bcache->lock);
+  if (!buf->dirty)
+    edfs_journal_dirtied(img, 1);
+  buf->dirty = true;
+  pthread_mutex_unlock(&img->bcache->lock);
+}
+
+/* Drops @block from the cache without writing it, used when the block
+ * is freed. The block must not be pinned.
+ */
+void
+edfs_cache_forget(edfs_image_t *img, edfs_block_t block)
+{
+  if (!img->bcache)
+    return;
+
+  pthread_mutex_lock(&img->bcache->lock);
+
+  edfs_buf_t *buf = edfs_cache_find(img->bcache, block);
+  if (buf && buf->pins == 0)
+    edfs_cache_unhash(img->bcache, buf);
+
+  pthread_mutex_unlock(&img->bcache->lock);
+}
+
+static int
+edfs_buf_compare_block(const void *a, const void *b)
+{
+  const edfs_buf_t *ba = *(const edfs_buf_t **)a;
+  const edfs_buf_t *bb = *(const edfs_buf_t **)b;
+
+  return ba->block < bb->block ? -1 : ba->block > bb->block;
+}
+
+/* Writes all dirty buffers to disk, in block order, as a single batch
+ * with one request for every run of adjacent blocks. Buffers that are
+ * pinned are skipped: they are being modified by an operation in
+ * progress, which marks them dirty again when it is done.
+ */
+int
+edfs_cache_flush(edfs_image_t *img)
+{
+  edfs_cache_t *cache = img->bcache;
+  int res = 0;
+
+  if (!cache)
+    return 0;
+
+  edfs_buf_t **dirty = malloc(cache->n_bufs * sizeof(edfs_buf_t *));
+  struct iovec *iov = malloc(cache->n_bufs * sizeof(struct iovec));
+  edfs_io_req_t *reqs = malloc(cache->n_bufs * sizeof(edfs_io_req_t));
+  uint32_t n_dirty = 0;
+  int n_reqs = 0;
+
+  if (!dirty || !iov || !reqs)
+    {
+      free(dirty);
+      free(iov);
+      free(reqs);
+      return -ENOMEM;
+    }
+
+  pthread_mutex_lock(&cache->lock);
+
+  for (uint32_t i = 0; i < cache->n_bufs; i++)
+    if (!cache->bufs[i].dirty || cache->bufs[i].pins > 0)
+      continue;
+    else if (img->map)
+      cache->bufs[i].dirty = false;
+    else
+      dirty[n_dirty++] = &cache->bufs[i];
+
+  qsort(dirty, n_dirty, sizeof(edfs_buf_t *), edfs_buf_compare_block);
+
+  /* @iov runs parallel to @dirty. */
+  uint32_t i = 0;
+
+  while (i < n_dirty)
+    {
+      uint32_t start = i;
+
+      do
+        {
+          iov[i].iov_base = dirty[i]->data;
+          iov[i].iov_len = img->sb.block_size;
+          i++;
+        }
+      while (i < n_dirty && i - start < EDFS_CACHE_MAX_IOV &&
+             dirty[i]->block == dirty[i - 1]->block + 1);
+
+      edfs_io_req_t *req = &reqs[n_reqs++];
+      memset(req, 0, sizeof(edfs_io_req_t));
+      req->op = EDFS_IO_WRITEV;
+      req->iov = &iov[start];
+      req->iovcnt = i - start;
+      req->len = (size_t)(i - start) * img->sb.block_size;
+      req->offset = edfs_get_block_offset(&img->sb, dirty[start]->block);
+    }
+
+  if (n_reqs > 0)
+    res = edfs_image_io(img, reqs, n_reqs);
+
+  for (int r = 0; r < n_reqs; r++)
+    {
+      if (reqs[r].res != (ssize_t)reqs[r].len)
+        continue;
+
+      uint32_t start = reqs[r].iov - iov;
+      for (uint32_t j = start; j < start + reqs[r].iovcnt; j++)
+        dirty[j]->dirty = false;
+      cache->stats.writebacks += reqs[r].iovcnt;
+    }
+
+  pthread_mutex_unlock(&cache->lock);
+
+  free(dirty);
+  free(iov);
+  free(reqs);
+  return res;
+}
+
+/* Calls @func for every dirty buffer, with the cache locked, and stops
+ * at the first error it returns. Used by the journal to copy buffers
+ * into a transaction; they stay dirty until written in place.
+ */
+int
+edfs_cache_foreach_dirty(edfs_image_t           *img,
+                         edfs_cache_dirty_func_t func,
+                         void                   *user_data)
+{
+  edfs_cache_t *cache = img->bcache;
+  int res = 0;
+
+  if (!cache)
+    return 0;
+
+  pthread_mutex_lock(&cache->lock);
+
+  for (uint32_t i = 0; i < cache->n_bufs && res == 0; i++)
+    if (cache->bufs[i].dirty)
+      res = func(cache->bufs[i].block, cache->bufs[i].data, user_data);
+
+  pthread_mutex_unlock(&cache->lock);
+
+  return res;
+}
+
+void
+edfs_cache_get_stats(edfs_cache_t *cache, edfs_cache_stats_t *stats)
+{
+  pthread_mutex_lock(&cache->lock);
+  *stats = cache->stats;
+  pthread_mutex_unlock(&cache->lock);
+}
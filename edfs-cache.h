@@ -0,0 +1,94 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#ifndef __EDFS_CACHE_H__
+#define __EDFS_CACHE_H__
+
+#include "edfs-common.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+
+/*
+ * Block buffer cache
+ *
+ * Directory and indirect blocks are accessed through a cache of
+ * block-sized buffers attached to the image, with a fixed memory
+ * budget. Buffers are handed out pinned and must be released with
+ * edfs_cache_release(); pinned buffers are never evicted. Modified
+ * buffers are marked dirty and written back on eviction or by
+ * edfs_image_sync(); with a journal, only by the latter, see
+ * edfs-journal.h. Eviction uses the CLOCK algorithm.
+ *
+ * File data does not pass through the cache, so that large reads and
+ * writes do not push out metadata. Blocks that are freed are dropped
+ * from the cache, so a cached copy never outlives the use of a block.
+ */
+typedef struct _edfs_cache edfs_cache_t;
+
+typedef struct
+{
+  edfs_block_t block;
+  char *data;           /* block_size bytes */
+
+  /* Private to the cache. */
+  int pins;
+  bool dirty;
+  bool referenced;
+  int32_t chain_next;
+} edfs_buf_t;
+
+typedef struct
+{
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t writebacks;   /* dirty buffers written to disk */
+
+  size_t n_buffers;      /* buffers holding a block */
+  size_t max_buffers;
+} edfs_cache_stats_t;
+
+typedef int (*edfs_cache_dirty_func_t) (edfs_block_t  block,
+                                        const char   *data,
+                                        void         *user_data);
+
+/* Default memory budget, in bytes. */
+#define EDFS_CACHE_DEFAULT_SIZE (1024 * 1024)
+
+/* A cache always has room for this many buffers, whatever its budget,
+ * so that operations holding a few buffers pinned can make progress.
+ */
+#define EDFS_CACHE_MIN_BUFFERS 16
+
+
+edfs_cache_t  *edfs_cache_new             (edfs_image_t *img,
+                                           size_t        max_bytes);
+void           edfs_cache_free            (edfs_cache_t *cache);
+
+edfs_buf_t    *edfs_cache_read            (edfs_image_t *img,
+                                           edfs_block_t  block);
+int            edfs_cache_load            (edfs_image_t       *img,
+                                           const edfs_block_t *blocks,
+                                           int                 n_blocks);
+edfs_buf_t    *edfs_cache_new_block       (edfs_image_t *img,
+                                           edfs_block_t  block);
+void           edfs_cache_release         (edfs_image_t *img,
+                                           edfs_buf_t   *buf);
+void           edfs_cache_mark_dirty      (edfs_image_t *img,
+                                           edfs_buf_t   *buf);
+void           edfs_cache_forget          (edfs_image_t *img,
+                                           edfs_block_t  block);
+int            edfs_cache_flush           (edfs_image_t *img);
+int            edfs_cache_foreach_dirty   (edfs_image_t           *img,
+                                           edfs_cache_dirty_func_t func,
+                                           void                   *user_data);
+
+void           edfs_cache_get_stats       (edfs_cache_t       *cache,
+                                           edfs_cache_stats_t *stats);
+
+#endif /* __EDFS_CACHE_H__ */
@@ -0,0 +1,999 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#include "edfs-check.h"
+#include "edfs-alloc.h"
+#include "edfs-cache.h"
+#include "edfs-extent.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+
+/* The check runs in three passes. First, every inode is checked on
+ * its own and the blocks it refers to are counted; threads take ranges
+ * of the inode table in turn. Second, the directory tree is walked from
+ * the root: threads take directories from a shared stack and push the
+ * subdirectories they find. Every inode is claimed by the first entry
+ * found to refer to it. Finally, orphans and the bitmap are checked
+ * and, if requested, everything is repaired, in a single thread.
+ */
+
+#define EDFS_CHECK_INODES_PER_TASK 1024
+
+/* Per-inode state. */
+enum
+{
+  CHECK_CLEAR = 1 << 0,         /* invalid or orphaned */
+  CHECK_SIZE  = 1 << 1          /* size exceeds the mapping */
+};
+
+/* Entry that claimed an inode, as dir_inumber << 32 | slot. */
+#define NO_REFERENCE UINT64_MAX
+
+typedef struct
+{
+  edfs_inumber_t dir;
+  uint32_t slot;
+} edfs_check_entry_t;
+
+typedef struct
+{
+  const char *name;
+  uint32_t slot;
+  edfs_inumber_t inumber;
+} edfs_check_name_t;
+
+typedef struct
+{
+  edfs_image_t *img;
+  int flags;
+
+  edfs_disk_inode_t *inodes;    /* copy of the inode table */
+  uint32_t n_inodes;
+  uint32_t n_blocks;
+  uint32_t first_data;          /* first block after the metadata */
+  uint32_t block_size;
+
+  uint8_t *state;               /* per inode */
+  uint64_t *reference;          /* per inode */
+  uint32_t *n_references;       /* per block */
+
+  /* Inode pass: first inode of the next range to check. */
+  uint32_t next_inode;
+
+  /* Directory walk: directories yet to visit, and the number of
+   * threads visiting one, which may push more.
+   */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  edfs_inumber_t *stack;
+  uint32_t n_stack;
+  uint32_t n_busy;
+
+  /* Directory entries to remove, protected by the lock. */
+  edfs_check_entry_t *bad;
+  uint32_t n_bad;
+  uint32_t max_bad;
+
+  int error;
+  edfs_check_result_t result;
+} edfs_check_t;
+
+
+static void
+edfs_check_report(edfs_check_t *check, const char *format, ...)
+{
+  va_list ap;
+
+  if (check->flags & EDFS_CHECK_QUIET)
+    return;
+
+  /* Build the line first, so lines of threads do not interleave. */
+  char line[256];
+  va_start(ap, format);
+  vsnprintf(line, sizeof(line), format, ap);
+  va_end(ap);
+
+  fprintf(stderr, "fsck: %s\n", line);
+}
+
+static inline void
+edfs_check_count(uint32_t *counter)
+{
+  __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+static void
+edfs_check_set_error(edfs_check_t *check, int error)
+{
+  int expected = 0;
+
+  __atomic_compare_exchange_n(&check->error, &expected, error, false,
+                              __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static bool
+edfs_check_read_block(edfs_check_t *check, edfs_block_t block, void *buf)
+{
+  off_t offset = edfs_get_block_offset(&check->img->sb, block);
+
+  if (edfs_image_pread(check->img, buf, check->block_size,
+                       offset) != check->block_size)
+    {
+      edfs_check_set_error(check, -EIO);
+      return false;
+    }
+
+  return true;
+}
+
+/* Runs @func in @n_threads threads, the calling thread included. */
+static void
+edfs_check_run(edfs_check_t *check, int n_threads, void *(*func)(void *))
+{
+  pthread_t threads[n_threads];
+  int n_started = 1;
+
+  for (; n_started < n_threads; n_started++)
+    if (pthread_create(&threads[n_started], NULL, func, check) != 0)
+      break;
+
+  func(check);
+
+  for (int i = 1; i < n_started; i++)
+    pthread_join(threads[i], NULL);
+}
+
+
+/*
+ * Inode pass
+ */
+
+/* Counts a reference of @inumber to @block. Returns true if @block is
+ * a block in the data area.
+ */
+static bool
+edfs_check_reference_block(edfs_check_t   *check,
+                           edfs_inumber_t  inumber,
+                           edfs_block_t    block)
+{
+  if (block == EDFS_BLOCK_INVALID)
+    return false;
+
+  if (block < check->first_data || block >= check->n_blocks)
+    {
+      edfs_check_report(check, "inode %u: block %u outside the data area",
+                        inumber, block);
+      edfs_check_count(&check->result.bad_blocks);
+      return false;
+    }
+
+  if (__atomic_fetch_add(&check->n_references[block], 1, __ATOMIC_RELAXED) == 1)
+    {
+      edfs_check_report(check, "inode %u: block %u is referenced more than once",
+                        inumber, block);
+      edfs_check_count(&check->result.duplicate_blocks);
+    }
+
+  return true;
+}
+
+/* Returns the largest size @inode can have. */
+static uint64_t
+edfs_check_capacity(edfs_check_t *check, const edfs_disk_inode_t *inode)
+{
+  uint32_t n_per_block = check->block_size / sizeof(edfs_block16_t);
+
+  if (edfs_disk_inode_has_extents(inode))
+    return (uint64_t)(UINT32_MAX / check->block_size) * check->block_size;
+  if (edfs_disk_inode_has_indirect(inode))
+    return (uint64_t)EDFS_INODE_N_BLOCKS * n_per_block * check->block_size;
+  return (uint64_t)EDFS_INODE_N_BLOCKS * check->block_size;
+}
+
+/* Returns true if extent @extent of an extent tree is valid, given that
+ * it must not start before logical block @next.
+ */
+static bool
+edfs_check_extent_is_valid(edfs_check_t *check, const edfs_extent_t *extent,
+                           uint32_t next)
+{
+  return extent->length > 0 && extent->logical >= next &&
+      extent->logical <= UINT32_MAX - extent->length &&
+      extent->start >= check->first_data &&
+      (uint64_t)extent->start + extent->length <= check->n_blocks;
+}
+
+/* Checks node @block of the extent tree of @inumber, which is at @depth
+ * unless that is -1, and counts the blocks it refers to. Its entries
+ * must not start before logical block *@next, which is advanced past
+ * them. Returns false if the node, or a node below it, is not valid.
+ */
+static bool
+edfs_check_extent_node(edfs_check_t   *check,
+                       edfs_inumber_t  inumber,
+                       edfs_block_t    block,
+                       int             depth,
+                       uint32_t       *next)
+{
+  if (!edfs_check_reference_block(check, inumber, block))
+    return false;
+
+  char *buf = malloc(check->block_size);
+  if (!buf)
+    {
+      edfs_check_set_error(check, -ENOMEM);
+      return false;
+    }
+  if (!edfs_check_read_block(check, block, buf))
+    {
+      free(buf);
+      return false;
+    }
+
+  edfs_extent_header_t *header = (edfs_extent_header_t *)buf;
+  bool valid = edfs_extent_node_is_valid(&check->img->sb, header) &&
+      (depth < 0 || header->depth == depth);
+
+  for (uint32_t i = 0; valid && i < header->n_entries; i++)
+    {
+      if (header->depth == 0)
+        {
+          edfs_extent_t extent;
+
+          memcpy(&extent, buf + sizeof(*header) + i * sizeof(extent),
+                 sizeof(extent));
+          valid = edfs_check_extent_is_valid(check, &extent, *next);
+          for (uint32_t j = 0; valid && j < extent.length; j++)
+            edfs_check_reference_block(check, inumber, extent.start + j);
+          if (valid)
+            *next = extent.logical + extent.length;
+          continue;
+        }
+
+      edfs_extent_index_t index;
+
+      memcpy(&index, buf + sizeof(*header) + i * sizeof(index),
+             sizeof(index));
+
+      /* The first child also maps the blocks before its entry. */
+      if (i > 0 && index.logical < *next)
+        valid = false;
+      else
+        {
+          if (i > 0)
+            *next = index.logical;
+          if (!edfs_check_extent_node(check, inumber, index.block,
+                                      header->depth - 1, next))
+            {
+              /* Reported for the node below. */
+              free(buf);
+              return false;
+            }
+        }
+    }
+
+  /* An index node without entries maps nothing. */
+  if (valid && header->depth > 0 && header->n_entries == 0)
+    valid = false;
+
+  if (!valid)
+    {
+      edfs_check_report(check, "inode %u: extent tree node %u is invalid",
+                        inumber, block);
+      edfs_check_count(&check->result.bad_inodes);
+    }
+
+  free(buf);
+  return valid;
+}
+
+static void
+edfs_check_inode(edfs_check_t *check, edfs_inumber_t inumber, edfs_block16_t *buf)
+{
+  edfs_disk_inode_t *inode = &check->inodes[inumber];
+  uint32_t n_per_block = check->block_size / sizeof(edfs_block16_t);
+
+  if (inode->type == EDFS_INODE_TYPE_FREE)
+    return;
+
+  if (inode->type != EDFS_INODE_TYPE_FILE &&
+      inode->type != EDFS_INODE_TYPE_DIRECTORY &&
+      (inode->type != (EDFS_INODE_TYPE_FILE | EDFS_INODE_TYPE_INDIRECT) ||
+       !edfs_super_block_has_indirect(&check->img->sb)) &&
+      (inode->type != (EDFS_INODE_TYPE_FILE | EDFS_INODE_TYPE_EXTENTS) ||
+       !edfs_super_block_has_extents(&check->img->sb)))
+    {
+      edfs_check_report(check, "inode %u: invalid type 0x%x", inumber,
+                        (unsigned)inode->type);
+      edfs_check_count(&check->result.bad_inodes);
+      check->state[inumber] |= CHECK_CLEAR;
+      return;
+    }
+
+  uint32_t next = 0;
+
+  if (edfs_disk_inode_has_extents(inode))
+    edfs_check_extent_node(check, inumber, edfs_disk_inode_get_block(inode, 0),
+                           -1, &next);
+  else
+    for (int i = 0; i < EDFS_INODE_N_BLOCKS; i++)
+      {
+        edfs_block_t block = edfs_disk_inode_get_block(inode, i);
+
+        if (!edfs_check_reference_block(check, inumber, block) ||
+            !edfs_disk_inode_has_indirect(inode))
+          continue;
+
+        if (!edfs_check_read_block(check, block, buf))
+          continue;
+        for (uint32_t j = 0; j < n_per_block; j++)
+          edfs_check_reference_block(check, inumber, buf[j]);
+      }
+
+  /* Directory sizes are not kept exactly, see edfs-dir.c. */
+  if (!edfs_disk_inode_is_directory(inode) &&
+      inode->size > edfs_check_capacity(check, inode))
+    {
+      edfs_check_report(check, "inode %u: size %u exceeds the mapping",
+                        inumber, inode->size);
+      edfs_check_count(&check->result.bad_inodes);
+      check->state[inumber] |= CHECK_SIZE;
+    }
+}
+
+static void *
+edfs_check_inodes_thread(void *data)
+{
+  edfs_check_t *check = data;
+  edfs_block16_t *buf = malloc(check->block_size);
+
+  if (!buf)
+    {
+      edfs_check_set_error(check, -ENOMEM);
+      return NULL;
+    }
+
+  while (true)
+    {
+      uint32_t first = __atomic_fetch_add(&check->next_inode,
+                                          EDFS_CHECK_INODES_PER_TASK,
+                                          __ATOMIC_RELAXED);
+      if (first >= check->n_inodes)
+        break;
+
+      uint32_t last = first + EDFS_CHECK_INODES_PER_TASK;
+      if (last > check->n_inodes)
+        last = check->n_inodes;
+
+      /* Inode 0 is not used. */
+      for (uint32_t i = first > 0 ? first : 1; i < last; i++)
+        edfs_check_inode(check, i, buf);
+    }
+
+  free(buf);
+  return NULL;
+}
+
+
+/*
+ * Directory walk
+ */
+
+static void
+edfs_check_bad_entry(edfs_check_t   *check,
+                     edfs_inumber_t  dir,
+                     uint32_t        slot,
+                     const char     *problem)
+{
+  edfs_check_report(check, "directory %u: entry %u %s", dir, slot, problem);
+  edfs_check_count(&check->result.bad_entries);
+
+  pthread_mutex_lock(&check->lock);
+  if (check->n_bad == check->max_bad)
+    {
+      uint32_t max_bad = check->max_bad ? check->max_bad * 2 : 64;
+      edfs_check_entry_t *bad = realloc(check->bad, max_bad * sizeof(edfs_check_entry_t));
+
+      if (!bad)
+        {
+          edfs_check_set_error(check, -ENOMEM);
+          pthread_mutex_unlock(&check->lock);
+          return;
+        }
+
+      check->bad = bad;
+      check->max_bad = max_bad;
+    }
+  check->bad[check->n_bad++] = (edfs_check_entry_t){ dir, slot };
+  pthread_mutex_unlock(&check->lock);
+}
+
+/* Returns what is wrong with @entry, or NULL. */
+static const char *
+edfs_check_entry(edfs_check_t *check, const edfs_dir_entry_t *entry)
+{
+  if (!memchr(entry->filename, 0, sizeof(entry->filename)))
+    return "has an unterminated name";
+  if (strchr(entry->filename, '/') ||
+      strcmp(entry->filename, ".") == 0 || strcmp(entry->filename, "..") == 0)
+    return "has an invalid name";
+  if (entry->inumber >= check->n_inodes)
+    return "has an invalid inumber";
+  if (entry->inumber == check->img->sb.root_inumber)
+    return "refers to the root";
+  if (check->inodes[entry->inumber].type == EDFS_INODE_TYPE_FREE)
+    return "refers to a free inode";
+  if (check->state[entry->inumber] & CHECK_CLEAR)
+    return "refers to an invalid inode";
+
+  return NULL;
+}
+
+static int
+edfs_check_compare_names(const void *a, const void *b)
+{
+  const edfs_check_name_t *x = a, *y = b;
+  int res = strcmp(x->name, y->name);
+
+  return res ? res : (x->slot > y->slot) - (x->slot < y->slot);
+}
+
+static void
+edfs_check_push_dir(edfs_check_t *check, edfs_inumber_t inumber)
+{
+  pthread_mutex_lock(&check->lock);
+  check->stack[check->n_stack++] = inumber;
+  pthread_cond_signal(&check->cond);
+  pthread_mutex_unlock(&check->lock);
+}
+
+/* Checks the entries of directory @dir_inumber, of which the blocks
+ * are read into @buf. Valid entries are sorted in @names to find
+ * duplicates.
+ */
+static void
+edfs_check_dir(edfs_check_t      *check,
+               edfs_inumber_t     dir_inumber,
+               edfs_dir_entry_t  *buf,
+               edfs_check_name_t *names)
+{
+  edfs_disk_inode_t *dir = &check->inodes[dir_inumber];
+  uint32_t n_entries_block = check->block_size / sizeof(edfs_dir_entry_t);
+  uint32_t n_names = 0;
+
+  for (int b = 0; b < EDFS_INODE_N_BLOCKS; b++)
+    {
+      edfs_block_t block = edfs_disk_inode_get_block(dir, b);
+      edfs_dir_entry_t *entries = buf + b * n_entries_block;
+
+      /* Bad blocks were reported by the inode pass. */
+      if (block < check->first_data || block >= check->n_blocks ||
+          !edfs_check_read_block(check, block, entries))
+        continue;
+
+      for (uint32_t e = 0; e < n_entries_block; e++)
+        {
+          uint32_t slot = b * n_entries_block + e;
+
+          if (edfs_dir_entry_is_empty(&entries[e]))
+            continue;
+
+          const char *problem = edfs_check_entry(check, &entries[e]);
+          if (problem)
+            edfs_check_bad_entry(check, dir_inumber, slot, problem);
+          else
+            names[n_names++] = (edfs_check_name_t)
+                { entries[e].filename, slot, entries[e].inumber };
+        }
+    }
+
+  qsort(names, n_names, sizeof(edfs_check_name_t), edfs_check_compare_names);
+
+  for (uint32_t i = 0; i < n_names; i++)
+    {
+      edfs_inumber_t inumber = names[i].inumber;
+      uint64_t expected = NO_REFERENCE;
+      uint64_t reference = (uint64_t)dir_inumber << 32 | names[i].slot;
+
+      if (i > 0 && strcmp(names[i].name, names[i - 1].name) == 0)
+        edfs_check_bad_entry(check, dir_inumber, names[i].slot,
+                             "has a duplicate name");
+      else if (!__atomic_compare_exchange_n(&check->reference[inumber],
+                                            &expected, reference, false,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        edfs_check_bad_entry(check, dir_inumber, names[i].slot,
+                             "refers to an inode that is already referred to");
+      else if (edfs_disk_inode_is_directory(&check->inodes[inumber]))
+        {
+          edfs_check_count(&check->result.n_dirs);
+          edfs_check_push_dir(check, inumber);
+        }
+      else
+        edfs_check_count(&check->result.n_files);
+    }
+}
+
+static void *
+edfs_check_dirs_thread(void *data)
+{
+  edfs_check_t *check = data;
+  uint32_t n_entries = EDFS_INODE_N_BLOCKS * check->block_size / sizeof(edfs_dir_entry_t);
+  edfs_dir_entry_t *buf = malloc(n_entries * sizeof(edfs_dir_entry_t));
+  edfs_check_name_t *names = malloc(n_entries * sizeof(edfs_check_name_t));
+
+  if (!buf || !names)
+    edfs_check_set_error(check, -ENOMEM);
+
+  pthread_mutex_lock(&check->lock);
+  while (buf && names)
+    {
+      while (check->n_stack == 0 && check->n_busy > 0)
+        pthread_cond_wait(&check->cond, &check->lock);
+      if (check->n_stack == 0)
+        break;
+
+      edfs_inumber_t inumber = check->stack[--check->n_stack];
+      check->n_busy++;
+      pthread_mutex_unlock(&check->lock);
+
+      edfs_check_dir(check, inumber, buf, names);
+
+      pthread_mutex_lock(&check->lock);
+      check->n_busy--;
+    }
+
+  /* Wake up the other threads once the walk is complete. */
+  pthread_cond_broadcast(&check->cond);
+  pthread_mutex_unlock(&check->lock);
+
+  free(buf);
+  free(names);
+  return NULL;
+}
+
+
+/*
+ * Final checks and repair
+ */
+
+static void
+edfs_check_orphans(edfs_check_t *check)
+{
+  for (uint32_t i = 1; i < check->n_inodes; i++)
+    if (check->inodes[i].type != EDFS_INODE_TYPE_FREE &&
+        !(check->state[i] & CHECK_CLEAR) &&
+        check->reference[i] == NO_REFERENCE)
+      {
+        edfs_check_report(check, "inode %u is not reachable from the root", i);
+        check->result.orphans++;
+        check->state[i] |= CHECK_CLEAR;
+      }
+}
+
+static void
+edfs_check_bitmap(edfs_check_t *check)
+{
+  const uint64_t *bitmap = check->img->block_bitmap;
+  uint32_t n_unmarked = 0, n_marked = 0;
+
+  for (uint32_t b = 0; b < check->n_blocks; b++)
+    {
+      bool used = b < check->first_data || check->n_references[b] > 0;
+      bool marked = (bitmap[b / 64] >> (b % 64)) & 1;
+
+      if (used && !marked)
+        n_unmarked++;
+      else if (!used && marked)
+        n_marked++;
+
+      if (b >= check->first_data && check->n_references[b] > 0)
+        check->result.n_blocks++;
+    }
+
+  if (n_unmarked > 0)
+    edfs_check_report(check, "%u blocks in use are free in the bitmap", n_unmarked);
+  if (n_marked > 0)
+    edfs_check_report(check, "%u unused blocks are marked in the bitmap", n_marked);
+  check->result.bitmap_errors = n_unmarked + n_marked;
+}
+
+static void
+edfs_check_write_inode(edfs_check_t *check, edfs_inumber_t inumber)
+{
+  edfs_inode_t inode = { .inumber = inumber, .inode = check->inodes[inumber] };
+
+  if (edfs_write_inode(check->img, &inode) < 0)
+    edfs_check_set_error(check, -EIO);
+}
+
+static void
+edfs_check_remove_entries(edfs_check_t *check)
+{
+  uint32_t n_entries_block = check->block_size / sizeof(edfs_dir_entry_t);
+
+  for (uint32_t i = 0; i < check->n_bad; i++)
+    {
+      edfs_disk_inode_t *dir = &check->inodes[check->bad[i].dir];
+      uint32_t slot = check->bad[i].slot;
+
+      edfs_block_t block = edfs_disk_inode_get_block(dir, slot / n_entries_block);
+      edfs_buf_t *buf = edfs_cache_read(check->img, block);
+      if (!buf)
+        {
+          edfs_check_set_error(check, -EIO);
+          continue;
+        }
+
+      edfs_dir_entry_t *entries = (edfs_dir_entry_t *)buf->data;
+      memset(&entries[slot % n_entries_block], 0, sizeof(edfs_dir_entry_t));
+      edfs_cache_mark_dirty(check->img, buf);
+      edfs_cache_release(check->img, buf);
+
+      if (dir->size >= sizeof(edfs_dir_entry_t))
+        dir->size -= sizeof(edfs_dir_entry_t);
+      edfs_check_write_inode(check, check->bad[i].dir);
+    }
+}
+
+/* Keeps @block for the inode being rebuilt, if it is in the data area
+ * and not kept by an inode before. Returns false if the pointer to it
+ * must be reset.
+ */
+static bool
+edfs_check_keep_block(edfs_check_t *check, uint64_t *kept, edfs_block_t block)
+{
+  uint64_t mask = 1ULL << (block % 64);
+
+  if (block < check->first_data || block >= check->n_blocks ||
+      (kept[block / 64] & mask))
+    return false;
+
+  kept[block / 64] |= mask;
+  return true;
+}
+
+static void
+edfs_check_unkeep_block(uint64_t *kept, edfs_block_t block)
+{
+  kept[block / 64] &= ~(1ULL << (block % 64));
+}
+
+/* Keeps the blocks of @extent, if all of them can be kept. */
+static bool
+edfs_check_keep_extent(edfs_check_t *check, uint64_t *kept,
+                       const edfs_extent_t *extent, uint32_t next)
+{
+  if (!edfs_check_extent_is_valid(check, extent, next))
+    return false;
+
+  for (uint32_t i = 0; i < extent->length; i++)
+    if (kept[(extent->start + i) / 64] & (1ULL << ((extent->start + i) % 64)))
+      return false;
+
+  for (uint32_t i = 0; i < extent->length; i++)
+    edfs_check_keep_block(check, kept, extent->start + i);
+  return true;
+}
+
+/* Keeps node @block of an extent tree and what it maps, as far as it is
+ * valid, and drops the rest of the tree from the first entry that
+ * cannot be kept on, setting *@cut. The other arguments are as for
+ * edfs_check_extent_node(). Returns the number of entries kept, or -1
+ * if the node itself cannot be kept.
+ */
+static int
+edfs_check_rebuild_extent_node(edfs_check_t *check,
+                               uint64_t     *kept,
+                               edfs_block_t  block,
+                               int           depth,
+                               uint32_t     *next,
+                               bool         *cut)
+{
+  if (!edfs_check_keep_block(check, kept, block))
+    return -1;
+
+  edfs_buf_t *buf = edfs_cache_read(check->img, block);
+  if (!buf)
+    {
+      edfs_check_set_error(check, -EIO);
+      edfs_check_unkeep_block(kept, block);
+      return -1;
+    }
+
+  edfs_extent_header_t *header = (edfs_extent_header_t *)buf->data;
+  if (!edfs_extent_node_is_valid(&check->img->sb, header) ||
+      (depth >= 0 && header->depth != depth))
+    {
+      edfs_cache_release(check->img, buf);
+      edfs_check_unkeep_block(kept, block);
+      return -1;
+    }
+
+  char *entries = buf->data + sizeof(*header);
+  uint32_t n_kept = 0;
+
+  while (n_kept < header->n_entries && !*cut)
+    {
+      if (header->depth == 0)
+        {
+          edfs_extent_t extent;
+
+          memcpy(&extent, entries + n_kept * sizeof(extent), sizeof(extent));
+          if (!edfs_check_keep_extent(check, kept, &extent, *next))
+            {
+              *cut = true;
+              break;
+            }
+          *next = extent.logical + extent.length;
+          n_kept++;
+          continue;
+        }
+
+      edfs_extent_index_t index;
+
+      memcpy(&index, entries + n_kept * sizeof(index), sizeof(index));
+      if (n_kept > 0 && index.logical < *next)
+        {
+          *cut = true;
+          break;
+        }
+      if (n_kept > 0)
+        *next = index.logical;
+
+      int n = edfs_check_rebuild_extent_node(check, kept, index.block,
+                                             header->depth - 1, next, cut);
+      if (n == 0)
+        edfs_check_unkeep_block(kept, index.block);
+      if (n <= 0)
+        {
+          *cut = true;
+          break;
+        }
+      n_kept++;
+    }
+
+  if (n_kept < header->n_entries)
+    {
+      header->n_entries = n_kept;
+      edfs_cache_mark_dirty(check->img, buf);
+    }
+  edfs_cache_release(check->img, buf);
+
+  return n_kept;
+}
+
+/* Walks the block pointers of all remaining inodes in inumber order,
+ * resetting those that cannot be kept, and builds the bitmap of the
+ * repaired image in @kept.
+ */
+static void
+edfs_check_rebuild_blocks(edfs_check_t *check, uint64_t *kept)
+{
+  uint32_t n_per_block = check->block_size / sizeof(edfs_block16_t);
+
+  for (uint32_t b = 0; b < check->first_data; b++)
+    kept[b / 64] |= 1ULL << (b % 64);
+
+  for (uint32_t i = 1; i < check->n_inodes; i++)
+    {
+      edfs_disk_inode_t *inode = &check->inodes[i];
+      bool dirty = false;
+
+      if (inode->type == EDFS_INODE_TYPE_FREE)
+        continue;
+
+      /* A file without a tree left has no blocks. */
+      if (edfs_disk_inode_has_extents(inode))
+        {
+          uint32_t next = 0;
+          bool cut = false;
+          edfs_block_t root = edfs_disk_inode_get_block(inode, 0);
+          int n = edfs_check_rebuild_extent_node(check, kept, root,
+                                                 -1, &next, &cut);
+          if (n == 0)
+            edfs_check_unkeep_block(kept, root);
+          if (n <= 0)
+            {
+              edfs_disk_inode_set_block(inode, 0, EDFS_BLOCK_INVALID);
+              inode->type &= ~EDFS_INODE_TYPE_EXTENTS;
+              edfs_check_write_inode(check, i);
+            }
+          continue;
+        }
+
+      for (int p = 0; p < EDFS_INODE_N_BLOCKS; p++)
+        {
+          edfs_block_t block = edfs_disk_inode_get_block(inode, p);
+
+          if (block == EDFS_BLOCK_INVALID)
+            continue;
+          if (!edfs_check_keep_block(check, kept, block))
+            {
+              edfs_disk_inode_set_block(inode, p, EDFS_BLOCK_INVALID);
+              dirty = true;
+              continue;
+            }
+          if (!edfs_disk_inode_has_indirect(inode))
+            continue;
+
+          edfs_buf_t *buf = edfs_cache_read(check->img, block);
+          if (!buf)
+            {
+              edfs_check_set_error(check, -EIO);
+              continue;
+            }
+
+          edfs_block16_t *blocks = (edfs_block16_t *)buf->data;
+          for (uint32_t j = 0; j < n_per_block; j++)
+            if (blocks[j] != EDFS_BLOCK_INVALID &&
+                !edfs_check_keep_block(check, kept, blocks[j]))
+              {
+                blocks[j] = EDFS_BLOCK_INVALID;
+                edfs_cache_mark_dirty(check->img, buf);
+              }
+          edfs_cache_release(check->img, buf);
+        }
+
+      if (dirty)
+        edfs_check_write_inode(check, i);
+    }
+}
+
+static void
+edfs_check_repair(edfs_check_t *check)
+{
+  edfs_inumber_t root = check->img->sb.root_inumber;
+
+  edfs_check_remove_entries(check);
+
+  for (uint32_t i = 1; i < check->n_inodes; i++)
+    {
+      edfs_disk_inode_t *inode = &check->inodes[i];
+
+      if (check->state[i] & CHECK_CLEAR)
+        {
+          memset(inode, 0, sizeof(*inode));
+          if (i == root)
+            inode->type = EDFS_INODE_TYPE_DIRECTORY;
+          edfs_check_write_inode(check, i);
+        }
+      else if (check->state[i] & CHECK_SIZE)
+        {
+          inode->size = edfs_check_capacity(check, inode);
+          edfs_check_write_inode(check, i);
+        }
+    }
+
+  uint64_t *kept = calloc(((uint64_t)check->n_blocks + 63) / 64, sizeof(uint64_t));
+  if (!kept)
+    {
+      edfs_check_set_error(check, -ENOMEM);
+      return;
+    }
+
+  edfs_check_rebuild_blocks(check, kept);
+  edfs_block_bitmap_replace(check->img, kept);
+  free(kept);
+
+  int res = edfs_image_sync(check->img);
+  if (res < 0)
+    edfs_check_set_error(check, res);
+}
+
+
+/*
+ * Public API
+ */
+
+/* Checks @img using @n_threads threads, or as many as there are
+ * processors if 0, and repairs it with EDFS_CHECK_REPAIR. The problems
+ * found are counted in @result. Returns 0 if the check completed, an
+ * error code otherwise.
+ */
+int
+edfs_check_image(edfs_image_t        *img,
+                 int                  flags,
+                 int                  n_threads,
+                 edfs_check_result_t *result)
+{
+  edfs_check_t check = { .img = img, .flags = flags };
+  edfs_inumber_t root = img->sb.root_inumber;
+
+  if (n_threads <= 0)
+    n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_threads <= 0)
+    n_threads = 1;
+
+  check.n_inodes = img->sb.inode_table_n_inodes;
+  check.n_blocks = img->sb.n_blocks;
+  check.block_size = img->sb.block_size;
+  check.first_data = (img->sb.inode_table_start + img->sb.inode_table_size +
+                      check.block_size - 1) / check.block_size;
+  if (img->sb.bitmap_start + img->sb.bitmap_size > img->sb.inode_table_start +
+      img->sb.inode_table_size)
+    check.first_data = (img->sb.bitmap_start + img->sb.bitmap_size +
+                        check.block_size - 1) / check.block_size;
+  if (img->sb.journal_size > 0 &&
+      (img->sb.journal_start + img->sb.journal_size) / check.block_size >
+      check.first_data)
+    check.first_data = (img->sb.journal_start + img->sb.journal_size) /
+        check.block_size;
+
+  size_t table_size = (size_t)check.n_inodes * sizeof(edfs_disk_inode_t);
+
+  check.inodes = malloc(table_size);
+  check.state = calloc(check.n_inodes, 1);
+  check.reference = malloc(check.n_inodes * sizeof(uint64_t));
+  check.stack = malloc(check.n_inodes * sizeof(edfs_inumber_t));
+  check.n_references = calloc(check.n_blocks, sizeof(uint32_t));
+  if (!check.inodes || !check.state || !check.reference || !check.stack ||
+      !check.n_references || !img->block_bitmap)
+    {
+      check.error = -ENOMEM;
+      goto out;
+    }
+
+  pthread_mutex_init(&check.lock, NULL);
+  pthread_cond_init(&check.cond, NULL);
+
+  /* The inode table is read at once. */
+  if (edfs_image_pread(img, check.inodes, table_size,
+                       img->sb.inode_table_start) != table_size)
+    {
+      check.error = -EIO;
+      goto out_locks;
+    }
+
+  for (uint32_t i = 0; i < check.n_inodes; i++)
+    check.reference[i] = NO_REFERENCE;
+
+  edfs_check_run(&check, n_threads, edfs_check_inodes_thread);
+
+  /* Without a root directory, nothing is reachable. */
+  if (check.inodes[root].type != EDFS_INODE_TYPE_DIRECTORY)
+    {
+      edfs_check_report(&check, "root inode %u is not a directory", root);
+      if (!(check.state[root] & CHECK_CLEAR))
+        check.result.bad_inodes++;
+      check.state[root] |= CHECK_CLEAR;
+    }
+  else
+    {
+      check.reference[root] = 0;
+      check.result.n_dirs++;
+      check.stack[check.n_stack++] = root;
+      edfs_check_run(&check, n_threads, edfs_check_dirs_thread);
+    }
+
+  if (check.error == 0)
+    {
+      edfs_check_orphans(&check);
+      edfs_check_bitmap(&check);
+
+      if ((flags & EDFS_CHECK_REPAIR) && edfs_check_n_problems(&check.result) > 0)
+        edfs_check_repair(&check);
+    }
+
+out_locks:
+  pthread_cond_destroy(&check.cond);
+  pthread_mutex_destroy(&check.lock);
+out:
+  free(check.inodes);
+  free(check.state);
+  free(check.reference);
+  free(check.stack);
+  free(check.n_references);
+  free(check.bad);
+
+  *result = check.result;
+  return check.error;
+}
@@ -0,0 +1,67 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#ifndef __EDFS_CHECK_H__
+#define __EDFS_CHECK_H__
+
+#include "edfs-common.h"
+
+#include <stdint.h>
+
+
+/* Consistency check of an image, as run by edfs-fsck and optionally by
+ * edfuse at mount time. The inode table is read at once and checked in
+ * parallel, then the directory tree is walked from the root by a pool
+ * of threads. Found are:
+ *
+ *  - inodes of an unknown type, or larger than their block mapping;
+ *  - block pointers outside the data area, which follows the inode
+ *    table, and blocks referenced more than once;
+ *  - directory entries with an invalid name or inumber, a duplicate
+ *    name, or referring to an inode that is free or already referred
+ *    to (EdFS has no hard links);
+ *  - orphans: inodes in use that are not reachable from the root;
+ *  - blocks marked wrongly in the bitmap.
+ *
+ * With EDFS_CHECK_REPAIR, bad entries are removed, invalid and orphaned
+ * inodes are cleared, bad and duplicate block pointers are reset so the
+ * lowest inumber keeps the block, sizes are cut to the mapping, and the
+ * bitmap is rebuilt. Problems are reported on stderr as they are found.
+ * The image must not be in use otherwise while it is checked.
+ */
+
+typedef enum
+{
+  EDFS_CHECK_REPAIR = 1 << 0,
+  EDFS_CHECK_QUIET  = 1 << 1    /* only count problems */
+} edfs_check_flags_t;
+
+typedef struct
+{
+  uint32_t n_dirs;
+  uint32_t n_files;
+  uint32_t n_blocks;            /* referenced by reachable inodes */
+
+  uint32_t bad_inodes;
+  uint32_t bad_blocks;
+  uint32_t duplicate_blocks;
+  uint32_t bad_entries;
+  uint32_t orphans;
+  uint32_t bitmap_errors;
+} edfs_check_result_t;
+
+int            edfs_check_image           (edfs_image_t        *img,
+                                           int                  flags,
+                                           int                  n_threads,
+                                           edfs_check_result_t *result);
+
+static inline uint32_t
+edfs_check_n_problems(const edfs_check_result_t *result)
+{
+  return result->bad_inodes + result->bad_blocks + result->duplicate_blocks +
+      result->bad_entries + result->orphans + result->bitmap_errors;
+}
+
+#endif /* __EDFS_CHECK_H__ */
@@ -4,6 +4,13 @@
  */
 
 #include "edfs-common.h"
+#include "edfs-alloc.h"
+#include "edfs-cache.h"
+#include "edfs-dcache.h"
+#include "edfs-dindex.h"
+#include "edfs-file.h"
+#include "edfs-journal.h"
+#include "edfs-readahead.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -12,6 +19,7 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 /*
@@ -24,17 +32,71 @@ edfs_image_close(edfs_image_t *img)
   if (!img)
     return;
 
+  /* The readahead threads hold references to files. */
+  edfs_readahead_free(img->readahead);
+
   if (img->fd >= 0)
-    close(img->fd);
+    {
+      /* Flushing files changes metadata, while commits may run. */
+      edfs_journal_begin(img);
+      edfs_file_table_free(img);
+      edfs_journal_end(img);
+
+      edfs_image_sync(img);
+      edfs_journal_free(img->journal);
+      close(img->fd);
+    }
+
+  edfs_io_free(img->io);
+
+  edfs_cache_free(img->bcache);
+  edfs_dcache_free(img->dcache);
+  edfs_dindex_free(img->dindex);
+  if (img->map)
+    munmap(img->map, img->map_size);
+  else
+    free(img->inode_table);
+  free(img->inode_table_dirty);
+  free(img->free_inodes);
+  edfs_block_bitmap_free(img);
+
+  pthread_mutex_destroy(&img->inode_lock);
+  pthread_mutex_destroy(&img->alloc_lock);
+  pthread_mutex_destroy(&img->file_table_lock);
+  for (int i = 0; i < EDFS_DIR_LOCK_STRIPES; i++)
+    pthread_rwlock_destroy(&img->dir_locks[i]);
 
   free(img);
 }
 
+/* Converts the super block @disk of an image up to version 2 to the
+ * form kept in memory.
+ */
+static void
+edfs_super_block_from_16(edfs_super_block_t          *sb,
+                         const edfs_super_block_16_t *disk)
+{
+  memset(sb, 0, sizeof(*sb));
+  sb->magic = disk->magic;
+  sb->version = disk->version;
+  sb->block_size = disk->block_size;
+  sb->n_blocks = disk->n_blocks;
+  sb->inode_table_n_inodes = disk->inode_table_n_inodes;
+  sb->root_inumber = disk->root_inumber;
+  sb->bitmap_start = disk->bitmap_start;
+  sb->bitmap_size = disk->bitmap_size;
+  sb->inode_table_start = disk->inode_table_start;
+  sb->inode_table_size = disk->inode_table_size;
+  sb->journal_start = disk->journal_start;
+  sb->journal_size = disk->journal_size;
+}
+
 /* Read and verify super block. */
 static bool
 edfs_read_super(edfs_image_t *img)
 {
-  if (pread(img->fd, &img->sb, sizeof(edfs_super_block_t), EDFS_SUPER_BLOCK_OFFSET) < 0)
+  if (edfs_image_pread(img, &img->sb, sizeof(edfs_super_block_t),
+                       EDFS_SUPER_BLOCK_OFFSET) < 0)
     {
       fprintf(stderr, "error: file '%s': %s\n",
               img->filename, strerror(errno));
@@ -48,6 +110,21 @@ edfs_read_super(edfs_image_t *img)
       return false;
     }
 
+  if (img->sb.version > EDFS_VERSION_LATEST)
+    {
+      fprintf(stderr, "error: file '%s': unsupported version %u.\n",
+              img->filename, img->sb.version);
+      return false;
+    }
+
+  if (img->sb.version < EDFS_VERSION_3)
+    {
+      edfs_super_block_16_t disk;
+
+      memcpy(&disk, &img->sb, sizeof(disk));
+      edfs_super_block_from_16(&img->sb, &disk);
+    }
+
   /* Simple sanity check of size of file system image. */
   struct stat buf;
 
@@ -65,17 +142,210 @@ edfs_read_super(edfs_image_t *img)
       return false;
     }
 
-  /* FIXME: implement more sanity checks? */
+  if ((uint64_t)img->sb.inode_table_n_inodes * sizeof(edfs_disk_inode_t) >
+      img->sb.inode_table_size)
+    {
+      fprintf(stderr, "error: file '%s': inode count exceeds inode table size.\n",
+              img->filename);
+      return false;
+    }
+
+  /* The metadata areas must lie within the file system, after the
+   * super block and apart from each other, or later reads of the
+   * bitmap and inode table go astray. edfs-fsck checks the rest.
+   */
+  const edfs_super_block_t *sb = &img->sb;
+  uint64_t bitmap_end = (uint64_t)sb->bitmap_start + sb->bitmap_size;
+  uint64_t inode_table_end = (uint64_t)sb->inode_table_start + sb->inode_table_size;
+
+  if (sb->block_size < EDFS_MIN_BLOCK_SIZE ||
+      sb->block_size > edfs_get_max_block_size(sb->version) ||
+      (sb->block_size & (sb->block_size - 1)) != 0)
+    {
+      fprintf(stderr, "error: file '%s': invalid block size %u.\n",
+              img->filename, sb->block_size);
+      return false;
+    }
+
+  size_t sb_end = EDFS_SUPER_BLOCK_OFFSET + edfs_get_super_block_size(sb->version);
+
+  if (sb->bitmap_start < sb_end || sb->inode_table_start < sb_end ||
+      bitmap_end > edfs_get_size(sb) || inode_table_end > edfs_get_size(sb) ||
+      (sb->bitmap_start < inode_table_end && sb->inode_table_start < bitmap_end))
+    {
+      fprintf(stderr, "error: file '%s': bitmap or inode table out of place.\n",
+              img->filename);
+      return false;
+    }
+
+  uint64_t journal_end = (uint64_t)sb->journal_start + sb->journal_size;
+
+  if (sb->journal_size > 0 &&
+      (sb->journal_start % sb->block_size != 0 ||
+       sb->journal_size % sb->block_size != 0 ||
+       sb->journal_size / sb->block_size < EDFS_JOURNAL_MIN_BLOCKS ||
+       journal_end > edfs_get_size(sb) ||
+       (sb->journal_start < bitmap_end && sb->bitmap_start < journal_end) ||
+       (sb->journal_start < inode_table_end &&
+        sb->inode_table_start < journal_end)))
+    {
+      fprintf(stderr, "error: file '%s': journal out of place.\n",
+              img->filename);
+      return false;
+    }
+
+  if (sb->root_inumber == 0 || sb->root_inumber >= sb->inode_table_n_inodes)
+    {
+      fprintf(stderr, "error: file '%s': invalid root inode %u.\n",
+              img->filename, sb->root_inumber);
+      return false;
+    }
+
+  return true;
+}
+
+/* Maps the entire image, for EDFS_IMAGE_MMAP. */
+static bool
+edfs_image_map(edfs_image_t *img)
+{
+  struct stat st;
+
+  img->map_size = edfs_get_size(&img->sb);
+  if (fstat(img->fd, &st) < 0 || st.st_size < img->map_size)
+    {
+      fprintf(stderr, "error: file '%s': image is smaller than its file system.\n",
+              img->filename);
+      return false;
+    }
+
+  void *map = mmap(NULL, img->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   img->fd, 0);
+  if (map == MAP_FAILED)
+    {
+      fprintf(stderr, "error: file '%s': cannot map image: %s\n",
+              img->filename, strerror(errno));
+      return false;
+    }
+
+  img->map = map;
+  return true;
+}
+
+/* Read the entire inode table into memory using a single read. */
+static bool
+edfs_load_inode_table(edfs_image_t *img)
+{
+  size_t size = img->sb.inode_table_n_inodes * sizeof(edfs_disk_inode_t);
+
+  /* Mapped images are updated in place. */
+  if (img->map)
+    {
+      img->inode_table = (edfs_disk_inode_t *)(img->map + img->sb.inode_table_start);
+      return true;
+    }
+
+  img->inode_table = malloc(size);
+  img->inode_table_n_chunks =
+      (size + img->sb.block_size - 1) / img->sb.block_size;
+  img->inode_table_dirty = calloc(img->inode_table_n_chunks, 1);
+  if (!img->inode_table || !img->inode_table_dirty)
+    {
+      fprintf(stderr, "error: file '%s': cannot allocate inode table.\n",
+              img->filename);
+      return false;
+    }
+
+  if (edfs_image_pread(img, img->inode_table, size,
+                       img->sb.inode_table_start) != size)
+    {
+      fprintf(stderr, "error: file '%s': cannot read inode table.\n",
+              img->filename);
+      return false;
+    }
+
+  return true;
+}
+
+static inline void
+edfs_free_inodes_set(edfs_image_t *img, edfs_inumber_t inumber, bool free)
+{
+  uint64_t mask = 1ULL << (inumber % 64);
+  uint64_t *word = &img->free_inodes[inumber / 64];
+
+  if (free && !(*word & mask))
+    {
+      *word |= mask;
+      img->n_free_inodes++;
+    }
+  else if (!free && (*word & mask))
+    {
+      *word &= ~mask;
+      img->n_free_inodes--;
+    }
+}
+
+/* Build the free-inode index from the inode table. Uses the in-memory
+ * table if present, otherwise the table is read using a single read.
+ */
+static bool
+edfs_build_free_inodes(edfs_image_t *img)
+{
+  uint32_t n_inodes = img->sb.inode_table_n_inodes;
+  edfs_disk_inode_t *table = img->inode_table;
+
+  if (!table)
+    {
+      size_t size = n_inodes * sizeof(edfs_disk_inode_t);
+
+      table = malloc(size);
+      if (!table ||
+          edfs_image_pread(img, table, size, img->sb.inode_table_start) != size)
+        {
+          fprintf(stderr, "error: file '%s': cannot read inode table.\n",
+                  img->filename);
+          free(table);
+          return false;
+        }
+    }
+
+  img->free_inodes = calloc((n_inodes + 63) / 64, sizeof(uint64_t));
+  if (!img->free_inodes)
+    {
+      if (table != img->inode_table)
+        free(table);
+      return false;
+    }
+
+  /* Inode 0 is reserved to signal failure, see edfs_find_free_inode(). */
+  for (edfs_inumber_t i = 1; i < n_inodes; i++)
+    if (table[i].type == EDFS_INODE_TYPE_FREE)
+      edfs_free_inodes_set(img, i, true);
+
+  img->free_inodes_cursor = 1;
+
+  if (table != img->inode_table)
+    free(table);
 
   return true;
 }
 
 edfs_image_t *
-edfs_image_open(const char *filename, bool read_super)
+edfs_image_open(const char *filename, int flags)
 {
-  edfs_image_t *img = malloc(sizeof(edfs_image_t));
+  edfs_image_t *img = calloc(1, sizeof(edfs_image_t));
+
+  if (flags & (EDFS_IMAGE_INODE_WRITEBACK | EDFS_IMAGE_MMAP))
+    flags |= EDFS_IMAGE_INODE_CACHE;
 
   img->filename = filename;
+  img->flags = flags;
+
+  pthread_mutex_init(&img->inode_lock, NULL);
+  pthread_mutex_init(&img->alloc_lock, NULL);
+  pthread_mutex_init(&img->file_table_lock, NULL);
+  for (int i = 0; i < EDFS_DIR_LOCK_STRIPES; i++)
+    pthread_rwlock_init(&img->dir_locks[i], NULL);
+
   img->fd = open(img->filename, O_RDWR);
   if (img->fd < 0)
     {
@@ -85,8 +355,70 @@ edfs_image_open(const char *filename, bool read_super)
       return NULL;
     }
 
+  if ((flags & EDFS_IMAGE_IO_URING) &&
+      !(img->io = edfs_io_new(img->fd, EDFS_IO_ENGINE_URING)))
+    fprintf(stderr, "warning: io_uring is not available, using pread\n");
+  if (!img->io && !(img->io = edfs_io_new(img->fd, EDFS_IO_ENGINE_PREAD)))
+    {
+      edfs_image_close(img);
+      return NULL;
+    }
+
   /* Load super block into memory. */
-  if (read_super && !edfs_read_super(img))
+  if ((flags & EDFS_IMAGE_READ_SUPER) && !edfs_read_super(img))
+    {
+      edfs_image_close(img);
+      return NULL;
+    }
+
+  /* Journaled metadata only reaches its place once committed, so it is
+   * kept in memory until then. The journal is replayed before any
+   * metadata is loaded.
+   */
+  if ((flags & EDFS_IMAGE_READ_SUPER) && img->sb.journal_size > 0)
+    {
+      if (flags & EDFS_IMAGE_MMAP)
+        {
+          fprintf(stderr, "error: file '%s': images with a journal cannot "
+                  "be mapped.\n", img->filename);
+          edfs_image_close(img);
+          return NULL;
+        }
+
+      flags |= EDFS_IMAGE_INODE_CACHE | EDFS_IMAGE_INODE_WRITEBACK;
+      img->flags = flags;
+
+      if (!(img->journal = edfs_journal_open(img)))
+        {
+          edfs_image_close(img);
+          return NULL;
+        }
+    }
+
+  if ((flags & EDFS_IMAGE_READ_SUPER) && (flags & EDFS_IMAGE_MMAP) &&
+      !edfs_image_map(img))
+    {
+      edfs_image_close(img);
+      return NULL;
+    }
+
+  /* The inode table can only be located through the super block. */
+  if ((flags & EDFS_IMAGE_READ_SUPER) && (flags & EDFS_IMAGE_INODE_CACHE) &&
+      !edfs_load_inode_table(img))
+    {
+      edfs_image_close(img);
+      return NULL;
+    }
+
+  if ((flags & EDFS_IMAGE_READ_SUPER) &&
+      (!edfs_build_free_inodes(img) || !edfs_block_bitmap_load(img)))
+    {
+      edfs_image_close(img);
+      return NULL;
+    }
+
+  if ((flags & EDFS_IMAGE_READ_SUPER) &&
+      !(img->bcache = edfs_cache_new(img, EDFS_CACHE_DEFAULT_SIZE)))
     {
       edfs_image_close(img);
       return NULL;
@@ -95,6 +427,267 @@ edfs_image_open(const char *filename, bool read_super)
   return img;
 }
 
+static inline uint64_t
+edfs_round_up(uint64_t value, uint32_t block_size)
+{
+  return (value + block_size - 1) / block_size * block_size;
+}
+
+/* Fills in @sb for an image in format @version of @n_blocks blocks of
+ * @block_size bytes, with room for @n_inodes inodes and a journal of
+ * @n_journal_blocks blocks, 0 for none. The layout follows the
+ * distributed images: the super block at its fixed offset, then the
+ * block bitmap, the inode table and the journal, each starting at a
+ * block boundary. Returns the number of blocks taken by this metadata,
+ * block 0 included, or an error code.
+ */
+int
+edfs_super_block_init(edfs_super_block_t *sb,
+                      uint16_t            version,
+                      uint32_t            block_size,
+                      uint32_t            n_blocks,
+                      uint32_t            n_inodes,
+                      uint32_t            n_journal_blocks)
+{
+  if (version < EDFS_VERSION_1 || version > EDFS_VERSION_LATEST ||
+      block_size < EDFS_MIN_BLOCK_SIZE ||
+      block_size > edfs_get_max_block_size(version) ||
+      (block_size & (block_size - 1)) != 0 ||
+      n_blocks >= edfs_get_max_blocks(version) || n_inodes < 2 ||
+      (n_journal_blocks > 0 && n_journal_blocks < EDFS_JOURNAL_MIN_BLOCKS) ||
+      n_journal_blocks >= edfs_get_max_blocks(version))
+    return -EINVAL;
+
+  memset(sb, 0, sizeof(*sb));
+  sb->magic = EDFS_MAGIC;
+  sb->version = version;
+  sb->block_size = block_size;
+  sb->n_blocks = n_blocks;
+  sb->bitmap_start = edfs_round_up(EDFS_SUPER_BLOCK_OFFSET +
+                                   edfs_get_super_block_size(version),
+                                   block_size);
+  sb->bitmap_size = edfs_round_up(((uint64_t)n_blocks + 7) / 8, block_size);
+  sb->inode_table_start = sb->bitmap_start + sb->bitmap_size;
+  sb->inode_table_size = edfs_round_up((uint64_t)n_inodes * sizeof(edfs_disk_inode_t),
+                                       block_size);
+  sb->inode_table_n_inodes = n_inodes;
+  sb->root_inumber = 1;
+  if (n_journal_blocks > 0)
+    {
+      sb->journal_start = sb->inode_table_start + sb->inode_table_size;
+      sb->journal_size = (uint64_t)n_journal_blocks * block_size;
+    }
+
+  uint64_t n_meta = (sb->inode_table_start + sb->inode_table_size) / block_size
+      + n_journal_blocks;
+  if (n_meta >= n_blocks)
+    return -ENOSPC;
+
+  /* The offsets of images up to version 2 are 32 bits wide. */
+  if (version < EDFS_VERSION_3 &&
+      sb->inode_table_start + sb->inode_table_size + sb->journal_size >
+      UINT32_MAX)
+    return -EINVAL;
+
+  return n_meta;
+}
+
+/* Writes @sb to the image file @fd, in the layout of its version.
+ * Returns 0 on success, error code otherwise.
+ */
+int
+edfs_super_block_write(int fd, const edfs_super_block_t *sb)
+{
+  if (sb->version >= EDFS_VERSION_3)
+    return pwrite(fd, sb, sizeof(*sb), EDFS_SUPER_BLOCK_OFFSET)
+        == sizeof(*sb) ? 0 : -EIO;
+
+  edfs_super_block_16_t disk =
+    {
+      .magic = sb->magic,
+      .version = sb->version,
+      .block_size = sb->block_size,
+      .n_blocks = sb->n_blocks,
+      .bitmap_start = sb->bitmap_start,
+      .bitmap_size = sb->bitmap_size,
+      .inode_table_start = sb->inode_table_start,
+      .inode_table_size = sb->inode_table_size,
+      .inode_table_n_inodes = sb->inode_table_n_inodes,
+      .root_inumber = sb->root_inumber,
+      .journal_start = sb->journal_start,
+      .journal_size = sb->journal_size
+    };
+
+  return pwrite(fd, &disk, sizeof(disk), EDFS_SUPER_BLOCK_OFFSET)
+      == sizeof(disk) ? 0 : -EIO;
+}
+
+/* Creates the file system image @filename in format @version, of
+ * @n_blocks blocks of @block_size bytes, with room for @n_inodes inodes
+ * and a journal of @n_journal_blocks blocks, holding an empty root
+ * directory. Returns 0 on success, error code otherwise.
+ */
+int
+edfs_image_create(const char *filename,
+                  uint16_t    version,
+                  uint32_t    block_size,
+                  uint32_t    n_blocks,
+                  uint32_t    n_inodes,
+                  uint32_t    n_journal_blocks)
+{
+  edfs_super_block_t sb;
+
+  int n_meta = edfs_super_block_init(&sb, version, block_size, n_blocks,
+                                     n_inodes, n_journal_blocks);
+  if (n_meta < 0)
+    return n_meta;
+
+  /* Metadata blocks are marked in use; block 0 is among them. */
+  uint8_t *bitmap = calloc(sb.bitmap_size, 1);
+  if (!bitmap)
+    return -ENOMEM;
+  for (int i = 0; i < n_meta; i++)
+    bitmap[i / 8] |= 1 << (i % 8);
+
+  edfs_disk_inode_t root = { .type = EDFS_INODE_TYPE_DIRECTORY };
+  int res = 0;
+
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    res = -errno;
+  else if (ftruncate(fd, (off_t)n_blocks * block_size) < 0)
+    res = -errno;
+  else if (edfs_super_block_write(fd, &sb) < 0 ||
+           pwrite(fd, bitmap, sb.bitmap_size, sb.bitmap_start) != sb.bitmap_size ||
+           pwrite(fd, &root, sizeof(root),
+                  edfs_get_inode_offset(&sb, sb.root_inumber)) != sizeof(root))
+    res = -EIO;
+  else
+    res = edfs_journal_format(fd, &sb);
+
+  if (fd >= 0 && close(fd) < 0 && res == 0)
+    res = -errno;
+  free(bitmap);
+
+  return res;
+}
+
+/* Queues writes of deferred inode table updates on @queue, one for
+ * every run of consecutive dirty chunks. The caller holds the inode
+ * lock until the writes are done.
+ */
+static int
+edfs_inode_table_queue(edfs_image_t *img, edfs_io_queue_t *queue)
+{
+  if (!img->inode_table_dirty)
+    return 0;
+
+  uint32_t chunk_size = img->sb.block_size;
+  size_t table_size = img->sb.inode_table_n_inodes * sizeof(edfs_disk_inode_t);
+  uint32_t i = 0;
+
+  while (i < img->inode_table_n_chunks)
+    {
+      if (!img->inode_table_dirty[i])
+        {
+          i++;
+          continue;
+        }
+
+      uint32_t start = i;
+      while (i < img->inode_table_n_chunks && img->inode_table_dirty[i])
+        i++;
+
+      size_t begin = (size_t)start * chunk_size;
+      size_t end = (size_t)i * chunk_size;
+      if (end > table_size)
+        end = table_size;
+
+      edfs_io_req_t *req = edfs_io_queue_add(queue, EDFS_IO_WRITE,
+                                             img->sb.inode_table_start + begin,
+                                             end - begin);
+      if (!req)
+        return -ENOMEM;
+      req->buf = (char *)img->inode_table + begin;
+    }
+
+  return 0;
+}
+
+/* Writes out all deferred metadata updates, through the journal if the
+ * image has one. Returns 0 on success, error code otherwise.
+ */
+int
+edfs_image_sync(edfs_image_t *img)
+{
+  if (img->journal)
+    return edfs_journal_commit(img);
+
+  return edfs_image_writeback(img);
+}
+
+/* Writes all deferred metadata updates in place: the blocks in the
+ * cache, the inode table and the free-block bitmap. The latter two are
+ * written as a single batch of requests. Returns 0 on success, error
+ * code otherwise.
+ */
+int
+edfs_image_writeback(edfs_image_t *img)
+{
+  edfs_io_queue_t queue;
+
+  /* Blocks go out before the bitmap and inodes that refer to them. */
+  int res = edfs_cache_flush(img);
+
+  edfs_io_queue_init(&queue);
+
+  pthread_mutex_lock(&img->alloc_lock);
+  pthread_mutex_lock(&img->inode_lock);
+
+  int res2 = edfs_block_bitmap_queue(img, &queue);
+  if (res2 == 0)
+    res2 = edfs_inode_table_queue(img, &queue);
+  if (res2 == 0 && queue.n_reqs > 0)
+    res2 = edfs_image_io(img, queue.reqs, queue.n_reqs);
+
+  /* After a failure everything is written again next time. */
+  if (res2 == 0)
+    {
+      edfs_block_bitmap_clean(img);
+      if (img->inode_table_dirty)
+        memset(img->inode_table_dirty, 0, img->inode_table_n_chunks);
+    }
+
+  pthread_mutex_unlock(&img->inode_lock);
+  pthread_mutex_unlock(&img->alloc_lock);
+
+  edfs_io_queue_clear(&queue);
+
+  if (img->map && msync(img->map, img->map_size, MS_SYNC) < 0 && res == 0)
+    res = -errno;
+
+  return res < 0 ? res : res2;
+}
+
+/* Runs a batch of reads and writes of the image file with the engine
+ * of the image, counted like single system calls. Returns 0 if all of
+ * them transferred all their bytes, error code otherwise.
+ */
+int
+edfs_image_io(edfs_image_t *img, edfs_io_req_t *reqs, int n_reqs)
+{
+  EDFS_TRACE_BEGIN(span);
+  int res = edfs_io_run(img->io, reqs, n_reqs);
+  EDFS_TRACE_END(span, "io_batch");
+
+  for (int i = 0; i < n_reqs; i++)
+    if (reqs[i].op == EDFS_IO_READ)
+      edfs_image_count_read(img, reqs[i].res);
+    else
+      edfs_image_count_write(img, reqs[i].res);
+
+  return res;
+}
 
 /*
  * Inode-related routines
@@ -110,8 +703,95 @@ edfs_read_inode(edfs_image_t *img,
   if (inode->inumber >= img->sb.inode_table_n_inodes)
     return -ENOENT;
 
+  if (img->inode_table)
+    {
+      pthread_mutex_lock(&img->inode_lock);
+      inode->inode = img->inode_table[inode->inumber];
+      pthread_mutex_unlock(&img->inode_lock);
+      return sizeof(edfs_disk_inode_t);
+    }
+
   off_t offset = edfs_get_inode_offset(&img->sb, inode->inumber);
-  return pread(img->fd, &inode->inode, sizeof(edfs_disk_inode_t), offset);
+  return edfs_image_pread(img, &inode->inode, sizeof(edfs_disk_inode_t),
+                          offset);
+}
+
+static int
+edfs_inode_ptr_compare(const void *a, const void *b)
+{
+  const edfs_inode_t *inode_a = *(const edfs_inode_t **)a;
+  const edfs_inode_t *inode_b = *(const edfs_inode_t **)b;
+
+  return (inode_a->inumber > inode_b->inumber) - (inode_a->inumber < inode_b->inumber);
+}
+
+/* Reads the @n_inodes inodes in @inodes, of which the inumbers must be
+ * set, as with edfs_read_inode(). Inodes that are close together in the
+ * inode table are read with a single pread() of the range covering
+ * them, of at most EDFS_INODE_BATCH_SIZE bytes. Inodes with an invalid
+ * inumber are returned as free. Returns 0 on success, error code
+ * otherwise.
+ */
+int
+edfs_read_inodes(edfs_image_t *img,
+                 edfs_inode_t *inodes,
+                 int           n_inodes)
+{
+  uint32_t n_per_batch = EDFS_INODE_BATCH_SIZE / sizeof(edfs_disk_inode_t);
+  int res = 0;
+
+  for (int i = 0; i < n_inodes; i++)
+    if (inodes[i].inumber >= img->sb.inode_table_n_inodes)
+      memset(&inodes[i].inode, 0, sizeof(edfs_disk_inode_t));
+
+  if (img->inode_table)
+    {
+      pthread_mutex_lock(&img->inode_lock);
+      for (int i = 0; i < n_inodes; i++)
+        if (inodes[i].inumber < img->sb.inode_table_n_inodes)
+          inodes[i].inode = img->inode_table[inodes[i].inumber];
+      pthread_mutex_unlock(&img->inode_lock);
+      return 0;
+    }
+
+  edfs_inode_t **sorted = malloc(n_inodes * sizeof(edfs_inode_t *) + 1);
+  edfs_disk_inode_t *batch = malloc(EDFS_INODE_BATCH_SIZE);
+  if (!sorted || !batch)
+    {
+      res = -ENOMEM;
+      goto out;
+    }
+
+  int n_sorted = 0;
+  for (int i = 0; i < n_inodes; i++)
+    if (inodes[i].inumber < img->sb.inode_table_n_inodes)
+      sorted[n_sorted++] = &inodes[i];
+  qsort(sorted, n_sorted, sizeof(edfs_inode_t *), edfs_inode_ptr_compare);
+
+  for (int start = 0, end; start < n_sorted; start = end)
+    {
+      edfs_inumber_t first = sorted[start]->inumber;
+
+      for (end = start + 1; end < n_sorted; end++)
+        if (sorted[end]->inumber - first >= n_per_batch)
+          break;
+
+      size_t size = (sorted[end - 1]->inumber - first + 1) * sizeof(edfs_disk_inode_t);
+      if (edfs_image_pread(img, batch, size,
+                           edfs_get_inode_offset(&img->sb, first)) != size)
+        {
+          res = -EIO;
+          goto out;
+        }
+
+      for (int i = start; i < end; i++)
+        sorted[i]->inode = batch[sorted[i]->inumber - first];
+    }
+
+out:
+  free(sorted);
+  free(batch);
+  return res;
 }
 
 /* Reads the root inode from disk. @inode must point to a valid
@@ -125,6 +805,53 @@ edfs_read_root_inode(edfs_image_t *img,
   return edfs_read_inode(img, inode);
 }
 
+/* Stores @disk_inode in the inode table. With an in-memory inode table
+ * the write either goes through to disk immediately, or the containing
+ * chunk is marked dirty for edfs_image_sync(). Called with the inode
+ * lock held.
+ */
+static int
+edfs_store_disk_inode_locked(edfs_image_t            *img,
+                             edfs_inumber_t           inumber,
+                             const edfs_disk_inode_t *disk_inode)
+{
+  if (img->free_inodes && inumber != 0)
+    edfs_free_inodes_set(img, inumber,
+                         disk_inode->type == EDFS_INODE_TYPE_FREE);
+
+  if (img->inode_table)
+    {
+      img->inode_table[inumber] = *disk_inode;
+
+      if (img->map)
+        return sizeof(edfs_disk_inode_t);
+
+      if (img->flags & EDFS_IMAGE_INODE_WRITEBACK)
+        {
+          uint32_t chunk = inumber * sizeof(edfs_disk_inode_t) / img->sb.block_size;
+          if (!img->inode_table_dirty[chunk])
+            edfs_journal_dirtied(img, 1);
+          img->inode_table_dirty[chunk] = 1;
+          return sizeof(edfs_disk_inode_t);
+        }
+    }
+
+  off_t offset = edfs_get_inode_offset(&img->sb, inumber);
+  return edfs_image_pwrite(img, disk_inode, sizeof(edfs_disk_inode_t), offset);
+}
+
+static int
+edfs_store_disk_inode(edfs_image_t            *img,
+                      edfs_inumber_t           inumber,
+                      const edfs_disk_inode_t *disk_inode)
+{
+  pthread_mutex_lock(&img->inode_lock);
+  int res = edfs_store_disk_inode_locked(img, inumber, disk_inode);
+  pthread_mutex_unlock(&img->inode_lock);
+
+  return res;
+}
+
 /* Writes @inode to disk, inode->inumber must be set to a valid
  * inode number to which the inode will be written.
  */
@@ -134,8 +861,7 @@ edfs_write_inode(edfs_image_t *img, edfs_inode_t *inode)
   if (inode->inumber >= img->sb.inode_table_n_inodes)
     return -ENOENT;
 
-  off_t offset = edfs_get_inode_offset(&img->sb, inode->inumber);
-  return pwrite(img->fd, &inode->inode, sizeof(edfs_disk_inode_t), offset);
+  return edfs_store_disk_inode(img, inode->inumber, &inode->inode);
 }
 
 /* Clears the specified inode on disk, based on inode->inumber.
@@ -146,11 +872,45 @@ edfs_clear_inode(edfs_image_t *img, edfs_inode_t *inode)
   if (inode->inumber >= img->sb.inode_table_n_inodes)
     return -ENOENT;
 
-  off_t offset = edfs_get_inode_offset(&img->sb, inode->inumber);
-
   edfs_disk_inode_t disk_inode;
   memset(&disk_inode, 0, sizeof(edfs_disk_inode_t));
-  return pwrite(img->fd, &disk_inode, sizeof(edfs_disk_inode_t), offset);
+  return edfs_store_disk_inode(img, inode->inumber, &disk_inode);
+}
+
+/* Finds a free inode using the free-inode index, searching a word of
+ * 64 inodes at a time starting at the cursor and wrapping around once.
+ */
+static edfs_inumber_t
+edfs_find_free_inode_indexed(edfs_image_t *img)
+{
+  uint32_t n_words = (img->sb.inode_table_n_inodes + 63) / 64;
+  uint32_t start = img->free_inodes_cursor / 64;
+
+  if (img->n_free_inodes == 0)
+    return 0;
+
+  for (uint32_t n = 0; n <= n_words; n++)
+    {
+      uint32_t w = (start + n) % n_words;
+      uint64_t word = img->free_inodes[w];
+
+      /* On the first visit of the cursor's word, skip the bits below the
+       * cursor; they are reconsidered after wrapping around.
+       */
+      if (n == 0)
+        word &= ~0ULL << (img->free_inodes_cursor % 64);
+
+      if (word)
+        {
+          edfs_inumber_t inumber = w * 64 + __builtin_ctzll(word);
+
+          img->free_inodes_cursor = inumber + 1 < img->sb.inode_table_n_inodes
+              ? inumber + 1 : 1;
+          return inumber;
+        }
+    }
+
+  return 0;
 }
 
 /* Finds a free inode and returns the inumber. NOTE: this does NOT
@@ -160,6 +920,14 @@ edfs_clear_inode(edfs_image_t *img, edfs_inode_t *inode)
 edfs_inumber_t
 edfs_find_free_inode(edfs_image_t *img)
 {
+  if (img->free_inodes)
+    {
+      pthread_mutex_lock(&img->inode_lock);
+      edfs_inumber_t inumber = edfs_find_free_inode_indexed(img);
+      pthread_mutex_unlock(&img->inode_lock);
+      return inumber;
+    }
+
   edfs_inode_t inode = { .inumber = 1 };
 
   while (inode.inumber < img->sb.inode_table_n_inodes)
@@ -176,6 +944,9 @@ edfs_find_free_inode(edfs_image_t *img)
 
 /* Create a new inode. Searches for a free inode in the inode table (returns
  * -ENOSPC if the inode table is full). @inode is initialized accordingly.
+ * The inumber is reserved in the free-inode index, so that it is not
+ * handed out twice before the inode is written; release it with
+ * edfs_clear_inode() if the inode is not used after all.
  */
 int
 edfs_new_inode(edfs_image_t *img,
@@ -184,7 +955,17 @@ edfs_new_inode(edfs_image_t *img,
 {
   edfs_inumber_t inumber;
 
-  inumber = edfs_find_free_inode(img);
+  if (img->free_inodes)
+    {
+      pthread_mutex_lock(&img->inode_lock);
+      inumber = edfs_find_free_inode_indexed(img);
+      if (inumber != 0)
+        edfs_free_inodes_set(img, inumber, false);
+      pthread_mutex_unlock(&img->inode_lock);
+    }
+  else
+    inumber = edfs_find_free_inode(img);
+
   if (inumber == 0)
     return -ENOSPC;
 
@@ -7,25 +7,233 @@
 #define __EDFS_COMMON_H__
 
 #include "edfs.h"
+#include "edfs-trace.h"
+#include "edfs-io.h"
 
 #include <stdint.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <pthread.h>
 
 
+/* Flags for edfs_image_open(). */
+typedef enum
+{
+  EDFS_IMAGE_READ_SUPER      = 1 << 0,
+  EDFS_IMAGE_INODE_CACHE     = 1 << 1,  /* Keep the inode table in memory,
+                                         * writes go through to disk.
+                                         */
+  EDFS_IMAGE_INODE_WRITEBACK = 1 << 2,  /* Implies EDFS_IMAGE_INODE_CACHE;
+                                         * inode writes are deferred to
+                                         * edfs_image_sync(). Always set
+                                         * for images with a journal.
+                                         */
+  EDFS_IMAGE_MMAP            = 1 << 3,  /* Map the image into memory and
+                                         * access blocks and inodes in
+                                         * place; edfs_image_sync() does
+                                         * an msync(). Requires
+                                         * EDFS_IMAGE_READ_SUPER, and an
+                                         * image without a journal.
+                                         */
+  EDFS_IMAGE_IO_URING        = 1 << 4   /* Run batches of requests through
+                                         * io_uring, see edfs-io.h; falls
+                                         * back to pread if unavailable.
+                                         */
+} edfs_image_flags_t;
+
+/* Locking
+ *
+ * An image may be used by several threads at once, as edfuse does by
+ * default. Its state is protected by the locks below, listed in the
+ * order in which they may be nested:
+ *
+ *  - a journal handle, see edfs-journal.h: operations begin before
+ *    taking any of the locks below, and a commit takes them while all
+ *    operations are held off.
+ *  - dir_locks: reader/writer locks of directories, striped by inumber.
+ *    Held for reading while a directory is searched or listed and for
+ *    writing while entries are added or removed, see edfs-dir.h. Two
+ *    directories are locked in stripe order.
+ *  - the lock of a file object: a reader/writer lock over its inode
+ *    copy, block map and write-back buffer, see edfs-file.h.
+ *  - file_table_lock: the file table and reference counts.
+ *  - alloc_lock: the block bitmap, reservations and the accounting of
+ *    free and buffered blocks, see edfs-alloc.h.
+ *  - inode_lock: the inode table and the free-inode index.
+ *  - the internal locks of the block cache, the dentry cache and the
+ *    directory index.
+ *
+ * Counters that are only reported are updated atomically.
+ */
+#define EDFS_DIR_LOCK_STRIPES 64
+
 /* Structure to use as handle to an opened image file. */
 typedef struct
 {
   int fd;
   const char *filename;
+  int flags;
+
+  /* Engine that runs batches of reads and writes of @fd. */
+  edfs_io_t *io;
 
   edfs_super_block_t sb;
+
+  /* Mapping of the entire image with EDFS_IMAGE_MMAP, NULL otherwise.
+   * Writes to the mapping reach the image file in the page cache;
+   * msync() makes them durable.
+   */
+  char *map;
+  size_t map_size;
+
+  /* In-memory copy of the inode table when EDFS_IMAGE_INODE_CACHE is
+   * set. For write-back, a dirty flag is kept per block-sized chunk of
+   * the table. With EDFS_IMAGE_MMAP, this points into the mapping.
+   */
+  edfs_disk_inode_t *inode_table;
+  uint8_t *inode_table_dirty;
+  uint32_t inode_table_n_chunks;
+
+  /* Free-inode index, built when the super block is read: one bit per
+   * inode, set when the inode is free. Allocation resumes scanning at
+   * the cursor, so it does not revisit the occupied start of the table.
+   */
+  uint64_t *free_inodes;
+  uint32_t free_inodes_cursor;
+  uint32_t n_free_inodes;
+
+  /* Free-block bitmap and allocator state, see edfs-alloc.h. */
+  uint64_t *block_bitmap;
+  uint64_t *block_reserved;
+  uint8_t *block_bitmap_dirty;
+  uint32_t block_bitmap_n_chunks;
+  uint32_t block_cursor;
+  uint32_t n_free_blocks;
+
+  /* Files in use and their write-back buffers, see edfs-file.h.
+   * delalloc_blocks counts buffered blocks that still need to be
+   * allocated.
+   */
+  struct _edfs_file **file_table;
+  uint32_t dirty_blocks;
+  uint32_t delalloc_blocks;
+  size_t writeback_limit;
+
+  /* I/O counters of the file data path. */
+  uint64_t n_read_requests;
+  uint64_t n_read_syscalls;
+  uint64_t n_flushes;
+  uint64_t n_write_syscalls;
+
+  /* All reads and writes of the image file, including those done by
+   * libfuse when data is spliced from it.
+   */
+  uint64_t n_reads;
+  uint64_t n_bytes_read;
+  uint64_t n_writes;
+  uint64_t n_bytes_written;
+
+  /* Buffer cache for directory and indirect blocks, see edfs-cache.h.
+   * Present whenever the super block has been read.
+   */
+  struct _edfs_cache *bcache;
+
+  /* Optional caches, NULL when disabled. Owned by the image. */
+  struct _edfs_dcache *dcache;
+  struct _edfs_dindex *dindex;
+
+  /* Readahead of file data, NULL when disabled, see edfs-readahead.h. */
+  struct _edfs_readahead *readahead;
+
+  /* Metadata journal, NULL if the image has none, see edfs-journal.h. */
+  struct _edfs_journal *journal;
+
+  /* See "Locking" above. */
+  pthread_mutex_t inode_lock;
+  pthread_mutex_t alloc_lock;
+  pthread_mutex_t file_table_lock;
+  pthread_rwlock_t dir_locks[EDFS_DIR_LOCK_STRIPES];
 } edfs_image_t;
 
 
 void           edfs_image_close           (edfs_image_t *img);
 edfs_image_t  *edfs_image_open            (const char   *filename,
-                                           bool          read_super);
+                                           int           flags);
+int            edfs_image_sync            (edfs_image_t *img);
+int            edfs_image_writeback       (edfs_image_t *img);
+int            edfs_image_io              (edfs_image_t  *img,
+                                           edfs_io_req_t *reqs,
+                                           int            n_reqs);
+int            edfs_super_block_init      (edfs_super_block_t *sb,
+                                           uint16_t      version,
+                                           uint32_t      block_size,
+                                           uint32_t      n_blocks,
+                                           uint32_t      n_inodes,
+                                           uint32_t      n_journal_blocks);
+int            edfs_super_block_write     (int           fd,
+                                           const edfs_super_block_t *sb);
+int            edfs_image_create          (const char   *filename,
+                                           uint16_t      version,
+                                           uint32_t      block_size,
+                                           uint32_t      n_blocks,
+                                           uint32_t      n_inodes,
+                                           uint32_t      n_journal_blocks);
+
+/* Adds @n to a counter that is shared between threads. */
+static inline void
+edfs_counter_add(uint64_t *counter, uint64_t n)
+{
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/* Count a read or write of @n bytes of the image file. */
+static inline void
+edfs_image_count_read(edfs_image_t *img, ssize_t n)
+{
+  edfs_counter_add(&img->n_reads, 1);
+  if (n > 0)
+    edfs_counter_add(&img->n_bytes_read, n);
+}
+
+static inline void
+edfs_image_count_write(edfs_image_t *img, ssize_t n)
+{
+  edfs_counter_add(&img->n_writes, 1);
+  if (n > 0)
+    edfs_counter_add(&img->n_bytes_written, n);
+}
+
+/* pread() and pwrite() of the image file, counted. */
+static inline ssize_t
+edfs_image_pread(edfs_image_t *img, void *buf, size_t size, off_t offset)
+{
+  EDFS_TRACE_BEGIN(span);
+  ssize_t n = pread(img->fd, buf, size, offset);
+  EDFS_TRACE_END(span, "pread");
+
+  edfs_image_count_read(img, n);
+  return n;
+}
+
+static inline ssize_t
+edfs_image_pwrite(edfs_image_t *img, const void *buf, size_t size, off_t offset)
+{
+  EDFS_TRACE_BEGIN(span);
+  ssize_t n = pwrite(img->fd, buf, size, offset);
+  EDFS_TRACE_END(span, "pwrite");
+
+  edfs_image_count_write(img, n);
+  return n;
+}
+
+/* Address of @block in the mapping of an image opened with
+ * EDFS_IMAGE_MMAP.
+ */
+static inline char *
+edfs_image_block_ptr(edfs_image_t *img, edfs_block_t block)
+{
+  return img->map + edfs_get_block_offset(&img->sb, block);
+}
 
 
 
@@ -44,8 +252,14 @@ typedef struct
 } edfs_inode_t;
 
 
+/* Largest range of the inode table read at once by edfs_read_inodes(). */
+#define EDFS_INODE_BATCH_SIZE (64 * 1024)
+
 int            edfs_read_inode            (edfs_image_t *img,
                                            edfs_inode_t *inode);
+int            edfs_read_inodes           (edfs_image_t *img,
+                                           edfs_inode_t *inodes,
+                                           int           n_inodes);
 int            edfs_read_root_inode       (edfs_image_t *img,
                                            edfs_inode_t *inode);
 int            edfs_write_inode           (edfs_image_t *img,
@@ -0,0 +1,345 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#include "edfs-dcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+
+/* Entries live in a single array and are linked by index, both into
+ * the hash chains and into an LRU list. When the cache is full, the
+ * least recently used entry is recycled. A single lock protects the
+ * cache; entries are small and operations short.
+ */
+#define NIL (-1)
+
+typedef struct
+{
+  edfs_inumber_t parent;
+  edfs_inumber_t inumber;   /* 0 for a negative entry */
+  uint32_t hash;
+
+  int32_t chain_next;
+  int32_t lru_prev;
+  int32_t lru_next;
+
+  char name[EDFS_FILENAME_SIZE];
+} edfs_dcache_entry_t;
+
+struct _edfs_dcache
+{
+  int32_t *buckets;
+  uint32_t bucket_mask;
+
+  edfs_dcache_entry_t *entries;
+  int32_t free_list;         /* chained through chain_next */
+
+  int32_t lru_head;          /* most recently used */
+  int32_t lru_tail;          /* least recently used */
+
+  pthread_mutex_t lock;
+
+  edfs_dcache_stats_t stats;
+};
+
+
+static inline uint32_t
+edfs_dcache_hash(edfs_inumber_t parent, const char *name)
+{
+  /* FNV-1a over the parent inumber and the component name. */
+  uint32_t hash = 2166136261u;
+
+  for (int i = 0; i < sizeof(edfs_inumber_t); i++)
+    {
+      hash ^= (parent >> (i * 8)) & 0xff;
+      hash *= 16777619u;
+    }
+
+  for (; *name; name++)
+    {
+      hash ^= (unsigned char)*name;
+      hash *= 16777619u;
+    }
+
+  return hash;
+}
+
+edfs_dcache_t *
+edfs_dcache_new(size_t max_entries)
+{
+  if (max_entries == 0)
+    return NULL;
+
+  edfs_dcache_t *dcache = calloc(1, sizeof(edfs_dcache_t));
+  if (!dcache)
+    return NULL;
+
+  pthread_mutex_init(&dcache->lock, NULL);
+
+  /* Aim for a load factor of at most 1. */
+  uint32_t n_buckets = 1;
+  while (n_buckets < max_entries)
+    n_buckets <<= 1;
+
+  dcache->buckets = malloc(n_buckets * sizeof(int32_t));
+  dcache->entries = malloc(max_entries * sizeof(edfs_dcache_entry_t));
+  if (!dcache->buckets || !dcache->entries)
+    {
+      edfs_dcache_free(dcache);
+      return NULL;
+    }
+
+  dcache->bucket_mask = n_buckets - 1;
+  for (uint32_t i = 0; i < n_buckets; i++)
+    dcache->buckets[i] = NIL;
+
+  for (size_t i = 0; i < max_entries; i++)
+    dcache->entries[i].chain_next = i + 1 < max_entries ? i + 1 : NIL;
+  dcache->free_list = 0;
+
+  dcache->lru_head = dcache->lru_tail = NIL;
+  dcache->stats.max_entries = max_entries;
+
+  return dcache;
+}
+
+void
+edfs_dcache_free(edfs_dcache_t *dcache)
+{
+  if (!dcache)
+    return;
+
+  pthread_mutex_destroy(&dcache->lock);
+  free(dcache->buckets);
+  free(dcache->entries);
+  free(dcache);
+}
+
+
+/*
+ * LRU list and hash chain maintenance
+ */
+
+static void
+edfs_dcache_lru_unlink(edfs_dcache_t *dcache, int32_t i)
+{
+  edfs_dcache_entry_t *entry = &dcache->entries[i];
+
+  if (entry->lru_prev != NIL)
+    dcache->entries[entry->lru_prev].lru_next = entry->lru_next;
+  else
+    dcache->lru_head = entry->lru_next;
+
+  if (entry->lru_next != NIL)
+    dcache->entries[entry->lru_next].lru_prev = entry->lru_prev;
+  else
+    dcache->lru_tail = entry->lru_prev;
+}
+
+static void
+edfs_dcache_lru_push(edfs_dcache_t *dcache, int32_t i)
+{
+  edfs_dcache_entry_t *entry = &dcache->entries[i];
+
+  entry->lru_prev = NIL;
+  entry->lru_next = dcache->lru_head;
+  if (dcache->lru_head != NIL)
+    dcache->entries[dcache->lru_head].lru_prev = i;
+  dcache->lru_head = i;
+  if (dcache->lru_tail == NIL)
+    dcache->lru_tail = i;
+}
+
+/* Returns the index of the matching entry or NIL. */
+static int32_t
+edfs_dcache_find(edfs_dcache_t  *dcache,
+                 edfs_inumber_t  parent,
+                 const char     *name,
+                 uint32_t        hash)
+{
+  for (int32_t i = dcache->buckets[hash & dcache->bucket_mask]; i != NIL;
+       i = dcache->entries[i].chain_next)
+    {
+      edfs_dcache_entry_t *entry = &dcache->entries[i];
+
+      if (entry->hash == hash && entry->parent == parent &&
+          strncmp(entry->name, name, EDFS_FILENAME_SIZE) == 0)
+        return i;
+    }
+
+  return NIL;
+}
+
+/* Removes entry @i from its hash chain and the LRU list and puts it
+ * on the free list.
+ */
+static void
+edfs_dcache_release(edfs_dcache_t *dcache, int32_t i)
+{
+  edfs_dcache_entry_t *entry = &dcache->entries[i];
+  int32_t *link = &dcache->buckets[entry->hash & dcache->bucket_mask];
+
+  while (*link != i)
+    link = &dcache->entries[*link].chain_next;
+  *link = entry->chain_next;
+
+  edfs_dcache_lru_unlink(dcache, i);
+
+  entry->chain_next = dcache->free_list;
+  dcache->free_list = i;
+  dcache->stats.n_entries--;
+}
+
+
+/*
+ * Public API
+ */
+
+/* Looks up @name in directory @parent. Returns true if the cache has
+ * an answer; in that case *@inumber is set to the child inumber, or to
+ * 0 if the name is known not to exist.
+ */
+bool
+edfs_dcache_lookup(edfs_dcache_t  *dcache,
+                   edfs_inumber_t  parent,
+                   const char     *name,
+                   edfs_inumber_t *inumber)
+{
+  uint32_t hash = edfs_dcache_hash(parent, name);
+
+  pthread_mutex_lock(&dcache->lock);
+
+  int32_t i = edfs_dcache_find(dcache, parent, name, hash);
+  if (i == NIL)
+    {
+      dcache->stats.misses++;
+      pthread_mutex_unlock(&dcache->lock);
+      return false;
+    }
+
+  edfs_dcache_lru_unlink(dcache, i);
+  edfs_dcache_lru_push(dcache, i);
+
+  *inumber = dcache->entries[i].inumber;
+  if (*inumber == 0)
+    dcache->stats.negative_hits++;
+  else
+    dcache->stats.hits++;
+
+  pthread_mutex_unlock(&dcache->lock);
+
+  return true;
+}
+
+/* Records that @name in directory @parent refers to @inumber. Pass an
+ * @inumber of 0 to record a negative entry. An existing entry for the
+ * same name is overwritten.
+ */
+void
+edfs_dcache_insert(edfs_dcache_t  *dcache,
+                   edfs_inumber_t  parent,
+                   const char     *name,
+                   edfs_inumber_t  inumber)
+{
+  uint32_t hash = edfs_dcache_hash(parent, name);
+
+  pthread_mutex_lock(&dcache->lock);
+
+  int32_t i = edfs_dcache_find(dcache, parent, name, hash);
+  if (i != NIL)
+    {
+      dcache->entries[i].inumber = inumber;
+      edfs_dcache_lru_unlink(dcache, i);
+      edfs_dcache_lru_push(dcache, i);
+      pthread_mutex_unlock(&dcache->lock);
+      return;
+    }
+
+  if (dcache->free_list == NIL)
+    {
+      edfs_dcache_release(dcache, dcache->lru_tail);
+      dcache->stats.evictions++;
+    }
+
+  i = dcache->free_list;
+  edfs_dcache_entry_t *entry = &dcache->entries[i];
+  dcache->free_list = entry->chain_next;
+
+  entry->parent = parent;
+  entry->inumber = inumber;
+  entry->hash = hash;
+  strncpy(entry->name, name, EDFS_FILENAME_SIZE - 1);
+  entry->name[EDFS_FILENAME_SIZE - 1] = 0;
+
+  uint32_t bucket = hash & dcache->bucket_mask;
+  entry->chain_next = dcache->buckets[bucket];
+  dcache->buckets[bucket] = i;
+
+  edfs_dcache_lru_push(dcache, i);
+
+  dcache->stats.n_entries++;
+  dcache->stats.insertions++;
+
+  pthread_mutex_unlock(&dcache->lock);
+}
+
+/* Drops any entry, positive or negative, for @name in @parent. */
+void
+edfs_dcache_remove(edfs_dcache_t  *dcache,
+                   edfs_inumber_t  parent,
+                   const char     *name)
+{
+  uint32_t hash = edfs_dcache_hash(parent, name);
+
+  pthread_mutex_lock(&dcache->lock);
+
+  int32_t i = edfs_dcache_find(dcache, parent, name, hash);
+  if (i != NIL)
+    {
+      edfs_dcache_release(dcache, i);
+      dcache->stats.invalidations++;
+    }
+
+  pthread_mutex_unlock(&dcache->lock);
+}
+
+/* Drops all entries whose parent is @parent. Used when a directory is
+ * removed, so that its inumber can be reused safely. This walks the
+ * entire cache, but directory removal is rare.
+ */
+void
+edfs_dcache_purge_dir(edfs_dcache_t  *dcache,
+                      edfs_inumber_t  parent)
+{
+  pthread_mutex_lock(&dcache->lock);
+
+  int32_t i = dcache->lru_head;
+
+  while (i != NIL)
+    {
+      int32_t next = dcache->entries[i].lru_next;
+
+      if (dcache->entries[i].parent == parent)
+        {
+          edfs_dcache_release(dcache, i);
+          dcache->stats.invalidations++;
+        }
+
+      i = next;
+    }
+
+  pthread_mutex_unlock(&dcache->lock);
+}
+
+void
+edfs_dcache_get_stats(edfs_dcache_t       *dcache,
+                      edfs_dcache_stats_t *stats)
+{
+  pthread_mutex_lock(&dcache->lock);
+  *stats = dcache->stats;
+  pthread_mutex_unlock(&dcache->lock);
+}
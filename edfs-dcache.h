@@ -0,0 +1,59 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#ifndef __EDFS_DCACHE_H__
+#define __EDFS_DCACHE_H__
+
+#include "edfs.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+
+/* Directory entry cache, mapping (parent inumber, component name) to
+ * the inumber of the child. An inumber of 0 is never a valid child, so
+ * it is used to record negative entries: names that are known not to
+ * exist in the parent directory.
+ */
+typedef struct _edfs_dcache edfs_dcache_t;
+
+typedef struct
+{
+  uint64_t hits;           /* positive entries found */
+  uint64_t negative_hits;  /* negative entries found */
+  uint64_t misses;
+  uint64_t insertions;
+  uint64_t evictions;
+  uint64_t invalidations;
+
+  size_t n_entries;
+  size_t max_entries;
+} edfs_dcache_stats_t;
+
+#define EDFS_DCACHE_DEFAULT_SIZE 4096
+
+
+edfs_dcache_t *edfs_dcache_new            (size_t          max_entries);
+void           edfs_dcache_free           (edfs_dcache_t  *dcache);
+
+bool           edfs_dcache_lookup         (edfs_dcache_t  *dcache,
+                                           edfs_inumber_t  parent,
+                                           const char     *name,
+                                           edfs_inumber_t *inumber);
+void           edfs_dcache_insert         (edfs_dcache_t  *dcache,
+                                           edfs_inumber_t  parent,
+                                           const char     *name,
+                                           edfs_inumber_t  inumber);
+void           edfs_dcache_remove         (edfs_dcache_t  *dcache,
+                                           edfs_inumber_t  parent,
+                                           const char     *name);
+void           edfs_dcache_purge_dir      (edfs_dcache_t  *dcache,
+                                           edfs_inumber_t  parent);
+
+void           edfs_dcache_get_stats      (edfs_dcache_t       *dcache,
+                                           edfs_dcache_stats_t *stats);
+
+#endif /* __EDFS_DCACHE_H__ */
@@ -0,0 +1,460 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#include "edfs-dindex.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+
+/* The index of a directory keeps a record per slot. Used slots are
+ * linked by index into hash chains on the name, free slots are marked
+ * in a bitmap so that the lowest one is handed out first, as a scan of
+ * the directory blocks would. The indexes themselves are kept in a
+ * hash table on the directory inumber and on an LRU list. A single
+ * lock protects the table and all indexes.
+ */
+#define NIL (-1)
+
+typedef struct
+{
+  edfs_inumber_t inumber;    /* 0 for a free or absent slot */
+  int32_t chain_next;
+  char name[EDFS_FILENAME_SIZE];
+} edfs_dindex_slot_t;
+
+struct _edfs_dindex_dir
+{
+  edfs_inumber_t inumber;
+  edfs_dindex_dir_t *next;       /* chain in the table */
+  edfs_dindex_dir_t *lru_prev;
+  edfs_dindex_dir_t *lru_next;
+
+  uint32_t n_slots;
+  uint32_t bucket_mask;
+  int32_t *buckets;
+  edfs_dindex_slot_t *slots;
+  uint64_t *free_map;            /* bit set for every free slot */
+};
+
+struct _edfs_dindex
+{
+  edfs_dindex_dir_t **buckets;
+  uint32_t bucket_mask;
+
+  edfs_dindex_dir_t *lru_head;   /* most recently used */
+  edfs_dindex_dir_t *lru_tail;   /* least recently used */
+
+  pthread_mutex_t lock;
+
+  edfs_dindex_stats_t stats;
+};
+
+
+static inline uint32_t
+edfs_dindex_hash(const char *name)
+{
+  /* FNV-1a over the component name. */
+  uint32_t hash = 2166136261u;
+
+  for (int i = 0; i < EDFS_FILENAME_SIZE && name[i]; i++)
+    {
+      hash ^= (unsigned char)name[i];
+      hash *= 16777619u;
+    }
+
+  return hash;
+}
+
+edfs_dindex_t *
+edfs_dindex_new(size_t max_dirs)
+{
+  if (max_dirs == 0)
+    return NULL;
+
+  edfs_dindex_t *dindex = calloc(1, sizeof(edfs_dindex_t));
+  if (!dindex)
+    return NULL;
+
+  uint32_t n_buckets = 1;
+  while (n_buckets < max_dirs)
+    n_buckets <<= 1;
+
+  dindex->buckets = calloc(n_buckets, sizeof(edfs_dindex_dir_t *));
+  if (!dindex->buckets)
+    {
+      free(dindex);
+      return NULL;
+    }
+
+  pthread_mutex_init(&dindex->lock, NULL);
+  dindex->bucket_mask = n_buckets - 1;
+  dindex->stats.max_dirs = max_dirs;
+
+  return dindex;
+}
+
+void
+edfs_dindex_dir_free(edfs_dindex_dir_t *dir)
+{
+  free(dir->buckets);
+  free(dir->slots);
+  free(dir->free_map);
+  free(dir);
+}
+
+void
+edfs_dindex_free(edfs_dindex_t *dindex)
+{
+  if (!dindex)
+    return;
+
+  edfs_dindex_dir_t *dir = dindex->lru_head;
+  while (dir)
+    {
+      edfs_dindex_dir_t *next = dir->lru_next;
+      edfs_dindex_dir_free(dir);
+      dir = next;
+    }
+
+  pthread_mutex_destroy(&dindex->lock);
+  free(dindex->buckets);
+  free(dindex);
+}
+
+
+/*
+ * Index of a single directory
+ */
+
+/* Creates an empty index for a directory of at most @n_slots slots, all
+ * of them absent. Returns NULL on allocation failure.
+ */
+edfs_dindex_dir_t *
+edfs_dindex_dir_new(uint32_t n_slots)
+{
+  edfs_dindex_dir_t *dir = calloc(1, sizeof(edfs_dindex_dir_t));
+  if (!dir)
+    return NULL;
+
+  /* Aim for a load factor of at most 1. */
+  uint32_t n_buckets = 1;
+  while (n_buckets < n_slots)
+    n_buckets <<= 1;
+
+  dir->n_slots = n_slots;
+  dir->bucket_mask = n_buckets - 1;
+  dir->buckets = malloc(n_buckets * sizeof(int32_t));
+  dir->slots = calloc(n_slots, sizeof(edfs_dindex_slot_t));
+  dir->free_map = calloc((n_slots + 63) / 64, sizeof(uint64_t));
+  if (!dir->buckets || !dir->slots || !dir->free_map)
+    {
+      edfs_dindex_dir_free(dir);
+      return NULL;
+    }
+
+  for (uint32_t i = 0; i < n_buckets; i++)
+    dir->buckets[i] = NIL;
+
+  return dir;
+}
+
+static int32_t
+edfs_dindex_dir_find(edfs_dindex_dir_t *dir, const char *name)
+{
+  for (int32_t i = dir->buckets[edfs_dindex_hash(name) & dir->bucket_mask];
+       i != NIL; i = dir->slots[i].chain_next)
+    if (strncmp(dir->slots[i].name, name, EDFS_FILENAME_SIZE) == 0)
+      return i;
+
+  return NIL;
+}
+
+static void
+edfs_dindex_dir_set(edfs_dindex_dir_t *dir, uint32_t slot,
+                    const char *name, edfs_inumber_t inumber)
+{
+  edfs_dindex_slot_t *s = &dir->slots[slot];
+  uint32_t bucket = edfs_dindex_hash(name) & dir->bucket_mask;
+
+  strncpy(s->name, name, EDFS_FILENAME_SIZE - 1);
+  s->name[EDFS_FILENAME_SIZE - 1] = 0;
+  s->inumber = inumber;
+  s->chain_next = dir->buckets[bucket];
+  dir->buckets[bucket] = slot;
+
+  dir->free_map[slot / 64] &= ~(1ULL << (slot % 64));
+}
+
+static void
+edfs_dindex_dir_clear(edfs_dindex_dir_t *dir, uint32_t slot)
+{
+  edfs_dindex_slot_t *s = &dir->slots[slot];
+
+  if (s->inumber == 0)
+    return;
+
+  int32_t *link = &dir->buckets[edfs_dindex_hash(s->name) & dir->bucket_mask];
+  while (*link != slot)
+    link = &dir->slots[*link].chain_next;
+  *link = s->chain_next;
+
+  s->inumber = 0;
+  dir->free_map[slot / 64] |= 1ULL << (slot % 64);
+}
+
+/* Records @entry, which is empty for a free slot, at @slot while
+ * building the index of a directory.
+ */
+void
+edfs_dindex_dir_add(edfs_dindex_dir_t      *dir,
+                    uint32_t                slot,
+                    const edfs_dir_entry_t *entry)
+{
+  if (slot >= dir->n_slots)
+    return;
+
+  if (edfs_dir_entry_is_empty(entry))
+    dir->free_map[slot / 64] |= 1ULL << (slot % 64);
+  else
+    edfs_dindex_dir_set(dir, slot, entry->filename, entry->inumber);
+}
+
+
+/*
+ * Table of directory indexes
+ */
+
+static void
+edfs_dindex_lru_unlink(edfs_dindex_t *dindex, edfs_dindex_dir_t *dir)
+{
+  if (dir->lru_prev)
+    dir->lru_prev->lru_next = dir->lru_next;
+  else
+    dindex->lru_head = dir->lru_next;
+
+  if (dir->lru_next)
+    dir->lru_next->lru_prev = dir->lru_prev;
+  else
+    dindex->lru_tail = dir->lru_prev;
+}
+
+static void
+edfs_dindex_lru_push(edfs_dindex_t *dindex, edfs_dindex_dir_t *dir)
+{
+  dir->lru_prev = NULL;
+  dir->lru_next = dindex->lru_head;
+  if (dindex->lru_head)
+    dindex->lru_head->lru_prev = dir;
+  dindex->lru_head = dir;
+  if (!dindex->lru_tail)
+    dindex->lru_tail = dir;
+}
+
+/* Returns the index of directory @dir_inumber, marking it as most
+ * recently used, or NULL.
+ */
+static edfs_dindex_dir_t *
+edfs_dindex_get(edfs_dindex_t *dindex, edfs_inumber_t dir_inumber)
+{
+  edfs_dindex_dir_t *dir = dindex->buckets[dir_inumber & dindex->bucket_mask];
+
+  while (dir && dir->inumber != dir_inumber)
+    dir = dir->next;
+
+  if (dir && dindex->lru_head != dir)
+    {
+      edfs_dindex_lru_unlink(dindex, dir);
+      edfs_dindex_lru_push(dindex, dir);
+    }
+
+  return dir;
+}
+
+static void
+edfs_dindex_release(edfs_dindex_t *dindex, edfs_dindex_dir_t *dir)
+{
+  edfs_dindex_dir_t **link = &dindex->buckets[dir->inumber & dindex->bucket_mask];
+
+  while (*link != dir)
+    link = &(*link)->next;
+  *link = dir->next;
+
+  edfs_dindex_lru_unlink(dindex, dir);
+  edfs_dindex_dir_free(dir);
+  dindex->stats.n_dirs--;
+}
+
+/* Makes @dir, built by the caller, the index of directory @dir_inumber.
+ * The table takes ownership. If another thread has attached an index
+ * for the directory meanwhile, that one is kept and @dir is freed.
+ */
+void
+edfs_dindex_attach(edfs_dindex_t     *dindex,
+                   edfs_inumber_t     dir_inumber,
+                   edfs_dindex_dir_t *dir)
+{
+  pthread_mutex_lock(&dindex->lock);
+
+  if (edfs_dindex_get(dindex, dir_inumber))
+    {
+      pthread_mutex_unlock(&dindex->lock);
+      edfs_dindex_dir_free(dir);
+      return;
+    }
+
+  if (dindex->stats.n_dirs >= dindex->stats.max_dirs)
+    {
+      edfs_dindex_release(dindex, dindex->lru_tail);
+      dindex->stats.evictions++;
+    }
+
+  uint32_t bucket = dir_inumber & dindex->bucket_mask;
+  dir->inumber = dir_inumber;
+  dir->next = dindex->buckets[bucket];
+  dindex->buckets[bucket] = dir;
+  edfs_dindex_lru_push(dindex, dir);
+
+  dindex->stats.n_dirs++;
+  dindex->stats.builds++;
+
+  pthread_mutex_unlock(&dindex->lock);
+}
+
+/* Drops the index of directory @dir_inumber, if any. Used when the
+ * directory is removed, so that its inumber can be reused safely.
+ */
+void
+edfs_dindex_drop(edfs_dindex_t *dindex, edfs_inumber_t dir_inumber)
+{
+  pthread_mutex_lock(&dindex->lock);
+
+  edfs_dindex_dir_t *dir = edfs_dindex_get(dindex, dir_inumber);
+  if (dir)
+    edfs_dindex_release(dindex, dir);
+
+  pthread_mutex_unlock(&dindex->lock);
+}
+
+/* Looks up @name in directory @dir_inumber. Returns false if the
+ * directory is not indexed. Otherwise *@inumber is set to the inumber
+ * of the entry and *@slot, if not NULL, to its slot; *@inumber is 0 if
+ * the directory has no such entry.
+ */
+bool
+edfs_dindex_lookup(edfs_dindex_t  *dindex,
+                   edfs_inumber_t  dir_inumber,
+                   const char     *name,
+                   edfs_inumber_t *inumber,
+                   uint32_t       *slot)
+{
+  pthread_mutex_lock(&dindex->lock);
+
+  edfs_dindex_dir_t *dir = edfs_dindex_get(dindex, dir_inumber);
+  if (dir)
+    {
+      int32_t i = edfs_dindex_dir_find(dir, name);
+
+      *inumber = i != NIL ? dir->slots[i].inumber : 0;
+      if (slot)
+        *slot = i != NIL ? i : EDFS_DINDEX_NO_SLOT;
+      dindex->stats.lookups++;
+    }
+
+  pthread_mutex_unlock(&dindex->lock);
+
+  return dir != NULL;
+}
+
+/* Finds the lowest free slot of directory @dir_inumber. Returns false
+ * if the directory is not indexed. Otherwise *@slot is set to the slot,
+ * or to EDFS_DINDEX_NO_SLOT if all slots are in use or absent.
+ */
+bool
+edfs_dindex_find_free(edfs_dindex_t  *dindex,
+                      edfs_inumber_t  dir_inumber,
+                      uint32_t       *slot)
+{
+  pthread_mutex_lock(&dindex->lock);
+
+  edfs_dindex_dir_t *dir = edfs_dindex_get(dindex, dir_inumber);
+  if (dir)
+    {
+      *slot = EDFS_DINDEX_NO_SLOT;
+      for (uint32_t i = 0; i < (dir->n_slots + 63) / 64; i++)
+        if (dir->free_map[i])
+          {
+            *slot = i * 64 + __builtin_ctzll(dir->free_map[i]);
+            break;
+          }
+    }
+
+  pthread_mutex_unlock(&dindex->lock);
+
+  return dir != NULL;
+}
+
+/* Marks the @n_slots slots starting at @first, those of a newly added
+ * directory block, as free.
+ */
+void
+edfs_dindex_add_slots(edfs_dindex_t  *dindex,
+                      edfs_inumber_t  dir_inumber,
+                      uint32_t        first,
+                      uint32_t        n_slots)
+{
+  pthread_mutex_lock(&dindex->lock);
+
+  edfs_dindex_dir_t *dir = edfs_dindex_get(dindex, dir_inumber);
+  for (uint32_t i = first; dir && i < first + n_slots && i < dir->n_slots; i++)
+    if (dir->slots[i].inumber == 0)
+      dir->free_map[i / 64] |= 1ULL << (i % 64);
+
+  pthread_mutex_unlock(&dindex->lock);
+}
+
+/* Records the new entry @name, referring to @inumber, at @slot. */
+void
+edfs_dindex_insert(edfs_dindex_t  *dindex,
+                   edfs_inumber_t  dir_inumber,
+                   uint32_t        slot,
+                   const char     *name,
+                   edfs_inumber_t  inumber)
+{
+  pthread_mutex_lock(&dindex->lock);
+
+  edfs_dindex_dir_t *dir = edfs_dindex_get(dindex, dir_inumber);
+  if (dir && slot < dir->n_slots)
+    {
+      edfs_dindex_dir_clear(dir, slot);
+      edfs_dindex_dir_set(dir, slot, name, inumber);
+    }
+
+  pthread_mutex_unlock(&dindex->lock);
+}
+
+/* Records that the entry at @slot has been removed. */
+void
+edfs_dindex_remove(edfs_dindex_t  *dindex,
+                   edfs_inumber_t  dir_inumber,
+                   uint32_t        slot)
+{
+  pthread_mutex_lock(&dindex->lock);
+
+  edfs_dindex_dir_t *dir = edfs_dindex_get(dindex, dir_inumber);
+  if (dir && slot < dir->n_slots)
+    edfs_dindex_dir_clear(dir, slot);
+
+  pthread_mutex_unlock(&dindex->lock);
+}
+
+void
+edfs_dindex_get_stats(edfs_dindex_t *dindex, edfs_dindex_stats_t *stats)
+{
+  pthread_mutex_lock(&dindex->lock);
+  *stats = dindex->stats;
+  pthread_mutex_unlock(&dindex->lock);
+}
@@ -0,0 +1,87 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#ifndef __EDFS_DINDEX_H__
+#define __EDFS_DINDEX_H__
+
+#include "edfs.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+
+/* Directory index, a complete in-memory copy of the names in a
+ * directory: a hash table from name to slot and inumber, and the set
+ * of free slots in the directory blocks. Unlike the dentry cache, the
+ * index of a directory answers every lookup without reading directory
+ * blocks, and finds a free slot for a new entry without a scan.
+ *
+ * Indexes are built by edfs-dir.c on first access to a directory and
+ * kept up to date as entries are added and removed. At most a fixed
+ * number of directories is indexed; the least recently used index is
+ * dropped to make room.
+ *
+ * Slots are numbered as in edfs-dir.h. A slot is absent when the
+ * directory block holding it has not been allocated yet.
+ */
+typedef struct _edfs_dindex edfs_dindex_t;
+typedef struct _edfs_dindex_dir edfs_dindex_dir_t;
+
+typedef struct
+{
+  uint64_t lookups;
+  uint64_t builds;
+  uint64_t evictions;
+
+  size_t n_dirs;
+  size_t max_dirs;
+} edfs_dindex_stats_t;
+
+#define EDFS_DINDEX_DEFAULT_SIZE 1024
+
+/* No free slot, see edfs_dindex_find_free(). */
+#define EDFS_DINDEX_NO_SLOT UINT32_MAX
+
+
+edfs_dindex_t *edfs_dindex_new            (size_t               max_dirs);
+void           edfs_dindex_free           (edfs_dindex_t       *dindex);
+
+edfs_dindex_dir_t *edfs_dindex_dir_new    (uint32_t             n_slots);
+void           edfs_dindex_dir_free       (edfs_dindex_dir_t   *dir);
+void           edfs_dindex_dir_add        (edfs_dindex_dir_t   *dir,
+                                           uint32_t             slot,
+                                           const edfs_dir_entry_t *entry);
+void           edfs_dindex_attach         (edfs_dindex_t       *dindex,
+                                           edfs_inumber_t       dir_inumber,
+                                           edfs_dindex_dir_t   *dir);
+void           edfs_dindex_drop           (edfs_dindex_t       *dindex,
+                                           edfs_inumber_t       dir_inumber);
+
+bool           edfs_dindex_lookup         (edfs_dindex_t       *dindex,
+                                           edfs_inumber_t       dir_inumber,
+                                           const char          *name,
+                                           edfs_inumber_t      *inumber,
+                                           uint32_t            *slot);
+bool           edfs_dindex_find_free      (edfs_dindex_t       *dindex,
+                                           edfs_inumber_t       dir_inumber,
+                                           uint32_t            *slot);
+void           edfs_dindex_add_slots      (edfs_dindex_t       *dindex,
+                                           edfs_inumber_t       dir_inumber,
+                                           uint32_t             first,
+                                           uint32_t             n_slots);
+void           edfs_dindex_insert         (edfs_dindex_t       *dindex,
+                                           edfs_inumber_t       dir_inumber,
+                                           uint32_t             slot,
+                                           const char          *name,
+                                           edfs_inumber_t       inumber);
+void           edfs_dindex_remove         (edfs_dindex_t       *dindex,
+                                           edfs_inumber_t       dir_inumber,
+                                           uint32_t             slot);
+
+void           edfs_dindex_get_stats      (edfs_dindex_t       *dindex,
+                                           edfs_dindex_stats_t *stats);
+
+#endif /* __EDFS_DINDEX_H__ */
@@ -0,0 +1,688 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2017,2019  Leiden University, The Netherlands.
+ */
+
+#include "edfs-dir.h"
+#include "edfs-alloc.h"
+#include "edfs-cache.h"
+#include "edfs-dcache.h"
+#include "edfs-dindex.h"
+#include "edfs-file.h"
+
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+
+
+/* Scans the blocks of @dir_inode for the entry @name, or for the first
+ * free slot if @name is NULL. Returns the slot, and stores the entry in
+ * *@direntry if not NULL, or returns EDFS_DINDEX_NO_SLOT if there is no
+ * such slot. Used for directories that are not indexed.
+ */
+static uint32_t
+edfs_dir_scan(edfs_image_t     *img,
+              edfs_inode_t     *dir_inode,
+              const char       *name,
+              edfs_dir_entry_t *direntry)
+{
+  uint32_t n_dir_entries_block = edfs_get_n_dir_entries_per_block(&img->sb);
+
+  for (uint32_t i = 0; i < EDFS_INODE_N_BLOCKS; i++)
+    {
+      edfs_block_t block = edfs_disk_inode_get_block(&dir_inode->inode, i);
+      if (block == EDFS_BLOCK_INVALID)
+        continue;
+
+      edfs_buf_t *buf = edfs_cache_read(img, block);
+      if (!buf)
+        continue;
+
+      edfs_dir_entry_t *entries = (edfs_dir_entry_t *)buf->data;
+      for (uint32_t j = 0; j < n_dir_entries_block; j++)
+        {
+          bool empty = edfs_dir_entry_is_empty(&entries[j]);
+
+          if (name ? empty || strncmp(entries[j].filename, name, EDFS_FILENAME_SIZE) != 0
+                   : !empty)
+            continue;
+
+          if (direntry)
+            *direntry = entries[j];
+          edfs_cache_release(img, buf);
+          return i * n_dir_entries_block + j;
+        }
+      edfs_cache_release(img, buf);
+    }
+
+  return EDFS_DINDEX_NO_SLOT;
+}
+
+/* Builds the index of the directory @dir_inode, which must be locked.
+ * Returns false on failure.
+ */
+static bool
+edfs_dir_index_build(edfs_image_t *img, edfs_inode_t *dir_inode)
+{
+  uint32_t n_dir_entries_block = edfs_get_n_dir_entries_per_block(&img->sb);
+  edfs_dindex_dir_t *dir = edfs_dindex_dir_new(EDFS_INODE_N_BLOCKS * n_dir_entries_block);
+
+  if (!dir)
+    return false;
+
+  for (uint32_t i = 0; i < EDFS_INODE_N_BLOCKS; i++)
+    {
+      edfs_block_t block = edfs_disk_inode_get_block(&dir_inode->inode, i);
+      if (block == EDFS_BLOCK_INVALID)
+        continue;
+
+      edfs_buf_t *buf = edfs_cache_read(img, block);
+      if (!buf)
+        {
+          edfs_dindex_dir_free(dir);
+          return false;
+        }
+
+      edfs_dir_entry_t *entries = (edfs_dir_entry_t *)buf->data;
+      for (uint32_t j = 0; j < n_dir_entries_block; j++)
+        edfs_dindex_dir_add(dir, i * n_dir_entries_block + j, &entries[j]);
+      edfs_cache_release(img, buf);
+    }
+
+  edfs_dindex_attach(img->dindex, dir_inode->inumber, dir);
+  return true;
+}
+
+/* Looks up @name in the index of @dir_inode, building the index on
+ * first use, see edfs_dindex_lookup(). Returns false if the image keeps
+ * no directory indexes, in which case the directory is to be scanned.
+ */
+static bool
+edfs_dir_index_lookup(edfs_image_t   *img,
+                      edfs_inode_t   *dir_inode,
+                      const char     *name,
+                      edfs_inumber_t *inumber,
+                      uint32_t       *slot)
+{
+  if (!img->dindex)
+    return false;
+
+  if (edfs_dindex_lookup(img->dindex, dir_inode->inumber, name, inumber, slot))
+    return true;
+
+  return edfs_dir_index_build(img, dir_inode) &&
+         edfs_dindex_lookup(img->dindex, dir_inode->inumber, name, inumber, slot);
+}
+
+/* Finds a free slot through the index of @dir_inode, like
+ * edfs_dir_index_lookup().
+ */
+static bool
+edfs_dir_index_find_free(edfs_image_t *img,
+                         edfs_inode_t *dir_inode,
+                         uint32_t     *slot)
+{
+  if (!img->dindex)
+    return false;
+
+  if (edfs_dindex_find_free(img->dindex, dir_inode->inumber, slot))
+    return true;
+
+  return edfs_dir_index_build(img, dir_inode) &&
+         edfs_dindex_find_free(img->dindex, dir_inode->inumber, slot);
+}
+
+/* Directories are protected by a striped set of read-write locks in
+ * the image, selected by inumber. Lookups and scans take the lock of the
+ * directory for reading, modifications for writing. As the lock is not
+ * held between operations, the directory inode is read again once it is
+ * taken.
+ */
+static pthread_rwlock_t *
+edfs_dir_lock(edfs_image_t *img, edfs_inumber_t inumber)
+{
+  return &img->dir_locks[inumber % EDFS_DIR_LOCK_STRIPES];
+}
+
+static bool
+edfs_dir_lock_read(edfs_image_t *img, edfs_inode_t *dir_inode)
+{
+  pthread_rwlock_rdlock(edfs_dir_lock(img, dir_inode->inumber));
+  return edfs_read_inode(img, dir_inode) > 0;
+}
+
+static bool
+edfs_dir_lock_write(edfs_image_t *img, edfs_inode_t *dir_inode)
+{
+  pthread_rwlock_wrlock(edfs_dir_lock(img, dir_inode->inumber));
+  return edfs_read_inode(img, dir_inode) > 0;
+}
+
+static void
+edfs_dir_unlock(edfs_image_t *img, edfs_inode_t *dir_inode)
+{
+  pthread_rwlock_unlock(edfs_dir_lock(img, dir_inode->inumber));
+}
+
+/* Looks up direntry->filename like edfs_dir_lookup(), with the directory
+ * locked.
+ */
+static bool
+edfs_dir_find(edfs_image_t     *img,
+              edfs_inode_t     *dir_inode,
+              edfs_dir_entry_t *direntry)
+{
+  edfs_inumber_t inumber;
+
+  if (img->dcache &&
+      edfs_dcache_lookup(img->dcache, dir_inode->inumber,
+                         direntry->filename, &inumber))
+    {
+      direntry->inumber = inumber;
+      return inumber != 0;
+    }
+
+  bool found;
+  if (edfs_dir_index_lookup(img, dir_inode, direntry->filename, &inumber, NULL))
+    {
+      found = inumber != 0;
+      if (found)
+        direntry->inumber = inumber;
+    }
+  else
+    found = edfs_dir_scan(img, dir_inode, direntry->filename,
+                          direntry) != EDFS_DINDEX_NO_SLOT;
+
+  if (img->dcache)
+    edfs_dcache_insert(img->dcache, dir_inode->inumber, direntry->filename,
+                       found ? direntry->inumber : 0);
+
+  return found;
+}
+
+/* Looks up direntry->filename in the directory @dir_inode and fills in
+ * direntry->inumber if found. The dentry cache is consulted first,
+ * without locking the directory; the outcome of a directory scan,
+ * including a failed one, is recorded in the cache.
+ */
+bool
+edfs_dir_lookup(edfs_image_t     *img,
+                edfs_inode_t     *dir_inode,
+                edfs_dir_entry_t *direntry)
+{
+  edfs_inumber_t inumber;
+
+  if (img->dcache &&
+      edfs_dcache_lookup(img->dcache, dir_inode->inumber,
+                         direntry->filename, &inumber))
+    {
+      direntry->inumber = inumber;
+      return inumber != 0;
+    }
+
+  EDFS_TRACE_BEGIN(span);
+  bool found = edfs_dir_lock_read(img, dir_inode) &&
+               edfs_dir_find(img, dir_inode, direntry);
+  edfs_dir_unlock(img, dir_inode);
+  EDFS_TRACE_END(span, "dir_lookup");
+
+  return found;
+}
+
+/* Calls @func for every entry of the directory @dir_inode, in slot
+ * order, starting at slot @start. Returns 0, or -EIO if a directory
+ * block cannot be read.
+ */
+int
+edfs_dir_iterate(edfs_image_t    *img,
+                 edfs_inode_t    *dir_inode,
+                 uint32_t         start,
+                 edfs_dir_func_t  func,
+                 void            *user_data)
+{
+  uint32_t n_dir_entries_block = edfs_get_n_dir_entries_per_block(&img->sb);
+  int res = 0;
+
+  if (!edfs_dir_lock_read(img, dir_inode))
+    {
+      res = -EIO;
+      goto out;
+    }
+
+  for (uint32_t i = start / n_dir_entries_block; i < EDFS_INODE_N_BLOCKS; i++)
+    {
+      edfs_block_t block = edfs_disk_inode_get_block(&dir_inode->inode, i);
+      if (block == EDFS_BLOCK_INVALID)
+        continue;
+
+      edfs_buf_t *buf = edfs_cache_read(img, block);
+      if (!buf)
+        {
+          res = -EIO;
+          goto out;
+        }
+
+      edfs_dir_entry_t *entries = (edfs_dir_entry_t *)buf->data;
+      uint32_t j = i == start / n_dir_entries_block ? start % n_dir_entries_block : 0;
+
+      for ( ; j < n_dir_entries_block; j++)
+        {
+          if (edfs_dir_entry_is_empty(&entries[j]))
+            continue;
+
+          if (!func(&entries[j], i * n_dir_entries_block + j + 1, user_data))
+            {
+              edfs_cache_release(img, buf);
+              goto out;
+            }
+        }
+      edfs_cache_release(img, buf);
+    }
+
+out:
+  edfs_dir_unlock(img, dir_inode);
+
+  return res;
+}
+
+static bool
+edfs_add_direntry(edfs_image_t *img, edfs_inode_t *parent_inode,
+                    const char *name, edfs_inumber_t inumber)
+{
+  uint32_t n_dir_entries_block = edfs_get_n_dir_entries_per_block(&img->sb);
+  uint32_t slot;
+
+  if (!edfs_dir_index_find_free(img, parent_inode, &slot))
+    slot = edfs_dir_scan(img, parent_inode, NULL, NULL);
+  if (slot == EDFS_DINDEX_NO_SLOT)
+    return false;
+
+  edfs_block_t block = edfs_disk_inode_get_block(&parent_inode->inode,
+                                                 slot / n_dir_entries_block);
+  edfs_buf_t *buf = edfs_cache_read(img, block);
+  if (!buf)
+    return false;
+
+  edfs_dir_entry_t *entry = (edfs_dir_entry_t *)buf->data + slot % n_dir_entries_block;
+  strncpy(entry->filename, name, sizeof(entry->filename));
+  entry->filename[sizeof(entry->filename) - 1] = '\0';
+  entry->inumber = inumber;
+  edfs_cache_mark_dirty(img, buf);
+  edfs_cache_release(img, buf);
+
+  if (img->dindex)
+    edfs_dindex_insert(img->dindex, parent_inode->inumber, slot, name, inumber);
+
+  parent_inode->inode.size += sizeof(edfs_dir_entry_t);
+  edfs_write_inode(img, parent_inode);
+  return true;
+}
+
+/* Adds a new directory block to @parent_inode, holding only the entry
+ * for @name. Fails if all block pointers of the directory are in use
+ * or the file system is full.
+ */
+static bool
+edfs_add_direntry_new_block(edfs_image_t *img, edfs_inode_t *parent_inode,
+                    const char *name, edfs_inumber_t inumber)
+{
+  uint32_t block_size = img->sb.block_size;
+  int slot = -1;
+
+  for (int i = 0; i < EDFS_INODE_N_BLOCKS; i++)
+  {
+    if (edfs_disk_inode_get_block(&parent_inode->inode, i) == EDFS_BLOCK_INVALID)
+    {
+      slot = i;
+      break;
+    }
+  }
+  if (slot < 0)
+    return false;
+
+  /* Keep the blocks of a directory close together. */
+  edfs_block_t goal = edfs_disk_inode_get_block(&parent_inode->inode, 0);
+  edfs_block_t new_block = edfs_allocate_block(img, goal);
+  if (new_block == EDFS_BLOCK_INVALID)
+    return false;
+
+  /* The full block is zeroed, so no stale data is interpreted as
+   * entries.
+   */
+  edfs_buf_t *buf = edfs_cache_new_block(img, new_block);
+  if (!buf)
+  {
+    edfs_free_block(img, new_block);
+    return false;
+  }
+
+  edfs_dir_entry_t *entries = (edfs_dir_entry_t *)buf->data;
+  strncpy(entries[0].filename, name, sizeof(entries[0].filename) - 1);
+  entries[0].inumber = inumber;
+  edfs_cache_release(img, buf);
+
+  edfs_disk_inode_set_block(&parent_inode->inode, slot, new_block);
+  parent_inode->inode.size += block_size;
+  edfs_write_inode(img, parent_inode);
+
+  if (img->dindex)
+    {
+      uint32_t n_dir_entries_block = edfs_get_n_dir_entries_per_block(&img->sb);
+
+      edfs_dindex_add_slots(img->dindex, parent_inode->inumber,
+                            slot * n_dir_entries_block, n_dir_entries_block);
+      edfs_dindex_insert(img->dindex, parent_inode->inumber,
+                         slot * n_dir_entries_block, name, inumber);
+    }
+  return true;
+}
+
+/* Removes the directory entry @name, referring to @inumber, from the
+ * directory @parent_inode. Returns false if no such entry exists.
+ */
+static bool
+edfs_remove_direntry(edfs_image_t *img, edfs_inode_t *parent_inode,
+                     const char *name, edfs_inumber_t inumber)
+{
+  uint32_t n_dir_entries_block = edfs_get_n_dir_entries_per_block(&img->sb);
+  edfs_inumber_t found;
+  uint32_t slot;
+
+  if (!edfs_dir_index_lookup(img, parent_inode, name, &found, &slot))
+    {
+      edfs_dir_entry_t direntry;
+
+      slot = edfs_dir_scan(img, parent_inode, name, &direntry);
+      found = slot != EDFS_DINDEX_NO_SLOT ? direntry.inumber : 0;
+    }
+  if (found == 0 || found != inumber)
+    return false;
+
+  edfs_block_t block = edfs_disk_inode_get_block(&parent_inode->inode,
+                                                 slot / n_dir_entries_block);
+  edfs_buf_t *buf = edfs_cache_read(img, block);
+  if (!buf)
+    return false;
+
+  edfs_dir_entry_t *entries = (edfs_dir_entry_t *)buf->data;
+  memset(&entries[slot % n_dir_entries_block], 0, sizeof(edfs_dir_entry_t));
+  edfs_cache_mark_dirty(img, buf);
+  edfs_cache_release(img, buf);
+
+  if (img->dindex)
+    edfs_dindex_remove(img->dindex, parent_inode->inumber, slot);
+
+  if (parent_inode->inode.size >= sizeof(edfs_dir_entry_t))
+    parent_inode->inode.size -= sizeof(edfs_dir_entry_t);
+  edfs_write_inode(img, parent_inode);
+  return true;
+}
+
+static bool
+edfs_dir_is_empty_locked(edfs_image_t *img, edfs_inode_t *inode)
+{
+  int n_dir_entries_block = edfs_get_n_dir_entries_per_block(&img->sb);
+  bool empty = true;
+
+  for (int i = 0; i < EDFS_INODE_N_BLOCKS && empty; i++)
+  {
+    edfs_block_t block = edfs_disk_inode_get_block(&inode->inode, i);
+    if (block == EDFS_BLOCK_INVALID)
+      continue;
+
+    edfs_buf_t *buf = edfs_cache_read(img, block);
+    if (!buf)
+      return false;
+    edfs_dir_entry_t *entries = (edfs_dir_entry_t *)buf->data;
+
+    for (int j = 0; j < n_dir_entries_block; j++)
+      if (!edfs_dir_entry_is_empty(&entries[j]))
+        {
+          empty = false;
+          break;
+        }
+    edfs_cache_release(img, buf);
+  }
+  return empty;
+}
+
+/* Returns true if the directory @inode does not contain any entries. */
+bool
+edfs_dir_is_empty(edfs_image_t *img, edfs_inode_t *inode)
+{
+  bool empty = edfs_dir_lock_read(img, inode) &&
+               edfs_dir_is_empty_locked(img, inode);
+  edfs_dir_unlock(img, inode);
+
+  return empty;
+}
+
+/* Walks @path component by component, see edfs_find_inode(). */
+static bool
+edfs_find_inode_walk(edfs_image_t *img,
+                     const char *path,
+                     edfs_inode_t *inode)
+{
+  if (strlen(path) == 0 || path[0] != '/')
+    return false;
+
+  edfs_inode_t current_inode;
+  edfs_read_root_inode(img, &current_inode);
+
+  while (path && (path = strchr(path, '/')))
+    {
+      /* Ignore path separator */
+      while (*path == '/')
+        path++;
+
+      /* Find end of new component */
+      char *end = strchr(path, '/');
+      if (!end)
+        {
+          int len = strnlen(path, PATH_MAX);
+          if (len > 0)
+            end = (char *)&path[len];
+          else
+            {
+              /* We are done: return current entry. */
+              *inode = current_inode;
+              return true;
+            }
+        }
+
+      /* Verify length of component is not larger than maximum allowed
+       * filename size.
+       */
+      int len = end - path;
+      if (len >= EDFS_FILENAME_SIZE)
+        return false;
+
+      /* Within the directory pointed to by parent_inode/current_inode,
+       * find the inode number for path, len.
+       */
+      edfs_dir_entry_t direntry = { 0, };
+      strncpy(direntry.filename, path, len);
+      direntry.filename[len] = 0;
+
+      if (direntry.filename[0] != 0)
+        {
+          if (!edfs_disk_inode_is_directory(&current_inode.inode))
+            return false;
+
+          if (!edfs_dir_lookup(img, &current_inode, &direntry))
+            return false;
+
+          /* Found what we were looking for, now get our new inode. */
+          current_inode.inumber = direntry.inumber;
+          edfs_read_inode(img, &current_inode);
+        }
+      path = end;
+    }
+
+  *inode = current_inode;
+
+  return true;
+}
+
+/* Searches the file system hierarchy to find the inode for
+ * the given path. Returns true if the operation succeeded.
+ */
+bool
+edfs_find_inode(edfs_image_t *img,
+                const char *path,
+                edfs_inode_t *inode)
+{
+  EDFS_TRACE_BEGIN(span);
+  bool found = edfs_find_inode_walk(img, path, inode);
+  EDFS_TRACE_END(span, "find_inode");
+
+  return found;
+}
+
+/* Filenames may only consist of alphanumeric characters, dots and
+ * spaces, and must fit in a directory entry including null-terminator.
+ */
+bool
+edfs_valid_basename(const char *basename)
+{
+  if (!basename || strlen(basename) == 0 ||
+      strlen(basename) >= EDFS_FILENAME_SIZE)
+    return false;
+
+  for (size_t i = 0; i < strlen(basename); i++)
+  {
+    char kar = basename[i];
+    if ((!isalnum(kar)) && (kar != '.') && (kar != ' '))
+      return false;
+  }
+  return true;
+}
+
+/* Creates a new inode of @type and registers it as @name in the
+ * directory @parent_inode. Shared by mkdir and create. Returns 0 on
+ * success, error code otherwise.
+ */
+int
+edfs_dir_create(edfs_image_t      *img,
+                edfs_inode_t      *parent_inode,
+                const char        *name,
+                edfs_inode_type_t  type,
+                edfs_inode_t      *new_inode)
+{
+  int res;
+
+  if (!edfs_valid_basename(name))
+    return -EINVAL;
+
+  if (!edfs_disk_inode_is_directory(&parent_inode->inode))
+    return -ENOTDIR;
+
+  /* The directory may have been removed since it was looked up. */
+  if (!edfs_dir_lock_write(img, parent_inode) ||
+      parent_inode->inode.type == EDFS_INODE_TYPE_FREE)
+    {
+      res = -ENOENT;
+      goto out;
+    }
+
+  edfs_dir_entry_t direntry = { 0, };
+  strncpy(direntry.filename, name, EDFS_FILENAME_SIZE - 1);
+  if (edfs_dir_find(img, parent_inode, &direntry))
+    {
+      res = -EEXIST;
+      goto out;
+    }
+
+  res = edfs_new_inode(img, new_inode, type);
+  if (res < 0)
+    goto out;
+
+  if (!edfs_add_direntry(img, parent_inode, name, new_inode->inumber) && !edfs_add_direntry_new_block(img, parent_inode, name, new_inode->inumber))
+  {
+    /* Give back the inumber reserved by edfs_new_inode(). */
+    edfs_clear_inode(img, new_inode);
+    res = -ENOSPC;
+    goto out;
+  }
+  edfs_write_inode(img, new_inode);
+
+  /* Replaces the negative entry left by the lookup above. */
+  if (img->dcache)
+    edfs_dcache_insert(img->dcache, parent_inode->inumber, name,
+                       new_inode->inumber);
+
+out:
+  edfs_dir_unlock(img, parent_inode);
+
+  return res;
+}
+
+/* Removes the entry @name from the directory @parent_inode and releases
+ * @inode, the inode it refers to. Shared by rmdir and unlink, which
+ * validate @inode beforehand; the checks that can be invalidated by
+ * other threads are repeated here. A directory to be removed is locked
+ * as well, so that no entries can be added to it meanwhile.
+ */
+int
+edfs_dir_remove(edfs_image_t *img,
+                edfs_inode_t *parent_inode,
+                const char   *name,
+                edfs_inode_t *inode)
+{
+  bool is_dir = edfs_disk_inode_is_directory(&inode->inode);
+  pthread_rwlock_t *parent_lock = edfs_dir_lock(img, parent_inode->inumber);
+  pthread_rwlock_t *lock = edfs_dir_lock(img, inode->inumber);
+  int res = 0;
+
+  if (!is_dir || lock == parent_lock)
+    pthread_rwlock_wrlock(parent_lock);
+  else if (lock < parent_lock)
+    {
+      pthread_rwlock_wrlock(lock);
+      pthread_rwlock_wrlock(parent_lock);
+    }
+  else
+    {
+      pthread_rwlock_wrlock(parent_lock);
+      pthread_rwlock_wrlock(lock);
+    }
+
+  if (edfs_read_inode(img, parent_inode) <= 0)
+    {
+      res = -EIO;
+      goto out;
+    }
+
+  if (is_dir &&
+      (edfs_read_inode(img, inode) <= 0 || !edfs_dir_is_empty_locked(img, inode)))
+    {
+      res = -ENOTEMPTY;
+      goto out;
+    }
+
+  if (!edfs_remove_direntry(img, parent_inode, name, inode->inumber))
+    {
+      res = -ENOENT;
+      goto out;
+    }
+
+  /* A file that is still open is released when it is closed. */
+  edfs_file_unlink(img, inode);
+
+  if (img->dcache)
+  {
+    edfs_dcache_insert(img->dcache, parent_inode->inumber, name, 0);
+    if (is_dir)
+      edfs_dcache_purge_dir(img->dcache, inode->inumber);
+  }
+  if (img->dindex && is_dir)
+    edfs_dindex_drop(img->dindex, inode->inumber);
+
+out:
+  if (is_dir && lock != parent_lock)
+    pthread_rwlock_unlock(lock);
+  pthread_rwlock_unlock(parent_lock);
+
+  return res;
+}
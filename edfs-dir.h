@@ -0,0 +1,63 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#ifndef __EDFS_DIR_H__
+#define __EDFS_DIR_H__
+
+#include "edfs-common.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/*
+ * Directories
+ *
+ * Operations on directories, addressed by inode and component name
+ * rather than by path, so that they can be shared by the path-based
+ * and the inode-based FUSE frontends. Lookups go through the dentry
+ * cache if the image has one; directory blocks are accessed through
+ * the block cache.
+ *
+ * Entries are numbered by slot: the index of the entry over all
+ * directory blocks, empty ones included. Slot numbers of existing
+ * entries do not change when other entries are added or removed, so
+ * a scan can be resumed at a slot.
+ */
+
+/* Called for every entry by edfs_dir_iterate(). @next is the slot from
+ * which to resume the scan after this entry. Return false to stop.
+ */
+typedef bool (*edfs_dir_func_t) (const edfs_dir_entry_t *entry,
+                                 uint32_t                next,
+                                 void                   *user_data);
+
+bool           edfs_valid_basename        (const char        *basename);
+
+bool           edfs_find_inode            (edfs_image_t      *img,
+                                           const char        *path,
+                                           edfs_inode_t      *inode);
+bool           edfs_dir_lookup            (edfs_image_t      *img,
+                                           edfs_inode_t      *dir_inode,
+                                           edfs_dir_entry_t  *direntry);
+int            edfs_dir_iterate           (edfs_image_t      *img,
+                                           edfs_inode_t      *dir_inode,
+                                           uint32_t           start,
+                                           edfs_dir_func_t    func,
+                                           void              *user_data);
+bool           edfs_dir_is_empty          (edfs_image_t      *img,
+                                           edfs_inode_t      *inode);
+
+int            edfs_dir_create            (edfs_image_t      *img,
+                                           edfs_inode_t      *parent_inode,
+                                           const char        *name,
+                                           edfs_inode_type_t  type,
+                                           edfs_inode_t      *new_inode);
+int            edfs_dir_remove            (edfs_image_t      *img,
+                                           edfs_inode_t      *parent_inode,
+                                           const char        *name,
+                                           edfs_inode_t      *inode);
+
+#endif /* __EDFS_DIR_H__ */
@@ -0,0 +1,669 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#include "edfs-extent.h"
+#include "edfs-alloc.h"
+#include "edfs-cache.h"
+
+#include <string.h>
+#include <errno.h>
+
+
+/* The nodes from the root down to a leaf, level 0 being the root. For
+ * index nodes, @index is the entry followed to the next level; for the
+ * leaf, the position of the first extent past the logical block looked
+ * up.
+ */
+typedef struct
+{
+  int n_levels;
+  edfs_block_t blocks[EDFS_EXTENT_MAX_DEPTH];
+  uint32_t index[EDFS_EXTENT_MAX_DEPTH];
+  uint32_t n_entries[EDFS_EXTENT_MAX_DEPTH];
+} edfs_extent_path_t;
+
+
+/*
+ * Nodes
+ */
+
+static inline edfs_extent_header_t *
+edfs_extent_header(edfs_buf_t *buf)
+{
+  return (edfs_extent_header_t *)buf->data;
+}
+
+static inline edfs_extent_t *
+edfs_extent_entries(edfs_buf_t *buf)
+{
+  return (edfs_extent_t *)(buf->data + sizeof(edfs_extent_header_t));
+}
+
+static inline edfs_extent_index_t *
+edfs_extent_indexes(edfs_buf_t *buf)
+{
+  return (edfs_extent_index_t *)(buf->data + sizeof(edfs_extent_header_t));
+}
+
+static inline size_t
+edfs_extent_entry_size(uint16_t depth)
+{
+  return depth == 0 ? sizeof(edfs_extent_t) : sizeof(edfs_extent_index_t);
+}
+
+static inline uint32_t
+edfs_extent_max_entries(const edfs_super_block_t *sb, uint16_t depth)
+{
+  return depth == 0 ? edfs_get_n_extents_per_block(sb)
+                    : edfs_get_n_extent_indexes_per_block(sb);
+}
+
+/* Returns the first logical block of entry @i of the node in @buf,
+ * which extents and index entries both store first.
+ */
+static inline uint32_t
+edfs_extent_key(edfs_buf_t *buf, uint32_t i)
+{
+  size_t size = edfs_extent_entry_size(edfs_extent_header(buf)->depth);
+  uint32_t key;
+
+  memcpy(&key, buf->data + sizeof(edfs_extent_header_t) + i * size,
+         sizeof(key));
+  return key;
+}
+
+/* Returns the number of entries of the node in @buf of which the first
+ * logical block is at most @logical.
+ */
+static uint32_t
+edfs_extent_search(edfs_buf_t *buf, uint32_t logical)
+{
+  uint32_t lo = 0, hi = edfs_extent_header(buf)->n_entries;
+
+  while (lo < hi)
+    {
+      uint32_t mid = lo + (hi - lo) / 2;
+
+      if (edfs_extent_key(buf, mid) <= logical)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return lo;
+}
+
+/* Inserts @entry at position @pos of the node in @buf, which has room. */
+static void
+edfs_extent_node_insert(edfs_buf_t *buf, uint32_t pos, const void *entry)
+{
+  edfs_extent_header_t *header = edfs_extent_header(buf);
+  size_t size = edfs_extent_entry_size(header->depth);
+  char *entries = buf->data + sizeof(edfs_extent_header_t);
+
+  memmove(entries + (pos + 1) * size, entries + pos * size,
+          (header->n_entries - pos) * size);
+  memcpy(entries + pos * size, entry, size);
+  header->n_entries++;
+}
+
+bool
+edfs_extent_node_is_valid(const edfs_super_block_t   *sb,
+                          const edfs_extent_header_t *header)
+{
+  return header->magic == EDFS_EXTENT_MAGIC &&
+      header->depth < EDFS_EXTENT_MAX_DEPTH &&
+      header->n_entries <= edfs_extent_max_entries(sb, header->depth);
+}
+
+/* Reads node @block, which must be at @depth unless that is -1. Returns
+ * NULL if it cannot be read or is not a valid node.
+ */
+static edfs_buf_t *
+edfs_extent_read_node(edfs_image_t *img, edfs_block_t block, int depth)
+{
+  if (block == EDFS_BLOCK_INVALID || block >= img->sb.n_blocks)
+    return NULL;
+
+  edfs_buf_t *buf = edfs_cache_read(img, block);
+  if (!buf)
+    return NULL;
+
+  edfs_extent_header_t *header = edfs_extent_header(buf);
+  if (!edfs_extent_node_is_valid(&img->sb, header) ||
+      (depth >= 0 && header->depth != depth))
+    {
+      edfs_cache_release(img, buf);
+      return NULL;
+    }
+
+  return buf;
+}
+
+
+/*
+ * Lookup
+ */
+
+/* Stores the extent of @inode that holds logical block @logical in
+ * *@extent. If the block is not mapped, *@extent describes the hole
+ * from @logical up to the next mapped block, with start block
+ * EDFS_BLOCK_INVALID. Returns 0 on success, -EIO if the tree cannot be
+ * read.
+ */
+int
+edfs_extent_lookup(edfs_image_t            *img,
+                   const edfs_disk_inode_t *inode,
+                   uint32_t                 logical,
+                   edfs_extent_t           *extent)
+{
+  edfs_block_t block = edfs_disk_inode_get_block(inode, 0);
+  uint32_t next = UINT32_MAX;   /* first block mapped past the subtree */
+  int depth = -1;
+
+  while (true)
+    {
+      EDFS_TRACE_BEGIN(span);
+      edfs_buf_t *buf = edfs_extent_read_node(img, block, depth);
+      EDFS_TRACE_END(span, "extent");
+      if (!buf)
+        return -EIO;
+
+      edfs_extent_header_t *header = edfs_extent_header(buf);
+      uint32_t n = header->n_entries;
+      uint32_t pos = edfs_extent_search(buf, logical);
+
+      if (header->depth == 0 || n == 0)
+        {
+          edfs_extent_t *entries = edfs_extent_entries(buf);
+
+          if (header->depth == 0 && pos > 0 &&
+              logical - entries[pos - 1].logical < entries[pos - 1].length)
+            *extent = entries[pos - 1];
+          else
+            {
+              if (header->depth == 0 && pos < n && entries[pos].logical < next)
+                next = entries[pos].logical;
+
+              extent->logical = logical;
+              extent->start = EDFS_BLOCK_INVALID;
+              extent->length = next - logical;
+            }
+
+          edfs_cache_release(img, buf);
+          return 0;
+        }
+
+      /* The first child also maps the blocks before its entry. */
+      edfs_extent_index_t *indexes = edfs_extent_indexes(buf);
+      uint32_t child = pos > 0 ? pos - 1 : 0;
+
+      if (child + 1 < n && indexes[child + 1].logical < next)
+        next = indexes[child + 1].logical;
+      block = indexes[child].block;
+      depth = header->depth - 1;
+
+      edfs_cache_release(img, buf);
+    }
+}
+
+/* Fills @path with the nodes leading to the leaf that holds, or would
+ * hold, logical block @logical.
+ */
+static int
+edfs_extent_find_path(edfs_image_t            *img,
+                      const edfs_disk_inode_t *inode,
+                      uint32_t                 logical,
+                      edfs_extent_path_t      *path)
+{
+  edfs_block_t block = edfs_disk_inode_get_block(inode, 0);
+  int depth = -1;
+
+  path->n_levels = 0;
+
+  while (true)
+    {
+      edfs_buf_t *buf = edfs_extent_read_node(img, block, depth);
+      if (!buf)
+        return -EIO;
+
+      edfs_extent_header_t *header = edfs_extent_header(buf);
+      int level = path->n_levels++;
+      uint32_t pos = edfs_extent_search(buf, logical);
+
+      path->blocks[level] = block;
+      path->n_entries[level] = header->n_entries;
+
+      if (header->depth == 0)
+        {
+          path->index[level] = pos;
+          edfs_cache_release(img, buf);
+          return 0;
+        }
+
+      /* Only the root is ever left without entries, as a leaf. */
+      if (header->n_entries == 0)
+        {
+          edfs_cache_release(img, buf);
+          return -EIO;
+        }
+
+      path->index[level] = pos > 0 ? pos - 1 : 0;
+      block = edfs_extent_indexes(buf)[path->index[level]].block;
+      depth = header->depth - 1;
+
+      edfs_cache_release(img, buf);
+    }
+}
+
+
+/*
+ * Mapping blocks
+ */
+
+/* Returns whether extent @b directly follows @a, in the file and on
+ * disk, so that they can be merged.
+ */
+static inline bool
+edfs_extent_follows(const edfs_extent_t *a, const edfs_extent_t *b)
+{
+  return a->logical + a->length == b->logical &&
+      a->start + a->length == b->start &&
+      a->length <= UINT32_MAX - b->length;
+}
+
+/* Turns the direct file @inode into one mapped by an extent tree, of
+ * which the root is allocated near @goal and takes over the direct
+ * block pointers. Returns 0 on success, error code otherwise.
+ */
+int
+edfs_extent_convert(edfs_image_t      *img,
+                    edfs_disk_inode_t *inode,
+                    edfs_block_t       goal)
+{
+  edfs_block_t root = edfs_allocate_block(img, goal);
+  if (root == EDFS_BLOCK_INVALID)
+    return -ENOSPC;
+
+  edfs_buf_t *buf = edfs_cache_new_block(img, root);
+  if (!buf)
+    {
+      edfs_free_block(img, root);
+      return -EIO;
+    }
+
+  edfs_extent_header_t *header = edfs_extent_header(buf);
+  edfs_extent_t *entries = edfs_extent_entries(buf);
+
+  header->magic = EDFS_EXTENT_MAGIC;
+  for (uint32_t i = 0; i < EDFS_INODE_N_BLOCKS; i++)
+    {
+      edfs_extent_t extent = { i, edfs_disk_inode_get_block(inode, i), 1 };
+      uint32_t n = header->n_entries;
+
+      if (extent.start == EDFS_BLOCK_INVALID)
+        continue;
+
+      if (n > 0 && edfs_extent_follows(&entries[n - 1], &extent))
+        entries[n - 1].length++;
+      else
+        edfs_extent_node_insert(buf, n, &extent);
+    }
+
+  edfs_cache_release(img, buf);
+
+  edfs_disk_inode_clear_blocks(inode);
+  edfs_disk_inode_set_block(inode, 0, root);
+  inode->type |= EDFS_INODE_TYPE_EXTENTS;
+
+  return 0;
+}
+
+/* Adds @extent to the leaf at the end of @path, merged with the extent
+ * before or after it where possible. Returns 1 if the leaf is full.
+ */
+static int
+edfs_extent_insert_leaf(edfs_image_t       *img,
+                        edfs_extent_path_t *path,
+                        const edfs_extent_t *extent)
+{
+  int level = path->n_levels - 1;
+  edfs_buf_t *buf = edfs_extent_read_node(img, path->blocks[level], 0);
+  if (!buf)
+    return -EIO;
+
+  edfs_extent_header_t *header = edfs_extent_header(buf);
+  edfs_extent_t *entries = edfs_extent_entries(buf);
+  uint32_t pos = path->index[level];
+  int res = 0;
+
+  if (pos > 0 && edfs_extent_follows(&entries[pos - 1], extent))
+    {
+      entries[pos - 1].length += extent->length;
+
+      if (pos < header->n_entries &&
+          edfs_extent_follows(&entries[pos - 1], &entries[pos]))
+        {
+          entries[pos - 1].length += entries[pos].length;
+          memmove(&entries[pos], &entries[pos + 1],
+                  (header->n_entries - pos - 1) * sizeof(edfs_extent_t));
+          header->n_entries--;
+        }
+    }
+  else if (pos < header->n_entries &&
+           edfs_extent_follows(extent, &entries[pos]))
+    {
+      entries[pos].logical = extent->logical;
+      entries[pos].start = extent->start;
+      entries[pos].length += extent->length;
+    }
+  else if (header->n_entries < edfs_get_n_extents_per_block(&img->sb))
+    edfs_extent_node_insert(buf, pos, extent);
+  else
+    res = 1;
+
+  if (res == 0)
+    edfs_cache_mark_dirty(img, buf);
+  edfs_cache_release(img, buf);
+
+  return res;
+}
+
+/* Moves the entries of the root of @inode to a new node below it, so
+ * that the tree grows by a level and the root has room again.
+ */
+static int
+edfs_extent_grow(edfs_image_t *img, edfs_disk_inode_t *inode)
+{
+  edfs_block_t root = edfs_disk_inode_get_block(inode, 0);
+  edfs_buf_t *buf = edfs_extent_read_node(img, root, -1);
+  if (!buf)
+    return -EIO;
+
+  edfs_extent_header_t *header = edfs_extent_header(buf);
+  if (header->depth + 1 >= EDFS_EXTENT_MAX_DEPTH)
+    {
+      edfs_cache_release(img, buf);
+      return -EFBIG;
+    }
+
+  edfs_block_t block = edfs_allocate_block(img, root);
+  edfs_buf_t *child = block != EDFS_BLOCK_INVALID
+      ? edfs_cache_new_block(img, block) : NULL;
+  if (!child)
+    {
+      edfs_cache_release(img, buf);
+      if (block == EDFS_BLOCK_INVALID)
+        return -ENOSPC;
+      edfs_free_block(img, block);
+      return -EIO;
+    }
+
+  memcpy(child->data, buf->data, img->sb.block_size);
+
+  edfs_extent_index_t index = { 0, block };
+  if (header->n_entries > 0)
+    index.logical = edfs_extent_key(buf, 0);
+
+  header->n_entries = 0;
+  header->depth++;
+  edfs_extent_node_insert(buf, 0, &index);
+
+  edfs_cache_release(img, child);
+  edfs_cache_mark_dirty(img, buf);
+  edfs_cache_release(img, buf);
+
+  return 0;
+}
+
+/* Adds @entry at position @pos of the node at @level of @path, whose
+ * nodes from @level up to @level - @n_splits + 1 are full. Each of
+ * those is split with one of the blocks in @blocks, and the new node
+ * added to its parent.
+ */
+static int
+edfs_extent_split(edfs_image_t       *img,
+                  edfs_extent_path_t *path,
+                  int                 level,
+                  uint32_t            pos,
+                  const void         *entry,
+                  const edfs_block_t *blocks,
+                  int                 n_splits)
+{
+  edfs_extent_t carry;          /* large enough for either kind */
+
+  memcpy(&carry, entry, level == path->n_levels - 1
+         ? sizeof(edfs_extent_t) : sizeof(edfs_extent_index_t));
+
+  for (int i = 0; i < n_splits; i++, level--)
+    {
+      int depth = path->n_levels - 1 - level;
+      edfs_buf_t *buf = edfs_extent_read_node(img, path->blocks[level], depth);
+      edfs_buf_t *new = buf ? edfs_cache_new_block(img, blocks[i]) : NULL;
+      if (!new)
+        {
+          if (buf)
+            edfs_cache_release(img, buf);
+          return -EIO;
+        }
+
+      edfs_extent_header_t *header = edfs_extent_header(buf);
+      edfs_extent_header_t *new_header = edfs_extent_header(new);
+      size_t size = edfs_extent_entry_size(depth);
+      uint32_t n = header->n_entries;
+
+      /* Appending starts a new node, so that files that grow at the
+       * end leave full nodes behind.
+       */
+      uint32_t split = pos == n ? n : n / 2;
+
+      new_header->magic = EDFS_EXTENT_MAGIC;
+      new_header->depth = depth;
+      new_header->n_entries = n - split;
+      memcpy(new->data + sizeof(edfs_extent_header_t),
+             buf->data + sizeof(edfs_extent_header_t) + split * size,
+             (n - split) * size);
+      header->n_entries = split;
+
+      if (pos >= split)
+        edfs_extent_node_insert(new, pos - split, &carry);
+      else
+        edfs_extent_node_insert(buf, pos, &carry);
+
+      /* The new node goes into the parent after the one split. */
+      edfs_extent_index_t index = { edfs_extent_key(new, 0), blocks[i] };
+      memcpy(&carry, &index, sizeof(index));
+      pos = path->index[level - 1] + 1;
+
+      edfs_cache_mark_dirty(img, buf);
+      edfs_cache_release(img, buf);
+      edfs_cache_release(img, new);
+    }
+
+  /* The parent of the last node split has room. */
+  int depth = path->n_levels - 1 - level;
+  edfs_buf_t *buf = edfs_extent_read_node(img, path->blocks[level], depth);
+  if (!buf)
+    return -EIO;
+
+  edfs_extent_node_insert(buf, pos, &carry);
+  edfs_cache_mark_dirty(img, buf);
+  edfs_cache_release(img, buf);
+
+  return 0;
+}
+
+/* Maps logical blocks [@logical, @logical + @length) of @inode, which
+ * are not mapped yet, to the blocks from @start on. Returns 0 on
+ * success, error code otherwise.
+ */
+int
+edfs_extent_insert(edfs_image_t      *img,
+                   edfs_disk_inode_t *inode,
+                   uint32_t           logical,
+                   edfs_block_t       start,
+                   uint32_t           length)
+{
+  edfs_extent_t extent = { logical, start, length };
+  edfs_extent_path_t path;
+
+  while (true)
+    {
+      int res = edfs_extent_find_path(img, inode, logical, &path);
+      if (res < 0)
+        return res;
+
+      res = edfs_extent_insert_leaf(img, &path, &extent);
+      if (res <= 0)
+        return res;
+
+      /* The leaf is full: count the full nodes above it, which are
+       * split along with it. A full root first moves down a level.
+       */
+      int leaf = path.n_levels - 1;
+      int n_splits = 1;
+
+      while (n_splits <= leaf &&
+             path.n_entries[leaf - n_splits] ==
+             edfs_extent_max_entries(&img->sb, n_splits))
+        n_splits++;
+
+      if (n_splits == path.n_levels)
+        {
+          res = edfs_extent_grow(img, inode);
+          if (res < 0)
+            return res;
+          continue;
+        }
+
+      /* All blocks are allocated up front, so a split cannot fail
+       * halfway for lack of space.
+       */
+      edfs_block_t blocks[EDFS_EXTENT_MAX_DEPTH];
+      int n = edfs_allocate_blocks(img, path.blocks[leaf], n_splits, blocks);
+      if (n < n_splits)
+        {
+          edfs_free_blocks(img, blocks, n);
+          return -ENOSPC;
+        }
+
+      return edfs_extent_split(img, &path, leaf, path.index[leaf], &extent,
+                               blocks, n_splits);
+    }
+}
+
+
+/*
+ * Releasing blocks
+ */
+
+/* Frees @length blocks from @start on, unless a damaged extent points
+ * them outside the image.
+ */
+static void
+edfs_extent_free_run(edfs_image_t *img, uint32_t start, uint32_t length)
+{
+  if (start < img->sb.n_blocks && length <= img->sb.n_blocks - start)
+    edfs_free_block_range(img, start, length);
+}
+
+/* Releases the blocks mapped from logical block @from on by the subtree
+ * of node @block at @depth, and its nodes that are left empty. Returns
+ * the number of entries left in the node, or an error code.
+ */
+static int
+edfs_extent_truncate_node(edfs_image_t *img,
+                          edfs_block_t  block,
+                          int           depth,
+                          uint32_t      from)
+{
+  edfs_buf_t *buf = edfs_extent_read_node(img, block, depth);
+  if (!buf)
+    return -EIO;
+
+  edfs_extent_header_t *header = edfs_extent_header(buf);
+  uint32_t n = header->n_entries;
+  bool dirty = false;
+  int res = 0;
+
+  while (n > 0 && header->depth == 0)
+    {
+      edfs_extent_t *extent = &edfs_extent_entries(buf)[n - 1];
+
+      if (extent->logical >= from)
+        {
+          edfs_extent_free_run(img, extent->start, extent->length);
+          n--;
+          continue;
+        }
+
+      uint32_t keep = from - extent->logical;
+      if (extent->length > keep)
+        {
+          edfs_extent_free_run(img, extent->start + keep,
+                               extent->length - keep);
+          extent->length = keep;
+          dirty = true;
+        }
+      break;
+    }
+
+  while (n > 0 && header->depth > 0)
+    {
+      edfs_extent_index_t *index = &edfs_extent_indexes(buf)[n - 1];
+
+      res = edfs_extent_truncate_node(img, index->block, header->depth - 1,
+                                      from);
+      if (res < 0)
+        break;
+
+      if (res == 0)
+        {
+          edfs_free_block(img, index->block);
+          n--;
+        }
+
+      /* Children before this one map blocks before @from only. */
+      if (res > 0 || index->logical < from)
+        break;
+    }
+
+  if (n != header->n_entries)
+    {
+      header->n_entries = n;
+      dirty = true;
+    }
+  if (dirty)
+    edfs_cache_mark_dirty(img, buf);
+
+  /* Released before the caller frees the node, so that it is dropped
+   * from the cache along with the block.
+   */
+  edfs_cache_release(img, buf);
+
+  return res < 0 ? res : (int)n;
+}
+
+/* Releases the blocks of @inode from logical block @from on, and the
+ * nodes that no longer map anything. Without any left, the root goes
+ * too and the inode reverts to direct block pointers. Returns 0 on
+ * success, error code otherwise.
+ */
+int
+edfs_extent_truncate(edfs_image_t      *img,
+                     edfs_disk_inode_t *inode,
+                     uint32_t           from)
+{
+  edfs_block_t root = edfs_disk_inode_get_block(inode, 0);
+  int res = edfs_extent_truncate_node(img, root, -1, from);
+  if (res != 0)
+    return res < 0 ? res : 0;
+
+  edfs_free_block(img, root);
+  edfs_disk_inode_clear_blocks(inode);
+  inode->type &= ~EDFS_INODE_TYPE_EXTENTS;
+
+  return 0;
+}
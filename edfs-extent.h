@@ -0,0 +1,56 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#ifndef __EDFS_EXTENT_H__
+#define __EDFS_EXTENT_H__
+
+#include "edfs-common.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/*
+ * Extent trees
+ *
+ * Routines to map files of images from version 2 on by an extent tree, see
+ * edfs.h for the format. A lookup descends from the root to a leaf,
+ * searching every node on the way by binary search, so it costs one
+ * block read per level of the tree, and the nodes come from the block
+ * cache. Files are allocated in long runs, so even large files need
+ * few extents and rarely more than a root.
+ *
+ * Nodes are split when full: the upper half of the entries moves to a
+ * new node, or only the new entry when it is added at the end, as it
+ * is when a file is appended to. When the root is full, its entries
+ * move to a new node below it, so the root block of a file never
+ * changes. Releasing the blocks at the end of a file frees nodes that
+ * no longer map anything; when none are left, the file reverts to
+ * direct block pointers.
+ *
+ * The caller serializes changes to the tree of a file with lookups,
+ * as the file lock does, see edfs-file.h.
+ */
+
+int            edfs_extent_lookup         (edfs_image_t            *img,
+                                           const edfs_disk_inode_t *inode,
+                                           uint32_t                 logical,
+                                           edfs_extent_t           *extent);
+int            edfs_extent_convert        (edfs_image_t            *img,
+                                           edfs_disk_inode_t       *inode,
+                                           edfs_block_t             goal);
+int            edfs_extent_insert         (edfs_image_t            *img,
+                                           edfs_disk_inode_t       *inode,
+                                           uint32_t                 logical,
+                                           edfs_block_t             start,
+                                           uint32_t                 length);
+int            edfs_extent_truncate       (edfs_image_t            *img,
+                                           edfs_disk_inode_t       *inode,
+                                           uint32_t                 from);
+
+bool           edfs_extent_node_is_valid  (const edfs_super_block_t    *sb,
+                                           const edfs_extent_header_t  *header);
+
+#endif /* __EDFS_EXTENT_H__ */
@@ -0,0 +1,1582 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#include "edfs-file.h"
+#include "edfs-cache.h"
+#include "edfs-extent.h"
+#include "edfs-readahead.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+
+
+/* Upper bound on the number of blocks written by a single request. */
+#define EDFS_MAX_IOV 256
+
+
+/*
+ * File table
+ */
+
+static inline edfs_file_t **
+edfs_file_bucket(edfs_image_t *img, edfs_inumber_t inumber)
+{
+  return &img->file_table[inumber % EDFS_FILE_TABLE_SIZE];
+}
+
+static bool
+edfs_file_table_init(edfs_image_t *img)
+{
+  if (img->file_table)
+    return true;
+
+  img->file_table = calloc(EDFS_FILE_TABLE_SIZE, sizeof(edfs_file_t *));
+  if (!img->file_table)
+    return false;
+
+  if (img->writeback_limit == 0)
+    img->writeback_limit = EDFS_WRITEBACK_DEFAULT_LIMIT;
+
+  return true;
+}
+
+/* Returns the file object of @inumber, if there is one. Does not take
+ * a reference. Called with the file table lock held.
+ */
+static edfs_file_t *
+edfs_file_lookup(edfs_image_t *img, edfs_inumber_t inumber)
+{
+  if (!img->file_table)
+    return NULL;
+
+  for (edfs_file_t *file = *edfs_file_bucket(img, inumber); file;
+       file = file->next)
+    if (file->inode.inumber == inumber)
+      return file;
+
+  return NULL;
+}
+
+/* Returns the file object for the inode @inode->inumber with a new
+ * reference, creating it if it does not exist yet. A new file object
+ * starts from the inode as it is in the inode table, which may have
+ * changed since @inode was read. Returns NULL if the inode has been
+ * cleared in the meantime, or on allocation failure.
+ */
+edfs_file_t *
+edfs_file_get(edfs_image_t *img, const edfs_inode_t *inode)
+{
+  edfs_file_t *file = NULL;
+
+  pthread_mutex_lock(&img->file_table_lock);
+
+  if (!edfs_file_table_init(img))
+    goto out;
+
+  file = edfs_file_lookup(img, inode->inumber);
+  if (file)
+    {
+      file->refcount++;
+      goto out;
+    }
+
+  file = calloc(1, sizeof(edfs_file_t));
+  if (!file)
+    goto out;
+
+  file->inode.inumber = inode->inumber;
+  if (edfs_read_inode(img, &file->inode) <= 0 ||
+      file->inode.inode.type == EDFS_INODE_TYPE_FREE)
+    {
+      free(file);
+      file = NULL;
+      goto out;
+    }
+
+  file->refcount = 1;
+  file->rsv = (edfs_block_reservation_t)EDFS_BLOCK_RESERVATION_INIT;
+  file->goal = EDFS_BLOCK_INVALID;
+  pthread_rwlock_init(&file->lock, NULL);
+  pthread_mutex_init(&file->map_lock, NULL);
+
+  edfs_file_t **bucket = edfs_file_bucket(img, inode->inumber);
+  file->next = *bucket;
+  *bucket = file;
+
+out:
+  pthread_mutex_unlock(&img->file_table_lock);
+
+  return file;
+}
+
+/* Copies the inode of @file, which is authoritative while the file
+ * object exists, to @inode.
+ */
+void
+edfs_file_stat(edfs_file_t *file, edfs_inode_t *inode)
+{
+  pthread_rwlock_rdlock(&file->lock);
+  *inode = file->inode;
+  pthread_rwlock_unlock(&file->lock);
+}
+
+/* If @inumber has a file object, copies its inode to @inode and returns
+ * true. Otherwise the inode table is up to date.
+ */
+bool
+edfs_file_lookup_inode(edfs_image_t   *img,
+                       edfs_inumber_t  inumber,
+                       edfs_inode_t   *inode)
+{
+  pthread_mutex_lock(&img->file_table_lock);
+
+  edfs_file_t *file = edfs_file_lookup(img, inumber);
+  if (file)
+    file->refcount++;
+
+  pthread_mutex_unlock(&img->file_table_lock);
+
+  if (!file)
+    return false;
+
+  edfs_file_stat(file, inode);
+  edfs_file_put(img, file);
+
+  return true;
+}
+
+static void
+edfs_file_drop_dirty(edfs_image_t *img, edfs_file_t *file, uint32_t from)
+{
+  uint32_t kept = 0;
+
+  for (uint32_t i = 0; i < file->n_dirty; i++)
+    {
+      edfs_dirty_block_t *dirty = &file->dirty[i];
+
+      if (dirty->logical < from)
+        {
+          file->dirty[kept++] = *dirty;
+          continue;
+        }
+
+      edfs_writeback_account(img, -1,
+                             dirty->physical == EDFS_BLOCK_INVALID ? -1 : 0);
+      free(dirty->data);
+    }
+
+  file->n_dirty = kept;
+}
+
+static void
+edfs_file_map_invalidate(edfs_file_t *file)
+{
+  for (int i = 0; i < EDFS_INODE_N_BLOCKS; i++)
+    {
+      free(file->map[i]);
+      file->map[i] = NULL;
+    }
+}
+
+static int edfs_file_flush_locked (edfs_image_t *img,
+                                   edfs_file_t  *file);
+
+/* Writes out or, for an unlinked file, releases the file and frees the
+ * file object. Called with the file table lock held, once no references
+ * are left. Normally edfs_file_put() has written the file out already,
+ * so that no I/O is done under the lock.
+ */
+static void
+edfs_file_close(edfs_image_t *img, edfs_file_t *file)
+{
+  edfs_file_t **link = edfs_file_bucket(img, file->inode.inumber);
+
+  while (*link != file)
+    link = &(*link)->next;
+  *link = file->next;
+
+  if (file->unlinked)
+    {
+      edfs_file_drop_dirty(img, file, 0);
+      edfs_reservation_release(img, &file->rsv);
+      edfs_inode_release_blocks(img, &file->inode);
+      edfs_clear_inode(img, &file->inode);
+    }
+  else
+    {
+      int res = edfs_file_flush_locked(img, file);
+      if (res < 0)
+        fprintf(stderr, "error: inode %u: cannot write back: %s\n",
+                file->inode.inumber, strerror(-res));
+      edfs_file_drop_dirty(img, file, 0);
+      edfs_reservation_release(img, &file->rsv);
+    }
+
+  edfs_file_map_invalidate(file);
+  pthread_rwlock_destroy(&file->lock);
+  pthread_mutex_destroy(&file->map_lock);
+  free(file->dirty);
+  free(file);
+}
+
+/* Drops a reference. When the last reference goes away, the file is
+ * flushed and the file object is freed.
+ *
+ * The last reference is kept while the file is flushed, without the
+ * file table lock, so that other files can be opened and closed in the
+ * meantime. The file stays in the table, so that opening it again
+ * finds it rather than a stale inode. It is flushed again if it was
+ * written to through such a reference.
+ */
+void
+edfs_file_put(edfs_image_t *img, edfs_file_t *file)
+{
+  int res = 0;
+
+  pthread_mutex_lock(&img->file_table_lock);
+
+  while (file->refcount == 1 && !file->unlinked && res == 0 &&
+         (file->n_dirty > 0 || file->inode_dirty))
+    {
+      pthread_mutex_unlock(&img->file_table_lock);
+
+      res = edfs_file_flush(img, file);
+
+      pthread_mutex_lock(&img->file_table_lock);
+    }
+
+  if (--file->refcount == 0)
+    edfs_file_close(img, file);
+
+  pthread_mutex_unlock(&img->file_table_lock);
+}
+
+/* Takes another reference to @file, of which the caller holds one. */
+void
+edfs_file_ref(edfs_image_t *img, edfs_file_t *file)
+{
+  pthread_mutex_lock(&img->file_table_lock);
+  file->refcount++;
+  pthread_mutex_unlock(&img->file_table_lock);
+}
+
+/* Releases @inode, of which the directory entry has been removed. If
+ * the file is open, this is deferred until it is closed.
+ */
+void
+edfs_file_unlink(edfs_image_t *img, edfs_inode_t *inode)
+{
+  pthread_mutex_lock(&img->file_table_lock);
+
+  edfs_file_t *file = edfs_file_lookup(img, inode->inumber);
+  if (file)
+    file->unlinked = true;
+  else if (edfs_read_inode(img, inode) > 0)
+    {
+      edfs_inode_release_blocks(img, inode);
+      edfs_clear_inode(img, inode);
+    }
+
+  pthread_mutex_unlock(&img->file_table_lock);
+}
+
+/* Flushes and frees all file objects, used when closing the image. */
+void
+edfs_file_table_free(edfs_image_t *img)
+{
+  if (!img->file_table)
+    return;
+
+  for (int i = 0; i < EDFS_FILE_TABLE_SIZE; i++)
+    while (img->file_table[i])
+      edfs_file_close(img, img->file_table[i]);
+
+  free(img->file_table);
+  img->file_table = NULL;
+}
+
+
+/*
+ * Block mapping
+ */
+
+/* Largest number of blocks a file can have: what indirect blocks can
+ * map or, with extent trees, what the file size can express.
+ */
+uint32_t
+edfs_file_max_blocks(edfs_image_t *img)
+{
+  if (edfs_super_block_has_extents(&img->sb))
+    return UINT32_MAX / img->sb.block_size;
+
+  return EDFS_INODE_N_BLOCKS * edfs_get_n_blocks_per_indirect_block(&img->sb);
+}
+
+/* Maps logical block @logical of @file to a block on disk, stored in
+ * *@block. Holes and blocks past the mapping are EDFS_BLOCK_INVALID.
+ * The entries of an indirect block are copied into the block map of
+ * the file on first use. The file must be locked for writing, or its
+ * block map loaded with edfs_file_load_map(). An extent tree is looked
+ * up through the block cache instead, which needs no more than a read
+ * lock. Returns 0 on success, error code otherwise.
+ */
+int
+edfs_file_bmap(edfs_image_t *img,
+               edfs_file_t  *file,
+               uint32_t      logical,
+               edfs_block_t *block)
+{
+  const edfs_inode_t *inode = &file->inode;
+
+  *block = EDFS_BLOCK_INVALID;
+
+  if (edfs_disk_inode_has_extents(&inode->inode))
+    {
+      edfs_extent_t extent;
+      int res = edfs_extent_lookup(img, &inode->inode, logical, &extent);
+
+      if (res == 0 && extent.start != EDFS_BLOCK_INVALID)
+        *block = extent.start + (logical - extent.logical);
+      return res;
+    }
+
+  if (!edfs_disk_inode_has_indirect(&inode->inode))
+    {
+      if (logical < EDFS_INODE_N_BLOCKS)
+        *block = edfs_disk_inode_get_block(&inode->inode, logical);
+      return 0;
+    }
+
+  uint32_t n_per_block = edfs_get_n_blocks_per_indirect_block(&img->sb);
+  uint32_t index = logical / n_per_block;
+
+  if (index >= EDFS_INODE_N_BLOCKS ||
+      edfs_disk_inode_get_block(&inode->inode, index) == EDFS_BLOCK_INVALID)
+    return 0;
+
+  if (!file->map[index])
+    {
+      EDFS_TRACE_BEGIN(span);
+      edfs_block_t indirect = edfs_disk_inode_get_block(&inode->inode, index);
+      edfs_buf_t *buf = edfs_cache_read(img, indirect);
+      if (!buf)
+        return -EIO;
+
+      file->map[index] = malloc(img->sb.block_size);
+      if (file->map[index])
+        memcpy(file->map[index], buf->data, img->sb.block_size);
+      edfs_cache_release(img, buf);
+      EDFS_TRACE_END(span, "indirect");
+
+      if (!file->map[index])
+        return -ENOMEM;
+    }
+
+  *block = file->map[index][logical % n_per_block];
+
+  return 0;
+}
+
+/* Maps @logical like edfs_file_bmap(), but looks up the extent holding
+ * it only if that is not the one in @cursor, which is then replaced.
+ * Walks over consecutive blocks look up every extent once this way.
+ * Start with a zero @cursor; files without extent trees get a single
+ * block extent for every block.
+ */
+static int
+edfs_file_bmap_cursor(edfs_image_t  *img,
+                      edfs_file_t   *file,
+                      edfs_extent_t *cursor,
+                      uint32_t       logical,
+                      edfs_block_t  *block)
+{
+  int res = 0;
+
+  if (logical - cursor->logical >= cursor->length)
+    {
+      if (edfs_disk_inode_has_extents(&file->inode.inode))
+        res = edfs_extent_lookup(img, &file->inode.inode, logical, cursor);
+      else
+        {
+          edfs_block_t start;
+
+          res = edfs_file_bmap(img, file, logical, &start);
+          *cursor = (edfs_extent_t){ logical, start, 1 };
+        }
+
+      if (res < 0)
+        {
+          cursor->length = 0;
+          return res;
+        }
+    }
+
+  *block = EDFS_BLOCK_INVALID;
+  if (cursor->start != EDFS_BLOCK_INVALID)
+    *block = cursor->start + (logical - cursor->logical);
+
+  return 0;
+}
+
+/* Loads the block map of @file completely, so that readers holding the
+ * file lock for reading can use it. Readers may race to load it, which
+ * the map lock serializes. Indirect blocks that are not cached are read
+ * as one batch.
+ */
+static int
+edfs_file_load_map(edfs_image_t *img, edfs_file_t *file)
+{
+  uint32_t n_per_block = edfs_get_n_blocks_per_indirect_block(&img->sb);
+  edfs_block_t missing[EDFS_INODE_N_BLOCKS];
+  int n_missing = 0;
+  edfs_block_t block;
+  int res = 0;
+
+  /* Extent trees are read through the block cache as they are used. */
+  if (!edfs_disk_inode_has_indirect(&file->inode.inode))
+    return 0;
+
+  pthread_mutex_lock(&file->map_lock);
+
+  for (uint32_t index = 0; index < EDFS_INODE_N_BLOCKS; index++)
+    if (!file->map[index] &&
+        edfs_disk_inode_get_block(&file->inode.inode, index) != EDFS_BLOCK_INVALID)
+      missing[n_missing++] = edfs_disk_inode_get_block(&file->inode.inode, index);
+
+  /* Failures show up below. */
+  if (n_missing > 1)
+    edfs_cache_load(img, missing, n_missing);
+  for (uint32_t index = 0; index < EDFS_INODE_N_BLOCKS && res == 0; index++)
+    res = edfs_file_bmap(img, file, index * n_per_block, &block);
+  pthread_mutex_unlock(&file->map_lock);
+
+  return res;
+}
+
+/* Makes sure the mapping of @file can hold logical blocks up to and
+ * including @last: converts a direct file to an indirect one, or to an
+ * extent-mapped one from version 2 on, when it outgrows its direct
+ * block pointers, and allocates missing indirect blocks. Extent trees
+ * allocate their nodes as blocks are mapped.
+ */
+static int
+edfs_file_prepare_map(edfs_image_t *img, edfs_file_t *file, uint32_t last)
+{
+  edfs_inode_t *inode = &file->inode;
+  uint32_t n_per_block = edfs_get_n_blocks_per_indirect_block(&img->sb);
+
+  if (last >= edfs_file_max_blocks(img))
+    return -EFBIG;
+
+  if (edfs_disk_inode_has_extents(&inode->inode))
+    return 0;
+
+  if (!edfs_disk_inode_has_indirect(&inode->inode) &&
+      edfs_super_block_has_extents(&img->sb))
+    {
+      if (last < EDFS_INODE_N_BLOCKS)
+        return 0;
+
+      edfs_block_t goal = edfs_disk_inode_get_block(&inode->inode, 0);
+      if (goal == EDFS_BLOCK_INVALID)
+        goal = file->goal;
+      int res = edfs_extent_convert(img, &inode->inode, goal);
+      if (res == 0)
+        file->inode_dirty = true;
+      return res;
+    }
+
+  if (!edfs_disk_inode_has_indirect(&inode->inode))
+    {
+      if (last < EDFS_INODE_N_BLOCKS)
+        return 0;
+
+      /* The direct block pointers become the first entries of the new
+       * indirect block.
+       */
+      edfs_block_t goal = edfs_disk_inode_get_block(&inode->inode, 0);
+      if (goal == EDFS_BLOCK_INVALID)
+        goal = file->goal;
+      edfs_block_t indirect = edfs_allocate_block(img, goal);
+      if (indirect == EDFS_BLOCK_INVALID)
+        return -ENOSPC;
+
+      edfs_buf_t *buf = edfs_cache_new_block(img, indirect);
+      if (!buf)
+        {
+          edfs_free_block(img, indirect);
+          return -EIO;
+        }
+
+      memcpy(buf->data, inode->inode.blocks_lo,
+             sizeof(inode->inode.blocks_lo));
+      edfs_cache_release(img, buf);
+
+      edfs_disk_inode_clear_blocks(&inode->inode);
+      edfs_disk_inode_set_block(&inode->inode, 0, indirect);
+      inode->inode.type |= EDFS_INODE_TYPE_INDIRECT;
+      file->inode_dirty = true;
+    }
+
+  for (uint32_t index = 0; index <= last / n_per_block; index++)
+    {
+      if (edfs_disk_inode_get_block(&inode->inode, index) != EDFS_BLOCK_INVALID)
+        continue;
+
+      edfs_block_t goal = index > 0
+          ? edfs_disk_inode_get_block(&inode->inode, index - 1) : file->goal;
+      edfs_block_t indirect = edfs_allocate_block(img, goal);
+      if (indirect == EDFS_BLOCK_INVALID)
+        return -ENOSPC;
+
+      edfs_buf_t *buf = edfs_cache_new_block(img, indirect);
+      if (!buf)
+        {
+          edfs_free_block(img, indirect);
+          return -EIO;
+        }
+      edfs_cache_release(img, buf);
+
+      edfs_disk_inode_set_block(&inode->inode, index, indirect);
+      file->inode_dirty = true;
+    }
+
+  return 0;
+}
+
+/* Records that logical blocks [first, first + n) of @file are stored in
+ * @blocks. The mapping must have been prepared. Sets *@n_mapped to the
+ * number of blocks from the start of @blocks that are mapped, which is
+ * less than @n only on failure.
+ */
+static int
+edfs_file_map_blocks(edfs_image_t *img, edfs_file_t *file, uint32_t first,
+                     const edfs_block_t *blocks, uint32_t n,
+                     uint32_t *n_mapped)
+{
+  edfs_inode_t *inode = &file->inode;
+
+  *n_mapped = 0;
+
+  /* Every run of contiguous blocks becomes an extent. */
+  if (edfs_disk_inode_has_extents(&inode->inode))
+    {
+      uint32_t i = 0;
+
+      while (i < n)
+        {
+          uint32_t start = i++;
+
+          while (i < n && blocks[i] == blocks[i - 1] + 1)
+            i++;
+
+          int res = edfs_extent_insert(img, &inode->inode, first + start,
+                                       blocks[start], i - start);
+          if (res < 0)
+            return res;
+          *n_mapped = i;
+        }
+
+      return 0;
+    }
+
+  if (!edfs_disk_inode_has_indirect(&inode->inode))
+    {
+      for (uint32_t i = 0; i < n; i++)
+        edfs_disk_inode_set_block(&inode->inode, first + i, blocks[i]);
+      file->inode_dirty = true;
+      *n_mapped = n;
+      return 0;
+    }
+
+  uint32_t n_per_block = edfs_get_n_blocks_per_indirect_block(&img->sb);
+  uint32_t i = 0;
+
+  while (i < n)
+    {
+      uint32_t logical = first + i;
+      uint32_t index = logical / n_per_block;
+      uint32_t entry = logical % n_per_block;
+      uint32_t count = n - i < n_per_block - entry ? n - i : n_per_block - entry;
+
+      edfs_block_t indirect = edfs_disk_inode_get_block(&inode->inode, index);
+      edfs_buf_t *buf = edfs_cache_read(img, indirect);
+      if (!buf)
+        return -EIO;
+
+      /* Indirect blocks only occur in version 1 images, so the block
+       * numbers fit their 16-bit entries.
+       */
+      edfs_block16_t *entries = (edfs_block16_t *)buf->data;
+      for (uint32_t j = 0; j < count; j++)
+        entries[entry + j] = blocks[i + j];
+      edfs_cache_mark_dirty(img, buf);
+      edfs_cache_release(img, buf);
+
+      if (file->map[index])
+        for (uint32_t j = 0; j < count; j++)
+          file->map[index][entry + j] = blocks[i + j];
+
+      i += count;
+      *n_mapped = i;
+    }
+
+  return 0;
+}
+
+/* Releases the mapped blocks of @file from logical block @from onwards,
+ * including indirect blocks and extent tree nodes that no longer map
+ * anything.
+ */
+static int
+edfs_file_unmap_from(edfs_image_t *img, edfs_file_t *file, uint32_t from)
+{
+  edfs_inode_t *inode = &file->inode;
+
+  if (edfs_disk_inode_has_extents(&inode->inode))
+    {
+      int res = edfs_extent_truncate(img, &inode->inode, from);
+
+      /* The inode changes when the tree is released entirely. */
+      if (!edfs_disk_inode_has_extents(&inode->inode))
+        file->inode_dirty = true;
+      return res;
+    }
+
+  if (!edfs_disk_inode_has_indirect(&inode->inode))
+    {
+      for (uint32_t i = from; i < EDFS_INODE_N_BLOCKS; i++)
+        if (edfs_disk_inode_get_block(&inode->inode, i) != EDFS_BLOCK_INVALID)
+          {
+            edfs_free_block(img, edfs_disk_inode_get_block(&inode->inode, i));
+            edfs_disk_inode_set_block(&inode->inode, i, EDFS_BLOCK_INVALID);
+            file->inode_dirty = true;
+          }
+      return 0;
+    }
+
+  uint32_t n_per_block = edfs_get_n_blocks_per_indirect_block(&img->sb);
+
+  edfs_file_map_invalidate(file);
+
+  for (uint32_t index = 0; index < EDFS_INODE_N_BLOCKS; index++)
+    {
+      edfs_block_t indirect = edfs_disk_inode_get_block(&inode->inode, index);
+      uint32_t base = index * n_per_block;
+
+      if (indirect == EDFS_BLOCK_INVALID || base + n_per_block <= from)
+        continue;
+
+      edfs_buf_t *buf = edfs_cache_read(img, indirect);
+      if (!buf)
+        return -EIO;
+
+      edfs_block16_t *entries = (edfs_block16_t *)buf->data;
+      uint32_t entry = from > base ? from - base : 0;
+
+      for (uint32_t j = entry; j < n_per_block; j++)
+        if (entries[j] != EDFS_BLOCK_INVALID)
+          edfs_free_block(img, entries[j]);
+      memset(&entries[entry], 0,
+             (n_per_block - entry) * sizeof(edfs_block16_t));
+      edfs_cache_mark_dirty(img, buf);
+      edfs_cache_release(img, buf);
+
+      /* The buffer is released first, so that it is dropped from the
+       * cache along with the block.
+       */
+      if (entry == 0)
+        {
+          edfs_free_block(img, indirect);
+          edfs_disk_inode_set_block(&inode->inode, index, EDFS_BLOCK_INVALID);
+          file->inode_dirty = true;
+        }
+    }
+
+  return 0;
+}
+
+/* Releases all blocks allocated to @inode, including the data blocks
+ * referenced from its indirect blocks. @inode itself is not written.
+ */
+void
+edfs_inode_release_blocks(edfs_image_t *img, edfs_inode_t *inode)
+{
+  edfs_file_t file = { .inode = *inode };
+
+  edfs_file_unmap_from(img, &file, 0);
+  *inode = file.inode;
+}
+
+
+/*
+ * Write-back buffer
+ */
+
+/* Returns the index of the first dirty block with a logical block
+ * number of at least @logical.
+ */
+static uint32_t
+edfs_file_dirty_search(const edfs_file_t *file, uint32_t logical)
+{
+  uint32_t lo = 0, hi = file->n_dirty;
+
+  while (lo < hi)
+    {
+      uint32_t mid = lo + (hi - lo) / 2;
+
+      if (file->dirty[mid].logical < logical)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return lo;
+}
+
+static edfs_dirty_block_t *
+edfs_file_dirty_find(const edfs_file_t *file, uint32_t logical)
+{
+  uint32_t i = edfs_file_dirty_search(file, logical);
+
+  if (i < file->n_dirty && file->dirty[i].logical == logical)
+    return &file->dirty[i];
+
+  return NULL;
+}
+
+/* Returns the buffer for logical block @logical, adding it to the
+ * write-back buffer if needed. If @fill is set, a newly added buffer
+ * holds the current contents of the block; otherwise the caller is
+ * going to overwrite it completely. Returns NULL and sets *@res on
+ * failure.
+ */
+static char *
+edfs_file_dirty_block(edfs_image_t *img, edfs_file_t *file,
+                      uint32_t logical, bool fill, int *res)
+{
+  uint32_t i = edfs_file_dirty_search(file, logical);
+
+  if (i < file->n_dirty && file->dirty[i].logical == logical)
+    return file->dirty[i].data;
+
+  edfs_block_t physical;
+  *res = edfs_file_bmap(img, file, logical, &physical);
+  if (*res < 0)
+    return NULL;
+
+  /* Blocks that are not mapped yet are allocated at flush time, but
+   * space is accounted for now so that a flush cannot run out of it.
+   */
+  *res = edfs_writeback_account(img, 1, physical == EDFS_BLOCK_INVALID);
+  if (*res < 0)
+    return NULL;
+
+  char *data = malloc(img->sb.block_size);
+  if (!data)
+    {
+      *res = -ENOMEM;
+      goto err_account;
+    }
+
+  uint32_t block_size = img->sb.block_size;
+  if (!fill)
+    ;
+  else if (physical != EDFS_BLOCK_INVALID &&
+           (off_t)logical * block_size < file->inode.inode.size)
+    {
+      if (img->map)
+        memcpy(data, edfs_image_block_ptr(img, physical), block_size);
+      else if (edfs_image_pread(img, data, block_size,
+                                edfs_get_block_offset(&img->sb, physical)) < 0)
+        {
+          *res = -errno;
+          free(data);
+          goto err_account;
+        }
+    }
+  else
+    memset(data, 0, block_size);
+
+  if (file->n_dirty == file->max_dirty)
+    {
+      uint32_t max_dirty = file->max_dirty ? file->max_dirty * 2 : 16;
+      edfs_dirty_block_t *dirty = realloc(file->dirty,
+                                          max_dirty * sizeof(edfs_dirty_block_t));
+      if (!dirty)
+        {
+          *res = -ENOMEM;
+          free(data);
+          goto err_account;
+        }
+
+      file->dirty = dirty;
+      file->max_dirty = max_dirty;
+    }
+
+  memmove(&file->dirty[i + 1], &file->dirty[i],
+          (file->n_dirty - i) * sizeof(edfs_dirty_block_t));
+  file->dirty[i].logical = logical;
+  file->dirty[i].physical = physical;
+  file->dirty[i].data = data;
+  file->n_dirty++;
+
+  return data;
+
+err_account:
+  edfs_writeback_account(img, -1, physical == EDFS_BLOCK_INVALID ? -1 : 0);
+  return NULL;
+}
+
+static int edfs_file_flush_table (edfs_image_t *img,
+                                  bool          wait);
+
+/* Flushes all files once the write-back buffers exceed their limit:
+ * @file, which the caller has locked for writing, and the others that
+ * are not busy.
+ */
+static int
+edfs_file_balance_dirty(edfs_image_t *img, edfs_file_t *file)
+{
+  uint32_t dirty_blocks = __atomic_load_n(&img->dirty_blocks, __ATOMIC_RELAXED);
+
+  if ((size_t)dirty_blocks * img->sb.block_size < img->writeback_limit)
+    return 0;
+
+  int res = edfs_file_flush_locked(img, file);
+  int res2 = edfs_file_flush_table(img, false);
+
+  return res < 0 ? res : res2;
+}
+
+/* Sets bytes [from, to) of @file to zero through the write-back buffer.
+ * Blocks in this range that are not mapped are allocated, so that holes
+ * are filled.
+ */
+static int
+edfs_file_zero_range(edfs_image_t *img, edfs_file_t *file, off_t from, off_t to)
+{
+  uint32_t block_size = img->sb.block_size;
+  int res = 0;
+
+  while (from < to)
+    {
+      uint32_t logical = from / block_size;
+      uint32_t start = from % block_size;
+      uint32_t len = to - from < block_size - start ? to - from : block_size - start;
+
+      res = edfs_file_balance_dirty(img, file);
+      if (res < 0)
+        return res;
+
+      char *data = edfs_file_dirty_block(img, file, logical,
+                                         len < block_size, &res);
+      if (!data)
+        return res;
+
+      memset(data + start, 0, len);
+      from += len;
+    }
+
+  return 0;
+}
+
+static int
+edfs_dirty_block_compare_physical(const void *a, const void *b)
+{
+  const edfs_dirty_block_t *da = a, *db = b;
+
+  return da->physical < db->physical ? -1 : da->physical > db->physical;
+}
+
+static int
+edfs_dirty_block_compare_logical(const void *a, const void *b)
+{
+  const edfs_dirty_block_t *da = a, *db = b;
+
+  return da->logical < db->logical ? -1 : da->logical > db->logical;
+}
+
+/* Allocates blocks for all dirty blocks that are not mapped yet. Runs
+ * of consecutive logical blocks are allocated together, following the
+ * preceding block of the file.
+ */
+static int
+edfs_file_allocate_dirty(edfs_image_t *img, edfs_file_t *file)
+{
+  uint32_t i = 0;
+  int res;
+
+  if (file->n_dirty > 0)
+    {
+      res = edfs_file_prepare_map(img, file, file->dirty[file->n_dirty - 1].logical);
+      if (res < 0)
+        return res;
+    }
+
+  while (i < file->n_dirty)
+    {
+      if (file->dirty[i].physical != EDFS_BLOCK_INVALID)
+        {
+          i++;
+          continue;
+        }
+
+      uint32_t start = i;
+      while (i < file->n_dirty && file->dirty[i].physical == EDFS_BLOCK_INVALID &&
+             file->dirty[i].logical == file->dirty[start].logical + (i - start))
+        i++;
+
+      uint32_t n = i - start;
+      uint32_t first = file->dirty[start].logical;
+      edfs_block_t goal = file->goal;
+      edfs_block_t prev;
+
+      if (first > 0 &&
+          edfs_file_bmap(img, file, first - 1, &prev) == 0 &&
+          prev != EDFS_BLOCK_INVALID)
+        goal = prev + 1;
+
+      edfs_block_t *blocks = malloc(n * sizeof(edfs_block_t));
+      if (!blocks)
+        return -ENOMEM;
+
+      int n_allocated = edfs_allocate_blocks_reserved(img, &file->rsv, goal,
+                                                      n, blocks);
+      if (n_allocated < n)
+        {
+          edfs_free_blocks(img, blocks, n_allocated);
+          free(blocks);
+          return -ENOSPC;
+        }
+
+      /* Blocks that did get mapped belong to the file now; only the
+       * others are given back.
+       */
+      uint32_t n_mapped;
+      res = edfs_file_map_blocks(img, file, first, blocks, n, &n_mapped);
+
+      for (uint32_t j = 0; j < n_mapped; j++)
+        file->dirty[start + j].physical = blocks[j];
+      edfs_writeback_account(img, 0, -(int)n_mapped);
+
+      if (res < 0)
+        edfs_free_blocks(img, blocks + n_mapped, n - n_mapped);
+      free(blocks);
+      if (res < 0)
+        return res;
+    }
+
+  return 0;
+}
+
+static int
+edfs_file_flush_locked(edfs_image_t *img, edfs_file_t *file)
+{
+  if (file->n_dirty == 0)
+    goto write_inode;
+
+  int res = edfs_file_allocate_dirty(img, file);
+  if (res < 0)
+    return res;
+
+  edfs_counter_add(&img->n_flushes, 1);
+
+  /* A mapped image is written in place. */
+  if (img->map)
+    {
+      for (uint32_t i = 0; i < file->n_dirty; i++)
+        memcpy(edfs_image_block_ptr(img, file->dirty[i].physical),
+               file->dirty[i].data, img->sb.block_size);
+      goto done;
+    }
+
+  struct iovec *iov = malloc(file->n_dirty * sizeof(struct iovec));
+  edfs_io_req_t *reqs = malloc(file->n_dirty * sizeof(edfs_io_req_t));
+  if (!iov || !reqs)
+    {
+      free(iov);
+      free(reqs);
+      return -ENOMEM;
+    }
+
+  /* Write every run of blocks that is contiguous on disk with a single
+   * request, and all runs as one batch.
+   */
+  qsort(file->dirty, file->n_dirty, sizeof(edfs_dirty_block_t),
+        edfs_dirty_block_compare_physical);
+
+  uint32_t i = 0;
+  int n_reqs = 0;
+
+  while (i < file->n_dirty)
+    {
+      uint32_t start = i;
+
+      do
+        {
+          iov[i].iov_base = file->dirty[i].data;
+          iov[i].iov_len = img->sb.block_size;
+          i++;
+        }
+      while (i < file->n_dirty && i - start < EDFS_MAX_IOV &&
+             file->dirty[i].physical == file->dirty[i - 1].physical + 1);
+
+      edfs_io_req_t *req = &reqs[n_reqs++];
+      memset(req, 0, sizeof(edfs_io_req_t));
+      req->op = EDFS_IO_WRITEV;
+      req->iov = &iov[start];
+      req->iovcnt = i - start;
+      req->len = (size_t)(i - start) * img->sb.block_size;
+      req->offset = edfs_get_block_offset(&img->sb, file->dirty[start].physical);
+    }
+
+  edfs_counter_add(&img->n_write_syscalls, n_reqs);
+  res = edfs_image_io(img, reqs, n_reqs);
+
+  free(iov);
+  free(reqs);
+
+  if (res < 0)
+    {
+      /* Keep the buffer intact, so that a later flush can retry. */
+      qsort(file->dirty, file->n_dirty, sizeof(edfs_dirty_block_t),
+            edfs_dirty_block_compare_logical);
+      return res;
+    }
+
+done:
+  for (uint32_t i = 0; i < file->n_dirty; i++)
+    free(file->dirty[i].data);
+  edfs_writeback_account(img, -(int)file->n_dirty, 0);
+  file->n_dirty = 0;
+
+write_inode:
+  if (file->inode_dirty)
+    {
+      if (edfs_write_inode(img, &file->inode) < 0)
+        return -EIO;
+      file->inode_dirty = false;
+    }
+
+  return 0;
+}
+
+/* Writes the buffered blocks of @file to disk and the inode if it has
+ * changed. Returns 0 on success, error code otherwise.
+ */
+int
+edfs_file_flush(edfs_image_t *img, edfs_file_t *file)
+{
+  pthread_rwlock_wrlock(&file->lock);
+  int res = edfs_file_flush_locked(img, file);
+  pthread_rwlock_unlock(&file->lock);
+
+  return res;
+}
+
+/* Flushes all files. Unless @wait is set, files that are locked by
+ * other threads are skipped. The files are collected first, so that
+ * the file table is not locked while waiting for a file.
+ */
+static int
+edfs_file_flush_table(edfs_image_t *img, bool wait)
+{
+  edfs_file_t **files = NULL;
+  uint32_t n_files = 0;
+  int res = 0;
+
+  pthread_mutex_lock(&img->file_table_lock);
+
+  if (img->file_table)
+    {
+      for (int i = 0; i < EDFS_FILE_TABLE_SIZE; i++)
+        for (edfs_file_t *file = img->file_table[i]; file; file = file->next)
+          n_files++;
+
+      files = malloc(n_files * sizeof(edfs_file_t *) + 1);
+      n_files = 0;
+      for (int i = 0; files && i < EDFS_FILE_TABLE_SIZE; i++)
+        for (edfs_file_t *file = img->file_table[i]; file; file = file->next)
+          {
+            file->refcount++;
+            files[n_files++] = file;
+          }
+    }
+
+  pthread_mutex_unlock(&img->file_table_lock);
+
+  for (uint32_t i = 0; i < n_files; i++)
+    {
+      if (wait)
+        pthread_rwlock_wrlock(&files[i]->lock);
+      else if (pthread_rwlock_trywrlock(&files[i]->lock) != 0)
+        continue;
+
+      int r = edfs_file_flush_locked(img, files[i]);
+      if (r < 0)
+        res = r;
+
+      pthread_rwlock_unlock(&files[i]->lock);
+    }
+
+  for (uint32_t i = 0; i < n_files; i++)
+    edfs_file_put(img, files[i]);
+
+  free(files);
+  return res;
+}
+
+int
+edfs_file_flush_all(edfs_image_t *img)
+{
+  return edfs_file_flush_table(img, true);
+}
+
+
+/*
+ * Read, write and truncate
+ */
+
+/* Asks the host to read @n_blocks blocks from @block on into its page
+ * cache, without waiting for them.
+ */
+static void
+edfs_file_prefetch_run(edfs_image_t *img, edfs_block_t block, uint32_t n_blocks)
+{
+  off_t offset = edfs_get_block_offset(&img->sb, block);
+  size_t len = (size_t)n_blocks * img->sb.block_size;
+
+  if (img->map)
+    {
+      /* The advice must start at a page boundary. */
+      off_t start = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+      posix_madvise(img->map + start, offset + len - start,
+                    POSIX_MADV_WILLNEED);
+    }
+  else
+    posix_fadvise(img->fd, offset, len, POSIX_FADV_WILLNEED);
+}
+
+/* Prefetches the data of logical blocks @first up to and including
+ * @last of @file, for readahead. The block map is loaded as needed;
+ * holes and blocks in the write-back buffer are skipped. Returns the
+ * number of blocks prefetched, or an error code.
+ */
+int
+edfs_file_prefetch(edfs_image_t *img,
+                   edfs_file_t  *file,
+                   uint32_t      first,
+                   uint32_t      last)
+{
+  uint32_t block_size = img->sb.block_size;
+  edfs_extent_t cursor = { 0, };
+  edfs_block_t run = EDFS_BLOCK_INVALID;
+  uint32_t run_len = 0;
+  int n_blocks = 0;
+
+  pthread_rwlock_rdlock(&file->lock);
+
+  uint32_t n_file_blocks =
+      (file->inode.inode.size + block_size - 1) / block_size;
+  if (last >= n_file_blocks)
+    last = n_file_blocks - 1;
+
+  int res = edfs_file_load_map(img, file);
+
+  for (uint32_t logical = first; res == 0 && logical <= last &&
+       n_file_blocks > 0; logical++)
+    {
+      edfs_block_t block = EDFS_BLOCK_INVALID;
+
+      if (!edfs_file_dirty_find(file, logical))
+        res = edfs_file_bmap_cursor(img, file, &cursor, logical, &block);
+
+      if (run_len > 0 && block != run + run_len)
+        {
+          edfs_file_prefetch_run(img, run, run_len);
+          n_blocks += run_len;
+          run_len = 0;
+        }
+
+      if (block != EDFS_BLOCK_INVALID)
+        {
+          if (run_len == 0)
+            run = block;
+          run_len++;
+        }
+    }
+
+  if (run_len > 0)
+    {
+      edfs_file_prefetch_run(img, run, run_len);
+      n_blocks += run_len;
+    }
+
+  pthread_rwlock_unlock(&file->lock);
+
+  return res < 0 ? res : n_blocks;
+}
+
+/* Called once after the last extent, see edfs_file_walk_extents(). */
+typedef int (*edfs_file_finish_func_t) (edfs_image_t *img, void *user_data);
+
+/* Describes the range of @size bytes at @offset of @file, clamped to
+ * the file size, as a sequence of extents passed to @func in order:
+ * runs of blocks that follow each other both in the file and on disk,
+ * data still in the write-back buffer, and holes. The extents are only
+ * valid during the call. Returns the number of bytes covered or an
+ * error code; a negative return value of @func stops the walk.
+ *
+ * If given, @finish is called after the last extent while the file is
+ * still locked, to complete work that @func deferred, such as reads of
+ * the blocks of the extents.
+ */
+static ssize_t
+edfs_file_walk_extents(edfs_image_t            *img,
+                       edfs_file_t             *file,
+                       size_t                   size,
+                       off_t                    offset,
+                       edfs_file_extent_func_t  func,
+                       edfs_file_finish_func_t  finish,
+                       void                    *user_data)
+{
+  uint32_t block_size = img->sb.block_size;
+  edfs_extent_t cursor = { 0, };
+  off_t start_offset = offset;
+  size_t total = 0;
+
+  edfs_counter_add(&img->n_read_requests, 1);
+
+  pthread_rwlock_rdlock(&file->lock);
+
+  off_t file_size = file->inode.inode.size;
+  int res = edfs_file_load_map(img, file);
+
+  if (res < 0 || offset >= file_size)
+    goto out;
+  if (size > file_size - offset)
+    size = file_size - offset;
+
+  while (total < size)
+    {
+      uint32_t logical = offset / block_size;
+      uint32_t start = offset % block_size;
+      size_t len = size - total < block_size - start ? size - total : block_size - start;
+      edfs_file_extent_t extent = { EDFS_EXTENT_HOLE, };
+
+      edfs_dirty_block_t *dirty = edfs_file_dirty_find(file, logical);
+      edfs_block_t block = EDFS_BLOCK_INVALID;
+
+      if (dirty)
+        {
+          extent.type = EDFS_EXTENT_BUFFER;
+          extent.data = dirty->data + start;
+        }
+      else
+        {
+          res = edfs_file_bmap_cursor(img, file, &cursor, logical, &block);
+          if (res < 0)
+            goto out;
+        }
+
+      if (block != EDFS_BLOCK_INVALID)
+        {
+          edfs_block_t last = block;
+
+          while (total + len < size)
+            {
+              edfs_block_t next;
+
+              if (edfs_file_dirty_find(file, logical + 1) ||
+                  edfs_file_bmap_cursor(img, file, &cursor, logical + 1,
+                                        &next) < 0 ||
+                  next != last + 1)
+                break;
+
+              logical++;
+              last = next;
+              len += size - total - len < block_size ? size - total - len : block_size;
+            }
+
+          extent.type = EDFS_EXTENT_DISK;
+          extent.pos = edfs_get_block_offset(&img->sb, block) + start;
+        }
+
+      extent.len = len;
+
+      res = func(img, &extent, user_data);
+      if (res < 0)
+        goto out;
+
+      total += len;
+      offset += len;
+    }
+
+  if (finish)
+    res = finish(img, user_data);
+
+out:
+  pthread_rwlock_unlock(&file->lock);
+
+  if (img->readahead && total > 0)
+    edfs_readahead_note(img, file, start_offset, total);
+
+  return res < 0 ? res : total;
+}
+
+/* Walks the extents of a range for edfuse, see edfs_file_walk_extents(). */
+ssize_t
+edfs_file_read_extents(edfs_image_t            *img,
+                       edfs_file_t             *file,
+                       size_t                   size,
+                       off_t                    offset,
+                       edfs_file_extent_func_t  func,
+                       void                    *user_data)
+{
+  return edfs_file_walk_extents(img, file, size, offset, func, NULL,
+                                user_data);
+}
+
+typedef struct
+{
+  char *buf;
+  size_t pos;
+  edfs_io_queue_t queue;        /* reads of disk extents */
+} edfs_file_read_state_t;
+
+static int
+edfs_file_read_extent(edfs_image_t             *img,
+                      const edfs_file_extent_t *extent,
+                      void                     *user_data)
+{
+  edfs_file_read_state_t *state = user_data;
+  char *dst = state->buf + state->pos;
+
+  switch (extent->type)
+    {
+      case EDFS_EXTENT_DISK:
+        if (img->map)
+          memcpy(dst, img->map + extent->pos, extent->len);
+        else
+          {
+            edfs_io_req_t *req = edfs_io_queue_add(&state->queue,
+                                                   EDFS_IO_READ,
+                                                   extent->pos, extent->len);
+            if (!req)
+              return -ENOMEM;
+            req->buf = dst;
+          }
+        break;
+
+      case EDFS_EXTENT_BUFFER:
+        memcpy(dst, extent->data, extent->len);
+        break;
+
+      case EDFS_EXTENT_HOLE:
+        memset(dst, 0, extent->len);
+        break;
+    }
+
+  state->pos += extent->len;
+  return 0;
+}
+
+/* Runs the reads collected by edfs_file_read_extent(), before the
+ * file is unlocked.
+ */
+static int
+edfs_file_read_finish(edfs_image_t *img, void *user_data)
+{
+  edfs_file_read_state_t *state = user_data;
+
+  if (state->queue.n_reqs == 0)
+    return 0;
+
+  edfs_counter_add(&img->n_read_syscalls, state->queue.n_reqs);
+  return edfs_image_io(img, state->queue.reqs, state->queue.n_reqs);
+}
+
+/* Reads up to @size bytes at @offset. Returns the number of bytes
+ * read, which is short at the end of the file, or an error code.
+ *
+ * Blocks that follow each other both in the file and on disk are read
+ * together, straight into @buf, with one request per run. The requests
+ * of all runs are run as a single batch.
+ */
+ssize_t
+edfs_file_read(edfs_image_t *img,
+               edfs_file_t  *file,
+               char         *buf,
+               size_t        size,
+               off_t         offset)
+{
+  edfs_file_read_state_t state = { buf, 0 };
+
+  edfs_io_queue_init(&state.queue);
+
+  ssize_t res = edfs_file_walk_extents(img, file, size, offset,
+                                       edfs_file_read_extent,
+                                       edfs_file_read_finish, &state);
+
+  edfs_io_queue_clear(&state.queue);
+
+  return res;
+}
+
+/* Writes @size bytes at @offset into the write-back buffer of @file,
+ * extending the file as needed. The data is stored by @fill, directly
+ * into the buffered blocks, in order. When writing past the end of the
+ * file, the gap is filled with zeroes. Returns the number of bytes
+ * written or an error code.
+ */
+ssize_t
+edfs_file_write_from(edfs_image_t          *img,
+                     edfs_file_t           *file,
+                     size_t                 size,
+                     off_t                  offset,
+                     edfs_file_fill_func_t  fill,
+                     void                  *user_data)
+{
+  uint32_t block_size = img->sb.block_size;
+  off_t max_size = (off_t)edfs_file_max_blocks(img) * block_size;
+  size_t total = 0;
+  int res = 0;
+
+  if (size == 0)
+    return 0;
+  if (offset >= max_size)
+    return -EFBIG;
+  if (size > max_size - offset)
+    size = max_size - offset;
+
+  pthread_rwlock_wrlock(&file->lock);
+
+  if (offset > file->inode.inode.size)
+    {
+      res = edfs_file_zero_range(img, file, file->inode.inode.size, offset);
+      if (res < 0)
+        goto out;
+    }
+
+  while (total < size)
+    {
+      uint32_t logical = offset / block_size;
+      uint32_t start = offset % block_size;
+      size_t len = size - total < block_size - start ? size - total : block_size - start;
+
+      res = edfs_file_balance_dirty(img, file);
+      if (res < 0)
+        break;
+
+      char *data = edfs_file_dirty_block(img, file, logical,
+                                         len < block_size, &res);
+      if (!data)
+        break;
+
+      res = fill(data + start, len, user_data);
+      if (res < 0)
+        break;
+
+      total += len;
+      offset += len;
+
+      if (offset > file->inode.inode.size)
+        {
+          file->inode.inode.size = offset;
+          file->inode_dirty = true;
+        }
+    }
+
+out:
+  pthread_rwlock_unlock(&file->lock);
+
+  if (total == 0 && res < 0)
+    return res;
+
+  return total;
+}
+
+static int
+edfs_file_fill_from_buffer(char *dst, size_t len, void *user_data)
+{
+  const char **src = user_data;
+
+  memcpy(dst, *src, len);
+  *src += len;
+
+  return 0;
+}
+
+/* Writes @size bytes from @buf at @offset, see edfs_file_write_from(). */
+ssize_t
+edfs_file_write(edfs_image_t *img,
+                edfs_file_t  *file,
+                const char   *buf,
+                size_t        size,
+                off_t         offset)
+{
+  return edfs_file_write_from(img, file, size, offset,
+                              edfs_file_fill_from_buffer, &buf);
+}
+
+/* Sets the size of @file to @size. Blocks past the new end of the file
+ * are released; growing the file fills the new range with zeroes.
+ */
+int
+edfs_file_truncate(edfs_image_t *img, edfs_file_t *file, off_t size)
+{
+  uint32_t block_size = img->sb.block_size;
+  int res = 0;
+
+  if (size > (off_t)edfs_file_max_blocks(img) * block_size)
+    return -EFBIG;
+
+  pthread_rwlock_wrlock(&file->lock);
+
+  off_t old_size = file->inode.inode.size;
+
+  if (size > old_size)
+    res = edfs_file_zero_range(img, file, old_size, size);
+  else if (size < old_size)
+    {
+      uint32_t n_blocks = (size + block_size - 1) / block_size;
+
+      edfs_file_drop_dirty(img, file, n_blocks);
+      edfs_reservation_release(img, &file->rsv);
+      res = edfs_file_unmap_from(img, file, n_blocks);
+    }
+
+  if (res < 0)
+    goto out;
+
+  if (size != old_size)
+    {
+      file->inode.inode.size = size;
+      file->inode_dirty = true;
+    }
+
+  /* Freed blocks may be reused right away, so the inode must not refer
+   * to them any longer.
+   */
+  if (file->inode_dirty && size < old_size)
+    {
+      if (edfs_write_inode(img, &file->inode) < 0)
+        res = -EIO;
+      else
+        file->inode_dirty = false;
+    }
+
+out:
+  pthread_rwlock_unlock(&file->lock);
+
+  return res;
+}
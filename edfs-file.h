@@ -0,0 +1,178 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#ifndef __EDFS_FILE_H__
+#define __EDFS_FILE_H__
+
+#include "edfs-common.h"
+#include "edfs-alloc.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+
+/*
+ * File data
+ *
+ * Files in use are represented by an in-memory file object, shared by
+ * all users of the same inode and kept in a table attached to the image.
+ * While a file object exists, its copy of the inode is authoritative.
+ * Open file handles refer to the file object directly. A file that is
+ * unlinked while open stays usable through its handles; its blocks and
+ * inode are released when the last reference is dropped.
+ *
+ * Every file object has a read-write lock. Reads take it for reading,
+ * writes, truncation and flushes for writing, so a file can be read by
+ * many threads at once. The file table has a lock of its own, which is
+ * only held briefly.
+ *
+ * Written data is collected per file in a write-back buffer of whole
+ * blocks. Blocks are only allocated when the buffer is flushed, so that
+ * they can be placed contiguously, and every run of blocks that is
+ * contiguous on disk is written with a single request. The requests of
+ * a flush are run as one batch, see edfs-io.h; reads batch the runs
+ * they cover likewise.
+ *
+ * From version 2 on, files that outgrow their direct block pointers
+ * are mapped by an extent tree, see edfs-extent.h, instead of indirect
+ * blocks. Walks over a range of such a file look up every extent once.
+ */
+
+/* A block in the write-back buffer. */
+typedef struct
+{
+  uint32_t logical;
+  edfs_block_t physical;   /* EDFS_BLOCK_INVALID until allocated */
+  char *data;
+} edfs_dirty_block_t;
+
+typedef struct _edfs_file edfs_file_t;
+
+struct _edfs_file
+{
+  edfs_inode_t inode;
+  bool inode_dirty;
+
+  int refcount;
+  bool unlinked;
+  edfs_file_t *next;            /* chain in the image's file table */
+
+  pthread_rwlock_t lock;
+  pthread_mutex_t map_lock;     /* fills @map for readers */
+
+  /* Logical to physical block map of an indirect file, filled lazily
+   * with a copy of each indirect block. Kept up to date when blocks are
+   * mapped and dropped when blocks are unmapped.
+   */
+  edfs_block16_t *map[EDFS_INODE_N_BLOCKS];
+
+  /* Write-back buffer, sorted by logical block number. */
+  edfs_dirty_block_t *dirty;
+  uint32_t n_dirty;
+  uint32_t max_dirty;
+
+  edfs_block_reservation_t rsv;
+  edfs_block_t goal;            /* placement goal for the first block */
+
+  /* Sequential read detection, see edfs-readahead.h. Protected by
+   * @map_lock.
+   */
+  off_t ra_next;                /* offset following the last read */
+  uint32_t ra_window;           /* blocks, 0 if not reading sequentially */
+  uint32_t ra_end;              /* first logical block not read ahead */
+};
+
+/* A piece of a file range, see edfs_file_read_extents(). */
+typedef enum
+{
+  EDFS_EXTENT_DISK,     /* @len bytes at image offset @pos */
+  EDFS_EXTENT_BUFFER,   /* @len bytes at @data, in the write-back buffer */
+  EDFS_EXTENT_HOLE      /* @len zero bytes */
+} edfs_file_extent_type_t;
+
+typedef struct
+{
+  edfs_file_extent_type_t type;
+  size_t len;
+  off_t pos;
+  const char *data;
+} edfs_file_extent_t;
+
+typedef int (*edfs_file_extent_func_t) (edfs_image_t             *img,
+                                        const edfs_file_extent_t *extent,
+                                        void                     *user_data);
+
+/* Stores the next @len bytes of data being written at @dst. */
+typedef int (*edfs_file_fill_func_t)   (char                     *dst,
+                                        size_t                    len,
+                                        void                     *user_data);
+
+#define EDFS_FILE_TABLE_SIZE 256
+
+/* Default amount of buffered data, in bytes, above which all dirty
+ * files are flushed.
+ */
+#define EDFS_WRITEBACK_DEFAULT_LIMIT (8 * 1024 * 1024)
+
+
+edfs_file_t   *edfs_file_get              (edfs_image_t       *img,
+                                           const edfs_inode_t *inode);
+void           edfs_file_put              (edfs_image_t       *img,
+                                           edfs_file_t        *file);
+void           edfs_file_ref              (edfs_image_t       *img,
+                                           edfs_file_t        *file);
+void           edfs_file_stat             (edfs_file_t        *file,
+                                           edfs_inode_t       *inode);
+bool           edfs_file_lookup_inode     (edfs_image_t       *img,
+                                           edfs_inumber_t      inumber,
+                                           edfs_inode_t       *inode);
+void           edfs_file_unlink           (edfs_image_t       *img,
+                                           edfs_inode_t       *inode);
+void           edfs_file_table_free       (edfs_image_t       *img);
+
+int            edfs_file_bmap             (edfs_image_t       *img,
+                                           edfs_file_t        *file,
+                                           uint32_t            logical,
+                                           edfs_block_t       *block);
+uint32_t       edfs_file_max_blocks       (edfs_image_t       *img);
+int            edfs_file_prefetch         (edfs_image_t       *img,
+                                           edfs_file_t        *file,
+                                           uint32_t            first,
+                                           uint32_t            last);
+
+ssize_t        edfs_file_read             (edfs_image_t       *img,
+                                           edfs_file_t        *file,
+                                           char               *buf,
+                                           size_t              size,
+                                           off_t               offset);
+ssize_t        edfs_file_write            (edfs_image_t       *img,
+                                           edfs_file_t        *file,
+                                           const char         *buf,
+                                           size_t              size,
+                                           off_t               offset);
+ssize_t        edfs_file_read_extents     (edfs_image_t            *img,
+                                           edfs_file_t             *file,
+                                           size_t                   size,
+                                           off_t                    offset,
+                                           edfs_file_extent_func_t  func,
+                                           void                    *user_data);
+ssize_t        edfs_file_write_from       (edfs_image_t            *img,
+                                           edfs_file_t             *file,
+                                           size_t                   size,
+                                           off_t                    offset,
+                                           edfs_file_fill_func_t    fill,
+                                           void                    *user_data);
+int            edfs_file_truncate         (edfs_image_t       *img,
+                                           edfs_file_t        *file,
+                                           off_t               size);
+int            edfs_file_flush            (edfs_image_t       *img,
+                                           edfs_file_t        *file);
+int            edfs_file_flush_all        (edfs_image_t       *img);
+
+void           edfs_inode_release_blocks  (edfs_image_t       *img,
+                                           edfs_inode_t       *inode);
+
+#endif /* __EDFS_FILE_H__ */
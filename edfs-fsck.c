@@ -0,0 +1,109 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+/* Checks the consistency of an image, and optionally repairs it. See
+ * edfs-check.h for what is checked.
+ */
+
+#include "edfs-common.h"
+#include "edfs-check.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/* Exit codes, as those of fsck(8). */
+#define FSCK_OK             0
+#define FSCK_REPAIRED       1
+#define FSCK_UNCORRECTED    4
+#define FSCK_ERROR          8
+
+static void
+usage(const char *execname)
+{
+  fprintf(stderr, "usage: %s [-r] [-q] [-j threads] image\n\n"
+          "  -r          repair the problems found\n"
+          "  -q          only print the summary\n"
+          "  -j threads  number of threads, default one per processor\n",
+          execname);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int flags = 0;
+  int n_threads = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "rqj:")) != -1)
+    {
+      switch (opt)
+        {
+          case 'r':
+            flags |= EDFS_CHECK_REPAIR;
+            break;
+          case 'q':
+            flags |= EDFS_CHECK_QUIET;
+            break;
+          case 'j':
+            n_threads = atoi(optarg);
+            break;
+          default:
+            usage(argv[0]);
+            return FSCK_ERROR;
+        }
+    }
+
+  if (argc - optind != 1)
+    {
+      usage(argv[0]);
+      return FSCK_ERROR;
+    }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  /* With the inode cache, the table is loaded with a single read and
+   * repairs update it in place.
+   */
+  edfs_image_t *img = edfs_image_open(argv[optind],
+                                      EDFS_IMAGE_READ_SUPER | EDFS_IMAGE_INODE_CACHE);
+  if (!img)
+    return FSCK_ERROR;
+
+  edfs_check_result_t result;
+  int res = edfs_check_image(img, flags, n_threads, &result);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  edfs_image_close(img);
+
+  if (res < 0)
+    {
+      fprintf(stderr, "error: check of '%s' failed: %s\n", argv[optind],
+              strerror(-res));
+      return FSCK_ERROR;
+    }
+
+  uint32_t n_problems = edfs_check_n_problems(&result);
+
+  printf("%s: %u directories, %u files, %u blocks in use\n", argv[optind],
+         result.n_dirs, result.n_files, result.n_blocks);
+  if (n_problems > 0)
+    printf("%u problems: %u bad inodes, %u bad block pointers, "
+           "%u duplicate blocks, %u bad entries, %u orphans, "
+           "%u bitmap errors%s\n", n_problems,
+           result.bad_inodes, result.bad_blocks, result.duplicate_blocks,
+           result.bad_entries, result.orphans, result.bitmap_errors,
+           (flags & EDFS_CHECK_REPAIR) ? ", repaired" : "");
+  printf("checked in %.3f s\n",
+         (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+  if (n_problems == 0)
+    return FSCK_OK;
+  return (flags & EDFS_CHECK_REPAIR) ? FSCK_REPAIRED : FSCK_UNCORRECTED;
+}
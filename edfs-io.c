@@ -0,0 +1,521 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#define _DEFAULT_SOURCE   /* syscall(), pwritev() */
+
+#include "edfs-io.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define EDFS_HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef EDFS_HAVE_IO_URING
+/* The numbers are the same on all architectures. */
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#endif
+
+
+/* The ring of a thread. When a thread exits its ring is kept, and
+ * handed to the next new thread, like the counters in edfs-stats.c.
+ */
+typedef struct _edfs_io_ring
+{
+  struct _edfs_io_ring *next;
+  edfs_io_t *io;
+  bool in_use;
+
+#ifdef EDFS_HAVE_IO_URING
+  int fd;
+  unsigned int entries;
+
+  void *sq_map;
+  size_t sq_map_size;
+  void *cq_map;
+  size_t cq_map_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_cqe *cqes;
+#endif
+} edfs_io_ring_t;
+
+struct _edfs_io
+{
+  int fd;
+  edfs_io_engine_t engine;
+  pthread_key_t key;
+
+  pthread_mutex_t lock;        /* protects the list of rings */
+  edfs_io_ring_t *rings;
+};
+
+
+/* Performs the rest of @req, from byte @done on, with plain system
+ * calls. Stops early only at the end of the file.
+ */
+static void
+edfs_io_run_sync(int fd, edfs_io_req_t *req, size_t done)
+{
+  while (done < req->len)
+    {
+      ssize_t n;
+
+      switch (req->op)
+        {
+          case EDFS_IO_READ:
+            n = pread(fd, (char *)req->buf + done, req->len - done,
+                      req->offset + done);
+            break;
+
+          case EDFS_IO_WRITE:
+            n = pwrite(fd, (char *)req->buf + done, req->len - done,
+                       req->offset + done);
+            break;
+
+          case EDFS_IO_WRITEV:
+          default:
+            {
+              /* Skip the buffers written already. */
+              size_t skip = done;
+              int i = 0;
+
+              while (skip >= req->iov[i].iov_len)
+                skip -= req->iov[i++].iov_len;
+
+              if (skip == 0)
+                n = pwritev(fd, req->iov + i, req->iovcnt - i,
+                            req->offset + done);
+              else
+                n = pwrite(fd, (char *)req->iov[i].iov_base + skip,
+                           req->iov[i].iov_len - skip, req->offset + done);
+            }
+            break;
+        }
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        {
+          req->res = -errno;
+          return;
+        }
+      if (n == 0)
+        break;
+
+      done += n;
+    }
+
+  req->res = done;
+}
+
+#ifdef EDFS_HAVE_IO_URING
+
+static void
+edfs_io_ring_close(edfs_io_ring_t *ring)
+{
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_map && ring->cq_map != ring->sq_map)
+    munmap(ring->cq_map, ring->cq_map_size);
+  if (ring->sq_map)
+    munmap(ring->sq_map, ring->sq_map_size);
+  if (ring->fd >= 0)
+    close(ring->fd);
+}
+
+static void *
+edfs_io_ring_map(int fd, size_t size, off_t offset)
+{
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, offset);
+
+  return map == MAP_FAILED ? NULL : map;
+}
+
+/* Sets up a ring of @entries entries and maps its submission queue,
+ * completion queue and submission entries. Returns 0 on success, error
+ * code otherwise.
+ */
+static int
+edfs_io_ring_open(edfs_io_ring_t *ring, unsigned int entries)
+{
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(p));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd < 0)
+    return -errno;
+
+  ring->entries = p.sq_entries;
+  ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  ring->cq_map_size = p.cq_off.cqes +
+      p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  /* Newer kernels map both queues at once. */
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (ring->cq_map_size > ring->sq_map_size)
+        ring->sq_map_size = ring->cq_map_size;
+      ring->sq_map = edfs_io_ring_map(ring->fd, ring->sq_map_size,
+                                      IORING_OFF_SQ_RING);
+      ring->cq_map = ring->sq_map;
+    }
+  else
+    {
+      ring->sq_map = edfs_io_ring_map(ring->fd, ring->sq_map_size,
+                                      IORING_OFF_SQ_RING);
+      ring->cq_map = edfs_io_ring_map(ring->fd, ring->cq_map_size,
+                                      IORING_OFF_CQ_RING);
+    }
+  ring->sqes = edfs_io_ring_map(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+
+  if (!ring->sq_map || !ring->cq_map || !ring->sqes)
+    {
+      edfs_io_ring_close(ring);
+      return -ENOMEM;
+    }
+
+  char *sq = ring->sq_map;
+  char *cq = ring->cq_map;
+
+  ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+  ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  return 0;
+}
+
+static void
+edfs_io_ring_prep(edfs_io_ring_t *ring, int fd, edfs_io_req_t *req,
+                  unsigned int tail, uint64_t user_data)
+{
+  unsigned int index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->fd = fd;
+  sqe->off = req->offset;
+  sqe->user_data = user_data;
+
+  switch (req->op)
+    {
+      case EDFS_IO_READ:
+        sqe->opcode = IORING_OP_READ;
+        sqe->addr = (uintptr_t)req->buf;
+        sqe->len = req->len;
+        break;
+
+      case EDFS_IO_WRITE:
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->addr = (uintptr_t)req->buf;
+        sqe->len = req->len;
+        break;
+
+      case EDFS_IO_WRITEV:
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (uintptr_t)req->iov;
+        sqe->len = req->iovcnt;
+        break;
+    }
+
+  ring->sq_array[index] = index;
+}
+
+/* Runs @n_reqs requests, at most the number of entries of @ring, as a
+ * single batch. The common case takes one io_uring_enter() call, which
+ * submits all requests and waits for all of them.
+ */
+static void
+edfs_io_ring_run(edfs_io_ring_t *ring, int fd,
+                 edfs_io_req_t *reqs, int n_reqs)
+{
+  unsigned int tail = *ring->sq_tail;
+  int submitted = 0, completed = 0;
+  bool failed = false;
+
+  for (int i = 0; i < n_reqs; i++)
+    edfs_io_ring_prep(ring, fd, &reqs[i], tail++, i);
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+  while (completed < submitted || (submitted < n_reqs && !failed))
+    {
+      unsigned int to_submit = failed ? 0 : n_reqs - submitted;
+      unsigned int wait_for = submitted + to_submit - completed;
+      int res = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_for,
+                        IORING_ENTER_GETEVENTS, NULL, 0);
+
+      /* Only a failed submission stops us; waiting fails with EINTR at
+       * most, and the requests in flight must be reaped in any case.
+       */
+      if (res > 0)
+        submitted += res;
+      else if (to_submit > 0 && (res == 0 || errno != EINTR))
+        failed = true;
+
+      unsigned int head = *ring->cq_head;
+      unsigned int cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+      for (; head != cq_tail; head++, completed++)
+        {
+          struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+          reqs[cqe->user_data].res = cqe->res;
+        }
+      __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+  /* Take back what the kernel did not accept and run it ourselves. */
+  if (submitted < n_reqs)
+    {
+      __atomic_store_n(ring->sq_tail,
+                       __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE),
+                       __ATOMIC_RELEASE);
+      for (int i = submitted; i < n_reqs; i++)
+        edfs_io_run_sync(fd, &reqs[i], 0);
+    }
+
+  /* Complete short transfers, and retry requests the kernel would not
+   * run asynchronously.
+   */
+  for (int i = 0; i < submitted; i++)
+    if (reqs[i].res >= 0 && reqs[i].res < reqs[i].len)
+      edfs_io_run_sync(fd, &reqs[i], reqs[i].res);
+    else if (reqs[i].res == -EINVAL || reqs[i].res == -EOPNOTSUPP ||
+             reqs[i].res == -EAGAIN || reqs[i].res == -EINTR)
+      edfs_io_run_sync(fd, &reqs[i], 0);
+}
+
+#endif /* EDFS_HAVE_IO_URING */
+
+static void
+edfs_io_ring_exit(void *data)
+{
+  edfs_io_ring_t *ring = data;
+
+  pthread_mutex_lock(&ring->io->lock);
+  ring->in_use = false;
+  pthread_mutex_unlock(&ring->io->lock);
+}
+
+/* Returns the ring of the calling thread, taking over that of an
+ * exited thread if possible. Returns NULL if no ring can be set up.
+ */
+static edfs_io_ring_t *
+edfs_io_ring_get(edfs_io_t *io)
+{
+  edfs_io_ring_t *ring = pthread_getspecific(io->key);
+  if (ring)
+    return ring;
+
+  pthread_mutex_lock(&io->lock);
+
+  for (ring = io->rings; ring; ring = ring->next)
+    if (!ring->in_use)
+      break;
+
+#ifdef EDFS_HAVE_IO_URING
+  if (!ring && (ring = calloc(1, sizeof(edfs_io_ring_t))))
+    {
+      if (edfs_io_ring_open(ring, EDFS_IO_RING_DEPTH) == 0)
+        {
+          ring->io = io;
+          ring->next = io->rings;
+          io->rings = ring;
+        }
+      else
+        {
+          free(ring);
+          ring = NULL;
+        }
+    }
+#endif
+
+  if (ring)
+    {
+      ring->in_use = true;
+      pthread_setspecific(io->key, ring);
+    }
+
+  pthread_mutex_unlock(&io->lock);
+
+  return ring;
+}
+
+/* Creates an I/O engine for the file @fd. Returns NULL on failure, or
+ * when io_uring is asked for and the system does not provide it.
+ */
+edfs_io_t *
+edfs_io_new(int fd, edfs_io_engine_t engine)
+{
+  edfs_io_t *io = calloc(1, sizeof(edfs_io_t));
+  if (!io)
+    return NULL;
+
+  if (pthread_key_create(&io->key, edfs_io_ring_exit) != 0)
+    {
+      free(io);
+      return NULL;
+    }
+
+  io->fd = fd;
+  io->engine = engine;
+  pthread_mutex_init(&io->lock, NULL);
+
+  /* Set up the ring of the calling thread to find out whether io_uring
+   * works at all.
+   */
+  if (engine == EDFS_IO_ENGINE_URING && !edfs_io_ring_get(io))
+    {
+      edfs_io_free(io);
+      return NULL;
+    }
+
+  return io;
+}
+
+void
+edfs_io_free(edfs_io_t *io)
+{
+  if (!io)
+    return;
+
+  pthread_key_delete(io->key);
+  pthread_mutex_destroy(&io->lock);
+
+  while (io->rings)
+    {
+      edfs_io_ring_t *next = io->rings->next;
+#ifdef EDFS_HAVE_IO_URING
+      edfs_io_ring_close(io->rings);
+#endif
+      free(io->rings);
+      io->rings = next;
+    }
+
+  free(io);
+}
+
+edfs_io_engine_t
+edfs_io_get_engine(edfs_io_t *io)
+{
+  return io->engine;
+}
+
+const char *
+edfs_io_engine_name(edfs_io_engine_t engine)
+{
+  return engine == EDFS_IO_ENGINE_URING ? "io_uring" : "pread";
+}
+
+/* Runs the @n_reqs requests in @reqs and waits for all of them; the
+ * result of every request is stored in its @res. Returns 0 if all
+ * requests transferred all their bytes, otherwise the error code of
+ * the first that did not, -EIO if it fell short.
+ */
+int
+edfs_io_run(edfs_io_t *io, edfs_io_req_t *reqs, int n_reqs)
+{
+#ifdef EDFS_HAVE_IO_URING
+  /* A single request is not worth a trip through the ring. */
+  edfs_io_ring_t *ring = NULL;
+
+  if (io->engine == EDFS_IO_ENGINE_URING && n_reqs > 1)
+    ring = edfs_io_ring_get(io);
+
+  if (ring)
+    for (int i = 0; i < n_reqs; i += ring->entries)
+      edfs_io_ring_run(ring, io->fd, reqs + i,
+                       n_reqs - i < ring->entries ? n_reqs - i
+                                                  : ring->entries);
+  else
+#endif
+    for (int i = 0; i < n_reqs; i++)
+      edfs_io_run_sync(io->fd, &reqs[i], 0);
+
+  for (int i = 0; i < n_reqs; i++)
+    if (reqs[i].res < 0)
+      return reqs[i].res;
+    else if (reqs[i].res < reqs[i].len)
+      return -EIO;
+
+  return 0;
+}
+
+
+/*
+ * Request queues
+ */
+
+void
+edfs_io_queue_init(edfs_io_queue_t *queue)
+{
+  memset(queue, 0, sizeof(edfs_io_queue_t));
+}
+
+/* Appends a request to @queue and returns it, for the caller to fill
+ * in the buffers. Returns NULL if memory runs out.
+ */
+edfs_io_req_t *
+edfs_io_queue_add(edfs_io_queue_t *queue,
+                  edfs_io_op_t     op,
+                  off_t            offset,
+                  size_t           len)
+{
+  if (queue->n_reqs == queue->max_reqs)
+    {
+      int max_reqs = queue->max_reqs ? 2 * queue->max_reqs : 16;
+      edfs_io_req_t *reqs = realloc(queue->reqs,
+                                    max_reqs * sizeof(edfs_io_req_t));
+      if (!reqs)
+        return NULL;
+
+      queue->reqs = reqs;
+      queue->max_reqs = max_reqs;
+    }
+
+  edfs_io_req_t *req = &queue->reqs[queue->n_reqs++];
+
+  memset(req, 0, sizeof(edfs_io_req_t));
+  req->op = op;
+  req->offset = offset;
+  req->len = len;
+
+  return req;
+}
+
+void
+edfs_io_queue_clear(edfs_io_queue_t *queue)
+{
+  free(queue->reqs);
+  edfs_io_queue_init(queue);
+}
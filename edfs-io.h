@@ -0,0 +1,91 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#ifndef __EDFS_IO_H__
+#define __EDFS_IO_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+
+/* I/O engines. Code that needs several reads or writes of the image
+ * file describes them as a batch of requests and hands the whole batch
+ * to edfs_io_run(), which returns once every request has completed.
+ *
+ * The pread engine performs the requests one after the other, with a
+ * pread(), pwrite() or pwritev() each; this is what EdFS always did.
+ * The io_uring engine places the batch in a submission ring and enters
+ * the kernel once to submit all of it and wait for the completions, so
+ * the requests are in flight together. It uses the system calls
+ * directly and needs no library. Every thread has a ring of its own,
+ * set up on first use, so submitting takes no locks.
+ *
+ * Both engines complete short transfers by continuing with plain
+ * system calls, so a request only falls short at the end of the file.
+ * Requests that the kernel refuses to run asynchronously are retried
+ * synchronously as well.
+ */
+typedef struct _edfs_io edfs_io_t;
+
+typedef enum
+{
+  EDFS_IO_ENGINE_PREAD,
+  EDFS_IO_ENGINE_URING
+} edfs_io_engine_t;
+
+typedef enum
+{
+  EDFS_IO_READ,         /* @len bytes into @buf */
+  EDFS_IO_WRITE,        /* @len bytes from @buf */
+  EDFS_IO_WRITEV        /* @len bytes from the @iovcnt buffers of @iov */
+} edfs_io_op_t;
+
+typedef struct
+{
+  edfs_io_op_t op;
+  int iovcnt;
+  void *buf;
+  const struct iovec *iov;
+  size_t len;
+  off_t offset;
+
+  ssize_t res;          /* set by edfs_io_run(): bytes or -errno */
+} edfs_io_req_t;
+
+/* A growing array of requests, to collect a batch in. */
+typedef struct
+{
+  edfs_io_req_t *reqs;
+  int n_reqs;
+  int max_reqs;
+} edfs_io_queue_t;
+
+/* Entries of the ring of every thread; larger batches are submitted in
+ * parts.
+ */
+#define EDFS_IO_RING_DEPTH 64
+
+
+edfs_io_t     *edfs_io_new                (int                 fd,
+                                           edfs_io_engine_t    engine);
+void           edfs_io_free               (edfs_io_t          *io);
+edfs_io_engine_t edfs_io_get_engine       (edfs_io_t          *io);
+const char    *edfs_io_engine_name        (edfs_io_engine_t    engine);
+
+int            edfs_io_run                (edfs_io_t          *io,
+                                           edfs_io_req_t      *reqs,
+                                           int                 n_reqs);
+
+void           edfs_io_queue_init         (edfs_io_queue_t    *queue);
+edfs_io_req_t *edfs_io_queue_add          (edfs_io_queue_t    *queue,
+                                           edfs_io_op_t        op,
+                                           off_t               offset,
+                                           size_t              len);
+void           edfs_io_queue_clear        (edfs_io_queue_t    *queue);
+
+#endif /* __EDFS_IO_H__ */
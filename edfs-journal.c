@@ -0,0 +1,1037 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#include "edfs-journal.h"
+#include "edfs-cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/* Journal blocks are numbered from the start of the journal; block 0
+ * is the header and transactions start at block 1. Transactions are
+ * never split around the end of the journal: when the next one does
+ * not fit, the journal starts over at block 1 with a new header.
+ *
+ * A transaction is collected in @buf, which has room for the largest
+ * number of descriptor blocks in front of the data blocks. The
+ * descriptors are filled in last, right before the data, so that the
+ * transaction can be written from @buf in one piece.
+ */
+struct _edfs_journal
+{
+  edfs_image_t *img;
+  uint32_t block_size;
+  uint32_t first_block;         /* image block of journal block 0 */
+  uint32_t n_blocks;
+  uint32_t tags_per_block;
+
+  /* Where the next transaction goes and its sequence number, and the
+   * first one after the header. Changed by the committing thread only.
+   */
+  uint32_t head;
+  uint64_t seq;
+  uint64_t header_seq;
+
+  /* Handles and commits, protected by @lock. */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int n_handles;
+  bool barrier;
+  bool committing;
+  uint64_t commit_gen;          /* commits started */
+  uint64_t done_gen;            /* last one that succeeded */
+  uint64_t failed_gen;          /* last one that failed */
+  int error;                    /* of the last one */
+
+  /* Blocks changed since the last commit, counted when they turn
+   * dirty, and the number at which edfs_journal_end() commits.
+   */
+  uint32_t n_dirtied;
+  uint32_t commit_blocks;
+
+  /* Cached blocks with a copy in the journal, and blocks freed since
+   * the last commit that have one. Protected by the allocation lock.
+   */
+  uint64_t *journaled;
+  edfs_block_t *revokes;
+  uint32_t n_revokes;
+
+  /* The transaction being collected. */
+  char *buf;
+  uint32_t max_desc;
+  edfs_journal_tag_t *tags;
+  uint32_t n_tags;
+  uint32_t n_data;
+
+  /* Commit thread. */
+  pthread_t thread;
+  pthread_cond_t thread_cond;
+  bool has_thread;
+  bool stop;
+  unsigned int interval;
+
+  edfs_journal_stats_t stats;
+};
+
+
+/* Largest transaction, in blocks, commit block included. */
+static inline uint32_t
+edfs_journal_capacity(edfs_journal_t *journal)
+{
+  return journal->n_blocks - 1;
+}
+
+static inline off_t
+edfs_journal_offset(edfs_journal_t *journal, uint32_t block)
+{
+  return (off_t)(journal->first_block + block) * journal->block_size;
+}
+
+/* Address of data block @i of the transaction in @buf. */
+static inline char *
+edfs_journal_data(edfs_journal_t *journal, uint32_t i)
+{
+  return journal->buf + (size_t)(journal->max_desc + i) * journal->block_size;
+}
+
+static inline uint32_t
+edfs_journal_n_desc(edfs_journal_t *journal, uint32_t n_tags)
+{
+  uint32_t n = (n_tags + journal->tags_per_block - 1) / journal->tags_per_block;
+
+  return n > 0 ? n : 1;
+}
+
+/* FNV-1a over 64-bit words; @len is a multiple of 8. */
+static uint64_t
+edfs_journal_checksum(const char *data, size_t len)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for (size_t i = 0; i < len; i += sizeof(uint64_t))
+    {
+      uint64_t word;
+
+      memcpy(&word, data + i, sizeof(word));
+      hash = (hash ^ word) * 0x100000001b3ULL;
+    }
+
+  return hash;
+}
+
+static int
+edfs_journal_write_header(edfs_image_t *img, int fd,
+                          const edfs_super_block_t *sb, uint64_t seq)
+{
+  char *block = calloc(1, sb->block_size);
+  edfs_journal_block_header_t header =
+    {
+      .magic = EDFS_JOURNAL_MAGIC,
+      .type = EDFS_JOURNAL_HEADER,
+      .seq = seq
+    };
+  ssize_t n;
+
+  if (!block)
+    return -ENOMEM;
+
+  memcpy(block, &header, sizeof(header));
+  if (img)
+    n = edfs_image_pwrite(img, block, sb->block_size, sb->journal_start);
+  else
+    n = pwrite(fd, block, sb->block_size, sb->journal_start);
+  free(block);
+
+  if (n < 0)
+    return -errno;
+  return n == sb->block_size ? 0 : -EIO;
+}
+
+/* Writes an empty journal to the image file @fd, laid out as in @sb.
+ * Used when an image is made. Returns 0 on success, error code
+ * otherwise.
+ */
+int
+edfs_journal_format(int fd, const edfs_super_block_t *sb)
+{
+  if (sb->journal_size == 0)
+    return 0;
+
+  /* Clear the first transaction, in case the file held a journal. */
+  char *block = calloc(1, sb->block_size);
+  if (!block)
+    return -ENOMEM;
+
+  ssize_t n = pwrite(fd, block, sb->block_size,
+                     sb->journal_start + sb->block_size);
+  free(block);
+  if (n != sb->block_size)
+    return n < 0 ? -errno : -EIO;
+
+  return edfs_journal_write_header(NULL, fd, sb, 1);
+}
+
+static int
+edfs_journal_sync(edfs_journal_t *journal)
+{
+  EDFS_TRACE_BEGIN(span);
+  int res = fdatasync(journal->img->fd);
+  EDFS_TRACE_END(span, "journal_sync");
+
+  journal->stats.syncs++;
+  return res < 0 ? -errno : 0;
+}
+
+/* Makes sure nothing before @seq is replayed anymore: syncs the
+ * metadata written in place, then lets the header point at @seq, to be
+ * written at block 1.
+ */
+static int
+edfs_journal_checkpoint(edfs_journal_t *journal, uint64_t seq)
+{
+  edfs_image_t *img = journal->img;
+
+  int res = edfs_journal_sync(journal);
+  if (res == 0)
+    res = edfs_journal_write_header(img, img->fd, &img->sb, seq);
+  if (res == 0)
+    res = edfs_journal_sync(journal);
+  if (res < 0)
+    return res;
+
+  journal->head = 1;
+  journal->header_seq = seq;
+  journal->stats.checkpoints++;
+
+  /* Freed blocks no longer have copies to cancel. */
+  pthread_mutex_lock(&img->alloc_lock);
+  memset(journal->journaled, 0,
+         ((uint64_t)img->sb.n_blocks + 63) / 64 * sizeof(uint64_t));
+  pthread_mutex_unlock(&img->alloc_lock);
+
+  return 0;
+}
+
+
+/*
+ * Replay
+ */
+
+/* A block found in the journal: the copy at journal block @pos, or a
+ * revoke if @pos is 0.
+ */
+typedef struct
+{
+  uint32_t block;
+  uint32_t pos;
+  uint64_t seq;
+} edfs_journal_record_t;
+
+static int
+edfs_journal_record_compare(const void *a, const void *b)
+{
+  const edfs_journal_record_t *ra = a;
+  const edfs_journal_record_t *rb = b;
+
+  if (ra->block != rb->block)
+    return ra->block < rb->block ? -1 : 1;
+  return (ra->seq > rb->seq) - (ra->seq < rb->seq);
+}
+
+static bool
+edfs_journal_header_valid(const char *block, uint32_t type, uint64_t seq)
+{
+  edfs_journal_block_header_t header;
+
+  memcpy(&header, block, sizeof(header));
+  return header.magic == EDFS_JOURNAL_MAGIC && header.type == type &&
+      header.seq == seq;
+}
+
+/* Checks the transaction @seq at journal block @pos of the journal
+ * contents in @data, of which block 0 is journal block 1. Returns its
+ * size in blocks, commit block included, or 0 if it is not intact.
+ */
+static uint32_t
+edfs_journal_scan_txn(edfs_journal_t *journal, const char *data,
+                      uint32_t pos, uint64_t seq)
+{
+  uint32_t block_size = journal->block_size;
+  uint32_t end = journal->n_blocks;
+  edfs_journal_block_header_t header;
+
+  if (pos >= end ||
+      !edfs_journal_header_valid(data + (size_t)(pos - 1) * block_size,
+                                 EDFS_JOURNAL_DESCRIPTOR, seq))
+    return 0;
+
+  memcpy(&header, data + (size_t)(pos - 1) * block_size, sizeof(header));
+  uint32_t n_desc = edfs_journal_n_desc(journal, header.n_tags);
+  uint32_t max_tags = edfs_journal_capacity(journal) * journal->tags_per_block;
+  if (header.n_tags > max_tags || n_desc >= end - pos)
+    return 0;
+
+  uint32_t n_data = 0;
+  for (uint32_t i = 0; i < header.n_tags; i++)
+    {
+      uint32_t desc_block = pos - 1 + i / journal->tags_per_block;
+      const char *desc = data + (size_t)desc_block * block_size;
+      edfs_journal_tag_t tag;
+
+      if (i % journal->tags_per_block == 0 &&
+          !edfs_journal_header_valid(desc, EDFS_JOURNAL_DESCRIPTOR, seq))
+        return 0;
+
+      memcpy(&tag, desc + sizeof(header) +
+             (i % journal->tags_per_block) * sizeof(tag), sizeof(tag));
+      if (!(tag.flags & EDFS_JOURNAL_TAG_REVOKE))
+        n_data++;
+    }
+
+  uint32_t n_blocks = n_desc + n_data;
+  if (n_blocks >= end - pos)
+    return 0;
+
+  const char *commit = data + (size_t)(pos - 1 + n_blocks) * block_size;
+  if (!edfs_journal_header_valid(commit, EDFS_JOURNAL_COMMIT, seq))
+    return 0;
+
+  memcpy(&header, commit, sizeof(header));
+  if (header.n_blocks != n_blocks ||
+      header.checksum !=
+      edfs_journal_checksum(data + (size_t)(pos - 1) * block_size,
+                            (size_t)n_blocks * block_size))
+    return 0;
+
+  return n_blocks + 1;
+}
+
+/* Adds the blocks of the intact transaction at journal block @pos to
+ * @records, which has room for them.
+ */
+static uint32_t
+edfs_journal_collect_txn(edfs_journal_t *journal, const char *data,
+                         uint32_t pos, uint64_t seq,
+                         edfs_journal_record_t *records)
+{
+  uint32_t block_size = journal->block_size;
+  edfs_journal_block_header_t header;
+  uint32_t n_records = 0;
+
+  memcpy(&header, data + (size_t)(pos - 1) * block_size, sizeof(header));
+  uint32_t next = pos + edfs_journal_n_desc(journal, header.n_tags);
+
+  for (uint32_t i = 0; i < header.n_tags; i++)
+    {
+      uint32_t desc_block = pos - 1 + i / journal->tags_per_block;
+      const char *desc = data + (size_t)desc_block * block_size;
+      edfs_journal_tag_t tag;
+
+      memcpy(&tag, desc + sizeof(header) +
+             (i % journal->tags_per_block) * sizeof(tag), sizeof(tag));
+
+      records[n_records].block = tag.block;
+      records[n_records].seq = seq;
+      records[n_records].pos = 0;
+      if (!(tag.flags & EDFS_JOURNAL_TAG_REVOKE))
+        records[n_records].pos = next++;
+      n_records++;
+    }
+
+  return n_records;
+}
+
+/* Writes the last copy of every block in the journal in place, unless
+ * the block was revoked since. Returns 0 on success, error code
+ * otherwise.
+ */
+static int
+edfs_journal_replay(edfs_journal_t *journal)
+{
+  edfs_image_t *img = journal->img;
+  uint32_t block_size = journal->block_size;
+  uint32_t n_blocks = edfs_journal_capacity(journal);
+  size_t size = (size_t)n_blocks * block_size;
+  edfs_journal_record_t *records = NULL;
+  uint32_t n_records = 0;
+  edfs_io_queue_t queue;
+  int res = 0;
+
+  /* The journal is read in one piece, into the transaction buffer. */
+  char *data = journal->buf;
+  if (edfs_image_pread(img, data, size,
+                       edfs_journal_offset(journal, 1)) != size)
+    return -EIO;
+
+  uint32_t pos = 1;
+  uint64_t seq = journal->header_seq;
+  uint32_t n_txn_blocks;
+  uint32_t max_records = 0;
+
+  while ((n_txn_blocks = edfs_journal_scan_txn(journal, data, pos, seq)) > 0)
+    {
+      edfs_journal_block_header_t header;
+
+      memcpy(&header, data + (size_t)(pos - 1) * block_size, sizeof(header));
+      edfs_journal_record_t *tmp =
+          realloc(records, (max_records + header.n_tags) * sizeof(*records));
+      if (!tmp)
+        {
+          free(records);
+          return -ENOMEM;
+        }
+      records = tmp;
+      max_records += header.n_tags;
+
+      n_records += edfs_journal_collect_txn(journal, data, pos, seq,
+                                            records + n_records);
+      pos += n_txn_blocks;
+      seq++;
+    }
+
+  journal->seq = seq;
+  journal->head = 1;
+  if (seq == journal->header_seq)
+    return 0;
+
+  qsort(records, n_records, sizeof(*records), edfs_journal_record_compare);
+
+  /* Records are sorted by block, then sequence number: the last one
+   * of a block is its newest copy or revoke. A revoke in the same
+   * transaction as a copy came before it.
+   */
+  edfs_io_queue_init(&queue);
+  uint32_t n_meta = journal->first_block + journal->n_blocks;
+
+  for (uint32_t i = 0; i < n_records && res == 0; i++)
+    {
+      edfs_journal_record_t *last = &records[i];
+
+      while (i + 1 < n_records && records[i + 1].block == last->block)
+        last = &records[++i];
+      if (last->pos == 0 && last > records && last[-1].block == last->block &&
+          last[-1].seq == last->seq && last[-1].pos != 0)
+        last--;
+
+      if (last->pos == 0 || last->block == EDFS_BLOCK_INVALID ||
+          last->block >= img->sb.n_blocks ||
+          (last->block >= journal->first_block && last->block < n_meta))
+        continue;
+
+      edfs_io_req_t *req =
+          edfs_io_queue_add(&queue, EDFS_IO_WRITE,
+                            edfs_get_block_offset(&img->sb, last->block),
+                            block_size);
+      if (!req)
+        res = -ENOMEM;
+      else
+        req->buf = data + (size_t)(last->pos - 1) * block_size;
+    }
+
+  if (res == 0 && queue.n_reqs > 0)
+    res = edfs_image_io(img, queue.reqs, queue.n_reqs);
+  if (res == 0)
+    journal->stats.replayed = queue.n_reqs;
+
+  edfs_io_queue_clear(&queue);
+  free(records);
+
+  if (res == 0)
+    res = edfs_journal_checkpoint(journal, seq);
+
+  return res;
+}
+
+
+/*
+ * Setting up
+ */
+
+/* Sets up the journal of @img and replays it, before the metadata of
+ * the image is loaded. Returns NULL on failure, after printing why.
+ */
+edfs_journal_t *
+edfs_journal_open(edfs_image_t *img)
+{
+  const edfs_super_block_t *sb = &img->sb;
+  edfs_journal_t *journal = calloc(1, sizeof(edfs_journal_t));
+
+  if (!journal)
+    return NULL;
+
+  journal->img = img;
+  journal->block_size = sb->block_size;
+  journal->first_block = sb->journal_start / sb->block_size;
+  journal->n_blocks = sb->journal_size / sb->block_size;
+  journal->tags_per_block = edfs_get_n_journal_tags_per_block(sb);
+  journal->max_desc = edfs_journal_n_desc(journal,
+                                          edfs_journal_capacity(journal));
+
+  pthread_mutex_init(&journal->lock, NULL);
+  pthread_cond_init(&journal->cond, NULL);
+  pthread_cond_init(&journal->thread_cond, NULL);
+
+  /* Commit well before the journal or the block cache runs full. */
+  journal->commit_blocks = edfs_journal_capacity(journal) / 4;
+  if (journal->commit_blocks > EDFS_CACHE_DEFAULT_SIZE / sb->block_size / 2)
+    journal->commit_blocks = EDFS_CACHE_DEFAULT_SIZE / sb->block_size / 2;
+
+  /* A block has at most one revoke in a transaction, and only if it
+   * has a copy in the journal.
+   */
+  uint32_t capacity = edfs_journal_capacity(journal);
+
+  journal->buf = malloc((size_t)(journal->max_desc + capacity) *
+                        sb->block_size);
+  journal->tags = malloc((size_t)journal->max_desc * journal->tags_per_block *
+                         sizeof(edfs_journal_tag_t));
+  journal->journaled = calloc(((uint64_t)sb->n_blocks + 63) / 64, sizeof(uint64_t));
+  journal->revokes = malloc(capacity * sizeof(edfs_block_t));
+  char *header = malloc(sb->block_size);
+
+  if (!journal->buf || !journal->tags || !journal->journaled ||
+      !journal->revokes || !header)
+    {
+      fprintf(stderr, "error: file '%s': cannot allocate journal.\n",
+              img->filename);
+      free(header);
+      edfs_journal_free(journal);
+      return NULL;
+    }
+
+  if (edfs_image_pread(img, header, sb->block_size, sb->journal_start)
+      != sb->block_size ||
+      !edfs_journal_header_valid(header, EDFS_JOURNAL_HEADER,
+                                 ((edfs_journal_block_header_t *)header)->seq))
+    {
+      fprintf(stderr, "error: file '%s': journal header is corrupt.\n",
+              img->filename);
+      free(header);
+      edfs_journal_free(journal);
+      return NULL;
+    }
+
+  journal->header_seq = ((edfs_journal_block_header_t *)header)->seq;
+  free(header);
+
+  EDFS_TRACE_BEGIN(span);
+  int res = edfs_journal_replay(journal);
+  EDFS_TRACE_END(span, "journal_replay");
+
+  if (res < 0)
+    {
+      fprintf(stderr, "error: file '%s': cannot replay journal: %s\n",
+              img->filename, strerror(-res));
+      edfs_journal_free(journal);
+      return NULL;
+    }
+
+  journal->stats.size = journal->n_blocks;
+
+  return journal;
+}
+
+static void *
+edfs_journal_thread(void *data)
+{
+  edfs_journal_t *journal = data;
+
+  pthread_mutex_lock(&journal->lock);
+
+  while (!journal->stop)
+    {
+      struct timespec deadline;
+
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += journal->interval;
+      while (!journal->stop &&
+             pthread_cond_timedwait(&journal->thread_cond, &journal->lock,
+                                    &deadline) != ETIMEDOUT)
+        ;
+      if (journal->stop)
+        break;
+
+      bool dirty = __atomic_load_n(&journal->n_dirtied, __ATOMIC_RELAXED) > 0;
+
+      pthread_mutex_unlock(&journal->lock);
+      if (dirty)
+        edfs_journal_commit(journal->img);
+      pthread_mutex_lock(&journal->lock);
+    }
+
+  pthread_mutex_unlock(&journal->lock);
+
+  return NULL;
+}
+
+/* Starts a thread that commits every @interval seconds if metadata
+ * has changed. Returns 0 on success or without a journal, error code
+ * otherwise.
+ */
+int
+edfs_journal_start_thread(edfs_image_t *img, unsigned int interval)
+{
+  edfs_journal_t *journal = img->journal;
+
+  if (!journal || interval == 0 || journal->has_thread)
+    return 0;
+
+  journal->interval = interval;
+  if (pthread_create(&journal->thread, NULL, edfs_journal_thread, journal) != 0)
+    return -EAGAIN;
+
+  journal->has_thread = true;
+  return 0;
+}
+
+/* Stops the commit thread and frees the journal. Everything must have
+ * been committed, after which the journal is emptied, so that the next
+ * open has nothing to replay.
+ */
+void
+edfs_journal_free(edfs_journal_t *journal)
+{
+  if (!journal)
+    return;
+
+  if (journal->has_thread)
+    {
+      pthread_mutex_lock(&journal->lock);
+      journal->stop = true;
+      pthread_cond_signal(&journal->thread_cond);
+      pthread_mutex_unlock(&journal->lock);
+
+      pthread_join(journal->thread, NULL);
+    }
+
+  if (journal->buf && journal->head > 1 && journal->error == 0)
+    edfs_journal_checkpoint(journal, journal->seq);
+
+  pthread_mutex_destroy(&journal->lock);
+  pthread_cond_destroy(&journal->cond);
+  pthread_cond_destroy(&journal->thread_cond);
+  free(journal->buf);
+  free(journal->tags);
+  free(journal->journaled);
+  free(journal->revokes);
+  free(journal);
+}
+
+
+/*
+ * Collecting transactions
+ */
+
+static void
+edfs_journal_txn_reset(edfs_journal_t *journal)
+{
+  journal->n_tags = 0;
+  journal->n_data = 0;
+}
+
+/* Whether one more tag, and a data block if @data, still fit. */
+static bool
+edfs_journal_txn_fits(edfs_journal_t *journal, bool data)
+{
+  uint32_t n_desc = edfs_journal_n_desc(journal, journal->n_tags + 1);
+
+  return n_desc + journal->n_data + data + 1 <= edfs_journal_capacity(journal);
+}
+
+/* Adds @len bytes of @data as the new contents of @block, padded with
+ * zeroes to a block.
+ */
+static int
+edfs_journal_txn_add(edfs_journal_t *journal, edfs_block_t block,
+                     const void *data, size_t len)
+{
+  if (!edfs_journal_txn_fits(journal, true))
+    return -ENOSPC;
+
+  char *dst = edfs_journal_data(journal, journal->n_data++);
+  memcpy(dst, data, len);
+  memset(dst + len, 0, journal->block_size - len);
+
+  journal->tags[journal->n_tags].block = block;
+  journal->tags[journal->n_tags].flags = 0;
+  journal->n_tags++;
+
+  return 0;
+}
+
+static int
+edfs_journal_add_buf(edfs_block_t block, const char *data, void *user_data)
+{
+  edfs_journal_t *journal = user_data;
+
+  return edfs_journal_txn_add(journal, block, data, journal->block_size);
+}
+
+/* Adds the dirty chunks of an in-memory copy of @size bytes of an area
+ * that starts at image offset @start.
+ */
+static int
+edfs_journal_add_chunks(edfs_journal_t *journal, uint64_t start,
+                        const void *mem, size_t size,
+                        const uint8_t *dirty, uint32_t n_chunks)
+{
+  uint32_t block_size = journal->block_size;
+
+  for (uint32_t i = 0; i < n_chunks; i++)
+    {
+      if (!dirty[i])
+        continue;
+
+      size_t begin = (size_t)i * block_size;
+      size_t len = size - begin < block_size ? size - begin : block_size;
+      int res = edfs_journal_txn_add(journal, start / block_size + i,
+                                     (const char *)mem + begin, len);
+      if (res < 0)
+        return res;
+    }
+
+  return 0;
+}
+
+/* Collects all changed metadata into a transaction, with all operations
+ * held off. Returns 0 on success, error code otherwise.
+ */
+static int
+edfs_journal_collect(edfs_journal_t *journal)
+{
+  edfs_image_t *img = journal->img;
+  int res;
+
+  edfs_journal_txn_reset(journal);
+
+  pthread_mutex_lock(&img->alloc_lock);
+  pthread_mutex_lock(&img->inode_lock);
+
+  res = edfs_cache_foreach_dirty(img, edfs_journal_add_buf, journal);
+  if (res == 0)
+    res = edfs_journal_add_chunks(journal, img->sb.bitmap_start,
+                                  img->block_bitmap,
+                                  ((uint64_t)img->sb.n_blocks + 7) / 8,
+                                  img->block_bitmap_dirty,
+                                  img->block_bitmap_n_chunks);
+  if (res == 0)
+    res = edfs_journal_add_chunks(journal, img->sb.inode_table_start,
+                                  img->inode_table,
+                                  img->sb.inode_table_n_inodes *
+                                  sizeof(edfs_disk_inode_t),
+                                  img->inode_table_dirty,
+                                  img->inode_table_n_chunks);
+
+  for (uint32_t i = 0; i < journal->n_revokes && res == 0; i++)
+    {
+      if (!edfs_journal_txn_fits(journal, false))
+        {
+          res = -ENOSPC;
+          break;
+        }
+
+      journal->tags[journal->n_tags].block = journal->revokes[i];
+      journal->tags[journal->n_tags].flags = EDFS_JOURNAL_TAG_REVOKE;
+      journal->n_tags++;
+    }
+
+  __atomic_store_n(&journal->n_dirtied, 0, __ATOMIC_RELAXED);
+
+  pthread_mutex_unlock(&img->inode_lock);
+  pthread_mutex_unlock(&img->alloc_lock);
+
+  return res;
+}
+
+/* Fills in the descriptor and commit blocks of the collected
+ * transaction and writes it at the head of the journal.
+ */
+static int
+edfs_journal_write_txn(edfs_journal_t *journal)
+{
+  uint32_t block_size = journal->block_size;
+  uint32_t tags_per_block = journal->tags_per_block;
+  uint32_t n_desc = edfs_journal_n_desc(journal, journal->n_tags);
+  uint32_t n_blocks = n_desc + journal->n_data;
+  char *txn = journal->buf + (size_t)(journal->max_desc - n_desc) * block_size;
+  edfs_journal_block_header_t header =
+    {
+      .magic = EDFS_JOURNAL_MAGIC,
+      .type = EDFS_JOURNAL_DESCRIPTOR,
+      .seq = journal->seq,
+      .n_tags = journal->n_tags
+    };
+
+  for (uint32_t d = 0; d < n_desc; d++)
+    {
+      char *desc = txn + (size_t)d * block_size;
+      uint32_t first = d * tags_per_block;
+      uint32_t n = journal->n_tags - first < tags_per_block
+          ? journal->n_tags - first : tags_per_block;
+
+      memset(desc, 0, block_size);
+      memcpy(desc, &header, sizeof(header));
+      memcpy(desc + sizeof(header), &journal->tags[first],
+             n * sizeof(edfs_journal_tag_t));
+    }
+
+  char *commit = txn + (size_t)n_blocks * block_size;
+  memset(commit, 0, block_size);
+  header.type = EDFS_JOURNAL_COMMIT;
+  header.n_tags = 0;
+  header.n_blocks = n_blocks;
+  header.checksum = edfs_journal_checksum(txn, (size_t)n_blocks * block_size);
+  memcpy(commit, &header, sizeof(header));
+
+  size_t size = (size_t)(n_blocks + 1) * block_size;
+  EDFS_TRACE_BEGIN(span);
+  ssize_t n = edfs_image_pwrite(journal->img, txn, size,
+                                edfs_journal_offset(journal, journal->head));
+  EDFS_TRACE_END(span, "journal_write");
+
+  if (n < 0)
+    return -errno;
+  return n == size ? 0 : -EIO;
+}
+
+/* Commits the metadata changed so far, with all operations held off.
+ * Returns 0 on success, error code otherwise.
+ */
+static int
+edfs_journal_do_commit(edfs_journal_t *journal)
+{
+  edfs_image_t *img = journal->img;
+  edfs_cache_stats_t cache_stats;
+
+  /* The cache may have been replaced since the last commit. */
+  if (img->bcache)
+    {
+      edfs_cache_get_stats(img->bcache, &cache_stats);
+      if (journal->commit_blocks > cache_stats.max_buffers / 2)
+        journal->commit_blocks = cache_stats.max_buffers / 2;
+    }
+
+  int res = edfs_journal_collect(journal);
+
+  /* Nothing to journal: what remains to be made durable is file data. */
+  if (res == 0 && journal->n_tags == 0)
+    return edfs_journal_sync(journal);
+
+  /* Too large for the journal at all: empty it, so that no older copy
+   * is replayed over what is written now, and write in place.
+   */
+  if (res == -ENOSPC)
+    {
+      journal->stats.overflows++;
+      res = edfs_journal_checkpoint(journal, journal->seq);
+      if (res == 0)
+        res = edfs_image_writeback(img);
+      if (res == 0)
+        res = edfs_journal_sync(journal);
+      if (res == 0)
+        {
+          pthread_mutex_lock(&img->alloc_lock);
+          journal->n_revokes = 0;
+          pthread_mutex_unlock(&img->alloc_lock);
+        }
+      return res;
+    }
+  if (res < 0)
+    return res;
+
+  uint32_t n_blocks = edfs_journal_n_desc(journal, journal->n_tags) +
+      journal->n_data + 1;
+  if (journal->head + n_blocks > journal->n_blocks &&
+      (res = edfs_journal_checkpoint(journal, journal->seq)) < 0)
+    return res;
+
+  res = edfs_journal_write_txn(journal);
+  if (res == 0)
+    res = edfs_journal_sync(journal);
+  if (res < 0)
+    return res;
+
+  journal->head += n_blocks;
+  journal->seq++;
+  journal->stats.commits++;
+  journal->stats.blocks += journal->n_data;
+
+  /* Later frees of these blocks need a revoke; the revokes written
+   * are done.
+   */
+  pthread_mutex_lock(&img->alloc_lock);
+  for (uint32_t i = 0; i < journal->n_tags; i++)
+    {
+      edfs_journal_tag_t *tag = &journal->tags[i];
+
+      if (tag->flags & EDFS_JOURNAL_TAG_REVOKE)
+        journal->stats.revokes++;
+      else
+        journal->journaled[tag->block / 64] |= 1ULL << (tag->block % 64);
+    }
+  journal->n_revokes = 0;
+  pthread_mutex_unlock(&img->alloc_lock);
+
+  /* The transaction is durable; the metadata is written in place from
+   * the same state, which the next checkpoint syncs.
+   */
+  return edfs_image_writeback(img);
+}
+
+
+/*
+ * Handles and commits
+ */
+
+/* Begins an operation that may modify the image. Waits while a commit
+ * is being written.
+ */
+void
+edfs_journal_begin(edfs_image_t *img)
+{
+  edfs_journal_t *journal = img->journal;
+
+  if (!journal)
+    return;
+
+  pthread_mutex_lock(&journal->lock);
+  while (journal->barrier)
+    pthread_cond_wait(&journal->cond, &journal->lock);
+  journal->n_handles++;
+  pthread_mutex_unlock(&journal->lock);
+}
+
+/* Ends an operation begun with edfs_journal_begin(). Commits if enough
+ * metadata has changed.
+ */
+void
+edfs_journal_end(edfs_image_t *img)
+{
+  edfs_journal_t *journal = img->journal;
+
+  if (!journal)
+    return;
+
+  pthread_mutex_lock(&journal->lock);
+  if (--journal->n_handles == 0 && journal->barrier)
+    pthread_cond_broadcast(&journal->cond);
+  bool full = __atomic_load_n(&journal->n_dirtied, __ATOMIC_RELAXED)
+      >= journal->commit_blocks && !journal->committing;
+  pthread_mutex_unlock(&journal->lock);
+
+  if (full)
+    edfs_journal_commit(img);
+}
+
+/* Commits all metadata changed by operations that have ended, and makes
+ * file data written so far durable. If another thread is committing,
+ * that commit covers everything so far, so this waits for it. Threads
+ * arriving in the meantime are served together by the next commit.
+ * Returns 0 on success, error code otherwise.
+ */
+int
+edfs_journal_commit(edfs_image_t *img)
+{
+  edfs_journal_t *journal = img->journal;
+  int res = 0;
+
+  if (!journal)
+    return 0;
+
+  pthread_mutex_lock(&journal->lock);
+
+  /* Operations are held off during a commit, so all that ended before
+   * this call is in the running commit, if any, and else in the next.
+   */
+  uint64_t target = journal->committing ? journal->commit_gen
+                                        : journal->commit_gen + 1;
+
+  if (journal->committing)
+    journal->stats.joined++;
+
+  while (journal->done_gen < target)
+    {
+      if (journal->committing)
+        {
+          pthread_cond_wait(&journal->cond, &journal->lock);
+          if (journal->failed_gen == target)
+            {
+              res = journal->error;
+              break;
+            }
+          continue;
+        }
+
+      journal->commit_gen++;
+      journal->committing = true;
+      journal->barrier = true;
+      while (journal->n_handles > 0)
+        pthread_cond_wait(&journal->cond, &journal->lock);
+      pthread_mutex_unlock(&journal->lock);
+
+      EDFS_TRACE_BEGIN(span);
+      res = edfs_journal_do_commit(journal);
+      EDFS_TRACE_END(span, "journal_commit");
+
+      pthread_mutex_lock(&journal->lock);
+      if (res == 0)
+        journal->done_gen = journal->commit_gen;
+      else
+        journal->failed_gen = journal->commit_gen;
+      journal->error = res;
+      journal->committing = false;
+      journal->barrier = false;
+      pthread_cond_broadcast(&journal->cond);
+
+      if (res < 0)
+        break;
+    }
+
+  pthread_mutex_unlock(&journal->lock);
+
+  return res;
+}
+
+/* Counts @n_blocks blocks of metadata that turned dirty. */
+void
+edfs_journal_dirtied(edfs_image_t *img, uint32_t n_blocks)
+{
+  if (img->journal)
+    __atomic_add_fetch(&img->journal->n_dirtied, n_blocks, __ATOMIC_RELAXED);
+}
+
+/* Records that @block is freed, so that replay does not write an older
+ * copy of it over its next use. Called with the allocation lock held.
+ */
+void
+edfs_journal_revoke(edfs_image_t *img, edfs_block_t block)
+{
+  edfs_journal_t *journal = img->journal;
+  uint64_t mask = 1ULL << (block % 64);
+
+  if (!journal || !(journal->journaled[block / 64] & mask))
+    return;
+
+  journal->journaled[block / 64] &= ~mask;
+  journal->revokes[journal->n_revokes++] = block;
+}
+
+void
+edfs_journal_get_stats(edfs_journal_t *journal, edfs_journal_stats_t *stats)
+{
+  memset(stats, 0, sizeof(edfs_journal_stats_t));
+  if (!journal)
+    return;
+
+  pthread_mutex_lock(&journal->lock);
+  *stats = journal->stats;
+  stats->used = journal->head - 1;
+  pthread_mutex_unlock(&journal->lock);
+}
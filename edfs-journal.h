@@ -0,0 +1,89 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#ifndef __EDFS_JOURNAL_H__
+#define __EDFS_JOURNAL_H__
+
+#include "edfs-common.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/*
+ * Metadata journal
+ *
+ * Images with a journal region (see edfs.h) have their metadata updated
+ * through it: directory and indirect blocks in the block cache, the
+ * free-block bitmap and the inode table. File data is written in place
+ * as before. Metadata is only modified in memory; a commit copies all
+ * of it that changed into one transaction, appends that to the journal
+ * with a single write and makes it durable with a single fdatasync().
+ * Only then is the metadata written to its place in the image, without
+ * waiting for it, so a crash at any time leaves the image as of the
+ * last commit once the journal is replayed. Replay happens when the
+ * image is opened.
+ *
+ * Operations that modify an image are bracketed by edfs_journal_begin()
+ * and edfs_journal_end(), so that commits only see completed updates. A
+ * commit waits for running operations to end and holds off new ones
+ * until the transaction is written. Threads that ask for a commit while
+ * one is running wait for it and then commit everything that came in
+ * the meantime together, so concurrent fsyncs share an fdatasync().
+ *
+ * Operations do not nest, and must not ask for a commit themselves.
+ * Single-threaded users may leave out the brackets, but must then call
+ * edfs_image_sync() before the changed metadata outgrows the block
+ * cache, as dirty buffers cannot be evicted before they are committed.
+ * Without a journal all these routines do nothing.
+ *
+ * Commits happen in edfs_image_sync(), when edfs_journal_end() finds
+ * that enough metadata has changed, and every few seconds if a commit
+ * thread is started. When the journal runs full, the metadata written
+ * in place since it last started over is synced, after which it starts
+ * over. A transaction that does not fit in the journal at all is written
+ * in place without its protection.
+ */
+typedef struct _edfs_journal edfs_journal_t;
+
+typedef struct
+{
+  uint64_t commits;      /* transactions written */
+  uint64_t joined;       /* commit requests served by another's commit */
+  uint64_t blocks;       /* blocks journaled */
+  uint64_t revokes;
+  uint64_t syncs;        /* fdatasync() calls */
+  uint64_t checkpoints;  /* times the journal started over */
+  uint64_t overflows;    /* transactions too large for the journal */
+  uint64_t replayed;     /* blocks replayed when opened */
+
+  uint32_t size;         /* blocks, including the header */
+  uint32_t used;         /* blocks in use by transactions */
+} edfs_journal_stats_t;
+
+/* Seconds between commits of the commit thread. */
+#define EDFS_JOURNAL_DEFAULT_INTERVAL 5
+
+
+int            edfs_journal_format        (int                       fd,
+                                           const edfs_super_block_t *sb);
+edfs_journal_t *edfs_journal_open         (edfs_image_t             *img);
+void           edfs_journal_free          (edfs_journal_t           *journal);
+int            edfs_journal_start_thread  (edfs_image_t             *img,
+                                           unsigned int              interval);
+
+void           edfs_journal_begin         (edfs_image_t             *img);
+void           edfs_journal_end           (edfs_image_t             *img);
+int            edfs_journal_commit        (edfs_image_t             *img);
+
+void           edfs_journal_dirtied       (edfs_image_t             *img,
+                                           uint32_t                  n_blocks);
+void           edfs_journal_revoke        (edfs_image_t             *img,
+                                           edfs_block_t              block);
+
+void           edfs_journal_get_stats     (edfs_journal_t           *journal,
+                                           edfs_journal_stats_t     *stats);
+
+#endif /* __EDFS_JOURNAL_H__ */
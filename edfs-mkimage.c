@@ -0,0 +1,845 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+/* Builds an EdFS image from a directory tree on the host, without
+ * mounting it. The complete layout is computed up front: inumbers are
+ * handed out breadth-first, so the entries of a directory have
+ * consecutive inodes, and the blocks of every directory and file are
+ * placed contiguously. The data area is then written front to back in
+ * large sequential writes, followed by the inode table, the bitmap and
+ * finally the super block.
+ */
+
+#include "edfs-common.h"
+#include "edfs-journal.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+
+#define MKIMAGE_DEFAULT_BLOCK_SIZE 4096
+#define MKIMAGE_WRITE_SIZE         (4 * 1024 * 1024)
+
+/* Spare blocks and inodes added to an image that is sized
+ * automatically: an eighth of what is used, at least this many.
+ */
+#define MKIMAGE_MIN_HEADROOM       64
+
+typedef struct
+{
+  char *path;                   /* on the host */
+  char name[EDFS_FILENAME_SIZE];
+  bool is_dir;
+  uint32_t size;                /* in bytes, for files */
+
+  /* Children are stored consecutively, as the tree is walked
+   * breadth-first.
+   */
+  uint32_t first_child;
+  uint32_t n_children;
+
+  /* Indirect blocks, if any, precede the data blocks. A file of a
+   * version 2 image has a single extent tree node instead, mapping all
+   * its data blocks as one extent.
+   */
+  edfs_block_t first_block;
+  uint32_t n_indirect;
+  uint32_t n_data;
+  bool has_extents;
+} mkimage_node_t;
+
+typedef struct
+{
+  mkimage_node_t *nodes;
+  uint32_t n_nodes;
+  uint32_t max_nodes;
+
+  uint32_t n_dirs;
+  uint32_t n_files;
+  uint64_t n_bytes;
+  uint32_t n_blocks;            /* directory, indirect and data blocks */
+} mkimage_tree_t;
+
+/* Output stream of the data area, which is written sequentially. */
+typedef struct
+{
+  int fd;
+  char *buf;
+  size_t used;
+  off_t offset;                 /* of buf[0] in the image */
+} mkimage_writer_t;
+
+
+/*
+ * Walking the host directory tree
+ */
+
+static mkimage_node_t *
+mkimage_add_node(mkimage_tree_t *tree)
+{
+  if (tree->n_nodes == tree->max_nodes)
+    {
+      uint32_t max_nodes = tree->max_nodes ? tree->max_nodes * 2 : 1024;
+      mkimage_node_t *nodes = realloc(tree->nodes, max_nodes * sizeof(mkimage_node_t));
+      if (!nodes)
+        return NULL;
+
+      tree->nodes = nodes;
+      tree->max_nodes = max_nodes;
+    }
+
+  mkimage_node_t *node = &tree->nodes[tree->n_nodes++];
+  memset(node, 0, sizeof(*node));
+  return node;
+}
+
+static int
+mkimage_compare_names(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Reads the names in directory @path, sorted, into a new array. */
+static char **
+mkimage_read_names(const char *path, uint32_t *n_names)
+{
+  DIR *dir = opendir(path);
+  if (!dir)
+    {
+      fprintf(stderr, "error: cannot open directory '%s': %s\n", path,
+              strerror(errno));
+      return NULL;
+    }
+
+  char **names = NULL;
+  uint32_t n = 0, max = 0;
+  struct dirent *dirent;
+
+  while ((dirent = readdir(dir)))
+    {
+      if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+        continue;
+
+      if (n == max)
+        {
+          max = max ? max * 2 : 64;
+          char **tmp = realloc(names, max * sizeof(char *));
+          if (!tmp)
+            break;
+          names = tmp;
+        }
+      if (!(names[n] = strdup(dirent->d_name)))
+        break;
+      n++;
+    }
+
+  /* An empty directory gives an empty array, not NULL. */
+  if (!dirent && !names)
+    names = malloc(sizeof(char *));
+
+  bool failed = dirent != NULL || !names;
+  closedir(dir);
+
+  if (failed)
+    {
+      fprintf(stderr, "error: out of memory\n");
+      for (uint32_t i = 0; i < n; i++)
+        free(names[i]);
+      free(names);
+      return NULL;
+    }
+
+  qsort(names, n, sizeof(char *), mkimage_compare_names);
+  *n_names = n;
+  return names;
+}
+
+/* Adds the entries of the directory at @index to the tree. Entries
+ * that EdFS cannot represent, such as symbolic links, are skipped with
+ * a warning.
+ */
+static bool
+mkimage_walk_dir(mkimage_tree_t *tree, uint32_t index, uint32_t max_entries)
+{
+  uint32_t n_names;
+  char **names = mkimage_read_names(tree->nodes[index].path, &n_names);
+  bool ok = true;
+
+  if (!names)
+    return false;
+
+  tree->nodes[index].first_child = tree->n_nodes;
+
+  for (uint32_t i = 0; i < n_names && ok; i++)
+    {
+      const char *parent = tree->nodes[index].path;
+      size_t len = strlen(parent) + strlen(names[i]) + 2;
+      char *path = malloc(len);
+      struct stat st;
+
+      if (!path)
+        {
+          fprintf(stderr, "error: out of memory\n");
+          ok = false;
+          break;
+        }
+      snprintf(path, len, "%s/%s", parent, names[i]);
+
+      if (lstat(path, &st) < 0)
+        {
+          fprintf(stderr, "error: cannot stat '%s': %s\n", path, strerror(errno));
+          ok = false;
+        }
+      else if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+        fprintf(stderr, "warning: skipping '%s', not a file or directory\n", path);
+      else if (strlen(names[i]) >= EDFS_FILENAME_SIZE)
+        {
+          fprintf(stderr, "error: name of '%s' is longer than %d bytes\n", path,
+                  (int)EDFS_FILENAME_SIZE - 1);
+          ok = false;
+        }
+      else if (S_ISREG(st.st_mode) && st.st_size > UINT32_MAX)
+        {
+          fprintf(stderr, "error: '%s' is too large\n", path);
+          ok = false;
+        }
+      else if (tree->nodes[index].n_children == max_entries)
+        {
+          fprintf(stderr, "error: '%s' holds more than %u entries\n",
+                  tree->nodes[index].path, max_entries);
+          ok = false;
+        }
+      else
+        {
+          mkimage_node_t *node = mkimage_add_node(tree);
+          if (!node)
+            {
+              fprintf(stderr, "error: out of memory\n");
+              ok = false;
+            }
+          else
+            {
+              node->path = path;
+              path = NULL;
+              strcpy(node->name, names[i]);
+              node->is_dir = S_ISDIR(st.st_mode);
+              node->size = node->is_dir ? 0 : st.st_size;
+
+              tree->nodes[index].n_children++;
+            }
+        }
+
+      free(path);
+    }
+
+  for (uint32_t i = 0; i < n_names; i++)
+    free(names[i]);
+  free(names);
+
+  return ok;
+}
+
+/* Walks the tree at @root breadth-first. */
+static bool
+mkimage_walk(mkimage_tree_t *tree, const char *root, uint32_t block_size)
+{
+  uint32_t max_entries = EDFS_INODE_N_BLOCKS * (block_size / sizeof(edfs_dir_entry_t));
+  struct stat st;
+
+  if (stat(root, &st) < 0 || !S_ISDIR(st.st_mode))
+    {
+      fprintf(stderr, "error: '%s' is not a directory\n", root);
+      return false;
+    }
+
+  mkimage_node_t *node = mkimage_add_node(tree);
+  if (!node || !(node->path = strdup(root)))
+    {
+      fprintf(stderr, "error: out of memory\n");
+      return false;
+    }
+  node->is_dir = true;
+
+  for (uint32_t i = 0; i < tree->n_nodes; i++)
+    if (tree->nodes[i].is_dir &&
+        !mkimage_walk_dir(tree, i, max_entries))
+      return false;
+
+  return true;
+}
+
+
+/*
+ * Layout
+ */
+
+/* Counts the blocks of every node and checks the files fit in the
+ * block pointers of an inode, in images of format @version.
+ */
+static bool
+mkimage_count_blocks(mkimage_tree_t *tree, uint16_t version,
+                     uint32_t block_size)
+{
+  uint32_t n_entries_block = block_size / sizeof(edfs_dir_entry_t);
+  uint32_t n_per_indirect = block_size / sizeof(edfs_block16_t);
+  uint64_t max_size = (uint64_t)EDFS_INODE_N_BLOCKS * n_per_indirect * block_size;
+
+  if (version >= EDFS_VERSION_2)
+    max_size = (uint64_t)(UINT32_MAX / block_size) * block_size;
+
+  tree->n_blocks = 0;
+
+  for (uint32_t i = 0; i < tree->n_nodes; i++)
+    {
+      mkimage_node_t *node = &tree->nodes[i];
+
+      if (node->is_dir)
+        {
+          node->n_data = (node->n_children + n_entries_block - 1) / n_entries_block;
+          node->n_indirect = 0;
+        }
+      else
+        {
+          if (node->size > max_size)
+            {
+              fprintf(stderr, "error: '%s' is larger than %llu bytes\n",
+                      node->path, (unsigned long long)max_size);
+              return false;
+            }
+
+          node->n_data = (node->size + block_size - 1) / block_size;
+          node->has_extents = version >= EDFS_VERSION_2 &&
+              node->n_data > EDFS_INODE_N_BLOCKS;
+          if (node->has_extents)
+            node->n_indirect = 1;
+          else
+            node->n_indirect = node->n_data > EDFS_INODE_N_BLOCKS
+                ? (node->n_data + n_per_indirect - 1) / n_per_indirect : 0;
+        }
+
+      tree->n_blocks += node->n_indirect + node->n_data;
+    }
+
+  return true;
+}
+
+static uint32_t
+mkimage_headroom(uint32_t n)
+{
+  return n / 8 > MKIMAGE_MIN_HEADROOM ? n / 8 : MKIMAGE_MIN_HEADROOM;
+}
+
+/* Sets up @sb for the tree, with a journal of @n_journal_blocks blocks.
+ * Zero @n_blocks or @n_inodes selects the smallest size that fits, plus
+ * some headroom. Returns the first block after the metadata, or an
+ * error code.
+ */
+static int
+mkimage_size(mkimage_tree_t     *tree,
+             edfs_super_block_t *sb,
+             uint16_t            version,
+             uint32_t            block_size,
+             uint32_t            n_blocks,
+             uint32_t            n_inodes,
+             uint32_t            n_journal_blocks)
+{
+  uint32_t inodes_per_block = block_size / sizeof(edfs_disk_inode_t);
+  int n_meta;
+
+  /* Inode 0 is not used. */
+  if (n_inodes == 0)
+    {
+      n_inodes = tree->n_nodes + 1 + mkimage_headroom(tree->n_nodes);
+      n_inodes = (n_inodes + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+    }
+  else if (n_inodes < tree->n_nodes + 1)
+    {
+      fprintf(stderr, "error: %u inodes needed\n", tree->n_nodes + 1);
+      return -ENOSPC;
+    }
+
+  if (n_blocks == 0)
+    {
+      /* The size of the bitmap depends on the number of blocks. */
+      uint64_t want = tree->n_blocks + mkimage_headroom(tree->n_blocks);
+      uint64_t max_blocks = edfs_get_max_blocks(version) - 1;
+
+      n_blocks = want < max_blocks ? want : max_blocks;
+      while (true)
+        {
+          n_meta = edfs_super_block_init(sb, version, block_size, n_blocks,
+                                         n_inodes, n_journal_blocks);
+          if (n_meta == -EINVAL || n_blocks == max_blocks ||
+              (n_meta > 0 && n_meta + want <= n_blocks))
+            break;
+
+          uint64_t next = n_meta > 0 ? n_meta + want : (uint64_t)n_blocks * 2;
+          n_blocks = next < max_blocks ? next : max_blocks;
+        }
+    }
+  else
+    n_meta = edfs_super_block_init(sb, version, block_size, n_blocks,
+                                   n_inodes, n_journal_blocks);
+
+  if (n_meta == -EINVAL)
+    return n_meta;
+  if (n_meta < 0 || n_meta + tree->n_blocks > n_blocks)
+    {
+      fprintf(stderr, "error: %u data blocks do not fit in %u blocks; "
+              "try a larger block size\n", tree->n_blocks, n_blocks);
+      return -ENOSPC;
+    }
+
+  return n_meta;
+}
+
+/* Places directory blocks first, as they are read on every lookup,
+ * then the blocks of every file, both in inode order.
+ */
+static void
+mkimage_place(mkimage_tree_t *tree, edfs_block_t first)
+{
+  edfs_block_t block = first;
+
+  for (int dirs = 1; dirs >= 0; dirs--)
+    for (uint32_t i = 0; i < tree->n_nodes; i++)
+      {
+        mkimage_node_t *node = &tree->nodes[i];
+
+        if (node->is_dir != dirs)
+          continue;
+
+        node->first_block = block;
+        block += node->n_indirect + node->n_data;
+      }
+}
+
+/* Fills in the inode of @node, with inumber @index + 1. */
+static void
+mkimage_fill_inode(mkimage_tree_t *tree, uint32_t index, edfs_disk_inode_t *inode)
+{
+  mkimage_node_t *node = &tree->nodes[index];
+
+  memset(inode, 0, sizeof(*inode));
+
+  if (node->is_dir)
+    {
+      inode->type = EDFS_INODE_TYPE_DIRECTORY;
+      inode->size = node->n_children * sizeof(edfs_dir_entry_t);
+    }
+  else
+    {
+      inode->type = EDFS_INODE_TYPE_FILE;
+      inode->size = node->size;
+    }
+
+  if (node->has_extents)
+    {
+      inode->type |= EDFS_INODE_TYPE_EXTENTS;
+      edfs_disk_inode_set_block(inode, 0, node->first_block);
+      return;
+    }
+
+  if (node->n_indirect > 0)
+    inode->type |= EDFS_INODE_TYPE_INDIRECT;
+
+  uint32_t n_pointers = node->n_indirect > 0 ? node->n_indirect : node->n_data;
+  for (uint32_t i = 0; i < n_pointers; i++)
+    edfs_disk_inode_set_block(inode, i, node->first_block + i);
+}
+
+
+/*
+ * Writing the image
+ */
+
+static int
+mkimage_flush(mkimage_writer_t *writer)
+{
+  size_t done = 0;
+
+  while (done < writer->used)
+    {
+      ssize_t n = pwrite(writer->fd, writer->buf + done, writer->used - done,
+                         writer->offset + done);
+      if (n < 0)
+        return -errno;
+      done += n;
+    }
+
+  writer->offset += writer->used;
+  writer->used = 0;
+  return 0;
+}
+
+/* Returns a pointer to @size bytes of room in the write buffer, at most
+ * MKIMAGE_WRITE_SIZE, and sets *@size to the room available.
+ */
+static char *
+mkimage_reserve(mkimage_writer_t *writer, size_t *size)
+{
+  if (writer->used == MKIMAGE_WRITE_SIZE && mkimage_flush(writer) < 0)
+    return NULL;
+
+  if (*size > MKIMAGE_WRITE_SIZE - writer->used)
+    *size = MKIMAGE_WRITE_SIZE - writer->used;
+
+  return writer->buf + writer->used;
+}
+
+/* Appends @size zero bytes. */
+static int
+mkimage_append_zero(mkimage_writer_t *writer, size_t size)
+{
+  while (size > 0)
+    {
+      size_t n = size;
+      char *ptr = mkimage_reserve(writer, &n);
+      if (!ptr)
+        return -EIO;
+
+      memset(ptr, 0, n);
+      writer->used += n;
+      size -= n;
+    }
+
+  return 0;
+}
+
+static int
+mkimage_write_dir(mkimage_writer_t *writer, mkimage_tree_t *tree,
+                  mkimage_node_t *node, uint32_t block_size)
+{
+  for (uint32_t i = 0; i < node->n_children; i++)
+    {
+      edfs_dir_entry_t entry = { .inumber = node->first_child + i + 1 };
+      size_t n = sizeof(entry);
+
+      strcpy(entry.filename, tree->nodes[node->first_child + i].name);
+
+      /* Directory blocks hold a whole number of entries. */
+      char *ptr = mkimage_reserve(writer, &n);
+      if (!ptr)
+        return -EIO;
+      memcpy(ptr, &entry, sizeof(entry));
+      writer->used += sizeof(entry);
+    }
+
+  size_t tail = (size_t)node->n_data * block_size - node->n_children * sizeof(edfs_dir_entry_t);
+  return mkimage_append_zero(writer, tail);
+}
+
+/* Writes the root of an extent tree that maps @n_data blocks from
+ * @data as a single extent.
+ */
+static int
+mkimage_write_extent_root(mkimage_writer_t *writer, edfs_block_t data,
+                          uint32_t n_data, uint32_t block_size)
+{
+  edfs_extent_header_t header = { .magic = EDFS_EXTENT_MAGIC, .n_entries = 1 };
+  edfs_extent_t extent = { 0, data, n_data };
+  size_t n = sizeof(header) + sizeof(extent);
+
+  /* Blocks start at a multiple of the block size in the buffer. */
+  char *ptr = mkimage_reserve(writer, &n);
+  if (!ptr)
+    return -EIO;
+  memcpy(ptr, &header, sizeof(header));
+  memcpy(ptr + sizeof(header), &extent, sizeof(extent));
+  writer->used += sizeof(header) + sizeof(extent);
+
+  return mkimage_append_zero(writer, block_size - sizeof(header) -
+                             sizeof(extent));
+}
+
+static int
+mkimage_write_file(mkimage_writer_t *writer, mkimage_node_t *node,
+                   uint32_t block_size)
+{
+  uint32_t n_per_indirect = block_size / sizeof(edfs_block16_t);
+  edfs_block_t data = node->first_block + node->n_indirect;
+
+  if (node->has_extents)
+    {
+      int res = mkimage_write_extent_root(writer, data, node->n_data,
+                                          block_size);
+      if (res < 0)
+        return res;
+      n_per_indirect = 0;
+    }
+
+  /* The indirect blocks map the data blocks that follow them. */
+  for (uint32_t i = 0; i < node->n_indirect * n_per_indirect; i++)
+    {
+      edfs_block16_t block = i < node->n_data ? data + i : EDFS_BLOCK_INVALID;
+      size_t n = sizeof(block);
+
+      char *ptr = mkimage_reserve(writer, &n);
+      if (!ptr)
+        return -EIO;
+      memcpy(ptr, &block, sizeof(block));
+      writer->used += sizeof(block);
+    }
+
+  if (node->n_data == 0)
+    return 0;
+
+  int fd = open(node->path, O_RDONLY);
+  if (fd < 0)
+    {
+      fprintf(stderr, "error: cannot open '%s': %s\n", node->path, strerror(errno));
+      return -errno;
+    }
+
+  size_t remaining = node->size;
+  int res = 0;
+
+  while (remaining > 0)
+    {
+      size_t n = remaining;
+      char *ptr = mkimage_reserve(writer, &n);
+      if (!ptr)
+        {
+          res = -EIO;
+          break;
+        }
+
+      ssize_t count = read(fd, ptr, n);
+      if (count < 0)
+        {
+          res = -errno;
+          fprintf(stderr, "error: cannot read '%s': %s\n", node->path,
+                  strerror(errno));
+          break;
+        }
+      if (count == 0)
+        {
+          fprintf(stderr, "warning: '%s' shrank while copying, padded with zeroes\n",
+                  node->path);
+          res = mkimage_append_zero(writer, remaining);
+          break;
+        }
+
+      writer->used += count;
+      remaining -= count;
+    }
+
+  close(fd);
+
+  if (res == 0)
+    res = mkimage_append_zero(writer, (size_t)node->n_data * block_size - node->size);
+  return res;
+}
+
+/* Writes the image @filename laid out as in @sb, of which the data
+ * area starts at block @first.
+ */
+static int
+mkimage_write(const char *filename, mkimage_tree_t *tree,
+              edfs_super_block_t *sb, edfs_block_t first)
+{
+  uint32_t block_size = sb->block_size;
+  edfs_block_t end = first + tree->n_blocks;
+
+  uint8_t *bitmap = calloc(sb->bitmap_size, 1);
+  edfs_disk_inode_t *inodes = calloc(sb->inode_table_size, 1);
+  mkimage_writer_t writer = { .fd = -1, .buf = malloc(MKIMAGE_WRITE_SIZE) };
+  int res = 0;
+
+  if (!bitmap || !inodes || !writer.buf)
+    {
+      res = -ENOMEM;
+      goto out;
+    }
+
+  for (uint32_t i = 0; i < end; i++)
+    bitmap[i / 8] |= 1 << (i % 8);
+  for (uint32_t i = 0; i < tree->n_nodes; i++)
+    mkimage_fill_inode(tree, i, &inodes[i + 1]);
+
+  writer.fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (writer.fd < 0)
+    {
+      res = -errno;
+      goto out;
+    }
+  if (ftruncate(writer.fd, (off_t)sb->n_blocks * block_size) < 0)
+    {
+      res = -errno;
+      goto out;
+    }
+
+  writer.offset = edfs_get_block_offset(sb, first);
+  for (int dirs = 1; dirs >= 0 && res == 0; dirs--)
+    for (uint32_t i = 0; i < tree->n_nodes && res == 0; i++)
+      {
+        mkimage_node_t *node = &tree->nodes[i];
+
+        if (node->is_dir != dirs)
+          continue;
+
+        res = dirs ? mkimage_write_dir(&writer, tree, node, block_size)
+                   : mkimage_write_file(&writer, node, block_size);
+      }
+  if (res == 0)
+    res = mkimage_flush(&writer);
+
+  /* The super block goes last, so an interrupted build does not leave
+   * an image that looks valid.
+   */
+  if (res == 0 &&
+      (pwrite(writer.fd, inodes, sb->inode_table_size,
+              sb->inode_table_start) != sb->inode_table_size ||
+       pwrite(writer.fd, bitmap, sb->bitmap_size, sb->bitmap_start) != sb->bitmap_size))
+    res = -EIO;
+  if (res == 0)
+    res = edfs_journal_format(writer.fd, sb);
+  if (res == 0)
+    res = edfs_super_block_write(writer.fd, sb);
+
+  if (res == 0 && fsync(writer.fd) < 0)
+    res = -errno;
+
+out:
+  if (writer.fd >= 0 && close(writer.fd) < 0 && res == 0)
+    res = -errno;
+  free(writer.buf);
+  free(inodes);
+  free(bitmap);
+
+  return res;
+}
+
+
+/*
+ * Main
+ */
+
+static void
+usage(const char *execname)
+{
+  fprintf(stderr, "usage: %s [-b block_size] [-n blocks] [-i inodes] [-j journal_blocks]\n"
+          "       [-v version] image directory\n\n"
+          "Builds image from the files and directories below directory. By\n"
+          "default, the image is sized to fit the tree with some room to spare.\n"
+          "With -j, the image gets a metadata journal of that many blocks.\n"
+          "Version 3, the default, has 32-bit block numbers and allows blocks\n"
+          "of up to 64 KiB. Version 2 maps large files by extents; version 1\n"
+          "images can be read by older versions of EdFS.\n",
+          execname);
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint32_t block_size = MKIMAGE_DEFAULT_BLOCK_SIZE;
+  uint32_t n_blocks = 0;
+  uint32_t n_inodes = 0;
+  uint32_t n_journal_blocks = 0;
+  uint16_t version = EDFS_VERSION_LATEST;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "b:n:i:j:v:")) != -1)
+    {
+      switch (opt)
+        {
+          case 'b':
+            block_size = strtoul(optarg, NULL, 0);
+            break;
+          case 'n':
+            n_blocks = strtoul(optarg, NULL, 0);
+            break;
+          case 'i':
+            n_inodes = strtoul(optarg, NULL, 0);
+            break;
+          case 'j':
+            n_journal_blocks = strtoul(optarg, NULL, 0);
+            break;
+          case 'v':
+            version = strtoul(optarg, NULL, 0);
+            break;
+          default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+  if (argc - optind != 2)
+    {
+      usage(argv[0]);
+      return -1;
+    }
+
+  const char *image = argv[optind];
+  mkimage_tree_t tree = { 0, };
+  edfs_super_block_t sb;
+  int first = -1;
+  int res = -1;
+
+  if (version < EDFS_VERSION_1 || version > EDFS_VERSION_LATEST)
+    {
+      fprintf(stderr, "error: version must be from %d to %d\n",
+              EDFS_VERSION_1, EDFS_VERSION_LATEST);
+      return -1;
+    }
+
+  if (block_size < EDFS_MIN_BLOCK_SIZE ||
+      block_size > edfs_get_max_block_size(version) ||
+      (block_size & (block_size - 1)) != 0)
+    {
+      fprintf(stderr, "error: block size must be a power of two from %d to %u "
+              "in version %u images\n",
+              EDFS_MIN_BLOCK_SIZE, edfs_get_max_block_size(version), version);
+      return -1;
+    }
+
+  if (mkimage_walk(&tree, argv[optind + 1], block_size) &&
+      mkimage_count_blocks(&tree, version, block_size))
+    {
+      first = mkimage_size(&tree, &sb, version, block_size, n_blocks,
+                           n_inodes, n_journal_blocks);
+
+      if (first == -EINVAL)
+        fprintf(stderr, "error: invalid image size\n");
+      else if (first > 0)
+        {
+          mkimage_place(&tree, first);
+          res = mkimage_write(image, &tree, &sb, first);
+          if (res < 0)
+            fprintf(stderr, "error: cannot write '%s': %s\n", image,
+                    strerror(-res));
+        }
+    }
+
+  if (res == 0)
+    {
+      for (uint32_t i = 0; i < tree.n_nodes; i++)
+        {
+          if (tree.nodes[i].is_dir)
+            tree.n_dirs++;
+          else
+            tree.n_files++;
+          tree.n_bytes += tree.nodes[i].size;
+        }
+
+      printf("%s: %u directories, %u files, %llu bytes\n", image,
+             tree.n_dirs, tree.n_files, (unsigned long long)tree.n_bytes);
+      printf("%u of %u blocks of %u bytes, %u of %u inodes in use\n",
+             first + tree.n_blocks, sb.n_blocks, sb.block_size,
+             tree.n_nodes, sb.inode_table_n_inodes - 1);
+    }
+
+  for (uint32_t i = 0; i < tree.n_nodes; i++)
+    free(tree.nodes[i].path);
+  free(tree.nodes);
+
+  return res < 0 ? -1 : 0;
+}
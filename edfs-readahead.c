@@ -0,0 +1,245 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#include "edfs-readahead.h"
+#include "edfs-journal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+
+/* Number of windows that can be queued. */
+#define EDFS_READAHEAD_QUEUE_SIZE 64
+
+/* A window to read ahead. The queue holds a reference to the file. */
+typedef struct
+{
+  edfs_file_t *file;
+  uint32_t first;
+  uint32_t last;
+} edfs_readahead_window_t;
+
+struct _edfs_readahead
+{
+  edfs_image_t *img;
+  uint32_t max_blocks;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool stop;
+
+  edfs_readahead_window_t queue[EDFS_READAHEAD_QUEUE_SIZE];
+  uint32_t head;
+  uint32_t n_queued;
+
+  uint64_t windows;
+  uint64_t dropped;
+  uint64_t blocks;
+
+  int n_threads;
+  pthread_t threads[];
+};
+
+
+static void *
+edfs_readahead_thread(void *data)
+{
+  edfs_readahead_t *ra = data;
+
+  pthread_mutex_lock(&ra->lock);
+
+  while (true)
+    {
+      while (ra->n_queued == 0 && !ra->stop)
+        pthread_cond_wait(&ra->cond, &ra->lock);
+      if (ra->stop)
+        break;
+
+      edfs_readahead_window_t window = ra->queue[ra->head];
+      ra->head = (ra->head + 1) % EDFS_READAHEAD_QUEUE_SIZE;
+      ra->n_queued--;
+
+      pthread_mutex_unlock(&ra->lock);
+
+      EDFS_TRACE_BEGIN(span);
+      int n_blocks = edfs_file_prefetch(ra->img, window.file,
+                                        window.first, window.last);
+      EDFS_TRACE_END(span, "readahead");
+
+      /* Dropping the last reference may release an unlinked file. */
+      edfs_journal_begin(ra->img);
+      edfs_file_put(ra->img, window.file);
+      edfs_journal_end(ra->img);
+
+      pthread_mutex_lock(&ra->lock);
+      if (n_blocks > 0)
+        ra->blocks += n_blocks;
+    }
+
+  pthread_mutex_unlock(&ra->lock);
+
+  return NULL;
+}
+
+/* Creates a pool of @n_threads threads reading ahead in windows of up
+ * to @max_size bytes. Returns NULL if either is 0, which disables
+ * readahead, or on failure.
+ */
+edfs_readahead_t *
+edfs_readahead_new(edfs_image_t *img, size_t max_size, int n_threads)
+{
+  uint32_t max_blocks = max_size / img->sb.block_size;
+
+  if (max_blocks == 0 || n_threads <= 0)
+    return NULL;
+
+  edfs_readahead_t *ra = calloc(1, sizeof(edfs_readahead_t) +
+                                n_threads * sizeof(pthread_t));
+  if (!ra)
+    return NULL;
+
+  ra->img = img;
+  ra->max_blocks = max_blocks;
+  pthread_mutex_init(&ra->lock, NULL);
+  pthread_cond_init(&ra->cond, NULL);
+
+  for (; ra->n_threads < n_threads; ra->n_threads++)
+    if (pthread_create(&ra->threads[ra->n_threads], NULL,
+                       edfs_readahead_thread, ra) != 0)
+      break;
+
+  if (ra->n_threads == 0)
+    {
+      edfs_readahead_free(ra);
+      return NULL;
+    }
+
+  return ra;
+}
+
+/* Stops the threads and drops the windows still queued. Must be called
+ * before the file table of the image is freed.
+ */
+void
+edfs_readahead_free(edfs_readahead_t *ra)
+{
+  if (!ra)
+    return;
+
+  pthread_mutex_lock(&ra->lock);
+  ra->stop = true;
+  pthread_cond_broadcast(&ra->cond);
+  pthread_mutex_unlock(&ra->lock);
+
+  for (int i = 0; i < ra->n_threads; i++)
+    pthread_join(ra->threads[i], NULL);
+
+  edfs_journal_begin(ra->img);
+  for (; ra->n_queued > 0; ra->n_queued--)
+    {
+      edfs_file_put(ra->img, ra->queue[ra->head].file);
+      ra->head = (ra->head + 1) % EDFS_READAHEAD_QUEUE_SIZE;
+    }
+  edfs_journal_end(ra->img);
+
+  pthread_mutex_destroy(&ra->lock);
+  pthread_cond_destroy(&ra->cond);
+  free(ra);
+}
+
+static void
+edfs_readahead_queue(edfs_readahead_t *ra, edfs_file_t *file,
+                     uint32_t first, uint32_t last)
+{
+  pthread_mutex_lock(&ra->lock);
+
+  if (ra->n_queued == EDFS_READAHEAD_QUEUE_SIZE)
+    {
+      ra->dropped++;
+      pthread_mutex_unlock(&ra->lock);
+      return;
+    }
+
+  edfs_file_ref(ra->img, file);
+
+  uint32_t tail = (ra->head + ra->n_queued) % EDFS_READAHEAD_QUEUE_SIZE;
+  ra->queue[tail].file = file;
+  ra->queue[tail].first = first;
+  ra->queue[tail].last = last;
+  ra->n_queued++;
+  ra->windows++;
+
+  pthread_cond_signal(&ra->cond);
+  pthread_mutex_unlock(&ra->lock);
+}
+
+/* Records a read of @size bytes at @offset of @file, of which the
+ * caller holds a reference, and queues the next window if the file is
+ * read sequentially.
+ */
+void
+edfs_readahead_note(edfs_image_t *img, edfs_file_t *file,
+                    off_t offset, size_t size)
+{
+  edfs_readahead_t *ra = img->readahead;
+  uint32_t block_size = img->sb.block_size;
+  uint32_t first = offset / block_size;
+  uint32_t last = (offset + size - 1) / block_size;
+  uint32_t ahead = 0, end = 0;
+
+  pthread_mutex_lock(&file->map_lock);
+
+  /* Requests of a sequential reader may arrive slightly out of order
+   * from several threads, so any read inside the current window counts
+   * as sequential.
+   */
+  bool sequential = offset == file->ra_next ||
+      (file->ra_window > 0 && first >= file->ra_end - file->ra_window &&
+       first < file->ra_end);
+
+  if (!sequential)
+    {
+      file->ra_window = 0;
+      file->ra_end = 0;
+    }
+  else if (file->ra_window == 0 ||
+           last + file->ra_window / 2 >= file->ra_end)
+    {
+      /* Start at twice the request size, then double every window. */
+      uint32_t window = file->ra_window ? 2 * file->ra_window
+                                        : 2 * (last - first + 1);
+      file->ra_window = window < ra->max_blocks ? window : ra->max_blocks;
+
+      ahead = last + 1 > file->ra_end ? last + 1 : file->ra_end;
+      end = last + 1 + file->ra_window;
+      file->ra_end = end;
+    }
+
+  if (offset + (off_t)size > file->ra_next || !sequential)
+    file->ra_next = offset + size;
+
+  pthread_mutex_unlock(&file->map_lock);
+
+  if (end > ahead)
+    edfs_readahead_queue(ra, file, ahead, end - 1);
+}
+
+void
+edfs_readahead_get_stats(edfs_readahead_t *ra, edfs_readahead_stats_t *stats)
+{
+  memset(stats, 0, sizeof(edfs_readahead_stats_t));
+  if (!ra)
+    return;
+
+  pthread_mutex_lock(&ra->lock);
+  stats->windows = ra->windows;
+  stats->dropped = ra->dropped;
+  stats->blocks = ra->blocks;
+  pthread_mutex_unlock(&ra->lock);
+
+  stats->max_size = (size_t)ra->max_blocks * ra->img->sb.block_size;
+  stats->n_threads = ra->n_threads;
+}
@@ -0,0 +1,60 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#ifndef __EDFS_READAHEAD_H__
+#define __EDFS_READAHEAD_H__
+
+#include "edfs-common.h"
+#include "edfs-file.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+
+/* Sequential readahead. Every read of a file is reported through
+ * edfs_readahead_note(), which keeps track of the offset following the
+ * last read of the file object. A read that starts there, or inside
+ * the window read ahead last, continues a sequential stream: the
+ * window grows from twice the request size up to the maximum, and once
+ * the reader has consumed half of it the next window is queued. Any
+ * other read closes the window, so random reads do not prefetch.
+ *
+ * A small pool of threads works through the queue. A thread resolves
+ * the block mapping of the window, reading indirect blocks through the
+ * block cache, and asks the host to read the data of every run of
+ * blocks into its page cache, from which the reads of the file are
+ * served. The queue is bounded; windows that do not fit are dropped.
+ */
+typedef struct _edfs_readahead edfs_readahead_t;
+
+typedef struct
+{
+  uint64_t windows;        /* windows queued */
+  uint64_t dropped;        /* windows not queued, the queue was full */
+  uint64_t blocks;         /* blocks prefetched */
+
+  size_t max_size;
+  int n_threads;
+} edfs_readahead_stats_t;
+
+#define EDFS_READAHEAD_DEFAULT_SIZE    (512 * 1024)
+#define EDFS_READAHEAD_DEFAULT_THREADS 2
+
+
+edfs_readahead_t *edfs_readahead_new      (edfs_image_t           *img,
+                                           size_t                  max_size,
+                                           int                     n_threads);
+void           edfs_readahead_free        (edfs_readahead_t       *ra);
+
+void           edfs_readahead_note        (edfs_image_t           *img,
+                                           edfs_file_t            *file,
+                                           off_t                   offset,
+                                           size_t                  size);
+
+void           edfs_readahead_get_stats   (edfs_readahead_t       *ra,
+                                           edfs_readahead_stats_t *stats);
+
+#endif /* __EDFS_READAHEAD_H__ */
@@ -0,0 +1,223 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#include "edfs-stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+
+/* The counters of a thread. A thread only writes its own counters,
+ * with plain loads and stores; readers may see a slightly stale sum.
+ * When a thread exits its counters are kept, and handed to the next
+ * new thread, so thread pools that come and go do not pile up memory.
+ */
+typedef struct _edfs_stats_thread
+{
+  struct _edfs_stats_thread *next;
+  edfs_stats_t *stats;
+  bool in_use;
+
+  edfs_stats_op_t ops[];
+} edfs_stats_thread_t;
+
+struct _edfs_stats
+{
+  int n_ops;
+  pthread_key_t key;
+
+  pthread_mutex_t lock;        /* protects the list of threads */
+  edfs_stats_thread_t *threads;
+};
+
+#define EDFS_STATS_CACHE_LINE 64
+
+
+static void
+edfs_stats_thread_exit(void *data)
+{
+  edfs_stats_thread_t *thread = data;
+
+  pthread_mutex_lock(&thread->stats->lock);
+  thread->in_use = false;
+  pthread_mutex_unlock(&thread->stats->lock);
+}
+
+edfs_stats_t *
+edfs_stats_new(int n_ops)
+{
+  edfs_stats_t *stats = calloc(1, sizeof(edfs_stats_t));
+  if (!stats)
+    return NULL;
+
+  if (pthread_key_create(&stats->key, edfs_stats_thread_exit) != 0)
+    {
+      free(stats);
+      return NULL;
+    }
+
+  stats->n_ops = n_ops;
+  pthread_mutex_init(&stats->lock, NULL);
+
+  return stats;
+}
+
+void
+edfs_stats_free(edfs_stats_t *stats)
+{
+  if (!stats)
+    return;
+
+  pthread_key_delete(stats->key);
+  pthread_mutex_destroy(&stats->lock);
+
+  while (stats->threads)
+    {
+      edfs_stats_thread_t *next = stats->threads->next;
+      free(stats->threads);
+      stats->threads = next;
+    }
+
+  free(stats);
+}
+
+/* Returns the counters of the calling thread, taking over those of an
+ * exited thread if possible.
+ */
+static edfs_stats_thread_t *
+edfs_stats_thread_get(edfs_stats_t *stats)
+{
+  edfs_stats_thread_t *thread = pthread_getspecific(stats->key);
+  if (thread)
+    return thread;
+
+  pthread_mutex_lock(&stats->lock);
+
+  for (thread = stats->threads; thread; thread = thread->next)
+    if (!thread->in_use)
+      break;
+
+  if (!thread)
+    {
+      size_t size = sizeof(edfs_stats_thread_t) +
+          stats->n_ops * sizeof(edfs_stats_op_t);
+
+      /* Counters of different threads never share a cache line. */
+      size = (size + EDFS_STATS_CACHE_LINE - 1) &
+          ~(size_t)(EDFS_STATS_CACHE_LINE - 1);
+      if (posix_memalign((void **)&thread, EDFS_STATS_CACHE_LINE, size) == 0)
+        {
+          memset(thread, 0, size);
+          thread->stats = stats;
+          thread->next = stats->threads;
+          stats->threads = thread;
+        }
+      else
+        thread = NULL;
+    }
+
+  if (thread)
+    {
+      thread->in_use = true;
+      pthread_setspecific(stats->key, thread);
+    }
+
+  pthread_mutex_unlock(&stats->lock);
+
+  return thread;
+}
+
+/* Timestamp in nanoseconds, to pass to edfs_stats_record(). */
+uint64_t
+edfs_stats_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Adds to a counter only written by the calling thread. */
+static inline void
+edfs_stats_add(uint64_t *counter, uint64_t n)
+{
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                   __ATOMIC_RELAXED);
+}
+
+/* Records a call of @op that started at @start, as returned by
+ * edfs_stats_now(), and has just completed.
+ */
+void
+edfs_stats_record(edfs_stats_t *stats, int op, uint64_t start, bool error)
+{
+  uint64_t ns = edfs_stats_now() - start;
+  uint64_t us = ns / 1000;
+
+  edfs_stats_thread_t *thread = edfs_stats_thread_get(stats);
+  if (!thread)
+    return;
+
+  int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+  if (bucket >= EDFS_STATS_N_BUCKETS)
+    bucket = EDFS_STATS_N_BUCKETS - 1;
+
+  edfs_stats_op_t *op_stats = &thread->ops[op];
+  edfs_stats_add(&op_stats->calls, 1);
+  edfs_stats_add(&op_stats->total_ns, ns);
+  edfs_stats_add(&op_stats->buckets[bucket], 1);
+  if (error)
+    edfs_stats_add(&op_stats->errors, 1);
+}
+
+/* Sums the counters of @op over all threads. */
+void
+edfs_stats_get(edfs_stats_t *stats, int op, edfs_stats_op_t *op_stats)
+{
+  memset(op_stats, 0, sizeof(edfs_stats_op_t));
+
+  pthread_mutex_lock(&stats->lock);
+
+  for (edfs_stats_thread_t *thread = stats->threads; thread;
+       thread = thread->next)
+    {
+      edfs_stats_op_t *src = &thread->ops[op];
+
+      op_stats->calls += __atomic_load_n(&src->calls, __ATOMIC_RELAXED);
+      op_stats->errors += __atomic_load_n(&src->errors, __ATOMIC_RELAXED);
+      op_stats->total_ns += __atomic_load_n(&src->total_ns, __ATOMIC_RELAXED);
+      for (int b = 0; b < EDFS_STATS_N_BUCKETS; b++)
+        op_stats->buckets[b] += __atomic_load_n(&src->buckets[b],
+                                                __ATOMIC_RELAXED);
+    }
+
+  pthread_mutex_unlock(&stats->lock);
+}
+
+/* Returns the upper bound, in microseconds, of the bucket holding the
+ * given @fraction of the calls, e.g. 0.99 for the 99th percentile.
+ */
+uint64_t
+edfs_stats_percentile(const edfs_stats_op_t *op_stats, double fraction)
+{
+  uint64_t n_calls = 0;
+
+  for (int b = 0; b < EDFS_STATS_N_BUCKETS; b++)
+    n_calls += op_stats->buckets[b];
+
+  uint64_t target = (uint64_t)(fraction * n_calls + 0.5);
+  uint64_t seen = 0;
+
+  for (int b = 0; b < EDFS_STATS_N_BUCKETS; b++)
+    {
+      seen += op_stats->buckets[b];
+      if (seen >= target && seen > 0)
+        return 1ULL << b;
+    }
+
+  return 0;
+}
@@ -0,0 +1,52 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#ifndef __EDFS_STATS_H__
+#define __EDFS_STATS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+
+/* Call counts and latency histograms of a fixed set of operations,
+ * such as the FUSE callbacks of edfuse. Every thread records into its
+ * own set of counters, so recording takes no locks and shares no cache
+ * lines; only the first call of a thread registers its counters. The
+ * counters of all threads are summed when read.
+ *
+ * Latencies are kept in power-of-two buckets of microseconds: bucket 0
+ * counts calls faster than 1 us, bucket b > 0 those of at least
+ * 2^(b - 1) and below 2^b us. The last bucket takes everything slower.
+ */
+typedef struct _edfs_stats edfs_stats_t;
+
+#define EDFS_STATS_N_BUCKETS 32
+
+typedef struct
+{
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t total_ns;
+  uint64_t buckets[EDFS_STATS_N_BUCKETS];
+} edfs_stats_op_t;
+
+
+edfs_stats_t  *edfs_stats_new             (int                    n_ops);
+void           edfs_stats_free            (edfs_stats_t          *stats);
+
+uint64_t       edfs_stats_now             (void);
+void           edfs_stats_record          (edfs_stats_t          *stats,
+                                           int                    op,
+                                           uint64_t               start,
+                                           bool                   error);
+
+void           edfs_stats_get             (edfs_stats_t          *stats,
+                                           int                    op,
+                                           edfs_stats_op_t       *op_stats);
+uint64_t       edfs_stats_percentile      (const edfs_stats_op_t *op_stats,
+                                           double                 fraction);
+
+#endif /* __EDFS_STATS_H__ */
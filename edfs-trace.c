@@ -0,0 +1,359 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#include "edfs-trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+
+#ifdef EDFS_TRACE
+
+typedef struct
+{
+  const char *name;
+  uint64_t start;
+  uint64_t end;
+} edfs_trace_event_t;
+
+/* The ring buffer of a thread. Only the owner writes events; @head
+ * counts all events ever recorded, the last @n_events of which are
+ * kept. As with the statistics, the buffer of an exited thread is
+ * handed to the next new thread, together with its events.
+ */
+typedef struct _edfs_trace_thread
+{
+  struct _edfs_trace_thread *next;
+  bool in_use;
+  int tid;
+
+  uint64_t head;
+  edfs_trace_event_t events[];
+} edfs_trace_thread_t;
+
+bool edfs_trace_enabled = false;
+
+static struct
+{
+  pthread_mutex_t lock;        /* protects all but the events */
+  pthread_key_t key;
+  bool have_key;
+
+  size_t n_events;
+  uint64_t epoch;
+
+  int n_threads;
+  edfs_trace_thread_t *threads;
+} edfs_trace =
+{
+  .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+
+static void
+edfs_trace_thread_exit(void *data)
+{
+  edfs_trace_thread_t *thread = data;
+
+  pthread_mutex_lock(&edfs_trace.lock);
+  thread->in_use = false;
+  pthread_mutex_unlock(&edfs_trace.lock);
+}
+
+/* Enables tracing, keeping the last @n_events spans of every thread.
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int
+edfs_trace_start(size_t n_events)
+{
+  if (n_events == 0)
+    return -EINVAL;
+
+  pthread_mutex_lock(&edfs_trace.lock);
+
+  if (edfs_trace.have_key)
+    {
+      pthread_mutex_unlock(&edfs_trace.lock);
+      return -EBUSY;
+    }
+
+  if (pthread_key_create(&edfs_trace.key, edfs_trace_thread_exit) != 0)
+    {
+      pthread_mutex_unlock(&edfs_trace.lock);
+      return -ENOMEM;
+    }
+
+  edfs_trace.have_key = true;
+  edfs_trace.n_events = n_events;
+  edfs_trace.epoch = edfs_trace_now();
+
+  pthread_mutex_unlock(&edfs_trace.lock);
+
+  __atomic_store_n(&edfs_trace_enabled, true, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Disables tracing and drops all recorded spans. No other thread may
+ * be recording, which is the case once the file system is unmounted.
+ */
+void
+edfs_trace_stop(void)
+{
+  __atomic_store_n(&edfs_trace_enabled, false, __ATOMIC_RELEASE);
+
+  pthread_mutex_lock(&edfs_trace.lock);
+
+  while (edfs_trace.threads)
+    {
+      edfs_trace_thread_t *next = edfs_trace.threads->next;
+      free(edfs_trace.threads);
+      edfs_trace.threads = next;
+    }
+
+  if (edfs_trace.have_key)
+    {
+      pthread_key_delete(edfs_trace.key);
+      edfs_trace.have_key = false;
+    }
+  edfs_trace.n_events = 0;
+
+  pthread_mutex_unlock(&edfs_trace.lock);
+}
+
+static edfs_trace_thread_t *
+edfs_trace_thread_get(void)
+{
+  edfs_trace_thread_t *thread = pthread_getspecific(edfs_trace.key);
+  if (thread)
+    return thread;
+
+  pthread_mutex_lock(&edfs_trace.lock);
+
+  for (thread = edfs_trace.threads; thread; thread = thread->next)
+    if (!thread->in_use)
+      break;
+
+  if (!thread)
+    {
+      thread = calloc(1, sizeof(edfs_trace_thread_t) +
+                      edfs_trace.n_events * sizeof(edfs_trace_event_t));
+      if (thread)
+        {
+          thread->tid = ++edfs_trace.n_threads;
+          thread->next = edfs_trace.threads;
+          edfs_trace.threads = thread;
+        }
+    }
+
+  if (thread)
+    {
+      thread->in_use = true;
+      pthread_setspecific(edfs_trace.key, thread);
+    }
+
+  pthread_mutex_unlock(&edfs_trace.lock);
+
+  return thread;
+}
+
+/* Records a span called @name, that started at @start as returned by
+ * edfs_trace_now(), and ends now.
+ */
+void
+edfs_trace_record(const char *name, uint64_t start)
+{
+  uint64_t end = edfs_trace_now();
+
+  edfs_trace_thread_t *thread = edfs_trace_thread_get();
+  if (!thread)
+    return;
+
+  edfs_trace_event_t *event;
+
+  event = &thread->events[thread->head % edfs_trace.n_events];
+  event->name = name;
+  event->start = start;
+  event->end = end;
+
+  __atomic_store_n(&thread->head, thread->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Writes the recorded spans to @filename as Chrome trace-event JSON.
+ * Recording continues. Returns 0 on success, a negative error code
+ * otherwise.
+ */
+int
+edfs_trace_dump(const char *filename)
+{
+  FILE *out = fopen(filename, "w");
+  if (!out)
+    return -errno;
+
+  int pid = getpid();
+  const char *sep = "";
+
+  fprintf(out, "{\"traceEvents\":[");
+
+  pthread_mutex_lock(&edfs_trace.lock);
+
+  for (edfs_trace_thread_t *thread = edfs_trace.threads; thread;
+       thread = thread->next)
+    {
+      uint64_t head = __atomic_load_n(&thread->head, __ATOMIC_ACQUIRE);
+      uint64_t first = head > edfs_trace.n_events ?
+          head - edfs_trace.n_events : 0;
+
+      for (uint64_t i = first; i < head; i++)
+        {
+          const edfs_trace_event_t *event =
+              &thread->events[i % edfs_trace.n_events];
+
+          fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"edfs\",\"ph\":\"X\","
+                  "\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                  sep, event->name, pid, thread->tid,
+                  (event->start - edfs_trace.epoch) / 1000.0,
+                  (event->end - event->start) / 1000.0);
+          sep = ",";
+        }
+    }
+
+  pthread_mutex_unlock(&edfs_trace.lock);
+
+  fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+  if (fclose(out) != 0)
+    return -errno;
+
+  return 0;
+}
+
+/* Dumping on a signal: the handler only wakes up a thread through a
+ * non-blocking pipe, the thread does the actual work.
+ */
+static int edfs_trace_pipe[2] = { -1, -1 };
+
+static void
+edfs_trace_signal_handler(int signo)
+{
+  int saved_errno = errno;
+  char c = 0;
+
+  if (write(edfs_trace_pipe[1], &c, 1) < 0)
+    {
+      /* The pipe is full, dumps are pending already. */
+    }
+
+  errno = saved_errno;
+}
+
+static void *
+edfs_trace_dump_thread(void *data)
+{
+  const char *filename = data;
+  char c;
+
+  while (true)
+    {
+      ssize_t n = read(edfs_trace_pipe[0], &c, 1);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+
+      if (edfs_trace_dump(filename) < 0)
+        fprintf(stderr, "error: could not write trace to '%s'\n", filename);
+    }
+
+  return NULL;
+}
+
+/* Dumps the trace to @filename whenever signal @signo is received. Must
+ * be called after the process has daemonized, the dumping thread does
+ * not survive a fork. Returns 0 on success, a negative error code
+ * otherwise.
+ */
+int
+edfs_trace_dump_on_signal(int signo, const char *filename)
+{
+  pthread_t thread;
+
+  if (edfs_trace_pipe[0] >= 0)
+    return -EBUSY;
+
+  if (pipe(edfs_trace_pipe) < 0)
+    return -errno;
+
+  fcntl(edfs_trace_pipe[1], F_SETFL, O_NONBLOCK);
+
+  if (pthread_create(&thread, NULL, edfs_trace_dump_thread,
+                     (void *)filename) != 0)
+    {
+      close(edfs_trace_pipe[0]);
+      close(edfs_trace_pipe[1]);
+      edfs_trace_pipe[0] = edfs_trace_pipe[1] = -1;
+      return -EAGAIN;
+    }
+  pthread_detach(thread);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(struct sigaction));
+  sa.sa_handler = edfs_trace_signal_handler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+
+  if (sigaction(signo, &sa, NULL) < 0)
+    return -errno;
+
+  return 0;
+}
+
+#else /* !EDFS_TRACE */
+
+int
+edfs_trace_start(size_t n_events)
+{
+  return -ENOTSUP;
+}
+
+void
+edfs_trace_stop(void)
+{
+}
+
+void
+edfs_trace_record(const char *name, uint64_t start)
+{
+}
+
+int
+edfs_trace_dump(const char *filename)
+{
+  return -ENOTSUP;
+}
+
+int
+edfs_trace_dump_on_signal(int signo, const char *filename)
+{
+  return -ENOTSUP;
+}
+
+#endif /* EDFS_TRACE */
+
+/* Timestamp in nanoseconds, to pass to edfs_trace_record(). */
+uint64_t
+edfs_trace_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
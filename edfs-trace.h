@@ -0,0 +1,75 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#ifndef __EDFS_TRACE_H__
+#define __EDFS_TRACE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+
+/* Tracing of spans, such as FUSE callbacks and I/O on the image, for
+ * viewing in chrome://tracing or Perfetto.
+ *
+ * Tracing is compiled in with -DEDFS_TRACE (make TRACE=1); otherwise
+ * the EDFS_TRACE_BEGIN() and EDFS_TRACE_END() macros are empty. When
+ * compiled in, it is off until edfs_trace_start() is called, and a span
+ * costs a single load of a global flag.
+ *
+ * Every thread records into a ring buffer of its own, without locks;
+ * once full, its oldest spans are overwritten. edfs_trace_dump() writes
+ * the spans of all threads in the Chrome trace-event JSON format. Spans
+ * recorded during a dump may come out garbled.
+ *
+ * Span names must be string constants, only their address is kept.
+ */
+
+#define EDFS_TRACE_DEFAULT_EVENTS 65536
+
+int            edfs_trace_start           (size_t                 n_events);
+void           edfs_trace_stop            (void);
+
+uint64_t       edfs_trace_now             (void);
+void           edfs_trace_record          (const char            *name,
+                                           uint64_t               start);
+
+int            edfs_trace_dump            (const char            *filename);
+int            edfs_trace_dump_on_signal  (int                    signo,
+                                           const char            *filename);
+
+#ifdef EDFS_TRACE
+
+extern bool edfs_trace_enabled;
+
+static inline uint64_t
+edfs_trace_begin(void)
+{
+  if (__builtin_expect(__atomic_load_n(&edfs_trace_enabled,
+                                       __ATOMIC_RELAXED), 0))
+    return edfs_trace_now();
+  return 0;
+}
+
+/* Declares @span, to be passed to EDFS_TRACE_END() in the same scope. */
+#define EDFS_TRACE_BEGIN(span) \
+  uint64_t span = edfs_trace_begin()
+
+#define EDFS_TRACE_END(span, name)              \
+  do                                            \
+    {                                           \
+      if (span)                                 \
+        edfs_trace_record(name, span);          \
+    }                                           \
+  while (0)
+
+#else
+
+#define EDFS_TRACE_BEGIN(span) do { } while (0)
+#define EDFS_TRACE_END(span, name) do { } while (0)
+
+#endif /* EDFS_TRACE */
+
+#endif /* __EDFS_TRACE_H__ */
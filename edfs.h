@@ -8,6 +8,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
 
@@ -17,11 +18,18 @@
 
 typedef uint32_t edfs_inumber_t;
 
-typedef uint16_t edfs_block_t;
-#define EDFS_MAX_BLOCKS (1 << (sizeof(edfs_block_t) * 8))
+/* Block numbers are 16 bits wide on disk up to format version 2 and 32
+ * bits from version 3 on, see the super block below.
+ */
+typedef uint32_t edfs_block_t;
+typedef uint16_t edfs_block16_t;
+
+#define EDFS_MAX_BLOCKS_16 (1ULL << 16)
+#define EDFS_MAX_BLOCKS_32 (1ULL << 32)
 
-#define EDFS_MAX_BLOCK_SIZE (1 << 13)
-#define EDFS_MIN_BLOCK_SIZE (1 << 9)
+#define EDFS_MAX_BLOCK_SIZE_16 (1 << 13)
+#define EDFS_MAX_BLOCK_SIZE    (1 << 16)
+#define EDFS_MIN_BLOCK_SIZE    (1 << 9)
 
 /* Block 0 is always in use for the boot block, so we can use it
  * as invalid block marker in inodes.
@@ -40,6 +48,52 @@ typedef uint16_t edfs_block_t;
 
 #define EDFS_MAGIC 0x00133700f00d0037ULL
 
+/* Format versions. Images made before the version was recorded have 0
+ * here, which reads as version 1.
+ */
+#define EDFS_VERSION_1      1   /* files mapped by direct and indirect
+                                 * blocks
+                                 */
+#define EDFS_VERSION_2      2   /* files may be mapped by an extent tree */
+#define EDFS_VERSION_3      3   /* 32-bit block numbers, 64-bit offsets
+                                 * and blocks up to 64 KiB
+                                 */
+#define EDFS_VERSION_LATEST EDFS_VERSION_3
+
+/* Super block of version 3 images, which is also the form in which the
+ * super block of any image is kept in memory.
+ */
+typedef struct
+{
+  uint64_t magic;
+  uint16_t version;
+  uint16_t reserved;
+
+  uint32_t block_size;
+  uint32_t n_blocks;
+
+  uint32_t inode_table_n_inodes;
+
+  /* Inode hosting the root directory of the file system. */
+  edfs_inumber_t root_inumber;
+  uint32_t reserved2;
+
+  uint64_t bitmap_start; /* offset from start of device; in bytes */
+  uint64_t bitmap_size;  /* in bytes */
+
+  uint64_t inode_table_start; /* offset from start of device; in bytes */
+  uint64_t inode_table_size;  /* in bytes */
+
+  /* Metadata journal, see below. A size of 0 means there is none, as
+   * in images made before the journal existed, which have zeroes here.
+   */
+  uint64_t journal_start; /* offset from start of device; in bytes */
+  uint64_t journal_size;  /* in bytes */
+} __attribute__((__packed__)) edfs_super_block_t;
+
+/* Super block of images up to version 2. The magic and version are
+ * where they are in edfs_super_block_t.
+ */
 typedef struct
 {
   uint64_t magic;
@@ -48,7 +102,7 @@ typedef struct
   uint16_t block_size;  /* technically supports blocks up to 64 KB, but
                          * we cap at 8 KB, see defines above.
                          */
-  edfs_block_t n_blocks;
+  edfs_block16_t n_blocks;
 
   uint32_t bitmap_start; /* offset from start of device; in bytes */
   uint32_t bitmap_size;  /* in bytes */
@@ -57,9 +111,64 @@ typedef struct
   uint32_t inode_table_size;  /* in bytes */
   uint32_t inode_table_n_inodes;
 
-  /* Inode hosting the root directory of the file system. */
   edfs_inumber_t root_inumber;
-} __attribute__((__packed__)) edfs_super_block_t;
+
+  uint32_t journal_start; /* offset from start of device; in bytes */
+  uint32_t journal_size;  /* in bytes */
+} __attribute__((__packed__)) edfs_super_block_16_t;
+
+
+
+/*
+ * Journal
+ */
+
+/* The journal is a region of whole blocks following the inode table.
+ * Its first block holds the journal header. Transactions follow from
+ * the second block on, each written as a single run of blocks:
+ *
+ *  - descriptor blocks: a block header followed by tags, one for every
+ *    block of the transaction, as many descriptor blocks as needed;
+ *  - the new contents of every tagged block that is not revoked, in
+ *    tag order;
+ *  - a commit block, with a checksum over all blocks before it.
+ *
+ * Transactions carry consecutive sequence numbers, starting at the one
+ * in the journal header. A transaction counts only if its commit block
+ * is intact, so replay stops at the first one that is not. A revoke
+ * tag cancels the copies of its block in earlier transactions, so
+ * that a freed block is not overwritten by replay once it is reused.
+ */
+#define EDFS_JOURNAL_MAGIC 0x4c4e524aU       /* "JRNL" */
+
+/* Smallest journal, in blocks: the header and a small transaction. */
+#define EDFS_JOURNAL_MIN_BLOCKS 8
+
+typedef enum
+{
+  EDFS_JOURNAL_HEADER = 1,
+  EDFS_JOURNAL_DESCRIPTOR,
+  EDFS_JOURNAL_COMMIT
+} edfs_journal_block_type_t;
+
+/* Starts every block of the journal except data blocks. */
+typedef struct
+{
+  uint32_t magic;
+  uint32_t type;
+  uint64_t seq;         /* header: of the first transaction to replay */
+  uint32_t n_tags;      /* descriptor: tags in the transaction */
+  uint32_t n_blocks;    /* commit: blocks of the transaction before it */
+  uint64_t checksum;    /* commit: of those blocks */
+} __attribute__((__packed__)) edfs_journal_block_header_t;
+
+#define EDFS_JOURNAL_TAG_REVOKE (1 << 0)
+
+typedef struct
+{
+  uint32_t block;
+  uint32_t flags;
+} __attribute__((__packed__)) edfs_journal_tag_t;
 
 
 
@@ -74,6 +183,10 @@ typedef enum
   EDFS_INODE_TYPE_FILE,
   EDFS_INODE_TYPE_DIRECTORY,
 
+  EDFS_INODE_TYPE_EXTENTS  = 1 << 6,   /* Flag to indicate the first block
+                                        * pointer is the root of an extent
+                                        * tree; version 2 and up.
+                                        */
   EDFS_INODE_TYPE_INDIRECT = 1 << 7    /* Flag to indicate block pointers
                                         * are indirect blocks.
                                         */
@@ -84,8 +197,10 @@ typedef enum
                                  * compatibility.
                                  */
 
-/* Padded to be 16 bytes in size, with 5 reserved bytes available for
- * future expansion.
+/* Padded to be 16 bytes in size, with 3 reserved bytes available for
+ * future expansion. Block pointers are split in halves, of which the
+ * upper ones are only used from version 3 on and are 0 before; use
+ * edfs_disk_inode_get_block() and edfs_disk_inode_set_block().
  */
 typedef struct
 {
@@ -94,11 +209,53 @@ typedef struct
 
   uint32_t size;
 
-  edfs_block_t blocks[EDFS_INODE_N_BLOCKS];
-  uint16_t reserved2[2];
+  edfs_block16_t blocks_lo[EDFS_INODE_N_BLOCKS];
+  edfs_block16_t blocks_hi[EDFS_INODE_N_BLOCKS];
 } __attribute__((__packed__)) edfs_disk_inode_t;
 
 
+/*
+ * Extent tree
+ */
+
+/* From version 2 on, a file that outgrows its direct block pointers
+ * is mapped by a B+tree of extents, rooted in the block that the first
+ * block pointer refers to. Every node is a block starting with a
+ * header. Leaves (depth 0) hold extents: runs of blocks that follow
+ * each other both in the file and on disk. Index nodes hold, for every
+ * child, the first logical block it maps. Entries are sorted by logical
+ * block and extents do not overlap; blocks not covered are holes.
+ */
+#define EDFS_EXTENT_MAGIC 0xe7e7
+
+/* Deepest tree, counting the root; far more than files can need. */
+#define EDFS_EXTENT_MAX_DEPTH 5
+
+typedef struct
+{
+  uint16_t magic;
+  uint16_t n_entries;
+  uint16_t depth;       /* levels below the node, 0 for leaves */
+  uint16_t reserved;
+} __attribute__((__packed__)) edfs_extent_header_t;
+
+/* Logical blocks [logical, logical + length) are stored in the blocks
+ * from @start on.
+ */
+typedef struct
+{
+  uint32_t logical;
+  uint32_t start;
+  uint32_t length;
+} __attribute__((__packed__)) edfs_extent_t;
+
+typedef struct
+{
+  uint32_t logical;
+  uint32_t block;
+} __attribute__((__packed__)) edfs_extent_index_t;
+
+
 /*
  * Directory entry
  */
@@ -129,10 +286,31 @@ edfs_get_super_block_offset(void)
   return 512;
 }
 
+static inline uint64_t
+edfs_get_max_blocks(uint16_t version)
+{
+  return version >= EDFS_VERSION_3 ? EDFS_MAX_BLOCKS_32 : EDFS_MAX_BLOCKS_16;
+}
+
 static inline uint32_t
+edfs_get_max_block_size(uint16_t version)
+{
+  return version >= EDFS_VERSION_3 ? EDFS_MAX_BLOCK_SIZE
+                                   : EDFS_MAX_BLOCK_SIZE_16;
+}
+
+/* Returns the size of the super block on disk. */
+static inline size_t
+edfs_get_super_block_size(uint16_t version)
+{
+  return version >= EDFS_VERSION_3 ? sizeof(edfs_super_block_t)
+                                   : sizeof(edfs_super_block_16_t);
+}
+
+static inline uint64_t
 edfs_get_size(const edfs_super_block_t *sb)
 {
-  return sb->block_size * sb->n_blocks;
+  return (uint64_t)sb->block_size * sb->n_blocks;
 }
 
 static inline int
@@ -144,19 +322,55 @@ edfs_get_n_dir_entries_per_block(const edfs_super_block_t *sb)
 static inline int
 edfs_get_n_blocks_per_indirect_block(const edfs_super_block_t *sb)
 {
-  return sb->block_size / sizeof(edfs_block_t);
+  return sb->block_size / sizeof(edfs_block16_t);
 }
 
-static inline uint32_t
+static inline off_t
 edfs_get_block_offset(const edfs_super_block_t *sb, edfs_block_t block)
 {
-  return sb->block_size * block;
+  return (off_t)sb->block_size * block;
 }
 
 static inline off_t
 edfs_get_inode_offset(edfs_super_block_t *sb, edfs_inumber_t inumber)
 {
-  return sb->inode_table_start + inumber * sizeof(edfs_disk_inode_t);
+  return sb->inode_table_start + (off_t)inumber * sizeof(edfs_disk_inode_t);
+}
+
+static inline uint32_t
+edfs_get_n_journal_tags_per_block(const edfs_super_block_t *sb)
+{
+  return (sb->block_size - sizeof(edfs_journal_block_header_t))
+      / sizeof(edfs_journal_tag_t);
+}
+
+static inline uint32_t
+edfs_get_n_extents_per_block(const edfs_super_block_t *sb)
+{
+  return (sb->block_size - sizeof(edfs_extent_header_t))
+      / sizeof(edfs_extent_t);
+}
+
+static inline uint32_t
+edfs_get_n_extent_indexes_per_block(const edfs_super_block_t *sb)
+{
+  return (sb->block_size - sizeof(edfs_extent_header_t))
+      / sizeof(edfs_extent_index_t);
+}
+
+static inline bool
+edfs_super_block_has_extents(const edfs_super_block_t *sb)
+{
+  return sb->version >= EDFS_VERSION_2;
+}
+
+/* Indirect blocks hold 16-bit block numbers, so version 3 images, of
+ * which files are mapped by extents, have none.
+ */
+static inline bool
+edfs_super_block_has_indirect(const edfs_super_block_t *sb)
+{
+  return sb->version < EDFS_VERSION_3;
 }
 
 static inline bool
@@ -180,4 +394,30 @@ edfs_disk_inode_has_indirect(const edfs_disk_inode_t *inode)
   return (inode->type & EDFS_INODE_TYPE_INDIRECT) == EDFS_INODE_TYPE_INDIRECT;
 }
 
+static inline bool
+edfs_disk_inode_has_extents(const edfs_disk_inode_t *inode)
+{
+  return (inode->type & EDFS_INODE_TYPE_EXTENTS) == EDFS_INODE_TYPE_EXTENTS;
+}
+
+static inline edfs_block_t
+edfs_disk_inode_get_block(const edfs_disk_inode_t *inode, int i)
+{
+  return inode->blocks_lo[i] | (edfs_block_t)inode->blocks_hi[i] << 16;
+}
+
+static inline void
+edfs_disk_inode_set_block(edfs_disk_inode_t *inode, int i, edfs_block_t block)
+{
+  inode->blocks_lo[i] = block & 0xffff;
+  inode->blocks_hi[i] = block >> 16;
+}
+
+static inline void
+edfs_disk_inode_clear_blocks(edfs_disk_inode_t *inode)
+{
+  memset(inode->blocks_lo, 0, sizeof(inode->blocks_lo));
+  memset(inode->blocks_hi, 0, sizeof(inode->blocks_hi));
+}
+
 #endif /* __EDFS_H__ */
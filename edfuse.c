@@ -7,144 +7,42 @@
 
 
 #include "edfs-common.h"
+#include "edfs-alloc.h"
+#include "edfs-cache.h"
+#include "edfs-dcache.h"
+#include "edfs-dindex.h"
+#include "edfs-dir.h"
+#include "edfs-file.h"
+#include "edfs-journal.h"
+#include "edfs-readahead.h"
+#include "edfs-check.h"
+#include "edfs-stats.h"
+#include "edfs-trace.h"
 
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <ctype.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <signal.h>
 
 #include <stdbool.h>
 
 
-
 static inline edfs_image_t *
 get_edfs_image(void)
 {
   return (edfs_image_t *)fuse_get_context()->private_data;
 }
 
-static bool 
-edfs_read_block(edfs_block_t *blocks, edfs_image_t *img , char *filename, edfs_dir_entry_t *direntry) //const edfs_super_block_t *sb
-{ 
-  int n_dir_entries_block = edfs_get_n_dir_entries_per_block(&img->sb); //number of directory entries in a block
-  uint16_t block_size = img->sb.block_size; //size of a block 
-  for (int i = 0; i < EDFS_INODE_N_BLOCKS; i++) //loop trough number of blocks 
-  { 
-    if (blocks[i] == EDFS_BLOCK_INVALID) 
-    {
-      continue; 
-    }
-    edfs_dir_entry_t *entries = malloc(block_size); //store entries of a block in buffer entries
-    uint32_t offset = edfs_get_block_offset(&img->sb, blocks[i]);
-    // uint16_t offset = (uint16_t)blocks[i] * block_size; //offset of block 
-    pread(img->fd, entries, block_size, offset); //TODO: sizeof(edfs_block_t) save block data in entries buffer 
-    for (int j = 0; j < n_dir_entries_block; j++) //loop trough the entries of the block
-    { 
-      if (edfs_dir_entry_is_empty(&entries[j]))
-      {
-        continue;
-      }
-      if (strncmp(entries[j].filename, filename, EDFS_FILENAME_SIZE) == 0) //found the file name in directory entries 
-      { 
-        *direntry = entries[j]; //save entry name in 
-        // target->inumber = entries[j].inumber;
-        free(entries); 
-        return true; 
-      }
-    }
-    free(entries); 
-  }
-  return false; 
-}
-
-/* Searches the file system hierarchy to find the inode for
- * the given path. Returns true if the operation succeeded.
- *
- * IMPORTANT: TODO: this function is not yet complete, you have to
- * finish it! See below and Section 4.1 of the Appendices PDF.
- */ 
-static bool
-edfs_find_inode(edfs_image_t *img,
-                const char *path,
-                edfs_inode_t *inode)
-{
-  if (strlen(path) == 0 || path[0] != '/')
-    return false;
-
-  edfs_inode_t current_inode;
-  edfs_read_root_inode(img, &current_inode);
-
-  while (path && (path = strchr(path, '/')))
-    {
-      /* Ignore path separator */
-      while (*path == '/')
-        path++;
-
-      /* Find end of new component */
-      char *end = strchr(path, '/');
-      if (!end)
-        {
-          int len = strnlen(path, PATH_MAX);
-          if (len > 0)
-            end = (char *)&path[len];
-          else
-            {
-              /* We are done: return current entry. */
-              *inode = current_inode;
-              return true;
-            }
-        }
-
-      /* Verify length of component is not larger than maximum allowed
-       * filename size.
-       */
-      int len = end - path;
-      if (len >= EDFS_FILENAME_SIZE)
-        return false;
-
-      /* Within the directory pointed to by parent_inode/current_inode,
-       * find the inode number for path, len.
-       */
-      edfs_dir_entry_t direntry = { 0, };
-      strncpy(direntry.filename, path, len);
-      direntry.filename[len] = 0;
-
-      if (direntry.filename[0] != 0 ) //of current_inode of inode 
-        {
-          /* TODO: visit the directory entries of parent_inode and look
-           * for a directory entry with the same filename as
-           * direntry.filename. If found, fill in direntry.inumber with
-           * the corresponding inode number.
-           *
-           * Write a generic function which visits directory entries,
-           * you are going to need this more often. Consider implementing
-           * a callback mechanism.
-           */
-          // if(current_inode.type == EDFS_INODE_TYPE_DIRECTORY)
-          // {
-
-          // }
-          if (edfs_read_block(current_inode.inode.blocks, img, direntry.filename, &direntry))  //&img->sb,
-          {
-            /* Found what we were looking for, now get our new inode. */
-            // break; 
-            current_inode.inumber = direntry.inumber;
-            edfs_read_inode(img, &current_inode);
-          }
-          else
-            return false;
-        }
-      path = end;
-    }
-
-  *inode = current_inode;
-
-  return true;
-}
 
 static inline void
 drop_trailing_slashes(char *path_copy)
@@ -251,468 +149,1993 @@ out:
 
 
 /*
- * Implementation of necessary FUSE operations.
+ * Statistics
+ *
+ * The number of calls, errors and a latency histogram is kept for
+ * every callback, together with the I/O and cache counters of the
+ * image. They are printed at unmount with -o stats, and can be read at
+ * any time from the virtual file EDFUSE_STATS_PATH in the root
+ * directory. That file is served from memory: it does not exist in the
+ * image, is not listed by readdir and hides a file of the same name.
+ *
+ * With -o trace=FILE, and edfuse built with TRACE=1, every callback and
+ * the image I/O it does is also recorded as a span, see edfs-trace.h.
+ * The trace is written to FILE on SIGUSR2 and at unmount.
  */
 
-static int
-edfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-               off_t offset, struct fuse_file_info *fi)
+enum
 {
-  edfs_image_t *img = get_edfs_image();
-  edfs_inode_t inode = { 0, };
-
-  if (!edfs_find_inode(img, path, &inode))
-    return -ENOENT;
+  EDFUSE_OP_LOOKUP,
+  EDFUSE_OP_GETATTR,
+  EDFUSE_OP_FGETATTR,
+  EDFUSE_OP_READDIR,
+  EDFUSE_OP_MKDIR,
+  EDFUSE_OP_RMDIR,
+  EDFUSE_OP_OPEN,
+  EDFUSE_OP_CREATE,
+  EDFUSE_OP_RELEASE,
+  EDFUSE_OP_FLUSH,
+  EDFUSE_OP_FSYNC,
+  EDFUSE_OP_UNLINK,
+  EDFUSE_OP_READ,
+  EDFUSE_OP_READ_BUF,
+  EDFUSE_OP_WRITE,
+  EDFUSE_OP_WRITE_BUF,
+  EDFUSE_OP_TRUNCATE,
+  EDFUSE_OP_FTRUNCATE,
+  EDFUSE_OP_SETATTR,
+  EDFUSE_N_OPS
+};
 
-  if (!edfs_disk_inode_is_directory(&inode.inode))
-    return -ENOTDIR;
+static const char *edfuse_op_names[EDFUSE_N_OPS] =
+{
+  "lookup", "getattr", "fgetattr", "readdir", "mkdir", "rmdir", "open",
+  "create", "release", "flush", "fsync", "unlink", "read", "read_buf",
+  "write", "write_buf", "truncate", "ftruncate", "setattr"
+};
 
-  filler(buf, ".", NULL, 0);
-  filler(buf, "..", NULL, 0);
+#define EDFUSE_STATS_PATH "/.edfs-stats"
 
-  /* TODO: traverse all valid directory entries of @inode and call
-   * the filler function (as done above) for each entry. The second
-   * argument of the filler function is the filename you want to add.
-   */
-    int n_dir_entries_block = edfs_get_n_dir_entries_per_block(&img->sb); //number of directory entries in a block
-    uint16_t block_size = img->sb.block_size; //size of a block 
-    for (int i = 0; i < EDFS_INODE_N_BLOCKS; i++)
-    { 
-      if (inode.inode.blocks[i] == EDFS_BLOCK_INVALID) 
-      {
-        continue; 
-      }
-      edfs_dir_entry_t *entries = malloc(block_size); //store entries of a block in buffer entries
-      uint32_t offset = edfs_get_block_offset(&img->sb, inode.inode.blocks[i]);
-      // uint16_t offset = (uint16_t)inode.inode.blocks[i] * block_size; //offset of block 
-      pread(img->fd, entries, block_size, offset);
-      for (int j = 0; j < n_dir_entries_block; j++) //loop trough the entries of the block
-      { 
-        if (!edfs_dir_entry_is_empty(&entries[j]))
-        { 
-          filler(buf, entries[j].filename, NULL, 0); 
-        }
-      
-      } 
-      free(entries); 
-    }
-  return 0;
-}
+static edfs_stats_t *edfuse_stats = NULL;
+static const char *edfuse_trace_filename = NULL;
 
-static bool 
-edfs_add_direntry(edfs_image_t *img, edfs_inode_t *parent_inode, 
-                    const char *name, edfs_inumber_t inumber) 
+static void
+edfuse_print_stats(FILE *out, edfs_image_t *img)
 {
-  int n_dir_entries_block = edfs_get_n_dir_entries_per_block(&img->sb);
-  uint16_t block_size = img->sb.block_size; 
+  edfs_cache_stats_t cache_stats;
+  uint64_t n_lookups;
+
+  fprintf(out, "io: %s engine, %llu reads, %llu bytes read, %llu writes, "
+          "%llu bytes written\n",
+          edfs_io_engine_name(edfs_io_get_engine(img->io)),
+          (unsigned long long)__atomic_load_n(&img->n_reads, __ATOMIC_RELAXED),
+          (unsigned long long)__atomic_load_n(&img->n_bytes_read,
+                                              __ATOMIC_RELAXED),
+          (unsigned long long)__atomic_load_n(&img->n_writes, __ATOMIC_RELAXED),
+          (unsigned long long)__atomic_load_n(&img->n_bytes_written,
+                                              __ATOMIC_RELAXED));
+
+  if (img->n_read_requests > 0)
+    fprintf(out, "reads: %llu requests, %llu syscalls (%.2f per request)\n",
+            (unsigned long long)img->n_read_requests,
+            (unsigned long long)img->n_read_syscalls,
+            (double)img->n_read_syscalls / img->n_read_requests);
+  if (img->n_flushes > 0)
+    fprintf(out, "writes: %llu flushes, %llu syscalls (%.2f per flush)\n",
+            (unsigned long long)img->n_flushes,
+            (unsigned long long)img->n_write_syscalls,
+            (double)img->n_write_syscalls / img->n_flushes);
+
+  edfs_cache_get_stats(img->bcache, &cache_stats);
+  n_lookups = cache_stats.hits + cache_stats.misses;
+  fprintf(out, "block cache: %zu/%zu buffers, %llu hits, %llu misses "
+          "(%.1f%% hit rate), %llu evictions, %llu writebacks\n",
+          cache_stats.n_buffers, cache_stats.max_buffers,
+          (unsigned long long)cache_stats.hits,
+          (unsigned long long)cache_stats.misses,
+          n_lookups ? 100.0 * cache_stats.hits / n_lookups : 0.0,
+          (unsigned long long)cache_stats.evictions,
+          (unsigned long long)cache_stats.writebacks);
+
+  if (img->dcache)
+    {
+      edfs_dcache_stats_t stats;
+
+      edfs_dcache_get_stats(img->dcache, &stats);
+      n_lookups = stats.hits + stats.negative_hits + stats.misses;
+      fprintf(out, "dcache: %zu/%zu entries, %llu hits, "
+              "%llu negative hits, %llu misses (%.1f%% hit rate), "
+              "%llu evictions, %llu invalidations\n",
+              stats.n_entries, stats.max_entries,
+              (unsigned long long)stats.hits,
+              (unsigned long long)stats.negative_hits,
+              (unsigned long long)stats.misses,
+              n_lookups ? 100.0 * (stats.hits + stats.negative_hits) / n_lookups
+                        : 0.0,
+              (unsigned long long)stats.evictions,
+              (unsigned long long)stats.invalidations);
+    }
 
-  for (int i = 0; i < EDFS_INODE_N_BLOCKS; i++) 
-  {
-    if (parent_inode->inode.blocks[i] != EDFS_BLOCK_INVALID) 
+  if (img->readahead)
     {
-      uint32_t parent_offset = edfs_get_block_offset(&img->sb, parent_inode->inode.blocks[i]);
-      edfs_dir_entry_t *entries = malloc(block_size);
-      pread(img->fd, entries, block_size, parent_offset);
+      edfs_readahead_stats_t stats;
+
+      edfs_readahead_get_stats(img->readahead, &stats);
+      fprintf(out, "readahead: %zu KiB windows, %d threads, %llu windows, "
+              "%llu dropped, %llu blocks\n",
+              stats.max_size / 1024, stats.n_threads,
+              (unsigned long long)stats.windows,
+              (unsigned long long)stats.dropped,
+              (unsigned long long)stats.blocks);
+    }
 
-      for (int j = 0; j < n_dir_entries_block; j++) 
-      {
-        if (edfs_dir_entry_is_empty(&entries[j])) 
-        {
-          strncpy(entries[j].filename, name, sizeof(entries[j].filename));
-          entries[j].filename[sizeof(entries[j].filename)] = '\0'; 
-          entries[j].inumber = inumber;
-
-          pwrite(img->fd, &entries[j], sizeof(edfs_dir_entry_t), parent_offset + j * sizeof(edfs_dir_entry_t));
-          
-          parent_inode->inode.size += sizeof(edfs_dir_entry_t);
-          edfs_write_inode(img, parent_inode);
-          free(entries); 
-          return true;
-        }
-      }
-      free(entries);
+  if (img->journal)
+    {
+      edfs_journal_stats_t stats;
+
+      edfs_journal_get_stats(img->journal, &stats);
+      fprintf(out, "journal: %u/%u blocks, %llu commits, %llu joined, "
+              "%llu blocks journaled, %llu revokes, %llu syncs, "
+              "%llu checkpoints, %llu overflows, %llu replayed\n",
+              stats.used, stats.size,
+              (unsigned long long)stats.commits,
+              (unsigned long long)stats.joined,
+              (unsigned long long)stats.blocks,
+              (unsigned long long)stats.revokes,
+              (unsigned long long)stats.syncs,
+              (unsigned long long)stats.checkpoints,
+              (unsigned long long)stats.overflows,
+              (unsigned long long)stats.replayed);
     }
-  }
-  return false; 
-}
 
-static bool 
-edfs_add_direntry_new_block(edfs_image_t *img, edfs_inode_t *parent_inode, 
-                    const char *name, edfs_inumber_t inumber) 
-{ 
-  uint16_t block_size = img->sb.block_size; 
-  // edfs_block_t new_block = edfs_allocate_block(img); //alloceer een nieuw blok
-  edfs_block_t new_block;
-  edfs_dir_entry_t new_entry;
-  strncpy(new_entry.filename, name, sizeof(new_entry.filename));
-  new_entry.filename[sizeof(new_entry.filename)] = '\0'; 
-  new_entry.inumber = inumber; 
+  if (img->dindex)
+    {
+      edfs_dindex_stats_t stats;
+
+      edfs_dindex_get_stats(img->dindex, &stats);
+      fprintf(out, "dindex: %zu/%zu directories, %llu lookups, "
+              "%llu builds, %llu evictions\n",
+              stats.n_dirs, stats.max_dirs,
+              (unsigned long long)stats.lookups,
+              (unsigned long long)stats.builds,
+              (unsigned long long)stats.evictions);
+    }
 
-  uint32_t new_block_offset = edfs_get_block_offset(&img->sb, new_block);
-  pwrite(img->fd, &new_entry, sizeof(edfs_dir_entry_t), new_block_offset);
+  if (!edfuse_stats)
+    return;
 
-  for (int i = 0; i < EDFS_INODE_N_BLOCKS; i++) 
-  {
-    if (parent_inode->inode.blocks[i] == EDFS_BLOCK_INVALID) 
+  for (int op = 0; op < EDFUSE_N_OPS; op++)
     {
-      parent_inode->inode.blocks[i] = new_block;
-      parent_inode->inode.size += block_size; 
-      edfs_write_inode(img, parent_inode);
-      return true;
+      edfs_stats_op_t op_stats;
+
+      edfs_stats_get(edfuse_stats, op, &op_stats);
+      if (op_stats.calls == 0)
+        continue;
+
+      fprintf(out, "op %s: %llu calls, %llu errors, mean %.1f us, "
+              "p50 < %llu us, p99 < %llu us, histogram",
+              edfuse_op_names[op],
+              (unsigned long long)op_stats.calls,
+              (unsigned long long)op_stats.errors,
+              op_stats.total_ns / 1000.0 / op_stats.calls,
+              (unsigned long long)edfs_stats_percentile(&op_stats, 0.50),
+              (unsigned long long)edfs_stats_percentile(&op_stats, 0.99));
+
+      /* Non-empty buckets as upper bound in us:count. */
+      const char *sep = " ";
+      for (int b = 0; b < EDFS_STATS_N_BUCKETS; b++)
+        if (op_stats.buckets[b] > 0)
+          {
+            fprintf(out, "%s%llu:%llu", sep, 1ULL << b,
+                    (unsigned long long)op_stats.buckets[b]);
+            sep = ",";
+          }
+      fputc('\n', out);
     }
-  }
-  return false;
 }
- 
 
-static int
-edfuse_mkdir(const char *path, mode_t mode)
+/* The statistics as of the open of the stats file, which are served
+ * to all reads of that open file.
+ */
+typedef struct
 {
-  /* TODO: implement.
-   *
-   * See also Section 4.3 of the Appendices document.
-   *
-   * Create a new inode, register in parent directory, write inode to
-   * disk.
-   */
-  edfs_image_t *img = get_edfs_image();
-  edfs_inode_type_t type = EDFS_INODE_TYPE_DIRECTORY; 
-  edfs_inode_t *parent_inode; 
-  edfs_inode_t *new_inode; 
-
-  edfs_get_parent_inode(img, path, parent_inode); 
-  // edfs_find_inode(img, path, inode); 
-  edfs_new_inode(img, new_inode, type); 
- 
-  char *basename = edfs_get_basename(path);
-  if (!basename || strlen(basename) > EDFS_FILENAME_SIZE) 
-  {
-    free(basename);
-    return -EINVAL;
-  }
-  for (size_t i = 0; i < strlen(basename); i++)
-  {
-    char kar = basename[i];
-    if ((!isalnum(kar)) && (kar != '.') && (kar != ' '))
-    {
-      free(basename);
-      return -EINVAL;
-    }
-  }
+  char *data;
+  size_t size;
+} edfuse_stats_snapshot_t;
 
-  if (!edfs_add_direntry(img, parent_inode, basename, new_inode->inumber) && !edfs_add_direntry_new_block(img, parent_inode, basename,  new_inode->inumber))
-  {
-    free(basename);
-    return -ENOSPC;
-  } 
-  //bitmap aanpassen 
-  edfs_write_inode(img, new_inode); 
-  
-  free(basename); 
-  return 0;
+static inline bool
+edfuse_is_stats_file(const char *path)
+{
+  return path && strcmp(path, EDFUSE_STATS_PATH) == 0;
 }
 
-static int
-edfuse_rmdir(const char *path)
+static inline edfuse_stats_snapshot_t *
+edfuse_stats_handle(struct fuse_file_info *fi)
 {
-  /* TODO: implement
-   *
-   * See also Section 4.3 of the Appendices document.
-   *
-   * Validate @path exists and is a directory; remove directory entry
-   * from parent directory; release allocated blocks; release inode.
-   */
-  // edfs_get_parent_inode();
-  return -ENOSYS;
+  return (edfuse_stats_snapshot_t *)(uintptr_t)fi->fh;
 }
 
+static void
+edfuse_stats_fill_stat(struct stat *stbuf)
+{
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_mode = S_IFREG | 0444;
+  stbuf->st_nlink = 1;
+  /* The size is not known in advance, the file is opened with
+   * direct_io so that reads go on to the end of the snapshot.
+   */
+  stbuf->st_size = 0;
+}
 
-/* Get attributes of @path, fill @stbuf. At least mode, nlink and
- * size must be filled here, otherwise the "ls" listings appear busted.
- * We assume all files and directories have rw permissions for owner and
- * group.
- */
 static int
-edfuse_getattr(const char *path, struct stat *stbuf)
+edfuse_stats_open(edfs_image_t *img, struct fuse_file_info *fi)
 {
-  int res = 0;
-  edfs_image_t *img = get_edfs_image();
+  if ((fi->flags & O_ACCMODE) != O_RDONLY)
+    return -EACCES;
 
-  memset(stbuf, 0, sizeof(struct stat));
-  if (strcmp(path, "/") == 0)
+  edfuse_stats_snapshot_t *snapshot;
+
+  snapshot = calloc(1, sizeof(edfuse_stats_snapshot_t));
+  if (!snapshot)
+    return -ENOMEM;
+
+  FILE *out = open_memstream(&snapshot->data, &snapshot->size);
+  if (!out)
     {
-      stbuf->st_mode = S_IFDIR | 0755;
-      stbuf->st_nlink = 2;
-      return res;
+      free(snapshot);
+      return -ENOMEM;
     }
 
-  edfs_inode_t inode;
-  if (!edfs_find_inode(img, path, &inode))
-    res = -ENOENT;
-  else
+  edfuse_print_stats(out, img);
+  if (fclose(out) != 0)
     {
-      if (edfs_disk_inode_is_directory(&inode.inode))
-        {
-          stbuf->st_mode = S_IFDIR | 0770;
-          stbuf->st_nlink = 2;
-        }
-      else
-        {
-          stbuf->st_mode = S_IFREG | 0660;
-          stbuf->st_nlink = 1;
-        }
-      stbuf->st_size = inode.inode.size;
-
-      /* Note that this setting is ignored, unless the FUSE file system
-       * is mounted with the 'use_ino' option.
-       */
-      stbuf->st_ino = inode.inumber;
+      free(snapshot->data);
+      free(snapshot);
+      return -ENOMEM;
     }
 
-  return res;
+  fi->fh = (uintptr_t)snapshot;
+  fi->direct_io = 1;
+  return 0;
 }
 
-/* Open file at @path. Verify it exists by finding the inode and
- * verify the found inode is not a directory. We do not maintain
- * state of opened files.
- */
 static int
-edfuse_open(const char *path, struct fuse_file_info *fi)
+edfuse_stats_read(struct fuse_file_info *fi, char *buf, size_t size,
+                  off_t offset)
 {
-  edfs_image_t *img = get_edfs_image();
-
-  edfs_inode_t inode;
-  if (!edfs_find_inode(img, path, &inode))
-    return -ENOENT;
+  edfuse_stats_snapshot_t *snapshot = edfuse_stats_handle(fi);
 
-  /* Open may only be called on files. */
-  if (edfs_disk_inode_is_directory(&inode.inode))
-    return -EISDIR;
+  if (offset >= snapshot->size)
+    return 0;
+  if (size > snapshot->size - offset)
+    size = snapshot->size - offset;
 
-  return 0;
+  memcpy(buf, snapshot->data + offset, size);
+  return size;
 }
 
 static int
-edfuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+edfuse_stats_read_buf(struct fuse_file_info *fi, struct fuse_bufvec **bufp,
+                      size_t size, off_t offset)
 {
-  /* TODO: implement
-   *
-   * See also Section 4.4 of the Appendices document.
-   *
-   * Create a new inode, attempt to register in parent directory,
-   * write inode to disk.
-   */
-  edfs_image_t *img = get_edfs_image();
+  struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+  if (!bufv)
+    return -ENOMEM;
 
-  char *basename = edfs_get_basename(path);
-  if (!basename || strlen(basename) > EDFS_FILENAME_SIZE) 
-  {
-    free(basename);
-    return -EINVAL;
-  }
-  for (size_t i = 0; i < strlen(basename); i++)
-  {
-    char kar = basename[i];
-    if ((!isalnum(kar)) && (kar != '.') && (kar != ' '))
+  *bufv = FUSE_BUFVEC_INIT(size);
+  bufv->buf[0].mem = malloc(size ? size : 1);
+  if (!bufv->buf[0].mem)
     {
-      free(basename);
-      return -EINVAL;
+      free(bufv);
+      return -ENOMEM;
     }
-  }
-  edfs_inode_t *parent_inode;
-  edfs_get_parent_inode(img, path, parent_inode);
 
-  edfs_inode_t *new_inode;
-  edfs_new_inode(img, new_inode, EDFS_INODE_TYPE_FILE); 
-  new_inode->inode.size = 0; 
+  bufv->buf[0].size = edfuse_stats_read(fi, bufv->buf[0].mem, size, offset);
 
-  if (!edfs_add_direntry(img, parent_inode, basename, new_inode->inumber) && !edfs_add_direntry_new_block(img, parent_inode, basename, new_inode->inumber))
-  {
-    free(basename);
-    return -ENOSPC;
-  }
-  edfs_write_inode(img, new_inode); 
-  free(basename); 
+  *bufp = bufv;
   return 0;
 }
 
-/* Since we don't maintain link count, we'll treat unlink as a file
- * remove operation.
+static void
+edfuse_stats_release(struct fuse_file_info *fi)
+{
+  edfuse_stats_snapshot_t *snapshot = edfuse_stats_handle(fi);
+
+  free(snapshot->data);
+  free(snapshot);
+  fi->fh = 0;
+}
+
+
+/*
+ * Implementation of necessary FUSE operations.
  */
-static int
-edfuse_unlink(const char *path)
+
+static void
+edfuse_fill_stat(const edfs_inode_t *inode, struct stat *stbuf)
 {
-  /* Validate @path exists and is not a directory; remove directory entry
-   * from parent directory; release allocated blocks; release inode.
+  if (edfs_disk_inode_is_directory(&inode->inode))
+    {
+      stbuf->st_mode = S_IFDIR | 0770;
+      stbuf->st_nlink = 2;
+    }
+  else
+    {
+      stbuf->st_mode = S_IFREG | 0660;
+      stbuf->st_nlink = 1;
+    }
+  stbuf->st_size = inode->inode.size;
+
+  /* Note that this setting is ignored, unless the FUSE file system
+   * is mounted with the 'use_ino' option.
    */
+  stbuf->st_ino = inode->inumber;
+}
+
+/* Directory listings are read in batches of entries. The inodes of a
+ * batch are read together, so that every entry is returned with its
+ * attributes, and the entries are added to the dentry cache, so that
+ * the lookups that usually follow a listing do not scan the directory
+ * again. Shared by both frontends.
+ */
+#define EDFUSE_READDIR_BATCH 64
+
+struct edfuse_dir_batch
+{
+  edfs_image_t *img;
+  edfs_inumber_t dir_inumber;
+
+  int n_entries;
+  char names[EDFUSE_READDIR_BATCH][EDFS_FILENAME_SIZE];
+  edfs_inode_t inodes[EDFUSE_READDIR_BATCH];
+  uint32_t next[EDFUSE_READDIR_BATCH];
+};
+
+/* Called with the directory locked, so that the dentry cache cannot
+ * be updated with an entry that has just been removed.
+ */
+static bool
+edfuse_dir_batch_add(const edfs_dir_entry_t *entry, uint32_t next,
+                     void *user_data)
+{
+  struct edfuse_dir_batch *batch = user_data;
+
+  if (batch->n_entries == EDFUSE_READDIR_BATCH)
+    return false;
 
-  /* NOTE: Not implemented and not part of the assignment. */
-  return -ENOSYS;
+  int i = batch->n_entries++;
+  memcpy(batch->names[i], entry->filename, EDFS_FILENAME_SIZE);
+  batch->names[i][EDFS_FILENAME_SIZE - 1] = 0;
+  batch->inodes[i].inumber = entry->inumber;
+  batch->next[i] = next;
+
+  if (batch->img->dcache)
+    edfs_dcache_insert(batch->img->dcache, batch->dir_inumber,
+                       batch->names[i], entry->inumber);
+
+  return true;
 }
 
-static uint32_t 
-edfs_get_indirect_block_offset(edfs_inode_t *inode, 
-                          int block_number)
+/* Reads the entries of @dir_inode from @slot on into @batch, with their
+ * inodes. Returns the number of entries, or an error code.
+ */
+static int
+edfuse_dir_batch_read(edfs_image_t            *img,
+                      edfs_inode_t            *dir_inode,
+                      uint32_t                 slot,
+                      struct edfuse_dir_batch *batch)
 {
-  edfs_image_t *img = get_edfs_image();
-  int blocks_per_indirect_block = edfs_get_n_blocks_per_indirect_block(&img->sb);
-  int indirect_block_index = block_number / blocks_per_indirect_block; 
-  uint16_t block_size = img->sb.block_size; 
+  batch->img = img;
+  batch->dir_inumber = dir_inode->inumber;
+  batch->n_entries = 0;
+
+  int res = edfs_dir_iterate(img, dir_inode, slot, edfuse_dir_batch_add, batch);
+  if (res == 0)
+    res = edfs_read_inodes(img, batch->inodes, batch->n_entries);
+
+  return res < 0 ? res : batch->n_entries;
+}
+
+/* Fills @stbuf for entry @i of @batch. Returns false if the inode has
+ * been removed since the directory was read.
+ */
+static bool
+edfuse_dir_batch_stat(struct edfuse_dir_batch *batch, int i,
+                      struct stat *stbuf)
+{
+  edfs_inode_t *inode = &batch->inodes[i];
+
+  if (inode->inode.type == EDFS_INODE_TYPE_FREE)
+    return false;
 
-  uint32_t indirect_block_offset = edfs_get_block_offset(&img->sb, inode->inode.blocks[indirect_block_index]);
+  /* An open file may have grown in its write-back buffer. */
+  edfs_file_lookup_inode(batch->img, inode->inumber, inode);
 
-  edfs_block_t *indirect_block = malloc(block_size);
-  pread(img->fd, indirect_block, block_size, indirect_block_offset);
-          
-  uint32_t block_start = edfs_get_block_offset(&img->sb, indirect_block[block_number]);
-  free(indirect_block); 
-  return block_start; 
+  memset(stbuf, 0, sizeof(struct stat));
+  edfuse_fill_stat(inode, stbuf);
+  return true;
 }
 
+/* Directory offsets 1 and 2 follow "." and ".."; after those, the offset
+ * is the slot from which to resume, plus 2. Listings can therefore be
+ * resumed at any offset returned before.
+ */
 static int
-edfuse_read(const char *path, char *buf, size_t size, off_t offset,
-            struct fuse_file_info *fi)
+edfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+               off_t offset, struct fuse_file_info *fi)
 {
-  /* TODO: implement
-   *
-   * See also Section 4.2 of the Appendices document.
-   *
-   * Read @size bytes of data from @path starting at @offset and write
-   * this to @buf.
-   */
   edfs_image_t *img = get_edfs_image();
   edfs_inode_t inode = { 0, };
-  if (!edfs_find_inode(img, path, &inode)) 
-  {
+
+  if (!edfs_find_inode(img, path, &inode))
     return -ENOENT;
-  }
-  if (edfs_disk_inode_is_directory(&inode.inode)) //waarom want we hebben toch de niet disk inode 
-  {
-    return -EISDIR;
-  }
-  uint16_t block_size = img->sb.block_size; //size of a block 
-  int block_number = offset / block_size;
-  uint32_t block_offset = offset % block_size; 
-  int total_bytes_read = 0; 
-  uint32_t block_start = 0; 
 
-  if(block_number >= EDFS_INODE_N_BLOCKS)
+  if (!edfs_disk_inode_is_directory(&inode.inode))
+    return -ENOTDIR;
+
+  if ((offset < 1 && filler(buf, ".", NULL, 1)) ||
+      (offset < 2 && filler(buf, "..", NULL, 2)))
+    return 0;
+
+  struct edfuse_dir_batch *batch = malloc(sizeof(struct edfuse_dir_batch));
+  if (!batch)
+    return -ENOMEM;
+
+  uint32_t slot = offset > 2 ? offset - 2 : 0;
+  int res;
+
+  while ((res = edfuse_dir_batch_read(img, &inode, slot, batch)) > 0)
+    {
+      for (int i = 0; i < batch->n_entries; i++)
+        {
+          struct stat stbuf;
+
+          if (edfuse_dir_batch_stat(batch, i, &stbuf) &&
+              filler(buf, batch->names[i], &stbuf, batch->next[i] + 2))
+            goto out;
+        }
+
+      if (batch->n_entries < EDFUSE_READDIR_BATCH)
+        break;
+      slot = batch->next[batch->n_entries - 1];
+    }
+
+out:
+  free(batch);
+  return res < 0 ? res : 0;
+}
+
+/* Creates a new inode of @type for @path and registers it in the parent
+ * directory, of which the inode is stored in @parent_inode. Shared by
+ * mkdir and create. Returns 0 on success, error code otherwise.
+ */
+static int
+edfs_create_inode(edfs_image_t *img, const char *path,
+                  edfs_inode_type_t type, edfs_inode_t *parent_inode,
+                  edfs_inode_t *new_inode)
+{
+  int res;
+
+  char *basename = edfs_get_basename(path);
+  if (!edfs_valid_basename(basename))
   {
-    return -EINVAL;
+    res = -EINVAL;
+    goto out;
   }
-  
-  while (total_bytes_read < size) 
-  { 
-    if (block_number >= EDFS_MAX_BLOCKS) {
-      break;
-    }
-    if (edfs_disk_inode_has_indirect(&inode.inode)) 
-    { 
-      block_start = edfs_get_indirect_block_offset(&inode, block_number); 
-    }
-    else 
-    { 
-      block_start = edfs_get_block_offset(&img->sb, inode.inode.blocks[block_number]); 
-    }
-    uint32_t total_block_offset = block_start + block_offset;
-    int bytes_to_read = block_size - block_offset;
-    if (bytes_to_read > size - total_bytes_read)
-      bytes_to_read = size - total_bytes_read;
-    
-    int actual_bytes_read = pread(img->fd, buf + total_bytes_read, bytes_to_read, total_block_offset);
-
-    if (actual_bytes_read < 0) 
-    {
-      return -errno;
-    }
-    total_bytes_read += actual_bytes_read;
-    block_number++;
-    block_offset = 0; 
-  }
-  return total_bytes_read;
+
+  res = edfs_get_parent_inode(img, path, parent_inode);
+  if (res < 0)
+    goto out;
+
+  res = edfs_dir_create(img, parent_inode, basename, type, new_inode);
+
+out:
+  free(basename);
+  return res;
 }
 
+/* Removes the directory entry for @path and releases @inode. Shared by
+ * rmdir and unlink, which validate @inode beforehand.
+ */
 static int
-edfuse_write(const char *path, const char *buf, size_t size, off_t offset,
-             struct fuse_file_info *fi)
+edfs_remove_inode(edfs_image_t *img, const char *path, edfs_inode_t *inode)
 {
-  /* TODO: implement
-   *
-   * See also Section 4.4 of the Appendices document.
-   *
-   * Write @size bytes of data from @buf to @path starting at @offset.
-   * Allocate new blocks as necessary. You may have to fill holes! Update
-   * the file size if necessary.
-   */
+  int res;
+  edfs_inode_t parent_inode;
 
-  return -ENOSYS;
-}
+  char *basename = edfs_get_basename(path);
+  if (!basename)
+    return -EINVAL;
 
+  res = edfs_get_parent_inode(img, path, &parent_inode);
+  if (res == 0)
+    res = edfs_dir_remove(img, &parent_inode, basename, inode);
+
+  free(basename);
+  return res;
+}
 
 static int
-edfuse_truncate(const char *path, off_t offset)
+edfuse_mkdir(const char *path, mode_t mode)
 {
-  /* TODO: implement
-   *
-   * See also Section 4.4 of the Appendices document.
-   *
-   * The size of @path must be set to be @offset. Release now superfluous
-   * blocks or allocate new blocks that are necessary to cover offset.
-   */
-  return -ENOSYS;
-}
+  edfs_image_t *img = get_edfs_image();
+  edfs_inode_t parent_inode;
+  edfs_inode_t new_inode;
 
+  if (edfuse_is_stats_file(path))
+    return -EEXIST;
 
-/*
- * FUSE setup
- */
+  return edfs_create_inode(img, path, EDFS_INODE_TYPE_DIRECTORY,
+                           &parent_inode, &new_inode);
+}
+
+/* Validate @path exists and is a directory; remove directory entry
+ * from parent directory; release allocated blocks; release inode.
+ */
+static int
+edfuse_rmdir(const char *path)
+{
+  edfs_image_t *img = get_edfs_image();
+  edfs_inode_t inode;
+
+  if (!edfs_find_inode(img, path, &inode))
+    return -ENOENT;
+
+  if (!edfs_disk_inode_is_directory(&inode.inode))
+    return -ENOTDIR;
+
+  if (inode.inumber == img->sb.root_inumber)
+    return -EBUSY;
+
+  if (!edfs_dir_is_empty(img, &inode))
+    return -ENOTEMPTY;
+
+  return edfs_remove_inode(img, path, &inode);
+}
+
+
+/* The file object of an open file is kept as handle in @fi. */
+static inline edfs_file_t *
+edfuse_file_handle(struct fuse_file_info *fi)
+{
+  return (edfs_file_t *)(uintptr_t)fi->fh;
+}
+
+/* Get attributes of @path, fill @stbuf. At least mode, nlink and
+ * size must be filled here, otherwise the "ls" listings appear busted.
+ * We assume all files and directories have rw permissions for owner and
+ * group.
+ */
+static int
+edfuse_getattr(const char *path, struct stat *stbuf)
+{
+  int res = 0;
+  edfs_image_t *img = get_edfs_image();
+
+  memset(stbuf, 0, sizeof(struct stat));
+  if (strcmp(path, "/") == 0)
+    {
+      stbuf->st_mode = S_IFDIR | 0755;
+      stbuf->st_nlink = 2;
+      return res;
+    }
+
+  if (edfuse_is_stats_file(path))
+    {
+      edfuse_stats_fill_stat(stbuf);
+      return res;
+    }
+
+  edfs_inode_t inode;
+  if (!edfs_find_inode(img, path, &inode))
+    res = -ENOENT;
+  else
+    {
+      /* An open file may have grown in its write-back buffer. */
+      edfs_file_lookup_inode(img, inode.inumber, &inode);
+      edfuse_fill_stat(&inode, stbuf);
+    }
+
+  return res;
+}
+
+static int
+edfuse_fgetattr(const char *path, struct stat *stbuf,
+                struct fuse_file_info *fi)
+{
+  edfs_inode_t inode;
+
+  if (edfuse_is_stats_file(path))
+    {
+      edfuse_stats_fill_stat(stbuf);
+      return 0;
+    }
+
+  edfs_file_stat(edfuse_file_handle(fi), &inode);
+
+  memset(stbuf, 0, sizeof(struct stat));
+  edfuse_fill_stat(&inode, stbuf);
+
+  return 0;
+}
+
+/* Looks up the file object for the file at @path, taking a reference
+ * that must be dropped with edfs_file_put(). Directories are refused,
+ * as are files removed by another thread after the lookup.
+ */
+static int
+edfuse_get_file(edfs_image_t *img, const char *path, edfs_file_t **file)
+{
+  edfs_inode_t inode;
+  if (!edfs_find_inode(img, path, &inode))
+    return -ENOENT;
+
+  if (edfs_disk_inode_is_directory(&inode.inode))
+    return -EISDIR;
+
+  *file = edfs_file_get(img, &inode);
+  if (!*file)
+    return -ENOENT;
+
+  return 0;
+}
+
+/* Open file at @path. Verify it exists by finding the inode and
+ * verify the found inode is not a directory. The file object serves
+ * as handle for the other operations on the open file, so these do
+ * not repeat the path lookup.
+ */
+static int
+edfuse_open(const char *path, struct fuse_file_info *fi)
+{
+  edfs_image_t *img = get_edfs_image();
+  edfs_file_t *file;
+
+  if (edfuse_is_stats_file(path))
+    return edfuse_stats_open(img, fi);
+
+  int res = edfuse_get_file(img, path, &file);
+  if (res < 0)
+    return res;
+
+  fi->fh = (uintptr_t)file;
+  return 0;
+}
+
+static int
+edfuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+  edfs_image_t *img = get_edfs_image();
+  edfs_inode_t new_inode;
+  edfs_inode_t parent_inode;
+
+  if (edfuse_is_stats_file(path))
+    return -EEXIST;
+
+  int res = edfs_create_inode(img, path, EDFS_INODE_TYPE_FILE,
+                              &parent_inode, &new_inode);
+  if (res < 0)
+    return res;
+
+  edfs_file_t *file = edfs_file_get(img, &new_inode);
+  if (!file)
+    return -ENOMEM;
+
+  /* Place the data of the new file near its directory. */
+  file->goal = edfs_disk_inode_get_block(&parent_inode.inode, 0);
+
+  fi->fh = (uintptr_t)file;
+  return 0;
+}
+
+static int
+edfuse_release(const char *path, struct fuse_file_info *fi)
+{
+  edfs_image_t *img = get_edfs_image();
+
+  if (edfuse_is_stats_file(path))
+    {
+      edfuse_stats_release(fi);
+      return 0;
+    }
+
+  edfs_file_put(img, edfuse_file_handle(fi));
+  fi->fh = 0;
+
+  return 0;
+}
+
+static int
+edfuse_flush(const char *path, struct fuse_file_info *fi)
+{
+  edfs_image_t *img = get_edfs_image();
+
+  if (edfuse_is_stats_file(path))
+    return 0;
+
+  return edfs_file_flush(img, edfuse_file_handle(fi));
+}
+
+/* Flushes @file and the allocation metadata it depends on, and asks
+ * the host to commit the image to stable storage. With a journal, a
+ * commit does both; it is shared with concurrent callers.
+ */
+static int
+edfuse_sync_file(edfs_image_t *img, edfs_file_t *file, int datasync)
+{
+  edfs_journal_begin(img);
+  int res = edfs_file_flush(img, file);
+  edfs_journal_end(img);
+  if (res < 0)
+    return res;
+
+  if (img->journal)
+    return edfs_journal_commit(img);
+
+  if (edfs_image_sync(img) < 0)
+    return -EIO;
+
+  if ((datasync ? fdatasync(img->fd) : fsync(img->fd)) < 0)
+    return -errno;
+
+  return 0;
+}
+
+static int
+edfuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+  edfs_image_t *img = get_edfs_image();
+
+  if (edfuse_is_stats_file(path))
+    return 0;
+
+  return edfuse_sync_file(img, edfuse_file_handle(fi), datasync);
+}
+
+/* Since we don't maintain link count, we'll treat unlink as a file
+ * remove operation.
+ */
+static int
+edfuse_unlink(const char *path)
+{
+  /* Validate @path exists and is not a directory; remove directory entry
+   * from parent directory; release allocated blocks; release inode.
+   */
+  edfs_image_t *img = get_edfs_image();
+  edfs_inode_t inode;
+
+  if (edfuse_is_stats_file(path))
+    return -EACCES;
+
+  if (!edfs_find_inode(img, path, &inode))
+    return -ENOENT;
+
+  if (edfs_disk_inode_is_directory(&inode.inode))
+    return -EISDIR;
+
+  return edfs_remove_inode(img, path, &inode);
+}
+
+static int
+edfuse_read(const char *path, char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi)
+{
+  edfs_image_t *img = get_edfs_image();
+
+  if (edfuse_is_stats_file(path))
+    return edfuse_stats_read(fi, buf, size, offset);
+
+  return edfs_file_read(img, edfuse_file_handle(fi), buf, size, offset);
+}
+
+/* Write @size bytes of data from @buf to @path starting at @offset.
+ * The data is buffered by the file object; blocks are allocated when
+ * the buffer is flushed.
+ */
+static int
+edfuse_write(const char *path, const char *buf, size_t size, off_t offset,
+             struct fuse_file_info *fi)
+{
+  edfs_image_t *img = get_edfs_image();
+
+  return edfs_file_write(img, edfuse_file_handle(fi), buf, size, offset);
+}
+
+/* Describes a read as buffers referring to the image file, so that
+ * libfuse can splice the data from the image into /dev/fuse without
+ * copying it through user space. Only buffered data and holes are
+ * passed in memory.
+ */
+static int
+edfuse_add_extent(edfs_image_t             *img,
+                  const edfs_file_extent_t *extent,
+                  void                     *user_data)
+{
+  struct fuse_bufvec *bufv = user_data;
+  struct fuse_buf *buf = &bufv->buf[bufv->count];
+
+  memset(buf, 0, sizeof(struct fuse_buf));
+  buf->size = extent->len;
+  buf->fd = -1;
+
+  switch (extent->type)
+    {
+      case EDFS_EXTENT_DISK:
+        buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        buf->fd = img->fd;
+        buf->pos = extent->pos;
+        /* libfuse reads or splices this from the image file. */
+        edfs_image_count_read(img, extent->len);
+        break;
+
+      case EDFS_EXTENT_BUFFER:
+        buf->mem = malloc(extent->len);
+        if (!buf->mem)
+          return -ENOMEM;
+        memcpy(buf->mem, extent->data, extent->len);
+        break;
+
+      case EDFS_EXTENT_HOLE:
+        buf->mem = calloc(1, extent->len);
+        if (!buf->mem)
+          return -ENOMEM;
+        break;
+    }
+
+  bufv->count++;
+  return 0;
+}
+
+static void
+edfuse_free_bufvec(struct fuse_bufvec *bufv)
+{
+  for (size_t i = 0; i < bufv->count; i++)
+    free(bufv->buf[i].mem);
+  free(bufv);
+}
+
+/* Describes the data of @file from @offset as a buffer vector, to be
+ * freed with edfuse_free_bufvec(). Shared by both frontends.
+ */
+static int
+edfuse_read_bufvec(edfs_image_t *img, edfs_file_t *file, size_t size,
+                   off_t offset, struct fuse_bufvec **bufp)
+{
+  /* Every block starts at most one extent. */
+  size_t max_extents = size / img->sb.block_size + 2;
+  struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) +
+                                    max_extents * sizeof(struct fuse_buf));
+  if (!bufv)
+    return -ENOMEM;
+
+  *bufv = FUSE_BUFVEC_INIT(0);
+  bufv->count = 0;
+
+  ssize_t res = edfs_file_read_extents(img, file, size, offset,
+                                       edfuse_add_extent, bufv);
+  if (res < 0)
+    {
+      edfuse_free_bufvec(bufv);
+      return res;
+    }
+
+  *bufp = bufv;
+  return 0;
+}
+
+static int
+edfuse_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                off_t offset, struct fuse_file_info *fi)
+{
+  edfs_image_t *img = get_edfs_image();
+
+  if (edfuse_is_stats_file(path))
+    return edfuse_stats_read_buf(fi, bufp, size, offset);
+
+  return edfuse_read_bufvec(img, edfuse_file_handle(fi), size, offset, bufp);
+}
+
+static int
+edfuse_fill_from_bufvec(char *dst, size_t len, void *user_data)
+{
+  struct fuse_bufvec *src = user_data;
+  struct fuse_bufvec dst_bufv = FUSE_BUFVEC_INIT(len);
+
+  dst_bufv.buf[0].mem = dst;
+
+  ssize_t res = fuse_buf_copy(&dst_bufv, src, 0);
+  if (res < 0)
+    return res;
+
+  return res == len ? 0 : -EIO;
+}
+
+/* Like edfuse_write(), but the data, which may still be in a pipe
+ * spliced from /dev/fuse, is copied into the write-back buffer of the
+ * file directly.
+ */
+static int
+edfuse_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                 struct fuse_file_info *fi)
+{
+  edfs_image_t *img = get_edfs_image();
+
+  return edfs_file_write_from(img, edfuse_file_handle(fi),
+                              fuse_buf_size(buf), offset,
+                              edfuse_fill_from_bufvec, buf);
+}
+
+/* The size of @path must be set to be @offset. Blocks past the new end
+ * of the file are released, a grown file reads back as zeroes.
+ */
+static int
+edfuse_truncate(const char *path, off_t offset)
+{
+  edfs_image_t *img = get_edfs_image();
+  edfs_file_t *file;
+
+  if (edfuse_is_stats_file(path))
+    return -EACCES;
+
+  int res = edfuse_get_file(img, path, &file);
+  if (res < 0)
+    return res;
+
+  res = edfs_file_truncate(img, file, offset);
+  edfs_file_put(img, file);
+
+  return res;
+}
+
+static int
+edfuse_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
+{
+  edfs_image_t *img = get_edfs_image();
+
+  return edfs_file_truncate(img, edfuse_file_handle(fi), offset);
+}
+
+
+/*
+ * Low-level frontend
+ *
+ * With -o lowlevel, requests are served through the inode-based FUSE
+ * API instead. The kernel resolves paths itself, one lookup of a name
+ * in a directory at a time, and caches the resulting entries and
+ * attributes for entry_timeout and attr_timeout seconds. All changes to
+ * the image go through this daemon, so the kernel's caches cannot go
+ * stale and long timeouts are safe. Failed lookups are cached too, as
+ * negative entries.
+ *
+ * FUSE inode numbers are EdFS inumbers, except that FUSE requires the
+ * root directory to be FUSE_ROOT_ID: the inumber of the root directory
+ * and FUSE_ROOT_ID trade places. EdFS has no generation numbers, so a
+ * reused inumber is not told apart from its previous use.
+ */
+
+#define EDFUSE_DEFAULT_TIMEOUT 60.0
+
+static struct
+{
+  double entry_timeout;
+  double attr_timeout;
+  bool splice;
+} edfuse_ll_config =
+{
+  EDFUSE_DEFAULT_TIMEOUT, EDFUSE_DEFAULT_TIMEOUT, true
+};
+
+static inline edfs_image_t *
+edfuse_ll_image(fuse_req_t req)
+{
+  return (edfs_image_t *)fuse_req_userdata(req);
+}
+
+/* Maps a FUSE inode number to an inumber and back. */
+static inline uint64_t
+edfuse_ll_map_ino(edfs_image_t *img, uint64_t ino)
+{
+  if (ino == FUSE_ROOT_ID)
+    return img->sb.root_inumber;
+  if (ino == img->sb.root_inumber)
+    return FUSE_ROOT_ID;
+  return ino;
+}
+
+static int
+edfuse_ll_read_inode(edfs_image_t *img, fuse_ino_t ino, edfs_inode_t *inode)
+{
+  inode->inumber = edfuse_ll_map_ino(img, ino);
+  if (edfs_read_inode(img, inode) <= 0 ||
+      inode->inode.type == EDFS_INODE_TYPE_FREE)
+    return -ENOENT;
+
+  return 0;
+}
+
+static void
+edfuse_ll_fill_stat(edfs_image_t *img, const edfs_inode_t *inode,
+                    struct stat *stbuf)
+{
+  /* An open file may have grown in its write-back buffer. */
+  edfs_inode_t current = *inode;
+  edfs_file_lookup_inode(img, inode->inumber, &current);
+
+  memset(stbuf, 0, sizeof(struct stat));
+  edfuse_fill_stat(&current, stbuf);
+  stbuf->st_ino = edfuse_ll_map_ino(img, inode->inumber);
+}
+
+static void
+edfuse_ll_fill_entry(edfs_image_t *img, const edfs_inode_t *inode,
+                     struct fuse_entry_param *e)
+{
+  memset(e, 0, sizeof(struct fuse_entry_param));
+  e->ino = edfuse_ll_map_ino(img, inode->inumber);
+  e->entry_timeout = edfuse_ll_config.entry_timeout;
+  e->attr_timeout = edfuse_ll_config.attr_timeout;
+  edfuse_ll_fill_stat(img, inode, &e->attr);
+}
+
+/* Looks up @name in the directory @parent_inode. */
+static int
+edfuse_ll_find_entry(edfs_image_t *img, edfs_inode_t *parent_inode,
+                     const char *name, edfs_inode_t *inode)
+{
+  if (!edfs_disk_inode_is_directory(&parent_inode->inode))
+    return -ENOTDIR;
+
+  if (strlen(name) >= EDFS_FILENAME_SIZE)
+    return -ENAMETOOLONG;
+
+  edfs_dir_entry_t direntry = { 0, };
+  strncpy(direntry.filename, name, EDFS_FILENAME_SIZE - 1);
+  if (!edfs_dir_lookup(img, parent_inode, &direntry))
+    return -ENOENT;
+
+  inode->inumber = direntry.inumber;
+  if (edfs_read_inode(img, inode) <= 0)
+    return -EIO;
+
+  return 0;
+}
+
+/* Like edfuse_ll_find_entry(), reading @parent_inode first. */
+static int
+edfuse_ll_lookup_entry(edfs_image_t *img, fuse_ino_t parent,
+                       const char *name, edfs_inode_t *parent_inode,
+                       edfs_inode_t *inode)
+{
+  int res = edfuse_ll_read_inode(img, parent, parent_inode);
+  if (res < 0)
+    return res;
+
+  return edfuse_ll_find_entry(img, parent_inode, name, inode);
+}
+
+static void
+edfuse_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  edfs_image_t *img = edfuse_ll_image(req);
+  edfs_inode_t parent_inode, inode;
+  struct fuse_entry_param e;
+
+  int res = edfuse_ll_read_inode(img, parent, &parent_inode);
+  if (res < 0)
+    {
+      fuse_reply_err(req, -res);
+      return;
+    }
+
+  res = edfuse_ll_find_entry(img, &parent_inode, name, &inode);
+  if (res == -ENOENT)
+    {
+      /* Inode number 0 makes the kernel cache the failed lookup. */
+      memset(&e, 0, sizeof(struct fuse_entry_param));
+      e.entry_timeout = edfuse_ll_config.entry_timeout;
+      fuse_reply_entry(req, &e);
+      return;
+    }
+  if (res < 0)
+    {
+      fuse_reply_err(req, -res);
+      return;
+    }
+
+  edfuse_ll_fill_entry(img, &inode, &e);
+  fuse_reply_entry(req, &e);
+}
+
+static void
+edfuse_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  edfs_image_t *img = edfuse_ll_image(req);
+  edfs_inode_t inode;
+  struct stat stbuf;
+
+  int res = edfuse_ll_read_inode(img, ino, &inode);
+  if (res < 0)
+    {
+      fuse_reply_err(req, -res);
+      return;
+    }
+
+  edfuse_ll_fill_stat(img, &inode, &stbuf);
+  fuse_reply_attr(req, &stbuf, edfuse_ll_config.attr_timeout);
+}
+
+/* Only the size can be changed; other attributes are fixed in EdFS and
+ * requests to change them are answered with the current attributes.
+ */
+static void
+edfuse_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                  int to_set, struct fuse_file_info *fi)
+{
+  edfs_image_t *img = edfuse_ll_image(req);
+  edfs_inode_t inode;
+  struct stat stbuf;
+
+  int res = edfuse_ll_read_inode(img, ino, &inode);
+  if (res == 0 && (to_set & FUSE_SET_ATTR_SIZE))
+    {
+      if (edfs_disk_inode_is_directory(&inode.inode))
+        res = -EISDIR;
+      else if (fi)
+        res = edfs_file_truncate(img, edfuse_file_handle(fi), attr->st_size);
+      else
+        {
+          edfs_file_t *file = edfs_file_get(img, &inode);
+          if (!file)
+            res = -ENOENT;
+          else
+            {
+              res = edfs_file_truncate(img, file, attr->st_size);
+              edfs_file_put(img, file);
+            }
+        }
+    }
+  if (res < 0)
+    {
+      fuse_reply_err(req, -res);
+      return;
+    }
+
+  edfs_read_inode(img, &inode);
+  edfuse_ll_fill_stat(img, &inode, &stbuf);
+  fuse_reply_attr(req, &stbuf, edfuse_ll_config.attr_timeout);
+}
+
+struct edfuse_ll_readdir_data
+{
+  fuse_req_t req;
+  char *buf;
+  size_t size;
+  size_t pos;
+};
+
+/* Adds an entry to the reply; returns false if it does not fit. */
+static bool
+edfuse_ll_add_direntry(struct edfuse_ll_readdir_data *data, const char *name,
+                       struct stat *stbuf, off_t next)
+{
+  size_t len = fuse_add_direntry(data->req, data->buf + data->pos,
+                                 data->size - data->pos, name, stbuf, next);
+  if (len > data->size - data->pos)
+    return false;
+
+  data->pos += len;
+  return true;
+}
+
+static bool
+edfuse_ll_add_dot(struct edfuse_ll_readdir_data *data, const char *name,
+                  fuse_ino_t ino, off_t next)
+{
+  struct stat stbuf;
+
+  memset(&stbuf, 0, sizeof(struct stat));
+  stbuf.st_mode = S_IFDIR;
+  stbuf.st_ino = ino;
+
+  return edfuse_ll_add_direntry(data, name, &stbuf, next);
+}
+
+/* Offsets as with edfuse_readdir(). */
+static void
+edfuse_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                  struct fuse_file_info *fi)
+{
+  edfs_image_t *img = edfuse_ll_image(req);
+  edfs_inode_t inode;
+
+  int res = edfuse_ll_read_inode(img, ino, &inode);
+  if (res == 0 && !edfs_disk_inode_is_directory(&inode.inode))
+    res = -ENOTDIR;
+  if (res < 0)
+    {
+      fuse_reply_err(req, -res);
+      return;
+    }
+
+  struct edfuse_ll_readdir_data data = { req, malloc(size), size, 0 };
+  if (!data.buf)
+    {
+      fuse_reply_err(req, ENOMEM);
+      return;
+    }
+
+  struct edfuse_dir_batch *batch = malloc(sizeof(struct edfuse_dir_batch));
+  if (!batch)
+    {
+      free(data.buf);
+      fuse_reply_err(req, ENOMEM);
+      return;
+    }
+
+  /* EdFS does not record the parent of a directory. */
+  if ((off > 0 || edfuse_ll_add_dot(&data, ".", ino, 1)) &&
+      (off > 1 || edfuse_ll_add_dot(&data, "..", FUSE_ROOT_ID, 2)))
+    {
+      uint32_t slot = off > 2 ? off - 2 : 0;
+
+      while ((res = edfuse_dir_batch_read(img, &inode, slot, batch)) > 0)
+        {
+          for (int i = 0; i < batch->n_entries; i++)
+            {
+              struct stat stbuf;
+
+              if (!edfuse_dir_batch_stat(batch, i, &stbuf))
+                continue;
+
+              stbuf.st_ino = edfuse_ll_map_ino(img, batch->inodes[i].inumber);
+              if (!edfuse_ll_add_direntry(&data, batch->names[i], &stbuf,
+                                          batch->next[i] + 2))
+                goto out;
+            }
+
+          if (batch->n_entries < EDFUSE_READDIR_BATCH)
+            break;
+          slot = batch->next[batch->n_entries - 1];
+        }
+    }
+
+out:
+  if (res < 0)
+    fuse_reply_err(req, -res);
+  else
+    fuse_reply_buf(req, data.buf, data.pos);
+
+  free(batch);
+  free(data.buf);
+}
+
+static void
+edfuse_ll_create_inode(fuse_req_t req, fuse_ino_t parent, const char *name,
+                       edfs_inode_type_t type, struct fuse_file_info *fi)
+{
+  edfs_image_t *img = edfuse_ll_image(req);
+  edfs_inode_t parent_inode, new_inode;
+  struct fuse_entry_param e;
+
+  int res = edfuse_ll_read_inode(img, parent, &parent_inode);
+  if (res == 0)
+    res = edfs_dir_create(img, &parent_inode, name, type, &new_inode);
+  if (res < 0)
+    {
+      fuse_reply_err(req, -res);
+      return;
+    }
+
+  edfuse_ll_fill_entry(img, &new_inode, &e);
+  if (!fi)
+    {
+      fuse_reply_entry(req, &e);
+      return;
+    }
+
+  edfs_file_t *file = edfs_file_get(img, &new_inode);
+  if (!file)
+    {
+      fuse_reply_err(req, ENOMEM);
+      return;
+    }
+
+  /* Place the data of the new file near its directory. */
+  file->goal = edfs_disk_inode_get_block(&parent_inode.inode, 0);
+
+  fi->fh = (uintptr_t)file;
+  fuse_reply_create(req, &e, fi);
+}
+
+static void
+edfuse_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                mode_t mode)
+{
+  edfuse_ll_create_inode(req, parent, name, EDFS_INODE_TYPE_DIRECTORY, NULL);
+}
+
+static void
+edfuse_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                 mode_t mode, struct fuse_file_info *fi)
+{
+  edfuse_ll_create_inode(req, parent, name, EDFS_INODE_TYPE_FILE, fi);
+}
+
+static void
+edfuse_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  edfs_image_t *img = edfuse_ll_image(req);
+  edfs_inode_t parent_inode, inode;
+
+  int res = edfuse_ll_lookup_entry(img, parent, name, &parent_inode, &inode);
+  if (res == 0 && edfs_disk_inode_is_directory(&inode.inode))
+    res = -EISDIR;
+  if (res == 0)
+    res = edfs_dir_remove(img, &parent_inode, name, &inode);
+
+  fuse_reply_err(req, -res);
+}
+
+static void
+edfuse_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  edfs_image_t *img = edfuse_ll_image(req);
+  edfs_inode_t parent_inode, inode;
+
+  int res = edfuse_ll_lookup_entry(img, parent, name, &parent_inode, &inode);
+  if (res == 0 && !edfs_disk_inode_is_directory(&inode.inode))
+    res = -ENOTDIR;
+  else if (res == 0 && !edfs_dir_is_empty(img, &inode))
+    res = -ENOTEMPTY;
+  if (res == 0)
+    res = edfs_dir_remove(img, &parent_inode, name, &inode);
+
+  fuse_reply_err(req, -res);
+}
+
+/* All changes go through this daemon, so the page cache of a file is
+ * kept across opens.
+ */
+static void
+edfuse_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  edfs_image_t *img = edfuse_ll_image(req);
+  edfs_inode_t inode;
+
+  int res = edfuse_ll_read_inode(img, ino, &inode);
+  if (res == 0 && edfs_disk_inode_is_directory(&inode.inode))
+    res = -EISDIR;
+  if (res < 0)
+    {
+      fuse_reply_err(req, -res);
+      return;
+    }
+
+  edfs_file_t *file = edfs_file_get(img, &inode);
+  if (!file)
+    {
+      fuse_reply_err(req, ENOENT);
+      return;
+    }
+
+  fi->fh = (uintptr_t)file;
+  fi->keep_cache = 1;
+  fuse_reply_open(req, fi);
+}
+
+static void
+edfuse_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  edfs_file_put(edfuse_ll_image(req), edfuse_file_handle(fi));
+  fuse_reply_err(req, 0);
+}
+
+static void
+edfuse_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  fuse_reply_err(req, -edfs_file_flush(edfuse_ll_image(req),
+                                       edfuse_file_handle(fi)));
+}
+
+static void
+edfuse_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                struct fuse_file_info *fi)
+{
+  fuse_reply_err(req, -edfuse_sync_file(edfuse_ll_image(req),
+                                        edfuse_file_handle(fi), datasync));
+}
+
+static void
+edfuse_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+               struct fuse_file_info *fi)
+{
+  edfs_image_t *img = edfuse_ll_image(req);
+  edfs_file_t *file = edfuse_file_handle(fi);
+
+  if (edfuse_ll_config.splice)
+    {
+      struct fuse_bufvec *bufv;
+      int res = edfuse_read_bufvec(img, file, size, off, &bufv);
+      if (res < 0)
+        fuse_reply_err(req, -res);
+      else
+        {
+          fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+          edfuse_free_bufvec(bufv);
+        }
+      return;
+    }
+
+  char *buf = malloc(size);
+  if (!buf)
+    {
+      fuse_reply_err(req, ENOMEM);
+      return;
+    }
+
+  ssize_t res = edfs_file_read(img, file, buf, size, off);
+  if (res < 0)
+    fuse_reply_err(req, -res);
+  else
+    fuse_reply_buf(req, buf, res);
+
+  free(buf);
+}
+
+static void
+edfuse_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                off_t off, struct fuse_file_info *fi)
+{
+  ssize_t res = edfs_file_write(edfuse_ll_image(req), edfuse_file_handle(fi),
+                                buf, size, off);
+  if (res < 0)
+    fuse_reply_err(req, -res);
+  else
+    fuse_reply_write(req, res);
+}
+
+static void
+edfuse_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                    off_t off, struct fuse_file_info *fi)
+{
+  ssize_t res = edfs_file_write_from(edfuse_ll_image(req),
+                                     edfuse_file_handle(fi),
+                                     fuse_buf_size(bufv), off,
+                                     edfuse_fill_from_bufvec, bufv);
+  if (res < 0)
+    fuse_reply_err(req, -res);
+  else
+    fuse_reply_write(req, res);
+}
+
+/* Threads are started from the init callbacks, as they would not
+ * survive daemonizing.
+ */
+static struct
+{
+  size_t readahead_size;
+  int readahead_threads;
+  unsigned int commit_interval;
+} edfuse_thread_config;
+
+static void
+edfuse_start_threads(edfs_image_t *img)
+{
+  img->readahead = edfs_readahead_new(img,
+                                      edfuse_thread_config.readahead_size,
+                                      edfuse_thread_config.readahead_threads);
+
+  if (edfs_journal_start_thread(img, edfuse_thread_config.commit_interval) < 0)
+    fprintf(stderr, "warning: the journal is only committed on demand.\n");
+
+  if (edfuse_trace_filename &&
+      edfs_trace_dump_on_signal(SIGUSR2, edfuse_trace_filename) < 0)
+    fprintf(stderr, "warning: the trace is not dumped on SIGUSR2.\n");
+}
+
+static void
+edfuse_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+  if (edfuse_ll_config.splice)
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+                                   FUSE_CAP_SPLICE_WRITE |
+                                   FUSE_CAP_SPLICE_MOVE);
+
+  edfuse_start_threads(userdata);
+}
+
+/* Like EDFUSE_TIMED(), but errors are sent as replies and not counted.
+ * The request is gone once replied to, so the image is looked up first.
+ */
+#define EDFUSE_LL_TIMED(name, op, params, args)                 \
+  static void                                                   \
+  edfuse_ll_timed_##name params                                 \
+  {                                                             \
+    edfs_image_t *img = edfuse_ll_image(req);                   \
+    uint64_t start = edfs_stats_now();                          \
+    EDFS_TRACE_BEGIN(span);                                     \
+    if (op != EDFUSE_OP_FSYNC)                                  \
+      edfs_journal_begin(img);                                  \
+    edfuse_ll_##name args;                                      \
+    if (op != EDFUSE_OP_FSYNC)                                  \
+      edfs_journal_end(img);                                    \
+    EDFS_TRACE_END(span, edfuse_op_names[op]);                  \
+    if (edfuse_stats)                                           \
+      edfs_stats_record(edfuse_stats, op, start, false);        \
+  }
+
+EDFUSE_LL_TIMED(lookup, EDFUSE_OP_LOOKUP,
+                (fuse_req_t req, fuse_ino_t parent, const char *name),
+                (req, parent, name))
+EDFUSE_LL_TIMED(getattr, EDFUSE_OP_GETATTR,
+                (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+                (req, ino, fi))
+EDFUSE_LL_TIMED(setattr, EDFUSE_OP_SETATTR,
+                (fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                 int to_set, struct fuse_file_info *fi),
+                (req, ino, attr, to_set, fi))
+EDFUSE_LL_TIMED(readdir, EDFUSE_OP_READDIR,
+                (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                 struct fuse_file_info *fi),
+                (req, ino, size, off, fi))
+EDFUSE_LL_TIMED(mkdir, EDFUSE_OP_MKDIR,
+                (fuse_req_t req, fuse_ino_t parent, const char *name,
+                 mode_t mode),
+                (req, parent, name, mode))
+EDFUSE_LL_TIMED(rmdir, EDFUSE_OP_RMDIR,
+                (fuse_req_t req, fuse_ino_t parent, const char *name),
+                (req, parent, name))
+EDFUSE_LL_TIMED(create, EDFUSE_OP_CREATE,
+                (fuse_req_t req, fuse_ino_t parent, const char *name,
+                 mode_t mode, struct fuse_file_info *fi),
+                (req, parent, name, mode, fi))
+EDFUSE_LL_TIMED(unlink, EDFUSE_OP_UNLINK,
+                (fuse_req_t req, fuse_ino_t parent, const char *name),
+                (req, parent, name))
+EDFUSE_LL_TIMED(open, EDFUSE_OP_OPEN,
+                (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+                (req, ino, fi))
+EDFUSE_LL_TIMED(read, EDFUSE_OP_READ,
+                (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                 struct fuse_file_info *fi),
+                (req, ino, size, off, fi))
+EDFUSE_LL_TIMED(write, EDFUSE_OP_WRITE,
+                (fuse_req_t req, fuse_ino_t ino, const char *buf,
+                 size_t size, off_t off, struct fuse_file_info *fi),
+                (req, ino, buf, size, off, fi))
+EDFUSE_LL_TIMED(write_buf, EDFUSE_OP_WRITE_BUF,
+                (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                 off_t off, struct fuse_file_info *fi),
+                (req, ino, bufv, off, fi))
+EDFUSE_LL_TIMED(flush, EDFUSE_OP_FLUSH,
+                (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+                (req, ino, fi))
+EDFUSE_LL_TIMED(release, EDFUSE_OP_RELEASE,
+                (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+                (req, ino, fi))
+EDFUSE_LL_TIMED(fsync, EDFUSE_OP_FSYNC,
+                (fuse_req_t req, fuse_ino_t ino, int datasync,
+                 struct fuse_file_info *fi),
+                (req, ino, datasync, fi))
+
+static struct fuse_lowlevel_ops edfs_ll_oper =
+{
+  .init      = edfuse_ll_init,
+  .lookup    = edfuse_ll_timed_lookup,
+  .getattr   = edfuse_ll_timed_getattr,
+  .setattr   = edfuse_ll_timed_setattr,
+  .readdir   = edfuse_ll_timed_readdir,
+  .mkdir     = edfuse_ll_timed_mkdir,
+  .rmdir     = edfuse_ll_timed_rmdir,
+  .create    = edfuse_ll_timed_create,
+  .unlink    = edfuse_ll_timed_unlink,
+  .open      = edfuse_ll_timed_open,
+  .read      = edfuse_ll_timed_read,
+  .write     = edfuse_ll_timed_write,
+  .write_buf = edfuse_ll_timed_write_buf,
+  .flush     = edfuse_ll_timed_flush,
+  .release   = edfuse_ll_timed_release,
+  .fsync     = edfuse_ll_timed_fsync,
+};
+
+/* Counterpart of fuse_main() for the low-level frontend. */
+static int
+edfuse_ll_main(struct fuse_args *args, edfs_image_t *img)
+{
+  char *mountpoint = NULL;
+  int multithreaded, foreground;
+  int res = -1;
+
+  if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) < 0)
+    return 1;
+
+  struct fuse_chan *ch = fuse_mount(mountpoint, args);
+  if (!ch)
+    goto out;
+
+  struct fuse_session *se = fuse_lowlevel_new(args, &edfs_ll_oper,
+                                              sizeof(edfs_ll_oper), img);
+  if (se)
+    {
+      if (fuse_set_signal_handlers(se) == 0)
+        {
+          fuse_session_add_chan(se, ch);
+          fuse_daemonize(foreground);
+
+          if (multithreaded)
+            res = fuse_session_loop_mt(se);
+          else
+            res = fuse_session_loop(se);
+
+          fuse_remove_signal_handlers(se);
+          fuse_session_remove_chan(ch);
+        }
+      fuse_session_destroy(se);
+    }
+  fuse_unmount(mountpoint, ch);
+
+out:
+  free(mountpoint);
+
+  return res == 0 ? 0 : 1;
+}
+
+
+/*
+ * FUSE setup
+ */
+
+/* Every callback is called through a wrapper that records its latency
+ * in edfuse_stats, and a span if tracing; a negative result counts as
+ * an error. Callbacks run as journal operations, see edfs-journal.h,
+ * except fsync, which commits.
+ */
+#define EDFUSE_TIMED(name, op, params, args)                    \
+  static int                                                    \
+  edfuse_timed_##name params                                    \
+  {                                                             \
+    edfs_image_t *img = get_edfs_image();                       \
+    uint64_t start = edfs_stats_now();                          \
+    EDFS_TRACE_BEGIN(span);                                     \
+    if (op != EDFUSE_OP_FSYNC)                                  \
+      edfs_journal_begin(img);                                  \
+    int res = edfuse_##name args;                               \
+    if (op != EDFUSE_OP_FSYNC)                                  \
+      edfs_journal_end(img);                                    \
+    EDFS_TRACE_END(span, edfuse_op_names[op]);                  \
+    if (edfuse_stats)                                           \
+      edfs_stats_record(edfuse_stats, op, start, res < 0);      \
+    return res;                                                 \
+  }
+
+EDFUSE_TIMED(getattr, EDFUSE_OP_GETATTR,
+             (const char *path, struct stat *stbuf), (path, stbuf))
+EDFUSE_TIMED(fgetattr, EDFUSE_OP_FGETATTR,
+             (const char *path, struct stat *stbuf, struct fuse_file_info *fi),
+             (path, stbuf, fi))
+EDFUSE_TIMED(readdir, EDFUSE_OP_READDIR,
+             (const char *path, void *buf, fuse_fill_dir_t filler,
+              off_t offset, struct fuse_file_info *fi),
+             (path, buf, filler, offset, fi))
+EDFUSE_TIMED(mkdir, EDFUSE_OP_MKDIR,
+             (const char *path, mode_t mode), (path, mode))
+EDFUSE_TIMED(rmdir, EDFUSE_OP_RMDIR, (const char *path), (path))
+EDFUSE_TIMED(open, EDFUSE_OP_OPEN,
+             (const char *path, struct fuse_file_info *fi), (path, fi))
+EDFUSE_TIMED(create, EDFUSE_OP_CREATE,
+             (const char *path, mode_t mode, struct fuse_file_info *fi),
+             (path, mode, fi))
+EDFUSE_TIMED(release, EDFUSE_OP_RELEASE,
+             (const char *path, struct fuse_file_info *fi), (path, fi))
+EDFUSE_TIMED(flush, EDFUSE_OP_FLUSH,
+             (const char *path, struct fuse_file_info *fi), (path, fi))
+EDFUSE_TIMED(fsync, EDFUSE_OP_FSYNC,
+             (const char *path, int datasync, struct fuse_file_info *fi),
+             (path, datasync, fi))
+EDFUSE_TIMED(unlink, EDFUSE_OP_UNLINK, (const char *path), (path))
+EDFUSE_TIMED(read, EDFUSE_OP_READ,
+             (const char *path, char *buf, size_t size, off_t offset,
+              struct fuse_file_info *fi),
+             (path, buf, size, offset, fi))
+EDFUSE_TIMED(read_buf, EDFUSE_OP_READ_BUF,
+             (const char *path, struct fuse_bufvec **bufp, size_t size,
+              off_t offset, struct fuse_file_info *fi),
+             (path, bufp, size, offset, fi))
+EDFUSE_TIMED(write, EDFUSE_OP_WRITE,
+             (const char *path, const char *buf, size_t size, off_t offset,
+              struct fuse_file_info *fi),
+             (path, buf, size, offset, fi))
+EDFUSE_TIMED(write_buf, EDFUSE_OP_WRITE_BUF,
+             (const char *path, struct fuse_bufvec *buf, off_t offset,
+              struct fuse_file_info *fi),
+             (path, buf, offset, fi))
+EDFUSE_TIMED(truncate, EDFUSE_OP_TRUNCATE,
+             (const char *path, off_t offset), (path, offset))
+EDFUSE_TIMED(ftruncate, EDFUSE_OP_FTRUNCATE,
+             (const char *path, off_t offset, struct fuse_file_info *fi),
+             (path, offset, fi))
+
+static void *
+edfuse_init(struct fuse_conn_info *conn)
+{
+  /* Allow splicing file data between the image and /dev/fuse. */
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+                                 FUSE_CAP_SPLICE_WRITE |
+                                 FUSE_CAP_SPLICE_MOVE);
+
+  edfs_image_t *img = fuse_get_context()->private_data;
+  edfuse_start_threads(img);
+
+  return img;
+}
 
 static struct fuse_operations edfs_oper =
 {
-  .readdir   = edfuse_readdir,
-  .mkdir     = edfuse_mkdir,
-  .rmdir     = edfuse_rmdir,
-  .getattr   = edfuse_getattr,
-  .open      = edfuse_open,
-  .create    = edfuse_create,
-  .unlink    = edfuse_unlink,
-  .read      = edfuse_read,
-  .write     = edfuse_write,
-  .truncate  = edfuse_truncate,
+  .readdir   = edfuse_timed_readdir,
+  .mkdir     = edfuse_timed_mkdir,
+  .rmdir     = edfuse_timed_rmdir,
+  .getattr   = edfuse_timed_getattr,
+  .open      = edfuse_timed_open,
+  .create    = edfuse_timed_create,
+  .unlink    = edfuse_timed_unlink,
+  .read      = edfuse_timed_read,
+  .write     = edfuse_timed_write,
+  .read_buf  = edfuse_timed_read_buf,
+  .write_buf = edfuse_timed_write_buf,
+  .truncate  = edfuse_timed_truncate,
+  .ftruncate = edfuse_timed_ftruncate,
+  .fgetattr  = edfuse_timed_fgetattr,
+  .flush     = edfuse_timed_flush,
+  .release   = edfuse_timed_release,
+  .fsync     = edfuse_timed_fsync,
+  .init      = edfuse_init,
+};
+
+/* Options specific to edfuse, passed as -o option[,option...]. */
+struct edfuse_options
+{
+  const char *image_filename;
+  int n_nonopts;
+
+  unsigned int dcache_size;
+  unsigned int dindex_size;
+  int no_inode_cache;
+  int inode_writeback;
+  int show_stats;
+  unsigned int writeback_kb;
+  unsigned int cache_kb;
+  int use_mmap;
+  int io_uring;
+  int no_splice;
+  int lowlevel;
+  double entry_timeout;
+  double attr_timeout;
+  int fsck;
+  int fsck_repair;
+  char *trace_file;
+  unsigned int trace_events;
+  unsigned int readahead_kb;
+  unsigned int readahead_threads;
+  unsigned int commit_interval;
+};
+
+#define EDFUSE_OPT(t, p, v) { t, offsetof(struct edfuse_options, p), v }
+
+static const struct fuse_opt edfuse_opts[] =
+{
+  EDFUSE_OPT("dcache_size=%u",        dcache_size,       0),
+  EDFUSE_OPT("dindex_size=%u",        dindex_size,       0),
+  EDFUSE_OPT("no_inode_cache",        no_inode_cache,    1),
+  EDFUSE_OPT("inode_writeback",       inode_writeback,   1),
+  EDFUSE_OPT("stats",                 show_stats,        1),
+  EDFUSE_OPT("writeback_kb=%u",       writeback_kb,      0),
+  EDFUSE_OPT("cache_kb=%u",           cache_kb,          0),
+  EDFUSE_OPT("mmap",                  use_mmap,          1),
+  EDFUSE_OPT("io_uring",              io_uring,          1),
+  EDFUSE_OPT("no_splice",             no_splice,         1),
+  EDFUSE_OPT("lowlevel",              lowlevel,          1),
+  EDFUSE_OPT("entry_timeout=%lf",     entry_timeout,     0),
+  EDFUSE_OPT("attr_timeout=%lf",      attr_timeout,      0),
+  EDFUSE_OPT("fsck",                  fsck,              1),
+  EDFUSE_OPT("fsck_repair",           fsck_repair,       1),
+  EDFUSE_OPT("trace=%s",              trace_file,        0),
+  EDFUSE_OPT("trace_events=%u",       trace_events,      0),
+  EDFUSE_OPT("readahead_kb=%u",       readahead_kb,      0),
+  EDFUSE_OPT("readahead_threads=%u",  readahead_threads, 0),
+  EDFUSE_OPT("commit=%u",             commit_interval,   0),
+  FUSE_OPT_END
 };
 
+/* The first argument without hyphens is the image file, which we
+ * consume. The others (the mountpoint) are passed on to FUSE.
+ */
+static int
+edfuse_opt_proc(void *data, const char *arg, int key,
+                struct fuse_args *outargs)
+{
+  struct edfuse_options *options = data;
+
+  if (key != FUSE_OPT_KEY_NONOPT)
+    return 1;
+
+  options->n_nonopts++;
+  if (!options->image_filename)
+    {
+      options->image_filename = arg;
+      return 0;
+    }
+
+  return 1;
+}
+
 int
 main(int argc, char *argv[])
 {
-  /* Count number of arguments without hyphens; excluding execname */
-  int count = 0;
-  for (int i = 1; i < argc; ++i)
-    if (argv[i][0] != '-')
-      count++;
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  struct edfuse_options options =
+    {
+      .dcache_size = EDFS_DCACHE_DEFAULT_SIZE,
+      .dindex_size = EDFS_DINDEX_DEFAULT_SIZE,
+      .writeback_kb = EDFS_WRITEBACK_DEFAULT_LIMIT / 1024,
+      .cache_kb = EDFS_CACHE_DEFAULT_SIZE / 1024,
+      .entry_timeout = -1.0,
+      .attr_timeout = -1.0,
+      .trace_events = EDFS_TRACE_DEFAULT_EVENTS,
+      .readahead_kb = EDFS_READAHEAD_DEFAULT_SIZE / 1024,
+      .readahead_threads = EDFS_READAHEAD_DEFAULT_THREADS,
+      .commit_interval = EDFS_JOURNAL_DEFAULT_INTERVAL,
+    };
+
+  if (fuse_opt_parse(&args, &options, edfuse_opts, edfuse_opt_proc) < 0)
+    return -1;
 
-  if (count != 2)
+  if (options.n_nonopts != 2)
     {
       fprintf(stderr, "error: file and mountpoint arguments required.\n");
+      fuse_opt_free_args(&args);
       return -1;
     }
 
-  /* Extract filename argument; we expect this to be the
-   * penultimate argument.
+  /* Try to open the file system. The inode table is kept in memory
+   * unless disabled; with inode_writeback, inode updates are only
+   * written out at unmount.
    */
-  /* FIXME: can't this be better handled using some FUSE API? */
-  const char *filename = argv[argc-2];
-  argv[argc-2] = argv[argc-1];
-  argv[argc-1] = NULL;
-  argc--;
-
-  /* Try to open the file system */
-  edfs_image_t *img = edfs_image_open(filename, true);
+  int flags = EDFS_IMAGE_READ_SUPER;
+  if (!options.no_inode_cache)
+    flags |= EDFS_IMAGE_INODE_CACHE;
+  if (options.inode_writeback)
+    flags |= EDFS_IMAGE_INODE_WRITEBACK;
+  if (options.use_mmap)
+    flags |= EDFS_IMAGE_MMAP;
+  if (options.io_uring)
+    flags |= EDFS_IMAGE_IO_URING;
+
+  edfs_image_t *img = edfs_image_open(options.image_filename, flags);
   if (!img)
-    return -1;
+    {
+      fuse_opt_free_args(&args);
+      return -1;
+    }
+
+  /* Check the image before anything is cached. An image that still
+   * has problems is not mounted.
+   */
+  if (options.fsck || options.fsck_repair)
+    {
+      edfs_check_result_t result;
+      int check_flags = options.fsck_repair ? EDFS_CHECK_REPAIR : 0;
+
+      if (edfs_check_image(img, check_flags, 0, &result) < 0 ||
+          (edfs_check_n_problems(&result) > 0 && !options.fsck_repair))
+        {
+          fprintf(stderr, "error: file '%s' is not consistent, "
+                  "run edfs-fsck or mount with fsck_repair.\n",
+                  options.image_filename);
+          edfs_image_close(img);
+          fuse_opt_free_args(&args);
+          return -1;
+        }
+    }
+
+  /* A size of 0 disables the dentry cache. */
+  img->dcache = edfs_dcache_new(options.dcache_size);
+
+  /* Number of directories of which an index is kept, 0 disables. */
+  img->dindex = edfs_dindex_new(options.dindex_size);
+
+  /* The image comes with a block cache of the default size. */
+  if (options.cache_kb != EDFS_CACHE_DEFAULT_SIZE / 1024)
+    {
+      edfs_cache_free(img->bcache);
+      img->bcache = edfs_cache_new(img, (size_t)options.cache_kb * 1024);
+    }
+
+  /* Statistics are always kept, they are cheap enough. */
+  edfuse_stats = edfs_stats_new(EDFUSE_N_OPS);
+
+  if (options.trace_file)
+    {
+      int res = edfs_trace_start(options.trace_events);
+      if (res == -ENOTSUP)
+        fprintf(stderr, "warning: edfuse was built without tracing, "
+                "rebuild with make TRACE=1.\n");
+      else if (res < 0)
+        fprintf(stderr, "warning: cannot start tracing: %s\n",
+                strerror(-res));
+      else
+        edfuse_trace_filename = options.trace_file;
+    }
+
+  /* Maximum readahead window; readahead_kb=0 disables readahead. */
+  edfuse_thread_config.readahead_size = (size_t)options.readahead_kb * 1024;
+  edfuse_thread_config.readahead_threads = options.readahead_threads;
+
+  /* Seconds between commits of the journal, if the image has one;
+   * commit=0 leaves committing to fsync and unmount.
+   */
+  edfuse_thread_config.commit_interval = options.commit_interval;
+
+  /* Amount of written data buffered before all files are flushed. */
+  img->writeback_limit = (size_t)options.writeback_kb * 1024;
+
+  /* Fall back to the copying read and write callbacks. */
+  if (options.no_splice)
+    {
+      edfs_oper.read_buf = NULL;
+      edfs_oper.write_buf = NULL;
+      edfs_ll_oper.write_buf = NULL;
+      edfuse_ll_config.splice = false;
+    }
+
+  /* The timeouts are handled by the high-level library itself, so
+   * these options are passed back on if it is used.
+   */
+  int ret;
+  if (options.lowlevel)
+    {
+      if (options.entry_timeout >= 0.0)
+        edfuse_ll_config.entry_timeout = options.entry_timeout;
+      if (options.attr_timeout >= 0.0)
+        edfuse_ll_config.attr_timeout = options.attr_timeout;
+
+      ret = edfuse_ll_main(&args, img);
+    }
+  else
+    {
+      char arg[64];
+
+      if (options.entry_timeout >= 0.0)
+        {
+          snprintf(arg, sizeof(arg), "-oentry_timeout=%f",
+                   options.entry_timeout);
+          fuse_opt_add_arg(&args, arg);
+        }
+      if (options.attr_timeout >= 0.0)
+        {
+          snprintf(arg, sizeof(arg), "-oattr_timeout=%f",
+                   options.attr_timeout);
+          fuse_opt_add_arg(&args, arg);
+        }
+
+      /* Start fuse main loop */
+      ret = fuse_main(args.argc, args.argv, &edfs_oper, img);
+    }
+
+  if (options.show_stats)
+    edfuse_print_stats(stderr, img);
+
+  if (edfuse_trace_filename)
+    {
+      if (edfs_trace_dump(edfuse_trace_filename) < 0)
+        fprintf(stderr, "error: could not write trace to '%s'\n",
+                edfuse_trace_filename);
+      edfs_trace_stop();
+    }
 
-  /* Start fuse main loop */
-  int ret = fuse_main(argc, argv, &edfs_oper, img);
   edfs_image_close(img);
+  edfs_stats_free(edfuse_stats);
+  free(options.trace_file);
+  fuse_opt_free_args(&args);
 
   return ret;
 }